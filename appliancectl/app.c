@@ -7,19 +7,27 @@
 #define IDENTIFIER_ARG   0x201
 
 static int register_app_usage() {
-  fprintf(stderr, "Usage: appliancectl register-app [-h] [-f] [-P] <app-manifest-url> [-S <signature-url>]\n");
+  fprintf(stderr, "Usage: appliancectl register-app [-h] [-f] [-P] [-r automatic|manual|security] <app-manifest-url> [-S <signature-url>]\n");
   return 1;
 }
 
+// Values of AU_UPDATE_REASON_*
+static int update_reason_from_str(const char *reason) {
+  if ( strcmp(reason, "automatic") == 0 ) return 1;
+  else if ( strcmp(reason, "manual") == 0 ) return 2;
+  else if ( strcmp(reason, "security") == 0 ) return 3;
+  else return -1;
+}
+
 int register_app(int argc, char **argv) {
   char buf[KITE_MAX_LOCAL_MSG_SZ];
   char *app_manifest;
   const char *signature = NULL;
   struct kitelocalmsg *msg = (struct kitelocalmsg *)buf;
   struct kitelocalattr *attr = KLM_FIRSTATTR(msg, sizeof(buf));
-  int sz = KLM_SIZE_INIT, sk, err, c, do_force = 0, show_progress = 0;
+  int sz = KLM_SIZE_INIT, sk, err, c, do_force = 0, show_progress = 0, reason = -1;
 
-  while ( (c = getopt(argc, argv, "hfPS:")) ) {
+  while ( (c = getopt(argc, argv, "hfPr:S:")) ) {
     if ( c == -1 ) break;
 
     switch ( c ) {
@@ -31,6 +39,14 @@ int register_app(int argc, char **argv) {
       show_progress = 1;
       break;
 
+    case 'r':
+      reason = update_reason_from_str(optarg);
+      if ( reason < 0 ) {
+        fprintf(stderr, "Unknown update reason %s\n", optarg);
+        return register_app_usage();
+      }
+      break;
+
     case 'S':
       signature = optarg;
       break;
@@ -65,6 +81,17 @@ int register_app(int argc, char **argv) {
     KLM_SIZE_ADD_ATTR(sz, attr);
   }
 
+  if ( reason > 0 ) {
+    uint16_t reason_n = htons(reason);
+
+    attr = KLM_NEXTATTR(msg, attr, sizeof(buf));
+    assert(attr);
+    attr->kla_name = ntohs(KLA_UPDATE_REASON);
+    attr->kla_length = ntohs(KLA_SIZE(sizeof(reason_n)));
+    memcpy(KLA_DATA_UNSAFE(attr, char*), &reason_n, sizeof(reason_n));
+    KLM_SIZE_ADD_ATTR(sz, attr);
+  }
+
   if ( signature ) {
     attr = KLM_NEXTATTR(msg, attr, sizeof(buf));
     assert(attr);
@@ -115,3 +142,166 @@ int register_app(int argc, char **argv) {
 
   return EXIT_SUCCESS;
 }
+
+static const char *update_status_str(int16_t sts) {
+  switch ( sts ) {
+  case -2: return "error";
+  case -1: return "canceled";
+  case 0: return "waiting";
+  case 1: return "downloading";
+  case 2: return "downloading-signature";
+  case 3: return "parsing";
+  case 4: return "updating";
+  case 5: return "installing";
+  case 6: return "done";
+  default: return "unknown";
+  }
+}
+
+static const char *update_priority_str(uint16_t priority) {
+  switch ( priority ) {
+  case 0: return "interactive";
+  case 1: return "security";
+  case 2: return "background";
+  default: return "unknown";
+  }
+}
+
+static const char *update_queue_str(uint16_t queued) {
+  switch ( queued ) {
+  case 0: return "-";
+  case 1: return "queued";
+  case 2: return "active";
+  case 3: return "following";
+  default: return "unknown";
+  }
+}
+
+int list_updates(int argc, char **argv) {
+  char buf[KITE_MAX_LOCAL_MSG_SZ];
+  struct kitelocalmsg *msg = (struct kitelocalmsg *)buf;
+  struct kitelocalattr *attr;
+  int sz = KLM_SIZE_INIT, sk, err;
+
+  if ( argc > 1 ) {
+    fprintf(stderr, "Usage: appliancectl list-updates\n");
+    return 1;
+  }
+
+  msg->klm_req = ntohs(KLM_REQ_GET | KLM_REQ_ENTITY_UPDATE);
+  msg->klm_req_flags = htons(KLM_RETURN_MULTIPLE);
+
+  sk = mk_api_socket();
+  if ( sk < 0 ) {
+    fprintf(stderr, "list_updates: mk_api_socket failed\n");
+    return 3;
+  }
+
+  err = send(sk, buf, sz, 0);
+  if ( err < 0 ) {
+    perror("list_updates: send");
+    close(sk);
+    return 3;
+  }
+
+  do {
+    sz = recv(sk, buf, sizeof(buf), 0);
+    if ( sz < 0 ) {
+      perror("list_updates: recv");
+      close(sk);
+      return 4;
+    }
+
+    if ( display_stork_response(buf, sz, NULL) == 0 ) {
+      char *url = NULL;
+      size_t url_sz = 0;
+      int16_t sts = 0;
+      uint16_t priority = 0xFFFF, queued = 0;
+
+      for ( attr = KLM_FIRSTATTR(msg, sz); attr; attr = KLM_NEXTATTR(msg, attr, sz) ) {
+        switch ( ntohs(attr->kla_name) ) {
+        case KLA_APP_MANIFEST_URL:
+          url = KLA_DATA(attr, msg, sz);
+          url_sz = KLA_PAYLOAD_SIZE(attr);
+          break;
+        case KLA_UPDATE_STATUS:
+          if ( KLA_PAYLOAD_SIZE(attr) == sizeof(uint16_t) )
+            sts = (int16_t) ntohs(*(KLA_DATA_AS(attr, buf, sz, uint16_t *)));
+          break;
+        case KLA_UPDATE_PRIORITY:
+          if ( KLA_PAYLOAD_SIZE(attr) == sizeof(uint16_t) )
+            priority = ntohs(*(KLA_DATA_AS(attr, buf, sz, uint16_t *)));
+          break;
+        case KLA_UPDATE_QUEUE:
+          if ( KLA_PAYLOAD_SIZE(attr) == sizeof(uint16_t) )
+            queued = ntohs(*(KLA_DATA_AS(attr, buf, sz, uint16_t *)));
+          break;
+        default:
+          break;
+        }
+      }
+
+      // An empty list is a single response without an update
+      if ( url )
+        printf("%.*s %s %s %s\n", (int) url_sz, url,
+               update_priority_str(priority), update_queue_str(queued),
+               update_status_str(sts));
+    } else {
+      close(sk);
+      return 5;
+    }
+
+  } while ( !KLM_IS_END(msg) );
+
+  close(sk);
+  return EXIT_SUCCESS;
+}
+
+int cancel_update(int argc, char **argv) {
+  char buf[KITE_MAX_LOCAL_MSG_SZ];
+  struct kitelocalmsg *msg = (struct kitelocalmsg *)buf;
+  struct kitelocalattr *attr = KLM_FIRSTATTR(msg, sizeof(buf));
+  int sz = KLM_SIZE_INIT, sk, err;
+  const char *app_manifest;
+
+  if ( argc != 2 ) {
+    fprintf(stderr, "Usage: appliancectl cancel-update <app-manifest-url>\n");
+    return 1;
+  }
+
+  app_manifest = argv[1];
+
+  msg->klm_req = ntohs(KLM_REQ_DELETE | KLM_REQ_ENTITY_UPDATE);
+  msg->klm_req_flags = 0;
+
+  attr->kla_name = ntohs(KLA_APP_MANIFEST_URL);
+  attr->kla_length = ntohs(KLA_SIZE(strlen(app_manifest)));
+  memcpy(KLA_DATA_UNSAFE(attr, char*), app_manifest, strlen(app_manifest));
+  KLM_SIZE_ADD_ATTR(sz, attr);
+
+  sk = mk_api_socket();
+  if ( sk < 0 ) {
+    fprintf(stderr, "cancel_update: mk_api_socket failed\n");
+    return 3;
+  }
+
+  err = send(sk, buf, sz, 0);
+  if ( err < 0 ) {
+    perror("cancel_update: send");
+    close(sk);
+    return 3;
+  }
+
+  err = recv(sk, buf, sizeof(buf), 0);
+  if ( err < 0 ) {
+    perror("cancel_update: recv");
+    close(sk);
+    return 2;
+  }
+  close(sk);
+
+  if ( display_stork_response(buf, err, "Canceled update\n") < 0 )
+    return EXIT_FAILURE;
+
+  return EXIT_SUCCESS;
+}
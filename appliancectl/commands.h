@@ -19,11 +19,15 @@ int send_with_fds(int sk, const void *buf, size_t bufsz, int flags,
 // Commands
 int create_persona(int argc, char **argv);
 int list_personas(int argc, char **argv);
+int grant_site(int argc, char **argv);
+int revoke_site(int argc, char **argv);
 
 int join_flock(int argc, char **argv);
 int list_flocks(int argc, char **argv);
 
 int register_app(int argc, char **argv);
+int list_updates(int argc, char **argv);
+int cancel_update(int argc, char **argv);
 
 //int get_container(int argc, char **argv);
 int run_in_container(int argc, char **argv);
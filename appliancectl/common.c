@@ -32,6 +32,7 @@ const char *kite_entity_str(uint16_t entity) {
   case KLM_REQ_ENTITY_APP: return "Application";
   case KLM_REQ_ENTITY_FLOCK: return "Flock";
   case KLM_REQ_ENTITY_CONTAINER: return "Container";
+  case KLM_REQ_ENTITY_UPDATE: return "Update";
   default: return "Unknown";
   }
 }
@@ -10,11 +10,15 @@ static struct {
 } commands[] = {
   { "create-persona", create_persona },
   { "list-personas", list_personas },
+  { "grant-site", grant_site },
+  { "revoke-site", revoke_site },
 
   { "join-flock", join_flock },
   { "list-flocks", list_flocks },
 
   { "register-app", register_app },
+  { "list-updates", list_updates },
+  { "cancel-update", cancel_update },
 
   { "run-in-container", run_in_container },
 
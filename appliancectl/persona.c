@@ -4,11 +4,14 @@
 
 #include "local_proto.h"
 #include "commands.h"
+#include "util.h"
 
 #define DISPLAY_NAME_ARG 0x200
 #define PASSWORD_ARG     0x201
 #define SUPERUSER_ARG    0x202
 
+#define PERSONA_ID_LENGTH 32
+
 int create_persona_usage() {
   fprintf(stderr, "Usage: appliancectl create-persona [--display-name <name>] [--password <pw>] [--superuser]\n");
   return 1;
@@ -108,3 +111,78 @@ int create_persona(int argc, char **argv) {
 int list_personas(int argc, char **argv) {
   return 1;
 }
+
+static int update_site(int argc, char **argv, int grant) {
+  char buf[KITE_MAX_LOCAL_MSG_SZ];
+  struct kitelocalmsg *msg = (struct kitelocalmsg *) buf;
+  struct kitelocalattr *attr = KLM_FIRSTATTR(msg, sizeof(buf));
+  unsigned char persona_id[PERSONA_ID_LENGTH];
+  int sz = KLM_SIZE_INIT, sk, err, i;
+
+  if ( argc < 4 ) {
+    fprintf(stderr, "Usage: appliancectl %s <persona-id> <site-id> <permission>...\n", argv[0]);
+    return 1;
+  }
+
+  if ( strlen(argv[1]) != PERSONA_ID_LENGTH * 2 ||
+       parse_hex_str(argv[1], persona_id, sizeof(persona_id)) != sizeof(persona_id) ) {
+    fprintf(stderr, "Invalid persona id %s\n", argv[1]);
+    return 1;
+  }
+
+  msg->klm_req = ntohs(KLM_REQ_UPDATE | KLM_REQ_ENTITY_PERSONA);
+  msg->klm_req_flags = 0;
+
+  attr->kla_name = ntohs(KLA_PERSONA_ID);
+  attr->kla_length = ntohs(KLA_SIZE(sizeof(persona_id)));
+  memcpy(KLA_DATA_UNSAFE(attr, void *), persona_id, sizeof(persona_id));
+  KLM_SIZE_ADD_ATTR(sz, attr);
+
+  for ( i = 2; i < argc; ++i ) {
+    attr = KLM_NEXTATTR(msg, attr, sizeof(buf));
+    if ( !attr ) goto too_long;
+    attr->kla_name = ntohs(i == 2 ? KLA_SITE_ID : (grant ? KLA_APP_PERMISSION : KLA_APP_PERMISSION_REVOKED));
+    attr->kla_length = ntohs(KLA_SIZE(strlen(argv[i])));
+    if ( !KLA_DATA(attr, buf, sizeof(buf)) ) goto too_long;
+    memcpy(KLA_DATA_UNSAFE(attr, char *), argv[i], strlen(argv[i]));
+    KLM_SIZE_ADD_ATTR(sz, attr);
+  }
+
+  sk = mk_api_socket();
+  if ( sk < 0 ) {
+    fprintf(stderr, "update_site: mk_api_socket failed\n");
+    return 3;
+  }
+
+  err = send(sk, buf, sz, 0);
+  if ( err < 0 ) {
+    perror("update_site: send");
+    close(sk);
+    return 3;
+  }
+
+  err = recv(sk, buf, sizeof(buf), 0);
+  if ( err < 0 ) {
+    perror("update_site: recv");
+    close(sk);
+    return 2;
+  }
+  close(sk);
+
+  if ( display_stork_response(buf, err, grant ? "Granted permissions\n" : "Revoked permissions\n") < 0 )
+    return EXIT_FAILURE;
+
+  return EXIT_SUCCESS;
+
+ too_long:
+  fprintf(stderr, "Too many permissions\n");
+  return 1;
+}
+
+int grant_site(int argc, char **argv) {
+  return update_site(argc, argv, 1);
+}
+
+int revoke_site(int argc, char **argv) {
+  return update_site(argc, argv, 0);
+}
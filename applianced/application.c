@@ -12,18 +12,32 @@
 #include "persona.h"
 #include "state.h"
 #include "buffer.h"
+#include "init_proto.h"
 
 #define OP_APPINSTANCE_RESET_REQUEST EVT_CTL_CUSTOM
 #define OP_APPINSTANCE_RESET_COMPLETE (EVT_CTL_CUSTOM + 1)
 #define OP_APPINSTANCE_FORCE_RESET (EVT_CTL_CUSTOM + 2)
 #define OP_APPINSTANCE_AFTER_RUN (EVT_CTL_CUSTOM + 3)
+#define OP_APPINSTANCE_START (EVT_CTL_CUSTOM + 4)
 
 static struct appmanifest *appmanifest_parse_tokens(const char *data, size_t sz,
                                                     jsmntok_t *tokens, int tokencnt,
                                                     const char *system);
 static void freemanifest(const struct shared *sh, int level);
 
-static int appinstance_setup(struct container *c, struct appinstance *ai);
+// Everything appinstance_setup needs to know about an instance. It is
+// packed in the parent, so that containers from the app instance pool,
+// cloned before the instance existed, can be set up for it
+struct appinstancesetup {
+  uint32_t ais_app_flags;
+  char     ais_persona_id[PERSONA_ID_X_LENGTH + 1];
+  uint32_t ais_bind_mount_count;
+  // Followed by the app domain, image path, and bind mounts, each
+  // NUL-terminated
+};
+
+static ssize_t appinstance_pack_setup(struct appinstance *ai, char *buf, size_t buf_sz);
+static int appinstance_setup(struct container *c, const char *setup, size_t setup_sz);
 static int appinstance_host_setup(struct container *c, struct appinstance *ai);
 static int appinstance_container_ctl(struct container *c, int op, void *argp, ssize_t argl);
 static void appinstfn(struct eventloop *el, int op, void *arg);
@@ -99,6 +113,112 @@ struct appmanifest *appmanifest_parse_from_file(const char *fn, unsigned char *e
   return mf;
 }
 
+static void freebincaches(struct bincache *caches, size_t count) {
+  size_t i;
+  int k;
+
+  for ( i = 0; i < count; ++i ) {
+    if ( caches[i].bc_uri ) free((void *)caches[i].bc_uri);
+    for ( k = 0; k < caches[i].bc_key_count; ++k )
+      free((void *)caches[i].bc_keys[k]);
+    if ( caches[i].bc_keys ) free(caches[i].bc_keys);
+  }
+
+  free(caches);
+}
+
+static int jsmn_key_is(const char *data, jsmntok_t *tok, const char *key) {
+  return tok->type == JSMN_STRING && (tok->end - tok->start) == strlen(key) &&
+    strncmp(data + tok->start, key, tok->end - tok->start) == 0;
+}
+
+static char *jsmn_strdup(const char *data, jsmntok_t *tok) {
+  char *ret = malloc(tok->end - tok->start + 1);
+  if ( !ret ) return NULL;
+
+  memcpy(ret, data + tok->start, tok->end - tok->start);
+  ret[tok->end - tok->start] = '\0';
+  return ret;
+}
+
+// Parse the binary-caches list at token i:
+//
+//   [ { "url": "https://...", "keys": [ "name:base64 key", ... ] }, ... ]
+//
+// Returns the index of the last token used, or -1 on error
+static int appmanifest_parse_bin_caches(const char *data, jsmntok_t *tokens, int tokencnt, int i,
+                                        struct bincache **caches_out, size_t *count_out) {
+  jsmntok_t *list = tokens + i;
+  struct bincache *caches;
+  size_t count = 0;
+  int c, keys_left;
+
+  if ( list->type != JSMN_ARRAY ) return -1;
+
+  caches = malloc(sizeof(*caches) * (list->size + 1));
+  if ( !caches ) return -1;
+  memset(caches, 0, sizeof(*caches) * (list->size + 1));
+
+  for ( c = 0; c < list->size; ++c ) {
+    struct bincache *bc = caches + count;
+    jsmntok_t *obj;
+
+    if ( ++i >= tokencnt || tokens[i].type != JSMN_OBJECT ) goto error;
+    obj = tokens + i;
+    count++;
+
+    for ( keys_left = obj->size; keys_left > 0; keys_left-- ) {
+      jsmntok_t *key, *value;
+
+      if ( i + 2 >= tokencnt ) goto error;
+      key = tokens + ++i;
+      value = tokens + ++i;
+
+      if ( jsmn_key_is(data, key, "url") ) {
+        char *url;
+
+        if ( value->type != JSMN_STRING || bc->bc_uri ) goto error;
+        bc->bc_uri = url = jsmn_strdup(data, value);
+        if ( !url ) goto error;
+
+        while ( *url && url[strlen(url) - 1] == '/' )
+          url[strlen(url) - 1] = '\0';
+      } else if ( jsmn_key_is(data, key, "keys") ) {
+        int k;
+
+        if ( value->type != JSMN_ARRAY || bc->bc_keys ) goto error;
+
+        bc->bc_keys = malloc(sizeof(*bc->bc_keys) * (value->size + 1));
+        if ( !bc->bc_keys ) goto error;
+
+        for ( k = 0; k < value->size; ++k ) {
+          if ( ++i >= tokencnt || tokens[i].type != JSMN_STRING ) goto error;
+
+          bc->bc_keys[k] = jsmn_strdup(data, tokens + i);
+          if ( !bc->bc_keys[k] ) goto error;
+          bc->bc_key_count++;
+        }
+      } else {
+        // Skip anything else
+        while ( i + 1 < tokencnt && tokens[i + 1].start < value->end ) i++;
+      }
+    }
+
+    if ( !bc->bc_uri ) {
+      fprintf(stderr, "Binary cache without a url\n");
+      goto error;
+    }
+  }
+
+  *caches_out = caches;
+  *count_out = count;
+  return i;
+
+ error:
+  freebincaches(caches, count);
+  return -1;
+}
+
 #define EXPECT(what) do {                                               \
     fprintf(stderr, "Expected %s at %d\n", (what), token->start);       \
     goto error;                                                         \
@@ -116,19 +236,25 @@ static struct appmanifest *appmanifest_parse_tokens(const char *data, size_t sz,
     PARSING_ST_SINGLETON,
     PARSING_ST_RUN_AS_ADMIN,
     PARSING_ST_BIND_MOUNTS,
+    PARSING_ST_WARM_CONTAINERS,
+    PARSING_ST_HEALTH_CHECK,
+    PARSING_ST_HEALTH_CHECK_INTERVAL,
+    PARSING_ST_BINARY_CACHES,
 
     PARSING_ST_VERSION
   } state = PARSING_ST_INITIAL;
   int main_obj_end = -1;
 
   struct appmanifest *ret;
-  char *name = NULL, *domain = NULL, *nix_closure = NULL;
+  char *name = NULL, *domain = NULL, *nix_closure = NULL, *health_check = NULL;
   char **bind_mounts = NULL;
+  struct bincache *bin_caches = NULL;
 
   unsigned int major = 0, minor = 0, revision = 0;
 
-  size_t bind_mount_count = 0;
+  size_t bind_mount_count = 0, bin_cache_count = 0;
   uint32_t flags = 0;
+  int warm_containers = 0, health_check_interval = 0;
 
   for ( i = 0; i < tokencnt; ++i ) {
     jsmntok_t *token = tokens + i;
@@ -161,6 +287,14 @@ static struct appmanifest *appmanifest_parse_tokens(const char *data, size_t sz,
           state = PARSING_ST_RUN_AS_ADMIN;
         } else if ( strncmp(data + token->start, "bind-mounts", token->end - token->start) == 0 ) {
           state = PARSING_ST_BIND_MOUNTS;
+        } else if ( strncmp(data + token->start, "warm-containers", token->end - token->start) == 0 ) {
+          state = PARSING_ST_WARM_CONTAINERS;
+        } else if ( strncmp(data + token->start, "health-check", token->end - token->start) == 0 ) {
+          state = PARSING_ST_HEALTH_CHECK;
+        } else if ( strncmp(data + token->start, "health-check-interval", token->end - token->start) == 0 ) {
+          state = PARSING_ST_HEALTH_CHECK_INTERVAL;
+        } else if ( strncmp(data + token->start, "binary-caches", token->end - token->start) == 0 ) {
+          state = PARSING_ST_BINARY_CACHES;
         } else if ( strncmp(data + token->start, "version", token->end - token->start) == 0 ) {
           state = PARSING_ST_VERSION;
         } else {
@@ -240,6 +374,7 @@ static struct appmanifest *appmanifest_parse_tokens(const char *data, size_t sz,
 
     case PARSING_ST_DOMAIN:
     case PARSING_ST_NAME:
+    case PARSING_ST_HEALTH_CHECK:
       if ( token->type != JSMN_STRING ) {
         EXPECT("string");
       } else {
@@ -247,6 +382,7 @@ static struct appmanifest *appmanifest_parse_tokens(const char *data, size_t sz,
         switch ( state ) {
         case PARSING_ST_DOMAIN: old = &domain; this_name = "domain"; break;
         case PARSING_ST_NAME: old = &name; this_name = "name"; break;
+        case PARSING_ST_HEALTH_CHECK: old = &health_check; this_name = "health-check"; break;
         case PARSING_ST_NIX_CLOSURE: old = &nix_closure; this_name = "nix-closure"; break;
         default: abort();
         }
@@ -287,6 +423,46 @@ static struct appmanifest *appmanifest_parse_tokens(const char *data, size_t sz,
       }
       break;
 
+    case PARSING_ST_HEALTH_CHECK_INTERVAL:
+      if ( token->type != JSMN_PRIMITIVE ) {
+        EXPECT("number");
+      } else if ( parse_decimal(&health_check_interval, data + token->start,
+                                token->end - token->start) != (token->end - token->start) ||
+                  health_check_interval < STK_HEALTH_MIN_INTERVAL ||
+                  health_check_interval > STK_HEALTH_MAX_INTERVAL ) {
+        EXPECT("interval between 1 and 86400 seconds");
+      } else
+        state = PARSING_ST_MAIN_OBJECT_KEY;
+      break;
+
+    case PARSING_ST_BINARY_CACHES:
+      if ( bin_caches ) {
+        fprintf(stderr, "Duplicate binary-caches\n");
+        goto error;
+      } else {
+        int last = appmanifest_parse_bin_caches(data, tokens, tokencnt, i,
+                                                &bin_caches, &bin_cache_count);
+        if ( last < 0 ) EXPECT("list of binary caches, with url and keys");
+
+        i = last;
+        state = PARSING_ST_MAIN_OBJECT_KEY;
+      }
+      break;
+
+    case PARSING_ST_WARM_CONTAINERS:
+      if ( token->type != JSMN_PRIMITIVE ) {
+        EXPECT("number");
+      } else if ( parse_decimal(&warm_containers, data + token->start,
+                                token->end - token->start) != (token->end - token->start) ) {
+        EXPECT("non-negative integer");
+      } else {
+        if ( warm_containers > CONTAINER_POOL_MAX )
+          warm_containers = CONTAINER_POOL_MAX;
+
+        state = PARSING_ST_MAIN_OBJECT_KEY;
+      }
+      break;
+
     case PARSING_ST_BIND_MOUNTS:
       if ( token->type != JSMN_ARRAY ) {
         EXPECT("list");
@@ -352,6 +528,15 @@ static struct appmanifest *appmanifest_parse_tokens(const char *data, size_t sz,
     goto error;
   }
 
+  // The probe itself is checked by app-instance-init
+  if ( health_check &&
+       strcmp(health_check, "script") != 0 &&
+       strncmp(health_check, "tcp:", 4) != 0 &&
+       strncmp(health_check, "http:", 5) != 0 ) {
+    fprintf(stderr, "Unknown health-check %s\n", health_check);
+    goto error;
+  }
+
   ret = malloc(sizeof(*ret));
   if ( !ret ) goto error;
 
@@ -370,18 +555,25 @@ static struct appmanifest *appmanifest_parse_tokens(const char *data, size_t sz,
   ret->am_minor = minor;
   ret->am_revision = revision;
 
-  ret->am_bin_caches_count = 0;
-  ret->am_bin_caches = NULL;
+  ret->am_bin_caches_count = bin_cache_count;
+  ret->am_bin_caches = bin_caches;
 
   ret->am_bind_mount_count = bind_mount_count;
   ret->am_bind_mounts = (const char **)bind_mounts;
 
+  ret->am_warm_containers = warm_containers;
+
+  ret->am_health_check = health_check;
+  ret->am_health_check_interval = health_check_interval;
+
   return ret;
 
  error:
   if ( name ) free(name);
+  if ( health_check ) free(health_check);
   if ( domain ) free(domain);
   if ( nix_closure ) free(nix_closure);
+  if ( bin_caches ) freebincaches(bin_caches, bin_cache_count);
   if ( bind_mounts ) {
     size_t i = 0;
 
@@ -400,7 +592,8 @@ static void freemanifest(const struct shared *sh, int level) {
     if ( mf->am_domain ) free((void *)mf->am_domain);
     if ( mf->am_name ) free((void *)mf->am_name);
     if ( mf->am_nix_closure ) free((void *)mf->am_nix_closure);
-    if ( mf->am_bin_caches ) free((void *)mf->am_bin_caches);
+    if ( mf->am_health_check ) free((void *)mf->am_health_check);
+    if ( mf->am_bin_caches ) freebincaches(mf->am_bin_caches, mf->am_bin_caches_count);
 
     if ( mf->am_bind_mounts ) {
       size_t i;
@@ -496,6 +689,7 @@ struct app *application_from_manifest(struct appmanifest *mf) {
 
   ret->app_instances = NULL;
   ret->app_singleton = NULL;
+  ret->app_warm_containers = 0;
 
   return ret;
 }
@@ -529,7 +723,60 @@ void appinstance_request_reset(struct eventloop *el, struct appinstance *ai) {
   }
 }
 
-struct appinstance *launch_app_instance(struct appstate *as, struct persona *p, struct app *a) {
+void appinstance_request_start(struct appinstance *ai) {
+  // inst_mutex may be held by someone waiting on the arp table
+  if ( __sync_bool_compare_and_swap(&ai->inst_start_queued, 0, 1) ) {
+    APPINSTANCE_WREF(ai);
+    if ( eventloop_invoke_async(&ai->inst_appstate->as_eventloop, &ai->inst_start) < 0 ) {
+      perror("appinstance_request_start: eventloop_invoke_async");
+      ai->inst_start_queued = 0;
+      APPINSTANCE_WUNREF(ai);
+    }
+  }
+}
+
+// Called by the bridge when a container asks for the instance's
+// address. Only containers of the instance's persona (or any kite
+// container, for singletons) may start it. The bridge holds a weak
+// reference on the instance while this runs
+static void appinstance_demandfn(struct brstate *br, struct brdemand *bd,
+                                 const struct brdemandreq *req) {
+  struct appinstance *ai = STRUCT_FROM_BASE(struct appinstance, inst_demand, bd);
+  struct in_addr requester = req->bdr_requester;
+  struct arpdesc desc;
+  const char *persona_id = NULL;
+  int allowed = 0;
+
+  if ( APPINSTANCE_LOCK(ai) != 0 ) return;
+
+  if ( bridge_describe_arp(br, &requester, &desc, sizeof(desc)) > 0 ) {
+    switch ( desc.ad_container_type ) {
+    case ARP_DESC_PERSONA:
+      persona_id = desc.ad_persona.ad_persona_id;
+      allowed = 1;
+      break;
+    case ARP_DESC_APP_INSTANCE:
+      persona_id = desc.ad_app_instance.ad_persona_id;
+      allowed = 1;
+      break;
+    default: break;
+    }
+
+    if ( allowed && ai->inst_persona )
+      allowed = memcmp(persona_id, ai->inst_persona->p_persona_id,
+                       sizeof(ai->inst_persona->p_persona_id)) == 0;
+
+    arpdesc_release(&desc, sizeof(desc));
+  }
+
+  if ( allowed )
+    appinstance_request_start(ai);
+
+  APPINSTANCE_UNREF(ai);
+}
+
+static struct appinstance *get_app_instance(struct appstate *as, struct persona *p,
+                                            struct app *a, int start) {
   int singleton = 0;
   struct appinstance *ret;
 
@@ -539,7 +786,8 @@ struct appinstance *launch_app_instance(struct appstate *as, struct persona *p,
       if ( a->app_singleton ) {
         ret = a->app_singleton;
         APPINSTANCE_REF(ret);
-        container_ensure_running(&ret->inst_container, &p->p_appstate->as_eventloop);
+        if ( start )
+          container_ensure_running(&ret->inst_container, &as->as_eventloop);
         pthread_mutex_unlock(&a->app_mutex);
 
         return ret;
@@ -564,7 +812,8 @@ struct appinstance *launch_app_instance(struct appstate *as, struct persona *p,
                 ret);
       if ( ret ) {
         APPINSTANCE_REF(ret);
-        container_ensure_running(&ret->inst_container, &p->p_appstate->as_eventloop);
+        if ( start )
+          container_ensure_running(&ret->inst_container, &as->as_eventloop);
         pthread_mutex_unlock(&p->p_mutex);
         return ret;
       }
@@ -583,7 +832,9 @@ struct appinstance *launch_app_instance(struct appstate *as, struct persona *p,
   qdevtsub_init(&ret->inst_reset_complete, OP_APPINSTANCE_RESET_COMPLETE, appinstfn);
   qdevtsub_init(&ret->inst_after_run, OP_APPINSTANCE_AFTER_RUN, appinstfn);
   timersub_init_default(&ret->inst_force_reset_timeout, OP_APPINSTANCE_FORCE_RESET, appinstfn);
+  qdevtsub_init(&ret->inst_start, OP_APPINSTANCE_START, appinstfn);
   ret->inst_flags = 0;
+  ret->inst_start_queued = 0;
 
   ret->inst_appstate = as;
 
@@ -598,6 +849,17 @@ struct appinstance *launch_app_instance(struct appstate *as, struct persona *p,
 
   ret->inst_init_comm = -1;
   container_init(&ret->inst_container, &as->as_bridge, appinstance_container_ctl, 0, APP_CONTAINER_TIMEOUT);
+  ret->inst_container.c_pool = &as->as_app_pool;
+
+  // The container keeps this address, even when started from the pool
+  memcpy(&ret->inst_demand.bd_ip, &ret->inst_container.c_ip, sizeof(ret->inst_demand.bd_ip));
+  ret->inst_demand.bd_shared = &ret->inst_shared;
+  ret->inst_demand.bd_fn = appinstance_demandfn;
+  APPINSTANCE_WREF(ret);
+  if ( bridge_add_demand(&as->as_bridge, &ret->inst_demand) < 0 ) {
+    fprintf(stderr, "get_app_instance: could not register instance address\n");
+    APPINSTANCE_WUNREF(ret);
+  }
 
   if ( pthread_mutex_lock(&a->app_mutex) == 0 ) {
     if ( p )
@@ -612,9 +874,10 @@ struct appinstance *launch_app_instance(struct appstate *as, struct persona *p,
     }
     pthread_mutex_unlock(&a->app_mutex);
 
-    // Start the container. The running container holds an instance of us
+    // The running container holds an instance of us
     APPINSTANCE_REF(ret);
-    container_ensure_running(&ret->inst_container, &as->as_eventloop);
+    if ( start )
+      container_ensure_running(&ret->inst_container, &as->as_eventloop);
   } else {
     free(ret);
     ret = NULL;
@@ -625,6 +888,14 @@ struct appinstance *launch_app_instance(struct appstate *as, struct persona *p,
   return ret;
 }
 
+struct appinstance *launch_app_instance(struct appstate *as, struct persona *p, struct app *a) {
+  return get_app_instance(as, p, a, 1);
+}
+
+struct appinstance *reserve_app_instance(struct appstate *as, struct persona *p, struct app *a) {
+  return get_app_instance(as, p, a, 0);
+}
+
 static void appinstfn(struct eventloop *el, int op, void *arg) {
   struct appinstance *ai;
   struct qdevent *evt = (struct qdevent *) arg;
@@ -703,6 +974,25 @@ static void appinstfn(struct eventloop *el, int op, void *arg) {
     }
     break;
 
+  case OP_APPINSTANCE_START:
+    ai = STRUCT_FROM_BASE(struct appinstance, inst_start, evt->qde_sub);
+    if ( APPINSTANCE_LOCK(ai) == 0 ) {
+      // Starts the container if needed, and restarts its idle timer
+      if ( container_ensure_running(&ai->inst_container, el) < 0 )
+        fprintf(stderr, "appinstfn: could not start instance of %s on demand\n",
+                ai->inst_app->app_domain);
+      else {
+        // Answer the ARP requests that asked for it to start
+        if ( bridge_announce_arp(&ai->inst_appstate->as_bridge, &ai->inst_container.c_ip) < 0 )
+          fprintf(stderr, "appinstfn: could not announce %s\n", ai->inst_app->app_domain);
+        container_release_running(&ai->inst_container, el);
+      }
+
+      ai->inst_start_queued = 0;
+      APPINSTANCE_UNREF(ai);
+    }
+    break;
+
   case OP_APPINSTANCE_AFTER_RUN:
     ai = STRUCT_FROM_BASE(struct appinstance, inst_after_run, evt->qde_sub);
     if ( appinstance_host_setup(&ai->inst_container, ai) < 0 ) {
@@ -716,7 +1006,13 @@ static void appinstfn(struct eventloop *el, int op, void *arg) {
 }
 
 static void freeinstfn(const struct shared *sh, int level) {
-  if ( level == SHFREE_NO_MORE_REFS ) {
+  if ( level == SHFREE_NO_MORE_STRONG ) {
+    struct appinstance *ai = STRUCT_FROM_BASE(struct appinstance, inst_shared, sh);
+
+    // Once removed, the bridge can no longer take a reference
+    if ( bridge_del_demand(&ai->inst_appstate->as_bridge, &ai->inst_demand) == 0 )
+      APPINSTANCE_WUNREF(ai);
+  } else if ( level == SHFREE_NO_MORE_REFS ) {
     struct appinstance *ai = STRUCT_FROM_BASE(struct appinstance, inst_shared, sh), *existing;
 
     if ( ai->inst_persona )
@@ -762,10 +1058,19 @@ static void freeinstfn(const struct shared *sh, int level) {
   }
 }
 
+int appinstance_pool_init(struct appstate *as, int max) {
+  return container_pool_init(&as->as_app_pool, &as->as_bridge, 0,
+                             appinstance_container_ctl, max);
+}
+
+// For CONTAINER_CTL_DO_SETUP with a setup description, c may be a
+// pooled container, and not part of an app instance
 static int appinstance_container_ctl(struct container *c, int op, void *argp, ssize_t argl) {
   struct appinstance *ai = STRUCT_FROM_BASE(struct appinstance, inst_container, c);
   const char **cp;
-  char *persona_id;
+  char *persona_id, *interval, setup[CONTAINER_MAX_SETUP_SIZE];
+  struct appmanifest *mf;
+  ssize_t setup_sz;
 
   struct arpdesc *desc;
 
@@ -790,7 +1095,7 @@ static int appinstance_container_ctl(struct container *c, int op, void *argp, ss
     return 0;
 
   case CONTAINER_CTL_GET_ARGS:
-    if ( argl < 3 ) {
+    if ( argl < 5 ) {
       fprintf(stderr, "appinstance_container_ctl: not enough space for args\n");
       return -1;
     }
@@ -806,7 +1111,19 @@ static int appinstance_container_ctl(struct container *c, int op, void *argp, ss
 
     cp[1] = ai->inst_app->app_domain;
     cp[2] = ai->inst_app->app_current_manifest->am_nix_closure;
-    return 3;
+
+    mf = ai->inst_app->app_current_manifest;
+    if ( !mf->am_health_check && mf->am_health_check_interval == 0 )
+      return 3;
+
+    cp[3] = mf->am_health_check ? mf->am_health_check : "script";
+    if ( mf->am_health_check_interval == 0 )
+      return 4;
+
+    cp[4] = interval = malloc(16);
+    if ( !interval ) return 4;
+    snprintf(interval, 16, "%d", mf->am_health_check_interval);
+    return 5;
 
   case CONTAINER_CTL_GET_HOSTNAME:
     cp = argp;
@@ -819,7 +1136,7 @@ static int appinstance_container_ctl(struct container *c, int op, void *argp, ss
     return 0;
 
   case CONTAINER_CTL_RELEASE_ARG:
-    if ( argl == 0 )
+    if ( argl == 0 || argl == 4 )
       free((char *)argp);
     return 0;
 
@@ -827,8 +1144,16 @@ static int appinstance_container_ctl(struct container *c, int op, void *argp, ss
   case CONTAINER_CTL_RELEASE_HOSTNAME:
     return 0;
 
+  case CONTAINER_CTL_GET_SETUP:
+    return appinstance_pack_setup(ai, argp, argl);
+
   case CONTAINER_CTL_DO_SETUP:
-    return appinstance_setup(c, ai);
+    if ( argp )
+      return appinstance_setup(c, argp, argl);
+
+    setup_sz = appinstance_pack_setup(ai, setup, sizeof(setup));
+    if ( setup_sz < 0 ) return -1;
+    return appinstance_setup(c, setup, setup_sz);
 
   case CONTAINER_CTL_AFTER_RUN_HOOK:
     eventloop_queue(&ai->inst_appstate->as_eventloop, &ai->inst_after_run);
@@ -870,23 +1195,73 @@ static int appinstance_container_ctl(struct container *c, int op, void *argp, ss
       fprintf(stderr, "appinstance_setup: while making %s\n", where);   \
     }                                                                   \
   } while (0)
-static int appinstance_setup(struct container *c, struct appinstance *ai) {
-  const char *image_path;
+static ssize_t appinstance_pack_setup(struct appinstance *ai, char *buf, size_t buf_sz) {
+  struct appinstancesetup ais;
   struct appmanifest *cur_mf;
-  char path[PATH_MAX], app_data_path[PATH_MAX],
-    persona_id_str[PERSONA_ID_X_LENGTH + 1];
-  int err;
-  uint32_t app_flags = 0;
+  size_t ofs = sizeof(ais), i;
+  ssize_t ret = -1;
+
+  if ( buf_sz < sizeof(ais) ) return -1;
+
+  memset(&ais, 0, sizeof(ais));
+  if ( ai->inst_persona ) {
+    hex_digest_str((unsigned char *) ai->inst_persona->p_persona_id,
+                   ais.ais_persona_id, PERSONA_ID_LENGTH);
+  } else {
+    memset(ais.ais_persona_id, '0', PERSONA_ID_X_LENGTH);
+    ais.ais_persona_id[PERSONA_ID_X_LENGTH] = '\0';
+  }
 
   if ( pthread_mutex_lock(&ai->inst_app->app_mutex) == 0 ) {
-    fprintf(stderr, "appinstance_setup: read flags\n");
-    app_flags = ai->inst_app->app_flags;
+    ais.ais_app_flags = ai->inst_app->app_flags;
     cur_mf = ai->inst_app->app_current_manifest;
-    image_path = ai->inst_app->app_current_manifest->am_nix_closure;
+    ais.ais_bind_mount_count = cur_mf->am_bind_mount_count;
+
+    if ( container_pack_string(buf, buf_sz, &ofs, ai->inst_app->app_domain) == 0 &&
+         container_pack_string(buf, buf_sz, &ofs, cur_mf->am_nix_closure) == 0 ) {
+      for ( i = 0; i < cur_mf->am_bind_mount_count; ++i ) {
+        if ( container_pack_string(buf, buf_sz, &ofs, cur_mf->am_bind_mounts[i]) < 0 )
+          break;
+      }
+
+      if ( i == cur_mf->am_bind_mount_count )
+        ret = ofs;
+    }
 
     pthread_mutex_unlock(&ai->inst_app->app_mutex);
-  } else
+  }
+
+  if ( ret < 0 ) {
+    fprintf(stderr, "appinstance_pack_setup: could not describe instance\n");
     return -1;
+  }
+
+  memcpy(buf, &ais, sizeof(ais));
+  return ret;
+}
+
+static int appinstance_setup(struct container *c, const char *setup, size_t setup_sz) {
+  struct appstate *as = c->c_bridge->br_appstate;
+  struct appinstancesetup ais;
+  const char *image_path, *app_domain, *bind_mount;
+  char path[PATH_MAX], app_data_path[PATH_MAX];
+  size_t ofs = sizeof(ais);
+  int err;
+
+  if ( setup_sz < sizeof(ais) ) {
+    fprintf(stderr, "appinstance_setup: setup description too short\n");
+    return -1;
+  }
+
+  memcpy(&ais, setup, sizeof(ais));
+  ais.ais_persona_id[PERSONA_ID_X_LENGTH] = '\0';
+
+  app_domain = container_unpack_string(setup, setup_sz, &ofs);
+  image_path = container_unpack_string(setup, setup_sz, &ofs);
+  if ( !app_domain || !image_path ) {
+    fprintf(stderr, "appinstance_setup: malformed setup description\n");
+    return -1;
+  }
 
   FORMAT_PATH("%s/nix", image_path);
   DO_MOUNT("/nix", path, "bind", MS_BIND | MS_RDONLY | MS_REC, "");
@@ -920,13 +1295,13 @@ static int appinstance_setup(struct container *c, struct appinstance *ai) {
   DO_MOUNT(app_data_path, path, "bind", MS_BIND | MS_RDONLY, "");
 
   FORMAT_PATH("%s/etc/resolv.conf", image_path);
-  DO_MOUNT(ai->inst_appstate->as_resolv_conf, path, "bind", MS_BIND | MS_RDONLY, "");
+  DO_MOUNT(as->as_resolv_conf, path, "bind", MS_BIND | MS_RDONLY, "");
 
   FORMAT_PATH("%s/run", image_path);
   DO_MOUNT("tmpfs", path, "tmpfs", MS_NOSUID | MS_STRICTATIME, "mode=700,size=16384k");
 
-  FORMAT_PATH("%s/personas/%s/tmp/%s", ai->inst_appstate->as_conf_dir,
-              persona_id_str, ai->inst_app->app_domain);
+  FORMAT_PATH("%s/personas/%s/tmp/%s", as->as_conf_dir,
+              ais.ais_persona_id, app_domain);
   err = mkdir_recursive(path);
   if ( err < 0 ) {
     perror("appinstance_setup: mkdir_recursive");
@@ -952,16 +1327,8 @@ static int appinstance_setup(struct container *c, struct appinstance *ai) {
   FORMAT_PATH("%s/sys", image_path);
   DO_MOUNT("sysfs", path, "sysfs", MS_NOSUID | MS_NOEXEC | MS_NODEV | MS_RDONLY, "");
 
-  if ( ai->inst_persona ) {
-    hex_digest_str((unsigned char *) ai->inst_persona->p_persona_id,
-                   persona_id_str, PERSONA_ID_LENGTH);
-  } else {
-    memset(persona_id_str, '0', sizeof(persona_id_str));
-    persona_id_str[PERSONA_ID_X_LENGTH] = '\0';
-  }
-
-  FORMAT_PATH("%s/personas/%s/data/%s", ai->inst_appstate->as_conf_dir,
-              persona_id_str, ai->inst_app->app_domain);
+  FORMAT_PATH("%s/personas/%s/data/%s", as->as_conf_dir,
+              ais.ais_persona_id, app_domain);
   err = mkdir_recursive(path);
   if ( err < 0 ) {
     perror("appinstance_setup: mkdir_recursive");
@@ -972,8 +1339,8 @@ static int appinstance_setup(struct container *c, struct appinstance *ai) {
   FORMAT_PATH("%s/kite", image_path);
   DO_MOUNT(app_data_path, path, "bind", MS_BIND | MS_RDONLY | MS_REC, "");
 
-  FORMAT_PATH("%s/personas/%s/log/%s", ai->inst_appstate->as_conf_dir,
-              persona_id_str, ai->inst_app->app_domain);
+  FORMAT_PATH("%s/personas/%s/log/%s", as->as_conf_dir,
+              ais.ais_persona_id, app_domain);
   err = mkdir_recursive(path);
   if ( err < 0 ) {
     perror("appinstance_setup: mkdir_recursive");
@@ -985,8 +1352,8 @@ static int appinstance_setup(struct container *c, struct appinstance *ai) {
   DO_MOUNT(app_data_path, path, "bind", MS_BIND | MS_REC, "");
 
   // If this app has the 'run_with_admin' permission, then run this application with administrator privileges
-  if ( app_flags & APP_FLAG_RUN_AS_ADMIN ) {
-    size_t i;
+  if ( ais.ais_app_flags & APP_FLAG_RUN_AS_ADMIN ) {
+    uint32_t i;
 
     FORMAT_PATH("%s/kite/appliance", image_path);
     err = mkdir_recursive(path);
@@ -995,24 +1362,29 @@ static int appinstance_setup(struct container *c, struct appinstance *ai) {
       fprintf(stderr, "appinstance_setup: while making %s\n", path);
     }
 
-    DO_MOUNT(ai->inst_appstate->as_conf_dir, path, "bind", MS_BIND | MS_REC, "");
+    DO_MOUNT(as->as_conf_dir, path, "bind", MS_BIND | MS_REC, "");
 
     // Also do any bind mounts
-    for ( i = 0; i < cur_mf->am_bind_mount_count; ++i ) {
-      FORMAT_PATH("%s%s", image_path, cur_mf->am_bind_mounts[i]);
+    for ( i = 0; i < ais.ais_bind_mount_count; ++i ) {
+      bind_mount = container_unpack_string(setup, setup_sz, &ofs);
+      if ( !bind_mount ) {
+        fprintf(stderr, "appinstance_setup: missing bind mount in setup description\n");
+        return -1;
+      }
+
+      FORMAT_PATH("%s%s", image_path, bind_mount);
 
       err = mkdir_recursive(path);
       if ( err < 0 ) {
         perror("appinstance_setup: mkdir_recursive");
-        fprintf(stderr, "appinstance_setup: while bind mounting %s (making %s)\n", cur_mf->am_bind_mounts[i], path);
+        fprintf(stderr, "appinstance_setup: while bind mounting %s (making %s)\n", bind_mount, path);
       }
 
-      DO_MOUNT(cur_mf->am_bind_mounts[i], path, "bind", MS_BIND | MS_REC, "");
+      DO_MOUNT(bind_mount, path, "bind", MS_BIND | MS_REC, "");
     }
 
-    if ( bridge_mark_as_admin(&ai->inst_appstate->as_bridge,
-                              ai->inst_container.c_bridge_port,
-                              &ai->inst_container.c_arp_entry) < 0 ) {
+    if ( bridge_mark_as_admin(&as->as_bridge, c->c_bridge_port,
+                              &c->c_arp_entry) < 0 ) {
       fprintf(stderr, "appinstance_setup: bridge_mark_as_admin fails\n");
     } else {
       fprintf(stderr, "appinstance_setup: marked as admin\n");
@@ -36,6 +36,13 @@ struct appinstance {
   uint32_t        inst_flags;
   struct qdevtsub inst_reset, inst_reset_complete, inst_after_run;
   struct timersub inst_force_reset_timeout;
+
+  // Starts the container when its address is first used. The entry
+  // holds a weak reference, dropped when the last strong one is
+  struct brdemand inst_demand;
+  // Set while inst_start is queued
+  int             inst_start_queued;
+  struct qdevtsub inst_start;
 };
 
 #define APPINSTANCE_REF(ai)    SHARED_REF(&(ai)->inst_shared)
@@ -74,6 +81,16 @@ struct appmanifest {
 
   size_t am_bind_mount_count;
   const char **am_bind_mounts;
+
+  // Idle containers to keep ready for new instances of this app
+  // ("warm-containers")
+  int am_warm_containers;
+
+  // Probe for app-instance-init to check the instance with
+  // ("health-check"), and seconds between checks
+  // ("health-check-interval"). NULL and 0 for the defaults
+  const char *am_health_check;
+  int am_health_check_interval;
 };
 
 #define APPMANIFEST_FLAG_RUN_AS_ADMIN 0x1
@@ -102,6 +119,10 @@ struct app {
   struct appinstance *app_instances;
 
   struct appinstance *app_singleton;
+
+  // The idle containers this app added to the appliance's app instance
+  // pool (as_app_pool). Follows the current manifest
+  int app_warm_containers;
 };
 
 #define APP_FLAG_MUTEX_INITIALIZED 0x1
@@ -132,5 +153,16 @@ int validate_perm_url(const char *url,
 struct appmanifest *application_get_manifest(struct app *a);
 
 struct appinstance *launch_app_instance(struct appstate *as, struct persona *p, struct app *a);
+// Like launch_app_instance, but the instance is not started. Its
+// address is reserved, and it starts once the address is used on the
+// bridge
+struct appinstance *reserve_app_instance(struct appstate *as, struct persona *p, struct app *a);
+// Start a reserved instance in the background. Safe to call with
+// the bridge's arp table locked
+void appinstance_request_start(struct appinstance *ai);
+
+// Initialize as->as_app_pool, which app instance containers are taken
+// from. At most max idle containers are kept
+int appinstance_pool_init(struct appstate *as, int max);
 
 #endif
@@ -79,6 +79,18 @@ struct brctlmsg_markadmin {
   struct arpentry bcm_arp;
 };
 
+struct brctlmsg_alias {
+  struct brctlmsg bcm_msg;
+  int bcm_port;
+  struct in_addr bcm_ip;
+};
+
+struct brctlmsg_readdress {
+  struct brctlmsg bcm_msg;
+  int bcm_port;
+  struct in_addr bcm_old_ip, bcm_new_ip;
+};
+
 struct brctlrsp_markadmin {
   struct brctlrsp bcr_rsp;
   struct in_addr bcr_inet_gw;
@@ -89,6 +101,9 @@ struct brctlrsp_markadmin {
 #define BR_DEL_TUNNEL      3
 #define BR_DISCONNECT_PORT 4
 #define BR_MARK_AS_ADMIN   5
+#define BR_ADD_ALIAS       6
+#define BR_DEL_ALIAS       7
+#define BR_READDRESS_PORT  8
 
 static int bridge_setup_ns(struct brstate *br);
 static int bridge_setup_main(void *br_ptr);
@@ -149,6 +164,7 @@ void bridge_clear(struct brstate *br) {
   br->br_bridge_addr.s_addr = 0;
   br->br_tap_addr.s_addr = 0;
   br->br_arp_table = NULL;
+  br->br_demand_table = NULL;
   br->br_sctp_table = NULL;
   memset(&br->br_tap_mac, 0, sizeof(mac_addr));
   fdsub_clear(&br->br_tap_sub);
@@ -315,6 +331,35 @@ static void log_tap_packet(FILE *out, char dir, const struct iovec *iov, int iov
   fflush(out);
 }
 
+static int bridge_write_arp_reply(struct brstate *br, const unsigned char *src_hw_addr,
+                                  uint32_t src_hw_ip, uint32_t tgt_hw_ip) {
+  mac_addr src_hw, tgt_hw_addr = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+  struct ethhdr rsp_eth;
+  struct arphdr rsp_arp;
+  struct iovec iov[] = {
+    { .iov_base = &rsp_eth, .iov_len = sizeof(rsp_eth) },
+    { .iov_base = &rsp_arp, .iov_len = sizeof(rsp_arp) },
+    { .iov_base = src_hw, .iov_len = sizeof(src_hw) },
+    { .iov_base = &src_hw_ip, .iov_len = sizeof(src_hw_ip) },
+    { .iov_base = tgt_hw_addr, .iov_len = sizeof(tgt_hw_addr) },
+    { .iov_base = &tgt_hw_ip, .iov_len = sizeof(tgt_hw_ip) }
+  };
+
+  memset(rsp_eth.h_dest, 0xFF, ETH_ALEN);
+  memcpy(rsp_eth.h_source, br->br_tap_mac, ETH_ALEN);
+  rsp_eth.h_proto = htons(ETH_P_ARP);
+
+  rsp_arp.ar_hrd = htons(ARPHRD_ETHER);
+  rsp_arp.ar_pro = htons(ETH_P_IP);
+  rsp_arp.ar_hln = ETH_ALEN;
+  rsp_arp.ar_pln = 4;
+  rsp_arp.ar_op = htons(ARPOP_REPLY);
+
+  memcpy(src_hw, src_hw_addr, ETH_ALEN);
+
+  return bridge_write_tap_pktv(br, iov, sizeof(iov) / sizeof(iov[0]));
+}
+
 static void bridge_process_arp(struct brstate *br, int size) {
   struct arphdr hdr;
   uint16_t ether_type;
@@ -343,21 +388,13 @@ static void bridge_process_arp(struct brstate *br, int size) {
   case ARPOP_REQUEST:
     if ( ether_type == ETH_P_IP ) {
       struct in_addr which_ip;
-      struct ethhdr rsp_eth;
-      struct arphdr rsp_arp;
-      uint32_t src_hw_ip;
+      uint32_t src_hw_ip, tgt_hw_ip;
       mac_addr src_hw_addr;
+      struct brdemand *demand = NULL;
+      struct brdemandreq demand_req;
+      const unsigned char *sender_hw = br->br_tap_pkt + sizeof(struct ethhdr) + sizeof(struct arphdr);
       int was_found = 0;
 
-      memset(rsp_eth.h_dest, 0xFF, ETH_ALEN);
-      rsp_eth.h_proto = htons(ETH_P_ARP);
-
-      rsp_arp.ar_hrd = htons(ARPHRD_ETHER);
-      rsp_arp.ar_pro = htons(ETH_P_IP);
-      rsp_arp.ar_hln = ETH_ALEN;
-      rsp_arp.ar_pln = 4;
-      rsp_arp.ar_op = htons(ARPOP_REPLY);
-
       if ( size < (sizeof(struct ethhdr) + sizeof(struct arphdr) +
                    (2 * hdr.ar_hln) + hdr.ar_pln) ) {
         fprintf(stderr, "bridge_process_arp: packet is too small\n");
@@ -369,18 +406,33 @@ static void bridge_process_arp(struct brstate *br, int size) {
 
       if ( memcmp(&which_ip, &br->br_tap_addr, sizeof(which_ip)) == 0 ) {
         was_found = 1;
-        memcpy(rsp_eth.h_source, br->br_tap_mac, ETH_ALEN);
         memcpy(src_hw_addr, br->br_tap_mac, ETH_ALEN);
         src_hw_ip = br->br_tap_addr.s_addr;
       } else {
         if ( pthread_rwlock_rdlock(&br->br_arp_mutex) == 0 ) {
-          struct arpentry *found;
+          struct arpentry *found, *requester;
           HASH_FIND(ae_hh, br->br_arp_table, &which_ip, sizeof(which_ip), found);
           if ( found ) {
             was_found = 1;
-            memcpy(rsp_eth.h_source, br->br_tap_mac, ETH_ALEN);
             memcpy(src_hw_addr, found->ae_mac, ETH_ALEN);
             src_hw_ip = found->ae_ip.s_addr;
+
+            if ( found->ae_ctlfn )
+              found->ae_ctlfn(found, ARP_ENTRY_TRAFFIC, NULL, 0);
+          }
+
+          // Start (or keep alive) the container at this address, if the
+          // request really comes from a container on the bridge
+          HASH_FIND(bd_hh, br->br_demand_table, &which_ip, sizeof(which_ip), demand);
+          if ( demand ) {
+            memcpy(&demand_req.bdr_requester.s_addr, sender_hw + hdr.ar_hln,
+                   sizeof(demand_req.bdr_requester.s_addr));
+            HASH_FIND(ae_hh, br->br_arp_table, &demand_req.bdr_requester,
+                      sizeof(demand_req.bdr_requester), requester);
+            if ( requester && memcmp(requester->ae_mac, sender_hw, ETH_ALEN) == 0 )
+              SHARED_WREF(demand->bd_shared);
+            else
+              demand = NULL;
           }
           pthread_rwlock_unlock(&br->br_arp_mutex);
         } else
@@ -388,20 +440,17 @@ static void bridge_process_arp(struct brstate *br, int size) {
       }
 
       if ( was_found ) {
-        mac_addr tgt_hw_addr = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
-        struct iovec iov[] = {
-          { .iov_base = &rsp_eth, .iov_len = sizeof(rsp_eth) },
-          { .iov_base = &rsp_arp, .iov_len = sizeof(rsp_arp) },
-          { .iov_base = src_hw_addr, .iov_len = sizeof(src_hw_addr) },
-          { .iov_base = &src_hw_ip, .iov_len = sizeof(src_hw_ip) },
-          { .iov_base = tgt_hw_addr, .iov_len = sizeof(tgt_hw_addr) },
-          { .iov_base = br->br_tap_pkt + sizeof(struct ethhdr) + sizeof(struct arphdr) + hdr.ar_pln,
-            .iov_len = sizeof(uint32_t) }
-        };
-
-        bridge_write_tap_pktv(br, iov, sizeof(iov) / sizeof(iov[0]));
-      } else
+        memcpy(&tgt_hw_ip, br->br_tap_pkt + sizeof(struct ethhdr) + sizeof(struct arphdr) + hdr.ar_pln,
+               sizeof(tgt_hw_ip));
+        bridge_write_arp_reply(br, src_hw_addr, src_hw_ip, tgt_hw_ip);
+      } else if ( !demand )
         fprintf(stderr, "bridge_process_arp: not found\n");
+
+      // If the container is not up yet, it is announced once it is
+      if ( demand ) {
+        demand->bd_fn(br, demand, &demand_req);
+        SHARED_WUNREF(demand->bd_shared);
+      }
     } else
       fprintf(stderr, "bridge_process_arp: TODO IPV6\n");
     break;
@@ -475,6 +524,7 @@ static void bridge_process_udp(struct brstate *br, struct eventloop *el, int sz,
             bpr->bpr_bridge = br;
             bpr->bpr_user_data = NULL;
             bpr->bpr_persona = NULL;
+            bpr->bpr_site_sz = 0;
             memcpy(bpr->bpr_srchost, hdr_eth->h_source, sizeof(bpr->bpr_srchost));
             bpr->bpr_srcaddr.sin_addr.s_addr = hdr_ip->saddr;
             bpr->bpr_srcaddr.sin_port = hdr_udp.uh_sport;
@@ -788,6 +838,9 @@ int bridge_write_from_foreign_pkt(struct brstate *br, struct container *dst,
 
   if ( pthread_rwlock_rdlock(&br->br_arp_mutex) == 0 ) {
     HASH_FIND(ae_hh, br->br_arp_table, &dst->c_ip, sizeof(dst->c_ip), arp);
+    // Wakes dst if it was frozen while idle
+    if ( arp && arp->ae_ctlfn )
+      arp->ae_ctlfn(arp, ARP_ENTRY_TRAFFIC, NULL, 0);
     pthread_rwlock_unlock(&br->br_arp_mutex);
   } else return -1;
 
@@ -831,6 +884,81 @@ int bridge_write_from_foreign_pkt(struct brstate *br, struct container *dst,
   }
 }
 
+int bridge_write_frag_needed(struct brstate *br, struct container *src,
+                             const unsigned char *pkt, uint16_t pkt_sz,
+                             uint16_t mtu) {
+  struct arpentry *arp;
+  struct ethhdr mac;
+  struct iphdr ip, orig_ip;
+  struct {
+    struct icmphdr icmp;
+    struct iphdr orig_ip;
+    unsigned char orig_data[8];
+  } KITE_PACKED rsp;
+
+  struct iovec iov[3] = {
+    { .iov_base = &mac, .iov_len = sizeof(mac) },
+    { .iov_base = &ip, .iov_len = sizeof(ip) },
+    { .iov_base = &rsp, .iov_len = sizeof(rsp) }
+  };
+
+  if ( pkt_sz < sizeof(rsp.orig_data) ) return -1;
+
+  if ( pthread_rwlock_rdlock(&br->br_arp_mutex) == 0 ) {
+    HASH_FIND(ae_hh, br->br_arp_table, &src->c_ip, sizeof(src->c_ip), arp);
+    pthread_rwlock_unlock(&br->br_arp_mutex);
+  } else return -1;
+
+  if ( !arp ) {
+    fprintf(stderr, "bridge_write_frag_needed: could not arp\n");
+    return -1;
+  }
+
+  memcpy(mac.h_dest, arp->ae_mac, ETH_ALEN);
+  memcpy(mac.h_source, br->br_tap_mac, ETH_ALEN);
+  mac.h_proto = htons(ETH_P_IP);
+
+  // Reconstruct the header of the packet the container sent us. The
+  // container's SCTP stack matches the ICMP error to an association
+  // using this header and the ports and verification tag in the first
+  // eight bytes of the SCTP packet.
+  orig_ip.version = 4;
+  orig_ip.ihl = 5;
+  orig_ip.tos = 0;
+  orig_ip.tot_len = htons(pkt_sz + sizeof(orig_ip));
+  orig_ip.id = 0;
+  orig_ip.frag_off = htons(IP_DF);
+  orig_ip.ttl = 64;
+  orig_ip.protocol = IPPROTO_SCTP;
+  orig_ip.check = 0;
+  orig_ip.saddr = arp->ae_ip.s_addr;
+  orig_ip.daddr = br->br_tap_addr.s_addr;
+  orig_ip.check = htons(ip_checksum(&orig_ip, sizeof(orig_ip)));
+
+  memset(&rsp.icmp, 0, sizeof(rsp.icmp));
+  rsp.icmp.type = ICMP_DEST_UNREACH;
+  rsp.icmp.code = ICMP_FRAG_NEEDED;
+  rsp.icmp.un.frag.mtu = htons(mtu);
+  memcpy(&rsp.orig_ip, &orig_ip, sizeof(orig_ip));
+  memcpy(rsp.orig_data, pkt, sizeof(rsp.orig_data));
+  rsp.icmp.checksum = htons(ip_checksum(&rsp, sizeof(rsp)));
+
+  ip.version = 4;
+  ip.ihl = 5;
+  ip.tos = 0;
+  ip.tot_len = htons(sizeof(ip) + sizeof(rsp));
+  ip.id = 0xBEEF;
+  ip.frag_off = htons(IP_DF);
+  ip.ttl = 64;
+  ip.protocol = IPPROTO_ICMP;
+  ip.check = 0;
+  ip.saddr = br->br_tap_addr.s_addr;
+  ip.daddr = arp->ae_ip.s_addr;
+  ip.check = htons(ip_checksum(&ip, sizeof(ip)));
+
+  return bridge_write_tap_pktv(br, iov, 3);
+}
+
 void bridge_enable_debug(struct brstate *br, const char *pkts_out) {
   int err;
 
@@ -889,6 +1017,55 @@ int bridge_del_arp(struct brstate *br, struct arpentry *arp) {
   } else return -1;
 }
 
+int bridge_add_demand(struct brstate *br, struct brdemand *bd) {
+  struct brdemand *old;
+  if ( pthread_rwlock_wrlock(&br->br_arp_mutex) == 0 ) {
+    int ret = 0;
+    HASH_FIND(bd_hh, br->br_demand_table, &bd->bd_ip, sizeof(bd->bd_ip), old);
+    if ( old ) {
+      fprintf(stderr, "bridge_add_demand: already have demand entry\n");
+      ret = -1;
+    } else {
+      HASH_ADD(bd_hh, br->br_demand_table, bd_ip, sizeof(bd->bd_ip), bd);
+    }
+    pthread_rwlock_unlock(&br->br_arp_mutex);
+    return ret;
+  } else return -1;
+}
+
+int bridge_announce_arp(struct brstate *br, const struct in_addr *ip) {
+  struct arpentry *arp;
+  mac_addr hw_addr;
+
+  if ( pthread_rwlock_rdlock(&br->br_arp_mutex) == 0 ) {
+    HASH_FIND(ae_hh, br->br_arp_table, ip, sizeof(*ip), arp);
+    if ( arp )
+      memcpy(hw_addr, arp->ae_mac, ETH_ALEN);
+    pthread_rwlock_unlock(&br->br_arp_mutex);
+  } else return -1;
+
+  if ( !arp ) return -1;
+
+  // A gratuitous reply updates the requesters' incomplete entries
+  return bridge_write_arp_reply(br, hw_addr, ip->s_addr, ip->s_addr);
+}
+
+int bridge_del_demand(struct brstate *br, struct brdemand *bd) {
+  struct brdemand *old;
+  if ( pthread_rwlock_wrlock(&br->br_arp_mutex) == 0 ) {
+    int ret = 0;
+    HASH_FIND(bd_hh, br->br_demand_table, &bd->bd_ip, sizeof(bd->bd_ip), old);
+    if ( old != bd ) {
+      fprintf(stderr, "bridge_del_demand: not in table\n");
+      ret = -1;
+    } else {
+      HASH_DELETE(bd_hh, br->br_demand_table, bd);
+    }
+    pthread_rwlock_unlock(&br->br_arp_mutex);
+    return ret;
+  } else return -1;
+}
+
 int bridge_register_sctp(struct brstate *br, struct sctpentry *se) {
   struct sctpentry *old;
   if ( pthread_rwlock_wrlock(&br->br_sctp_mutex) == 0 ) {
@@ -1336,6 +1513,74 @@ static void bridge_do_mark_as_admin(struct brstate *br, struct brctlmsg *_msg) {
   return;
 }
 
+// Let the container on bcm_port send packets from an additional
+// address. The exception goes just before the anti-spoofing rule,
+// which is always last in the port's table
+static void bridge_do_mod_alias(struct brstate *br, struct brctlmsg *_msg) {
+  struct brctlmsg_alias *msg = (struct brctlmsg_alias *) _msg;
+  char cmd_buf[512], ip_addr_str[INET6_ADDRSTRLEN];
+  int err;
+
+  inet_ntop(AF_INET, &msg->bcm_ip, ip_addr_str, sizeof(ip_addr_str));
+
+  if ( msg->bcm_msg.bcm_what == BR_ADD_ALIAS )
+    err = snprintf(cmd_buf, sizeof(cmd_buf), "%s -I TABLE%d -1 -p IPv4 --ip-source %s -j RETURN",
+                   br->br_ebroute_path, msg->bcm_port, ip_addr_str);
+  else
+    err = snprintf(cmd_buf, sizeof(cmd_buf), "%s -D TABLE%d -p IPv4 --ip-source %s -j RETURN",
+                   br->br_ebroute_path, msg->bcm_port, ip_addr_str);
+  if ( err >= sizeof(cmd_buf) ) {
+    fprintf(stderr, "bridge_do_mod_alias: command overflow\n");
+    bridge_respond_error(br, -1);
+    return;
+  }
+
+  err = system(cmd_buf);
+  if ( err != 0 ) {
+    fprintf(stderr, "bridge_do_mod_alias: '%s' failed: %d\n", cmd_buf, err);
+    bridge_respond_error(br, -1);
+    return;
+  }
+
+  bridge_respond_success(br);
+}
+
+// Swap the port's anti-spoofing rule for one with the new address
+static void bridge_do_readdress_port(struct brstate *br, struct brctlmsg *_msg) {
+  struct brctlmsg_readdress *msg = (struct brctlmsg_readdress *) _msg;
+  char cmd_buf[512], old_ip_str[INET6_ADDRSTRLEN], new_ip_str[INET6_ADDRSTRLEN];
+  int err;
+
+  inet_ntop(AF_INET, &msg->bcm_old_ip, old_ip_str, sizeof(old_ip_str));
+  inet_ntop(AF_INET, &msg->bcm_new_ip, new_ip_str, sizeof(new_ip_str));
+
+  err = snprintf(cmd_buf, sizeof(cmd_buf), "%s -A TABLE%d -p IPv4 --ip-source ! %s -j DROP",
+                 br->br_ebroute_path, msg->bcm_port, new_ip_str);
+  if ( err >= sizeof(cmd_buf) ) goto overflow;
+
+  err = system(cmd_buf);
+  if ( err != 0 ) goto cmd_error;
+
+  err = snprintf(cmd_buf, sizeof(cmd_buf), "%s -D TABLE%d -p IPv4 --ip-source ! %s -j DROP",
+                 br->br_ebroute_path, msg->bcm_port, old_ip_str);
+  if ( err >= sizeof(cmd_buf) ) goto overflow;
+
+  err = system(cmd_buf);
+  if ( err != 0 ) goto cmd_error;
+
+  bridge_respond_success(br);
+  return;
+
+ overflow:
+  fprintf(stderr, "bridge_do_readdress_port: command overflow\n");
+  bridge_respond_error(br, -1);
+  return;
+
+ cmd_error:
+  fprintf(stderr, "bridge_do_readdress_port: '%s' failed: %d\n", cmd_buf, err);
+  bridge_respond_error(br, -1);
+}
+
 static int open_netns(pid_t p) {
   char netns_path[PATH_MAX];
   int err;
@@ -1503,6 +1748,15 @@ static int bridge_setup_main(void *br_ptr) {
       bridge_do_mark_as_admin(br, &rcvbuf.msg);
       break;
 
+    case BR_ADD_ALIAS:
+    case BR_DEL_ALIAS:
+      bridge_do_mod_alias(br, &rcvbuf.msg);
+      break;
+
+    case BR_READDRESS_PORT:
+      bridge_do_readdress_port(br, &rcvbuf.msg);
+      break;
+
     default:
       fprintf(stderr, "Nonsense message received in bridge %d\n", rcvbuf.msg.bcm_what);
       bridge_respond_error(br, -2);
@@ -2190,6 +2444,73 @@ int bridge_mark_as_admin(struct brstate *br, int port_ix, struct arpentry *arp)
     return -1;
 }
 
+static int bridge_mod_alias(struct brstate *br, uint16_t what, int port_ix,
+                            struct in_addr *ip) {
+  struct brctlmsg_alias msg
+    = { .bcm_msg = { .bcm_what = what },
+        .bcm_port = port_ix };
+
+  memcpy(&msg.bcm_ip, ip, sizeof(msg.bcm_ip));
+
+  if ( pthread_mutex_lock(&br->br_comm_mutex) == 0 ) {
+    int ret = 0, err;
+    err = send(br->br_comm_fd[1], &msg, sizeof(msg), 0);
+    if ( err < 0 ) {
+      perror("bridge_mod_alias: send");
+      ret = -1;
+    } else {
+      struct brctlrsp rsp = { .bcr_sts = -1 };
+      err = recv(br->br_comm_fd[1], &rsp, sizeof(rsp), 0);
+      if ( err < 0 ) {
+        perror("bridge_mod_alias: recv");
+        ret = -1;
+      } else
+        ret = rsp.bcr_sts;
+    }
+    pthread_mutex_unlock(&br->br_comm_mutex);
+    return ret;
+  } else
+    return -1;
+}
+
+int bridge_add_alias(struct brstate *br, int port_ix, struct in_addr *ip) {
+  return bridge_mod_alias(br, BR_ADD_ALIAS, port_ix, ip);
+}
+
+int bridge_del_alias(struct brstate *br, int port_ix, struct in_addr *ip) {
+  return bridge_mod_alias(br, BR_DEL_ALIAS, port_ix, ip);
+}
+
+int bridge_readdress_port(struct brstate *br, int port_ix,
+                          struct in_addr *old_ip, struct in_addr *new_ip) {
+  struct brctlmsg_readdress msg
+    = { .bcm_msg = { .bcm_what = BR_READDRESS_PORT },
+        .bcm_port = port_ix };
+
+  memcpy(&msg.bcm_old_ip, old_ip, sizeof(msg.bcm_old_ip));
+  memcpy(&msg.bcm_new_ip, new_ip, sizeof(msg.bcm_new_ip));
+
+  if ( pthread_mutex_lock(&br->br_comm_mutex) == 0 ) {
+    int ret = 0, err;
+    err = send(br->br_comm_fd[1], &msg, sizeof(msg), 0);
+    if ( err < 0 ) {
+      perror("bridge_readdress_port: send");
+      ret = -1;
+    } else {
+      struct brctlrsp rsp = { .bcr_sts = -1 };
+      err = recv(br->br_comm_fd[1], &rsp, sizeof(rsp), 0);
+      if ( err < 0 ) {
+        perror("bridge_readdress_port: recv");
+        ret = -1;
+      } else
+        ret = rsp.bcr_sts;
+    }
+    pthread_mutex_unlock(&br->br_comm_mutex);
+    return ret;
+  } else
+    return -1;
+}
+
 static void brtunnel_deinit(struct brtunnel *tun) {
   struct brctlmsg_deltun msg;
   struct brstate *br = tun->brtun_br;
@@ -2375,6 +2696,50 @@ static void bridge_respond_bpr_error(struct brstate *br, struct brpermrequest *b
   bridge_respond(br, bpr, &rsp, STKD_ERROR_MSG_SZ);
 }
 
+int bridge_open_app(struct brstate *br, struct eventloop *el, struct persona *p,
+                    const char *app_url, size_t app_url_sz, struct in_addr *addr) {
+  struct appinstance *ai;
+  struct app *a = appstate_get_app_by_url_ex(br->br_appstate, app_url, app_url_sz);
+  if ( !a ) {
+    fprintf(stderr, "bridge_open_app: could not find app %.*s\n", (int) app_url_sz, app_url);
+    return STKD_ERROR_APP_DOES_NOT_EXIST;
+  }
+
+  ai = launch_app_instance(p->p_appstate, p, a);
+  APPLICATION_UNREF(a);
+  if ( !ai ) {
+    fprintf(stderr, "bridge_open_app: could not launch app instance\n");
+    return -1;
+  }
+
+  container_release_running(&ai->inst_container, el);
+
+  fprintf(stderr, "bridge_open_app: launched application %s\n", ai->inst_app->app_domain);
+  addr->s_addr = ai->inst_container.c_ip.s_addr;
+
+  APPINSTANCE_UNREF(ai);
+
+  return 0;
+}
+
+int bridge_open_site_app(struct brstate *br, struct eventloop *el, struct persona *p,
+                         const unsigned char *site, unsigned int site_sz,
+                         const char *app_url, size_t app_url_sz, struct in_addr *addr) {
+  struct sitekey key;
+
+  if ( site_sz > 0 && site_sz <= sizeof(key.sk_fingerprint) ) {
+    memcpy(key.sk_persona_id, p->p_persona_id, sizeof(key.sk_persona_id));
+    key.sk_fingerprint_sz = site_sz;
+    memcpy(key.sk_fingerprint, site, site_sz);
+
+    if ( siteindex_resolve(&br->br_appstate->as_sites, &key, p,
+                           app_url, app_url_sz, addr) == 1 )
+      return 0;
+  }
+
+  return bridge_open_app(br, el, p, app_url, app_url_sz, addr);
+}
+
 static void bridge_handle_bpr_response(struct brstate *br, struct brpermrequest *bpr) {
   if ( bpr->bpr_sts < 0 ) {
     fprintf(stderr, "bridge_handle_bpr_response: brpermrequest fails with %d\n", bpr->bpr_sts);
@@ -2386,31 +2751,21 @@ static void bridge_handle_bpr_response(struct brstate *br, struct brpermrequest
         fprintf(stderr, "bridge_handle_bpr_response: expected bpr_persona to be filled for BR_PERM_APPLICATION\n");
         bridge_respond_bpr_error(br, bpr, STKD_ERROR_PERSONA_DOES_NOT_EXIST);
       } else {
-        struct app *a = appstate_get_app_by_url_ex(br->br_appstate,
-                                                   (const char *)bpr->bpr_perm.bp_data,
-                                                   bpr->bpr_perm_size);
-        if ( !a ) {
-          fprintf(stderr, "bridge_handle_bpr_response: could not find app %.*s\n",
-                  bpr->bpr_perm_size, bpr->bpr_perm.bp_data);
-          bridge_respond_bpr_error(br, bpr, STKD_ERROR_APP_DOES_NOT_EXIST);
+        struct in_addr app_addr;
+        int err = bridge_open_site_app(br, bpr->bpr_el, bpr->bpr_persona,
+                                       bpr->bpr_site, bpr->bpr_site_sz,
+                                       (const char *)bpr->bpr_perm.bp_data,
+                                       bpr->bpr_perm_size, &app_addr);
+        if ( err < 0 ) {
+          // Leave the request unanswered. The requester will retry
+        } else if ( err > 0 ) {
+          bridge_respond_bpr_error(br, bpr, err);
         } else {
-          struct appinstance *ai = launch_app_instance(bpr->bpr_persona->p_appstate,
-                                                       bpr->bpr_persona, a);
-          APPLICATION_UNREF(a);
-          if ( !ai ) {
-            fprintf(stderr, "bridge_handle_bpr_response: could not launch app instance\n");
-          } else {
-            struct stkdmsg rsp;
-            container_release_running(&ai->inst_container, bpr->bpr_el);
-            APPINSTANCE_UNREF(ai);
-
-            fprintf(stderr, "bridge_handle_bpr_response: launched application %s\n", ai->inst_app->app_domain);
-
-            rsp.sm_flags = STKD_MKFLAGS(STKD_RSP, STKD_OPEN_APP_REQUEST);
-            rsp.sm_data.sm_opened_app.sm_family = htonl(AF_INET);
-            rsp.sm_data.sm_opened_app.sm_addr = ai->inst_container.c_ip.s_addr;
-            bridge_respond(br, bpr, &rsp, STKD_OPENED_APP_RSP_SZ);
-          }
+          struct stkdmsg rsp;
+          rsp.sm_flags = STKD_MKFLAGS(STKD_RSP, STKD_OPEN_APP_REQUEST);
+          rsp.sm_data.sm_opened_app.sm_family = htonl(AF_INET);
+          rsp.sm_data.sm_opened_app.sm_addr = app_addr.s_addr;
+          bridge_respond(br, bpr, &rsp, STKD_OPENED_APP_RSP_SZ);
         }
       }
       break;
@@ -2454,198 +2809,6 @@ int bridge_describe_arp(struct brstate *br, struct in_addr *ip, struct arpdesc *
     return -1;
 }
 
-// Permissions
-
-#define BR_TEMP_ROUTE_PATH 1
-#define BR_PERM_ROUTE_PATH 2
-
-static int bridge_routes_path(struct brstate *br, struct pconn *pc, int which,
-                              char *routes_path, int routes_path_sz) {
-  int n;
-  char persona_digest[PERSONA_ID_X_LENGTH + 1];
-  char fingerprint_digest[EVP_MD_size(pc->pc_remote_cert_fingerprint_digest) * 2 + 1];
-
-  if ( which == BR_TEMP_ROUTE_PATH ) {
-    n = snprintf(routes_path, routes_path_sz,
-                 "%s/personas/%s/sites/%s/.routes.tmp.%p",
-                 br->br_appstate->as_conf_dir,
-                 hex_digest_str((unsigned char *)pc->pc_persona->p_persona_id,
-                                persona_digest, PERSONA_ID_LENGTH),
-                 hex_digest_str((unsigned char *)pc->pc_remote_cert_fingerprint,
-                              fingerprint_digest,
-                                EVP_MD_size(pc->pc_remote_cert_fingerprint_digest)),
-                 pc);
-  } else {
-    n = snprintf(routes_path, routes_path_sz,
-                 "%s/personas/%s/sites/%s/routes",
-                 br->br_appstate->as_conf_dir,
-                 hex_digest_str((unsigned char *)pc->pc_persona->p_persona_id,
-                                persona_digest, PERSONA_ID_LENGTH),
-                 hex_digest_str((unsigned char *)pc->pc_remote_cert_fingerprint,
-                              fingerprint_digest,
-                                EVP_MD_size(pc->pc_remote_cert_fingerprint_digest)));
-  }
-  if ( n >= routes_path_sz ) {
-    fprintf(stderr, "bridge_temp_routes_path: overflow\n");
-    return -1;
-  }
-
-  return 0;
-}
-
-static FILE *bridge_open_temp_routes(struct brstate *br, struct pconn *pc) {
-  char tmp_routes_path[PATH_MAX];
-
-  if ( bridge_routes_path(br, pc, BR_TEMP_ROUTE_PATH, tmp_routes_path, sizeof(tmp_routes_path)) < 0 )
-    return NULL;
-
-  return fopen(tmp_routes_path, "wt");
-}
-
-static void bridge_cleanup_temp_routes(struct brstate *br, struct pconn *pc) {
-  char tmp_routes_path[PATH_MAX];
-  if ( bridge_routes_path(br, pc, BR_TEMP_ROUTE_PATH, tmp_routes_path, sizeof(tmp_routes_path)) < 0 )
-    return;
-
-  if ( unlink(tmp_routes_path) < 0 ) {
-    perror("bridge_cleanup_temp_routes: unlink");
-    fprintf(stderr, "while unlinking %s\n", tmp_routes_path);
-  }
-}
-
-static int bridge_update_routes(struct brstate *br, struct pconn *pc) {
-  char tmp_routes_path[PATH_MAX], real_routes_path[PATH_MAX];
-
-  if ( bridge_routes_path(br, pc, BR_TEMP_ROUTE_PATH, tmp_routes_path, sizeof(tmp_routes_path)) < 0 )
-    return -1;
-
-  if ( bridge_routes_path(br, pc, BR_PERM_ROUTE_PATH, real_routes_path, sizeof(real_routes_path)) < 0 )
-    return -1;
-
-  if ( rename(tmp_routes_path, real_routes_path) < 0 ) {
-    perror("bridge_update_routes: rename");
-    fprintf(stderr, "while renaming %s -> %s\n", tmp_routes_path, real_routes_path);
-    return -1;
-  } else
-    return 0;
-}
-
-static FILE *bridge_open_site_perms(struct brstate *br, struct pconn *pc) {
-  char perms_path[PATH_MAX];
-  char persona_digest[PERSONA_ID_X_LENGTH + 1];
-  char site_digest[EVP_MD_size(pc->pc_remote_cert_fingerprint_digest) * 2 + 1];
-  int n;
-
-  FILE *ret;
-
-  n = snprintf(perms_path, sizeof(perms_path),
-               "%s/personas/%s/sites/%s/perms",
-               br->br_appstate->as_conf_dir,
-               hex_digest_str((unsigned char *) pc->pc_persona->p_persona_id,
-                              persona_digest, PERSONA_ID_LENGTH),
-               hex_digest_str((unsigned char *) pc->pc_remote_cert_fingerprint,
-                              site_digest, EVP_MD_size(pc->pc_remote_cert_fingerprint_digest)));
-  if ( n >= sizeof(persona_digest) ) {
-    fprintf(stderr, "bridge_open_site_perms: path overflow\n");
-    return NULL;
-  }
-
-  ret = fopen(perms_path, "at+");
-  if ( !ret ) return NULL;
-
-  if ( fseek(ret, 0, SEEK_SET) < 0 ) {
-    perror("bridge_open_site_perms: fseek");
-    fclose(ret);
-    return NULL;
-  }
-
-  return ret;
-}
-
-// Site permissions live in
-// <conf-dir>/personas/<persona-id>/site/<site-fingerprint>/permissions
-int bridge_write_site_routes(struct brstate *br, struct pconn *pc) {
-  FILE *perms, *routes;
-  char perm[PATH_MAX];
-  char app_addr[INET_ADDRSTRLEN];
-  struct app *a, *tmp;
-
-  routes = bridge_open_temp_routes(br, pc);
-  if ( !routes ) return -1;
-
-  perms = bridge_open_site_perms(br, pc);
-  if ( !perms ) { fclose(routes); return -1; }
-
-  SAFE_RWLOCK_RDLOCK(&br->br_appstate->as_applications_mutex);
-  while ( fgets(perm, sizeof(perm), perms) ) {
-    if ( validate_perm_url(perm, NULL, 0, NULL, 0) ) {
-      // Check if any application has this permission
-      HASH_FIND(app_hh, br->br_appstate->as_apps, perm, strlen(perm), a);
-
-      if ( a ) {
-        // Check if this application is running for this persona. If not, launch it
-        struct appinstance *ai;
-
-        ai = launch_app_instance(br->br_appstate, pc->pc_persona, a);
-        if ( !ai ) {
-          fprintf(stderr, "bridge_write_site_routes: skipping %s because of an error while launching\n",
-                  perm);
-        } else {
-          int universal_access = 0;
-
-          SAFE_MUTEX_LOCK(&a->app_mutex);
-          universal_access = APP_HAS_UNIVERSAL_ACCESS(a);
-          pthread_mutex_unlock(&a->app_mutex);
-
-          if ( !universal_access )
-            fprintf(routes, "%s %s\n", perm, inet_ntop(AF_INET, &ai->inst_container.c_ip,
-                                                       app_addr, sizeof(app_addr)));
-        }
-      }
-    }
-  }
-
-  HASH_ITER(app_hh, br->br_appstate->as_apps, a, tmp) {
-    int universal_access = 0;
-    struct appinstance *ai;
-
-    SAFE_MUTEX_LOCK(&a->app_mutex);
-    universal_access = APP_HAS_UNIVERSAL_ACCESS(a);
-    pthread_mutex_unlock(&a->app_mutex);
-
-    if ( universal_access ) {
-      ai = launch_app_instance(br->br_appstate, pc->pc_persona, a);
-      if ( !ai ) {
-        fprintf(stderr, "bridge_write_site_routes: skipping %s because of an error while launching\n",
-                a->app_domain);
-      } else {
-        fprintf(routes, "%s %s\n", a->app_domain, inet_ntop(AF_INET, &ai->inst_container.c_ip,
-                                                            app_addr, sizeof(app_addr)));
-      }
-    }
-  }
-
-  pthread_rwlock_unlock(&br->br_appstate->as_applications_mutex);
-
-  if ( ferror(perms) ) {
-    fprintf(stderr, "bridge_write_site_routes: could not read permissions. Aborting\n");
-    fclose(perms);
-    fclose(routes);
-    bridge_cleanup_temp_routes(br, pc);
-  }
-
-  // If any permission is the url of an installed application, then, add this to the route set
-  fclose(perms);
-
-  if ( bridge_update_routes(br, pc) < 0 ) {
-    fclose(routes);
-    return -1;
-  } else {
-    fclose(routes);
-    return 0;
-  }
-}
-
 // Bridge API
 
 int bridge_setup_container(struct brstate *br, int port_ix,
@@ -2720,3 +2883,36 @@ int bridge_setup_container(struct brstate *br, int port_ix,
     return -1;
 }
 
+int bridge_readdress_container(struct brstate *br, const char *if_name,
+                               struct in_addr *old_addr, struct in_addr *new_addr) {
+  char cmd_buf[512], ip_addr_str[INET6_ADDRSTRLEN];
+  int err;
+
+  // Nothing has been routed over the old address yet, so the
+  // connected route just follows the new one
+  inet_ntop(AF_INET, old_addr, ip_addr_str, sizeof(ip_addr_str));
+  err = snprintf(cmd_buf, sizeof(cmd_buf), "%s address del %s/8 dev %s",
+                 br->br_iproute_path, ip_addr_str, if_name);
+  if ( err >= sizeof(cmd_buf) ) goto overflow;
+
+  err = system(cmd_buf);
+  if ( err != 0 ) goto cmd_error;
+
+  inet_ntop(AF_INET, new_addr, ip_addr_str, sizeof(ip_addr_str));
+  err = snprintf(cmd_buf, sizeof(cmd_buf), "%s address add %s/8 broadcast 10.255.255.255 dev %s",
+                 br->br_iproute_path, ip_addr_str, if_name);
+  if ( err >= sizeof(cmd_buf) ) goto overflow;
+
+  err = system(cmd_buf);
+  if ( err != 0 ) goto cmd_error;
+
+  return 0;
+
+  overflow:
+    fprintf(stderr, "bridge_readdress_container: no space for command '%s'\n", cmd_buf);
+    return -1;
+
+  cmd_error:
+    fprintf(stderr, "bridge_readdress_container: %s failed: %d\n", cmd_buf, err);
+    return -1;
+}
@@ -11,6 +11,8 @@
 #include "event.h"
 
 #define BR_CAPABILITY_SIZE 256
+// Largest site certificate fingerprint
+#define BR_SITE_FINGERPRINT_MAX 64
 #define PERSONA_ID_LENGTH   32
 #define APP_URL_MAX 1024
 
@@ -45,6 +47,9 @@ typedef int(*aectlfn)(struct arpentry*, int, void *, ssize_t);
 
 #define ARP_ENTRY_CHECK_PERMISSION 1
 #define ARP_ENTRY_DESCRIBE 2
+// Traffic for this address has reached the bridge. Called with the arp
+// table read-locked, so it must not block or touch the arp table
+#define ARP_ENTRY_TRAFFIC 3
 
 struct arpentry {
   mac_addr       ae_mac;
@@ -53,6 +58,27 @@ struct arpentry {
   aectlfn        ae_ctlfn;
 };
 
+// Addresses of containers that are started when first used. When a
+// container on the bridge sends an ARP request for bd_ip, bd_fn is
+// called after the arp table is unlocked, holding a weak reference on
+// bd_shared. It decides whether the requester may start the
+// container. Once the container is up, bridge_announce_arp answers
+// the request.
+struct brstate;
+struct brdemand;
+struct brdemandreq {
+  // The address of the container that sent the request. Its MAC
+  // address matched its arp entry
+  struct in_addr bdr_requester;
+};
+typedef void(*brdemandfn)(struct brstate *, struct brdemand *, const struct brdemandreq *);
+struct brdemand {
+  struct in_addr bd_ip;
+  UT_hash_handle bd_hh;
+  struct shared *bd_shared;
+  brdemandfn     bd_fn;
+};
+
 // we intercept sctp packets
 struct sctpentry;
 typedef void(*pktfn)(struct sctpentry *, const void*, size_t);
@@ -119,6 +145,11 @@ struct brpermrequest {
   // All outstanding requests are in the br_outstanding_checks hash table
   UT_hash_handle bpr_hh;
 
+  // Certificate fingerprint of the site that made the request, if
+  // known. Filled in by ARP_ENTRY_CHECK_PERMISSION handlers
+  unsigned int bpr_site_sz;
+  unsigned char bpr_site[BR_SITE_FINGERPRINT_MAX];
+
   int bpr_perm_size; // The total size of the permission below
   struct brperm bpr_perm;
 };
@@ -154,6 +185,7 @@ struct brstate {
   pthread_rwlock_t br_arp_mutex;
   struct arpentry *br_arp_table;
   struct brpermrequest *br_outstanding_checks; // protected by arp mutex
+  struct brdemand *br_demand_table; // protected by arp mutex
 
   pthread_rwlock_t br_sctp_mutex;
   struct sctpentry *br_sctp_table;
@@ -190,12 +222,24 @@ void bridge_allocate(struct brstate *br, struct in_addr *new_ip, int *new_eth_ix
 int bridge_add_arp(struct brstate *br, struct arpentry *new_arp);
 int bridge_del_arp(struct brstate *br, struct arpentry *old_arp);
 
+int bridge_add_demand(struct brstate *br, struct brdemand *bd);
+int bridge_del_demand(struct brstate *br, struct brdemand *bd);
+// Broadcast an ARP reply for ip, which must have an arp entry. Used to
+// answer requests that arrived before the container was up
+int bridge_announce_arp(struct brstate *br, const struct in_addr *ip);
+
 int bridge_register_sctp(struct brstate *br, struct sctpentry *se);
 int bridge_unregister_sctp(struct brstate *br, struct sctpentry *se);
 
 int bridge_write_from_foreign_pkt(struct brstate *br, struct container *dst,
                                   const struct sockaddr *sa, socklen_t sa_sz,
                                   const unsigned char *tap_pkt, uint16_t tap_sz);
+// Tell the SCTP stack in the container that the SCTP packet pkt it
+// sent was too large for the path, by way of an ICMP 'fragmentation
+// needed' message advertising an IP MTU of mtu.
+int bridge_write_frag_needed(struct brstate *br, struct container *src,
+                             const unsigned char *pkt, uint16_t pkt_sz,
+                             uint16_t mtu);
 int bridge_write_tap_pkt(struct brstate *br, const unsigned char *tap_pkt, uint16_t tap_sz);
 int bridge_write_tap_pktv(struct brstate *br, const struct iovec *iov, int iovcnt);
 
@@ -213,16 +257,40 @@ struct brtunnel *bridge_create_tunnel(struct brstate *br, int port1, int port2);
 
 int bridge_mark_as_admin(struct brstate *br, int port_ix, struct arpentry *arp);
 
-// Ask to write out the routes for the given site. If the site
-// permissions do not exist, this will create the site permissions
-// directory.
+// Allow the container on port_ix to send from ip as well as its own
+// address. Its table is removed with the port, so aliases left over
+// when the port is disconnected need not be deleted
+int bridge_add_alias(struct brstate *br, int port_ix, struct in_addr *ip);
+int bridge_del_alias(struct brstate *br, int port_ix, struct in_addr *ip);
+
+// Let the container on port_ix send from new_ip instead of old_ip
+int bridge_readdress_port(struct brstate *br, int port_ix,
+                          struct in_addr *old_ip, struct in_addr *new_ip);
+
+// Launch the app at app_url for persona p, and put the address of its
+// instance in addr.
 //
-// pc should be locked
-struct pconn;
-int bridge_write_site_routes(struct brstate *br, struct pconn *pc);
+// Returns 0 on success, a STKD_ERROR_* code if the app cannot be
+// opened, or -1 if it could not be launched right now
+struct persona;
+int bridge_open_app(struct brstate *br, struct eventloop *el, struct persona *p,
+                    const char *app_url, size_t app_url_sz, struct in_addr *addr);
+
+// Like bridge_open_app, but for a request from the site with the
+// given certificate fingerprint. The site's routes are looked up in
+// the site index first, so that an instance that has been reserved
+// for the site answers right away, while it starts in the
+// background.
+int bridge_open_site_app(struct brstate *br, struct eventloop *el, struct persona *p,
+                         const unsigned char *site, unsigned int site_sz,
+                         const char *app_url, size_t app_url_sz, struct in_addr *addr);
 
 int bridge_setup_container(struct brstate *br, int port_ix,
                            struct in_addr *this_addr, const char *if_name,
                            struct arpentry *arp);
+// Called in a container set up by bridge_setup_container, to change
+// the address of if_name from old_addr to new_addr
+int bridge_readdress_container(struct brstate *br, const char *if_name,
+                               struct in_addr *old_addr, struct in_addr *new_addr);
 
 #endif
@@ -0,0 +1,1630 @@
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <utime.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <lzma.h>
+#include <openssl/evp.h>
+
+#include "closure.h"
+#include "application.h"
+#include "buffer.h"
+#include "util.h"
+
+#define OP_CLOSURE_NARINFO EVT_CTL_CUSTOM
+#define OP_CLOSURE_NAR     (EVT_CTL_CUSTOM + 1)
+#define OP_CLOSUREGC_TIMER   (EVT_CTL_CUSTOM + 2)
+#define OP_CLOSUREGC_ASYNC   (EVT_CTL_CUSTOM + 3)
+
+#define CP_STATE_QUEUED  0
+#define CP_STATE_NARINFO 1
+#define CP_STATE_NAR     2
+#define CP_STATE_DONE    3
+
+#define CP_COMPRESSION_NONE 0
+#define CP_COMPRESSION_XZ   1
+
+#define NIX32_ALPHABET "0123456789abcdfghijklmnpqrsvwxyz"
+#define NIX_HASH_PART_LEN 32
+#define NIX_MAX_NAME_LEN 211
+#define NIX_SHA256_LEN 32
+#define NIX_SHA256_NIX32_LEN 52
+
+#define ED25519_KEY_LEN 32
+#define ED25519_SIG_LEN 64
+
+#define NARINFO_MAX_SIZE (64 * 1024)
+#define NARINFO_MAX_SIGS 8
+#define XZBUFSZ (256 * 1024)
+
+#define NIX_CACHE_INFO "StoreDir: " CLOSURE_STORE_DIR "\nWantMassQuery: 0\nPriority: 10\n"
+
+struct narinfo {
+  const char *ni_store_path, *ni_url, *ni_compression;
+  const char *ni_file_hash, *ni_nar_hash, *ni_references, *ni_deriver;
+  unsigned long long ni_nar_size;
+
+  int ni_sig_count;
+  const char *ni_sigs[NARINFO_MAX_SIGS];
+};
+
+struct closurepath {
+  struct closurefetch *cp_fetch;
+  UT_hash_handle cp_hh;
+
+  char cp_hash[NIX_HASH_PART_LEN + 1];
+  char *cp_name;
+
+  int cp_state;
+  // The binary cache being tried
+  size_t cp_cache;
+
+  struct closurepath *cp_next_queued;
+
+  int cp_download_live;
+  struct download cp_download;
+
+  // The narinfo as downloaded. Fields in cp_info point into it
+  struct buffer cp_narinfo_buf;
+  char *cp_narinfo;
+  struct narinfo cp_info;
+
+  int cp_compression;
+  lzma_stream cp_xz;
+  int cp_xz_live;
+  unsigned char *cp_xz_buf;
+
+  FILE *cp_out;
+  EVP_MD_CTX *cp_nar_digest;
+  unsigned long long cp_nar_size;
+  int cp_have_file_hash;
+};
+
+static void closurefn(struct eventloop *el, int op, void *arg);
+static void closurefetch_pump(struct closurefetch *cf);
+static int closurepath_write_narinfo(struct closurepath *cp, const char *nar_name);
+
+static void closure_progress(struct closurefetch *cf, const char *fmt, ...)
+  __attribute__ ((format (printf, 2, 3)));
+
+static void closure_progress(struct closurefetch *cf, const char *fmt, ...) {
+  va_list ap;
+
+  if ( cf->cf_progress < 0 ) return;
+
+  va_start(ap, fmt);
+  vdprintf(cf->cf_progress, fmt, ap);
+  va_end(ap);
+}
+
+// Names are <hash>-<name>, where hash is 32 characters of nix's base
+// 32. Since they come from the cache, and end up in paths, they are
+// checked strictly
+static int closure_valid_name(const char *name) {
+  size_t i, len = strlen(name);
+
+  if ( len <= NIX_HASH_PART_LEN + 1 || len > NIX_MAX_NAME_LEN ) return 0;
+
+  for ( i = 0; i < NIX_HASH_PART_LEN; ++i )
+    if ( !strchr(NIX32_ALPHABET, name[i]) ) return 0;
+
+  if ( name[NIX_HASH_PART_LEN] != '-' || name[NIX_HASH_PART_LEN + 1] == '.' ) return 0;
+
+  for ( i = NIX_HASH_PART_LEN + 1; i < len; ++i )
+    if ( !isalnum(name[i]) && !strchr("+-._?=", name[i]) ) return 0;
+
+  return 1;
+}
+
+static int nix32_decode(const char *s, size_t s_sz, unsigned char *out, size_t out_sz) {
+  size_t n;
+
+  memset(out, 0, out_sz);
+
+  for ( n = 0; n < s_sz; ++n ) {
+    const char *c = strchr(NIX32_ALPHABET, s[s_sz - n - 1]);
+    unsigned int digit, b = n * 5, i = b / 8, j = b % 8;
+
+    if ( !c || !*c ) return -1;
+    digit = c - NIX32_ALPHABET;
+
+    out[i] |= digit << j;
+    if ( i < out_sz - 1 )
+      out[i + 1] |= digit >> (8 - j);
+    else if ( digit >> (8 - j) )
+      return -1;
+  }
+
+  return 0;
+}
+
+// Parse a sha256 hash, as it appears in narinfos
+static int closure_parse_sha256(const char *s, unsigned char *out) {
+  size_t s_sz;
+
+  if ( strncmp(s, "sha256:", 7) != 0 ) return -1;
+  s += 7;
+  s_sz = strlen(s);
+
+  if ( s_sz == NIX_SHA256_NIX32_LEN )
+    return nix32_decode(s, s_sz, out, NIX_SHA256_LEN);
+  else if ( s_sz == NIX_SHA256_LEN * 2 )
+    return parse_hex_str(s, out, NIX_SHA256_LEN) < 0 ? -1 : 0;
+  else
+    return -1;
+}
+
+static int closure_b64_decode(const char *s, size_t s_sz, unsigned char *out, size_t exp_sz) {
+  unsigned char buf[ED25519_SIG_LEN + 3];
+  int sz;
+
+  if ( s_sz == 0 || s_sz % 4 != 0 || s_sz / 4 * 3 > sizeof(buf) ) return -1;
+
+  sz = EVP_DecodeBlock(buf, (const unsigned char *) s, s_sz);
+  if ( sz < 0 ) return -1;
+
+  // EVP_DecodeBlock counts padding as data
+  if ( s[s_sz - 1] == '=' ) sz--;
+  if ( s[s_sz - 2] == '=' ) sz--;
+
+  if ( sz != exp_sz ) return -1;
+
+  memcpy(out, buf, exp_sz);
+  return 0;
+}
+
+static int closure_ed25519_verify(const unsigned char *key, const unsigned char *sig,
+                                  const char *msg, size_t msg_sz) {
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+  EVP_PKEY *pkey;
+  EVP_MD_CTX *ctx;
+  int ret = -1;
+
+  pkey = EVP_PKEY_new_raw_public_key(EVP_PKEY_ED25519, NULL, key, ED25519_KEY_LEN);
+  if ( !pkey ) return -1;
+
+  ctx = EVP_MD_CTX_new();
+  if ( ctx ) {
+    if ( EVP_DigestVerifyInit(ctx, NULL, NULL, NULL, pkey) == 1 &&
+         EVP_DigestVerify(ctx, sig, ED25519_SIG_LEN, (const unsigned char *) msg, msg_sz) == 1 )
+      ret = 0;
+    EVP_MD_CTX_free(ctx);
+  }
+
+  EVP_PKEY_free(pkey);
+  return ret;
+#else
+  fprintf(stderr, "closure_ed25519_verify: OpenSSL is too old for ed25519 signatures\n");
+  return -1;
+#endif
+}
+
+// Check that one of the narinfo's signatures is from one of the
+// cache's keys. Both are <key name>:<base64>
+static int closure_verify(struct narinfo *ni, struct bincache *bc) {
+  const char *store_dir_end, *ref, *fingerprint;
+  struct buffer b;
+  size_t fingerprint_sz;
+  int i, k, ret = -1;
+
+  store_dir_end = strrchr(ni->ni_store_path, '/');
+  if ( !store_dir_end ) return -1;
+
+  buffer_init(&b);
+  buffer_printf(&b, "1;%s;%s;%llu;", ni->ni_store_path, ni->ni_nar_hash, ni->ni_nar_size);
+  for ( ref = ni->ni_references; *ref; ) {
+    size_t ref_sz = strcspn(ref, " ");
+
+    if ( ref_sz > 0 )
+      buffer_printf(&b, "%s%.*s/%.*s", ref == ni->ni_references ? "" : ",",
+                    (int) (store_dir_end - ni->ni_store_path), ni->ni_store_path,
+                    (int) ref_sz, ref);
+
+    ref += ref_sz;
+    ref += strspn(ref, " ");
+  }
+  buffer_finalize(&b, &fingerprint, &fingerprint_sz);
+  if ( !fingerprint ) return -1;
+
+  for ( i = 0; i < ni->ni_sig_count && ret < 0; ++i ) {
+    const char *sig_data = strchr(ni->ni_sigs[i], ':');
+    unsigned char sig[ED25519_SIG_LEN];
+
+    if ( !sig_data ) continue;
+    sig_data++;
+
+    if ( closure_b64_decode(sig_data, strlen(sig_data), sig, sizeof(sig)) < 0 ) continue;
+
+    for ( k = 0; k < bc->bc_key_count; ++k ) {
+      const char *key_data = strchr(bc->bc_keys[k], ':');
+      unsigned char key[ED25519_KEY_LEN];
+
+      if ( !key_data ) continue;
+      key_data++;
+
+      if ( (key_data - bc->bc_keys[k]) != (sig_data - ni->ni_sigs[i]) ||
+           memcmp(bc->bc_keys[k], ni->ni_sigs[i], key_data - bc->bc_keys[k]) != 0 )
+        continue;
+
+      if ( closure_b64_decode(key_data, strlen(key_data), key, sizeof(key)) < 0 ) {
+        fprintf(stderr, "closure_verify: invalid key %s\n", bc->bc_keys[k]);
+        continue;
+      }
+
+      if ( closure_ed25519_verify(key, sig, fingerprint, fingerprint_sz) == 0 ) {
+        ret = 0;
+        break;
+      }
+    }
+  }
+
+  free((void *) fingerprint);
+  return ret;
+}
+
+// Split a narinfo into fields, in place
+static int closure_parse_narinfo(char *data, struct narinfo *ni) {
+  char *line, *next;
+
+  memset(ni, 0, sizeof(*ni));
+  ni->ni_compression = "bzip2";
+  ni->ni_references = "";
+
+  for ( line = data; *line; line = next ) {
+    char *value;
+
+    next = strchr(line, '\n');
+    if ( next ) *(next++) = '\0';
+    else next = line + strlen(line);
+
+    if ( !*line ) continue;
+
+    value = strstr(line, ": ");
+    if ( !value ) {
+      fprintf(stderr, "closure_parse_narinfo: invalid line %s\n", line);
+      return -1;
+    }
+    *value = '\0';
+    value += 2;
+
+    if ( strcmp(line, "StorePath") == 0 ) ni->ni_store_path = value;
+    else if ( strcmp(line, "URL") == 0 ) ni->ni_url = value;
+    else if ( strcmp(line, "Compression") == 0 ) ni->ni_compression = value;
+    else if ( strcmp(line, "FileHash") == 0 ) ni->ni_file_hash = value;
+    else if ( strcmp(line, "NarHash") == 0 ) ni->ni_nar_hash = value;
+    else if ( strcmp(line, "References") == 0 ) ni->ni_references = value;
+    else if ( strcmp(line, "Deriver") == 0 ) ni->ni_deriver = value;
+    else if ( strcmp(line, "NarSize") == 0 ) {
+      char *end;
+      ni->ni_nar_size = strtoull(value, &end, 10);
+      if ( *end ) {
+        fprintf(stderr, "closure_parse_narinfo: invalid NarSize %s\n", value);
+        return -1;
+      }
+    } else if ( strcmp(line, "Sig") == 0 ) {
+      if ( ni->ni_sig_count < NARINFO_MAX_SIGS )
+        ni->ni_sigs[ni->ni_sig_count++] = value;
+    }
+  }
+
+  if ( !ni->ni_store_path || !ni->ni_url || !ni->ni_nar_hash ) {
+    fprintf(stderr, "closure_parse_narinfo: missing StorePath, URL, or NarHash\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+// <cache>/<dir><hash><suffix>
+static int closure_cache_path(struct closurefetch *cf, char *out, size_t out_sz,
+                              const char *dir, const char *hash, const char *suffix) {
+  return snprintf(out, out_sz, "%s/%s%s%s", cf->cf_cache_dir, dir, hash, suffix) >= out_sz ? -1 : 0;
+}
+
+// Temporary files are private to this fetch, since another may be
+// fetching the same path
+static int closure_tmp_path(struct closurefetch *cf, char *out, size_t out_sz,
+                            const char *dir, const char *hash) {
+  return snprintf(out, out_sz, "%s/%s.%s.%"PRIxPTR".tmp", cf->cf_cache_dir,
+                  dir, hash, (uintptr_t) cf) >= out_sz ? -1 : 0;
+}
+
+// NARs are stored under the hex sha256 of their contents
+static int closure_nar_name(struct narinfo *ni, char *out) {
+  unsigned char nar_hash[NIX_SHA256_LEN];
+
+  if ( closure_parse_sha256(ni->ni_nar_hash, nar_hash) < 0 ) {
+    fprintf(stderr, "closure_nar_name: invalid NarHash %s\n", ni->ni_nar_hash);
+    return -1;
+  }
+
+  hex_digest_str(nar_hash, out, NIX_SHA256_LEN);
+  return 0;
+}
+
+// cf_mutex must be held
+static void closurefetch_check_done(struct closurefetch *cf) {
+  if ( cf->cf_active > 0 || cf->cf_complete_queued ) return;
+
+  if ( cf->cf_sts == CLOSURE_STATUS_IN_PROGRESS ) {
+    if ( cf->cf_first_queued ) return;
+
+    cf->cf_sts = CLOSURE_STATUS_COMPLETE;
+    closure_progress(cf, "Fetched %u paths (%llu bytes), %u already present, %u reused from cache\n",
+                     cf->cf_fetched, cf->cf_bytes, cf->cf_skipped, cf->cf_deduped);
+  }
+
+  cf->cf_complete_queued = 1;
+  eventloop_queue(cf->cf_eventloop, &cf->cf_on_complete);
+}
+
+// cf_mutex must be held. Queue name to be fetched, unless we've seen
+// it already
+static int closurefetch_add(struct closurefetch *cf, const char *name, size_t name_sz) {
+  struct closurepath *cp;
+  char *cp_name;
+
+  cp_name = malloc(name_sz + 1);
+  if ( !cp_name ) return -1;
+  memcpy(cp_name, name, name_sz);
+  cp_name[name_sz] = '\0';
+
+  if ( !closure_valid_name(cp_name) ) {
+    fprintf(stderr, "closurefetch_add: invalid store path %s\n", cp_name);
+    free(cp_name);
+    return -1;
+  }
+
+  HASH_FIND(cp_hh, cf->cf_paths, cp_name, NIX_HASH_PART_LEN, cp);
+  if ( cp ) {
+    free(cp_name);
+    return 0;
+  }
+
+  cp = malloc(sizeof(*cp));
+  if ( !cp ) {
+    free(cp_name);
+    return -1;
+  }
+
+  memset(cp, 0, sizeof(*cp));
+  cp->cp_fetch = cf;
+  cp->cp_name = cp_name;
+  memcpy(cp->cp_hash, cp_name, NIX_HASH_PART_LEN);
+  cp->cp_hash[NIX_HASH_PART_LEN] = '\0';
+  cp->cp_state = CP_STATE_QUEUED;
+  download_clear(&cp->cp_download);
+  buffer_init(&cp->cp_narinfo_buf);
+
+  HASH_ADD(cp_hh, cf->cf_paths, cp_hash, NIX_HASH_PART_LEN, cp);
+
+  if ( cf->cf_last_queued )
+    cf->cf_last_queued->cp_next_queued = cp;
+  else
+    cf->cf_first_queued = cp;
+  cf->cf_last_queued = cp;
+
+  return 0;
+}
+
+// cf_mutex must be held
+static int closurefetch_add_references(struct closurefetch *cf, struct closurepath *cp,
+                                       const char *refs) {
+  while ( *refs ) {
+    size_t ref_sz = strcspn(refs, " ");
+
+    // Paths may refer to themselves
+    if ( ref_sz > 0 &&
+         (ref_sz != strlen(cp->cp_name) || memcmp(refs, cp->cp_name, ref_sz) != 0) &&
+         closurefetch_add(cf, refs, ref_sz) < 0 )
+      return -1;
+
+    refs += ref_sz;
+    refs += strspn(refs, " ");
+  }
+
+  return 0;
+}
+
+static void closurepath_release(struct closurepath *cp) {
+  if ( cp->cp_download_live ) {
+    download_release(&cp->cp_download);
+    download_clear(&cp->cp_download);
+    cp->cp_download_live = 0;
+  }
+
+  buffer_release(&cp->cp_narinfo_buf);
+  buffer_init(&cp->cp_narinfo_buf);
+
+  if ( cp->cp_narinfo ) {
+    free(cp->cp_narinfo);
+    cp->cp_narinfo = NULL;
+  }
+
+  if ( cp->cp_xz_live ) {
+    lzma_end(&cp->cp_xz);
+    cp->cp_xz_live = 0;
+  }
+
+  if ( cp->cp_xz_buf ) {
+    free(cp->cp_xz_buf);
+    cp->cp_xz_buf = NULL;
+  }
+
+  if ( cp->cp_nar_digest ) {
+    EVP_MD_CTX_free(cp->cp_nar_digest);
+    cp->cp_nar_digest = NULL;
+  }
+
+  if ( cp->cp_out ) {
+    char tmp_path[PATH_MAX];
+
+    fclose(cp->cp_out);
+    cp->cp_out = NULL;
+
+    if ( closure_tmp_path(cp->cp_fetch, tmp_path, sizeof(tmp_path), "nar/", cp->cp_hash) == 0 )
+      unlink(tmp_path);
+  }
+}
+
+// The path is no longer active. sts is the error, if any
+static void closurepath_finish(struct closurepath *cp, int sts) {
+  struct closurefetch *cf = cp->cp_fetch;
+
+  closurepath_release(cp);
+
+  SAFE_MUTEX_LOCK(&cf->cf_mutex);
+  cp->cp_state = CP_STATE_DONE;
+  cf->cf_active--;
+
+  if ( sts < 0 && cf->cf_sts == CLOSURE_STATUS_IN_PROGRESS )
+    cf->cf_sts = sts;
+
+  closurefetch_pump(cf);
+  closurefetch_check_done(cf);
+  pthread_mutex_unlock(&cf->cf_mutex);
+}
+
+static int closurepath_download(struct closurepath *cp, const char *url, int op) {
+  struct closurefetch *cf = cp->cp_fetch;
+  UriParserStateA urip;
+  UriUriA uri;
+  int err;
+
+  urip.uri = &uri;
+  if ( uriParseUriExA(&urip, url, url + strlen(url)) != URI_SUCCESS ) {
+    fprintf(stderr, "closurepath_download: invalid URL %s\n", url);
+    return -1;
+  }
+
+  err = download_init(&cp->cp_download, cf->cf_downloader, &uri, op, closurefn);
+  uriFreeUriMembersA(&uri);
+  if ( err < 0 ) {
+    fprintf(stderr, "closurepath_download: could not download %s\n", url);
+    download_clear(&cp->cp_download);
+    return -1;
+  }
+
+  cp->cp_download_live = 1;
+  return 0;
+}
+
+static int closurepath_fetch_narinfo(struct closurepath *cp) {
+  struct closurefetch *cf = cp->cp_fetch;
+  char url[PATH_MAX];
+
+  if ( snprintf(url, sizeof(url), "%s/%s.narinfo",
+                cf->cf_caches[cp->cp_cache].bc_uri, cp->cp_hash) >= sizeof(url) ) {
+    fprintf(stderr, "closurepath_fetch_narinfo: URL overflow\n");
+    return -1;
+  }
+
+  if ( closurepath_download(cp, url, OP_CLOSURE_NARINFO) < 0 )
+    return -1;
+
+  cp->cp_state = CP_STATE_NARINFO;
+  download_start(&cp->cp_download);
+  return 0;
+}
+
+// cf_mutex must be held. Returns 1 if the path is being fetched, 0 if
+// there was nothing to do, and a CLOSURE_STATUS_* error otherwise
+static int closurepath_begin(struct closurepath *cp) {
+  struct closurefetch *cf = cp->cp_fetch;
+  char path[PATH_MAX];
+  struct buffer b;
+  struct stat st;
+  const char *local;
+  int err;
+
+  if ( snprintf(path, sizeof(path), "%s/%s", cf->cf_store_dir, cp->cp_name) >= sizeof(path) )
+    return CLOSURE_STATUS_ERROR;
+
+  if ( stat(path, &st) == 0 ) {
+    // nix keeps store closures complete
+    cf->cf_skipped++;
+    return 0;
+  }
+
+  if ( closure_cache_path(cf, path, sizeof(path), "", cp->cp_hash, ".narinfo") < 0 )
+    return CLOSURE_STATUS_ERROR;
+
+  buffer_init(&b);
+  err = buffer_read_from_file(&b, path);
+  if ( err == 0 ) {
+    struct narinfo ni;
+
+    // Fetched before. Its references may not have been
+    buffer_finalize_str(&b, &local);
+    if ( !local ) return CLOSURE_STATUS_ERROR;
+
+    err = closure_parse_narinfo((char *) local, &ni);
+    if ( err == 0 )
+      err = closurefetch_add_references(cf, cp, ni.ni_references);
+    free((void *) local);
+
+    if ( err < 0 ) return CLOSURE_STATUS_ERROR;
+
+    cf->cf_skipped++;
+    return 0;
+  } else
+    buffer_release(&b);
+
+  if ( cf->cf_cache_count == 0 ) {
+    fprintf(stderr, "closurepath_begin: no binary caches for %s\n", cp->cp_name);
+    return CLOSURE_STATUS_NOT_FOUND;
+  }
+
+  cp->cp_cache = 0;
+  if ( closurepath_fetch_narinfo(cp) < 0 )
+    return CLOSURE_STATUS_ERROR;
+
+  return 1;
+}
+
+// cf_mutex must be held
+static void closurefetch_pump(struct closurefetch *cf) {
+  while ( cf->cf_sts == CLOSURE_STATUS_IN_PROGRESS &&
+          cf->cf_active < CLOSURE_MAX_ACTIVE &&
+          cf->cf_first_queued ) {
+    struct closurepath *cp = cf->cf_first_queued;
+    int sts;
+
+    cf->cf_first_queued = cp->cp_next_queued;
+    if ( !cf->cf_first_queued )
+      cf->cf_last_queued = NULL;
+    cp->cp_next_queued = NULL;
+
+    sts = closurepath_begin(cp);
+    if ( sts > 0 )
+      cf->cf_active++;
+    else {
+      cp->cp_state = CP_STATE_DONE;
+      if ( sts < 0 ) {
+        closurepath_release(cp);
+        cf->cf_sts = sts;
+      }
+    }
+  }
+}
+
+static int closurepath_start_nar(struct closurepath *cp) {
+  struct closurefetch *cf = cp->cp_fetch;
+  struct narinfo *ni = &cp->cp_info;
+  char url[PATH_MAX], tmp_path[PATH_MAX];
+
+  if ( strcmp(ni->ni_compression, "none") == 0 ) {
+    cp->cp_compression = CP_COMPRESSION_NONE;
+  } else if ( strcmp(ni->ni_compression, "xz") == 0 ) {
+    lzma_stream init = LZMA_STREAM_INIT;
+
+    cp->cp_compression = CP_COMPRESSION_XZ;
+    cp->cp_xz = init;
+    if ( lzma_stream_decoder(&cp->cp_xz, UINT64_MAX, 0) != LZMA_OK ) {
+      fprintf(stderr, "closurepath_start_nar: could not start xz decoder\n");
+      return CLOSURE_STATUS_ERROR;
+    }
+    cp->cp_xz_live = 1;
+
+    cp->cp_xz_buf = malloc(XZBUFSZ);
+    if ( !cp->cp_xz_buf ) return CLOSURE_STATUS_ERROR;
+  } else {
+    fprintf(stderr, "closurepath_start_nar: %s: unsupported compression %s\n",
+            cp->cp_name, ni->ni_compression);
+    return CLOSURE_STATUS_ERROR;
+  }
+
+  cp->cp_nar_digest = EVP_MD_CTX_new();
+  if ( !cp->cp_nar_digest ||
+       !EVP_DigestInit_ex(cp->cp_nar_digest, EVP_sha256(), NULL) ) {
+    fprintf(stderr, "closurepath_start_nar: could not create digest\n");
+    return CLOSURE_STATUS_ERROR;
+  }
+  cp->cp_nar_size = 0;
+
+  if ( closure_tmp_path(cf, tmp_path, sizeof(tmp_path), "nar/", cp->cp_hash) < 0 )
+    return CLOSURE_STATUS_ERROR;
+
+  cp->cp_out = fopen(tmp_path, "wb");
+  if ( !cp->cp_out ) {
+    perror("closurepath_start_nar: fopen");
+    return CLOSURE_STATUS_ERROR;
+  }
+
+  if ( snprintf(url, sizeof(url), "%s/%s", cf->cf_caches[cp->cp_cache].bc_uri,
+                ni->ni_url) >= sizeof(url) ) {
+    fprintf(stderr, "closurepath_start_nar: URL overflow\n");
+    return CLOSURE_STATUS_ERROR;
+  }
+
+  if ( closurepath_download(cp, url, OP_CLOSURE_NAR) < 0 )
+    return CLOSURE_STATUS_ERROR;
+
+  // The compressed file is hashed as it arrives
+  cp->cp_have_file_hash = ni->ni_file_hash && strncmp(ni->ni_file_hash, "sha256:", 7) == 0;
+  if ( cp->cp_have_file_hash &&
+       download_set_digest(&cp->cp_download, EVP_sha256()) < 0 )
+    return CLOSURE_STATUS_ERROR;
+
+  closure_progress(cf, "Fetching %s (%llu bytes)\n", cp->cp_name, ni->ni_nar_size);
+
+  cp->cp_state = CP_STATE_NAR;
+  download_start(&cp->cp_download);
+  return 0;
+}
+
+// Returns 0 if the NAR is being fetched, 1 if it was already in the
+// cache, and a CLOSURE_STATUS_* error otherwise
+static int closurepath_got_narinfo(struct closurepath *cp) {
+  struct closurefetch *cf = cp->cp_fetch;
+  char nar_name[NIX_SHA256_LEN * 2 + 1], nar_path[PATH_MAX];
+  const char *name;
+  int err;
+
+  buffer_finalize_str(&cp->cp_narinfo_buf, (const char **) &cp->cp_narinfo);
+  if ( !cp->cp_narinfo ) return CLOSURE_STATUS_ERROR;
+
+  if ( closure_parse_narinfo(cp->cp_narinfo, &cp->cp_info) < 0 )
+    return CLOSURE_STATUS_ERROR;
+
+  name = strrchr(cp->cp_info.ni_store_path, '/');
+  if ( !name || strcmp(name + 1, cp->cp_name) != 0 ) {
+    fprintf(stderr, "closurepath_got_narinfo: narinfo for %s is for %s\n",
+            cp->cp_name, cp->cp_info.ni_store_path);
+    return CLOSURE_STATUS_ERROR;
+  }
+
+  if ( closure_verify(&cp->cp_info, &cf->cf_caches[cp->cp_cache]) < 0 ) {
+    fprintf(stderr, "closurepath_got_narinfo: %s: no valid signature from %s\n",
+            cp->cp_name, cf->cf_caches[cp->cp_cache].bc_uri);
+    return CLOSURE_STATUS_BAD_SIGNATURE;
+  }
+
+  SAFE_MUTEX_LOCK(&cf->cf_mutex);
+  err = closurefetch_add_references(cf, cp, cp->cp_info.ni_references);
+  if ( err == 0 )
+    closurefetch_pump(cf);
+  pthread_mutex_unlock(&cf->cf_mutex);
+  if ( err < 0 ) return CLOSURE_STATUS_ERROR;
+
+  download_release(&cp->cp_download);
+  download_clear(&cp->cp_download);
+  cp->cp_download_live = 0;
+
+  if ( closure_nar_name(&cp->cp_info, nar_name) < 0 ||
+       closure_cache_path(cf, nar_path, sizeof(nar_path), "nar/", nar_name, ".nar") < 0 )
+    return CLOSURE_STATUS_ERROR;
+
+  // The NAR was verified against its name when it was written. Touch
+  // it, so that closurecache_sweep leaves it alone until the narinfo
+  // refers to it
+  if ( utime(nar_path, NULL) == 0 ) {
+    err = closurepath_write_narinfo(cp, nar_name);
+    if ( err < 0 ) return err;
+
+    SAFE_MUTEX_LOCK(&cf->cf_mutex);
+    cf->cf_deduped++;
+    pthread_mutex_unlock(&cf->cf_mutex);
+
+    closure_progress(cf, "Reusing cached contents for %s\n", cp->cp_name);
+    return 1;
+  }
+
+  return closurepath_start_nar(cp);
+}
+
+static int closurepath_write(struct closurepath *cp, const void *data, size_t sz) {
+  if ( sz == 0 ) return 0;
+
+  if ( fwrite(data, 1, sz, cp->cp_out) != sz ) {
+    perror("closurepath_write: fwrite");
+    return CLOSURE_STATUS_ERROR;
+  }
+
+  if ( !EVP_DigestUpdate(cp->cp_nar_digest, data, sz) )
+    return CLOSURE_STATUS_ERROR;
+
+  cp->cp_nar_size += sz;
+  return 0;
+}
+
+// Decompress data (or, if data is NULL, whatever is left) to cp_out
+static int closurepath_decompress(struct closurepath *cp, const void *data, size_t sz) {
+  lzma_action action = data ? LZMA_RUN : LZMA_FINISH;
+  lzma_ret ret;
+  int err;
+
+  if ( cp->cp_compression == CP_COMPRESSION_NONE )
+    return closurepath_write(cp, data, sz);
+
+  cp->cp_xz.next_in = data;
+  cp->cp_xz.avail_in = sz;
+
+  do {
+    cp->cp_xz.next_out = cp->cp_xz_buf;
+    cp->cp_xz.avail_out = XZBUFSZ;
+
+    ret = lzma_code(&cp->cp_xz, action);
+    if ( ret != LZMA_OK && ret != LZMA_STREAM_END ) {
+      fprintf(stderr, "closurepath_decompress: %s: xz error %d\n", cp->cp_name, ret);
+      return CLOSURE_STATUS_ERROR;
+    }
+
+    err = closurepath_write(cp, cp->cp_xz_buf, XZBUFSZ - cp->cp_xz.avail_out);
+    if ( err < 0 ) return err;
+  } while ( ret != LZMA_STREAM_END &&
+            (cp->cp_xz.avail_in > 0 || cp->cp_xz.avail_out == 0 || action == LZMA_FINISH) );
+
+  if ( action == LZMA_FINISH && ret != LZMA_STREAM_END ) return CLOSURE_STATUS_ERROR;
+
+  return 0;
+}
+
+// Write the narinfo for cp, pointing at nar/<nar_name>.nar. The
+// signatures are over the uncompressed NAR, so they still hold
+static int closurepath_write_narinfo(struct closurepath *cp, const char *nar_name) {
+  struct closurefetch *cf = cp->cp_fetch;
+  struct narinfo *ni = &cp->cp_info;
+  char tmp_path[PATH_MAX], final_path[PATH_MAX];
+  FILE *out;
+  int i;
+
+  if ( closure_tmp_path(cf, tmp_path, sizeof(tmp_path), "", cp->cp_hash) < 0 ||
+       closure_cache_path(cf, final_path, sizeof(final_path), "", cp->cp_hash, ".narinfo") < 0 )
+    return CLOSURE_STATUS_ERROR;
+
+  out = fopen(tmp_path, "wt");
+  if ( !out ) {
+    perror("closurepath_write_narinfo: fopen");
+    return CLOSURE_STATUS_ERROR;
+  }
+
+  fprintf(out, "StorePath: %s\nURL: nar/%s.nar\nCompression: none\n"
+          "NarHash: %s\nNarSize: %llu\nReferences: %s\n",
+          ni->ni_store_path, nar_name, ni->ni_nar_hash, ni->ni_nar_size,
+          ni->ni_references);
+  if ( ni->ni_deriver )
+    fprintf(out, "Deriver: %s\n", ni->ni_deriver);
+  for ( i = 0; i < ni->ni_sig_count; ++i )
+    fprintf(out, "Sig: %s\n", ni->ni_sigs[i]);
+
+  if ( fclose(out) != 0 || rename(tmp_path, final_path) < 0 ) {
+    perror("closurepath_write_narinfo: rename");
+    unlink(tmp_path);
+    return CLOSURE_STATUS_ERROR;
+  }
+
+  return 0;
+}
+
+// Verify the NAR, and move it into the cache, along with its narinfo
+static int closurepath_got_nar(struct closurepath *cp) {
+  struct closurefetch *cf = cp->cp_fetch;
+  struct narinfo *ni = &cp->cp_info;
+  unsigned char expected[NIX_SHA256_LEN], actual[EVP_MAX_MD_SIZE];
+  char tmp_path[PATH_MAX], final_path[PATH_MAX], nar_name[NIX_SHA256_LEN * 2 + 1];
+  FILE *out;
+  int err;
+
+  err = closurepath_decompress(cp, NULL, 0);
+  if ( err < 0 ) return err;
+
+  if ( cp->cp_have_file_hash ) {
+    if ( closure_parse_sha256(ni->ni_file_hash, expected) < 0 ||
+         download_digest(&cp->cp_download, actual, NULL) < 0 ||
+         memcmp(expected, actual, NIX_SHA256_LEN) != 0 ) {
+      fprintf(stderr, "closurepath_got_nar: %s: FileHash mismatch\n", cp->cp_name);
+      return CLOSURE_STATUS_BAD_HASH;
+    }
+  }
+
+  if ( closure_parse_sha256(ni->ni_nar_hash, expected) < 0 ||
+       !EVP_DigestFinal_ex(cp->cp_nar_digest, actual, NULL) ||
+       memcmp(expected, actual, NIX_SHA256_LEN) != 0 ||
+       cp->cp_nar_size != ni->ni_nar_size ) {
+    fprintf(stderr, "closurepath_got_nar: %s: NarHash or NarSize mismatch\n", cp->cp_name);
+    return CLOSURE_STATUS_BAD_HASH;
+  }
+
+  out = cp->cp_out;
+  cp->cp_out = NULL;
+  if ( fflush(out) != 0 || fsync(fileno(out)) < 0 ) {
+    perror("closurepath_got_nar: fsync");
+    fclose(out);
+    return CLOSURE_STATUS_ERROR;
+  }
+  fclose(out);
+
+  hex_digest_str(expected, nar_name, NIX_SHA256_LEN);
+  if ( closure_tmp_path(cf, tmp_path, sizeof(tmp_path), "nar/", cp->cp_hash) < 0 ||
+       closure_cache_path(cf, final_path, sizeof(final_path), "nar/", nar_name, ".nar") < 0 )
+    return CLOSURE_STATUS_ERROR;
+
+  // Another path with the same contents may have got here first, in
+  // which case this replaces its NAR with an identical file
+  if ( rename(tmp_path, final_path) < 0 ) {
+    perror("closurepath_got_nar: rename(nar)");
+    unlink(tmp_path);
+    return CLOSURE_STATUS_ERROR;
+  }
+
+  err = closurepath_write_narinfo(cp, nar_name);
+  if ( err < 0 ) return err;
+
+  SAFE_MUTEX_LOCK(&cf->cf_mutex);
+  cf->cf_fetched++;
+  cf->cf_bytes += cp->cp_download.dl_complete;
+  pthread_mutex_unlock(&cf->cf_mutex);
+
+  closure_progress(cf, "Fetched %s\n", cp->cp_name);
+
+  return 0;
+}
+
+static void closurefn(struct eventloop *el, int op, void *arg) {
+  struct dlevent *dle = arg;
+  struct download *dl = dle->dle_dl;
+  struct closurepath *cp = STRUCT_FROM_BASE(struct closurepath, cp_download, dl);
+  struct closurefetch *cf = cp->cp_fetch;
+  int stopped, err = 0;
+
+  SAFE_MUTEX_LOCK(&cf->cf_mutex);
+  stopped = cf->cf_sts != CLOSURE_STATUS_IN_PROGRESS;
+  pthread_mutex_unlock(&cf->cf_mutex);
+
+  // Each active path has one event outstanding, so this is where
+  // paths notice the fetch is over
+  if ( stopped ) {
+    download_cancel(dl);
+    closurepath_finish(cp, 0);
+    return;
+  }
+
+  switch ( op ) {
+  case OP_CLOSURE_NARINFO:
+    if ( download_complete(dl) ) {
+      if ( dl->dl_sts == DL_STATUS_COMPLETE ) {
+        err = closurepath_got_narinfo(cp);
+        if ( err == 0 ) return;
+        else if ( err > 0 ) err = 0;
+      } else if ( dl->dl_sts == DL_STATUS_NOT_FOUND &&
+                  cp->cp_cache + 1 < cf->cf_cache_count ) {
+        download_release(dl);
+        download_clear(dl);
+        cp->cp_download_live = 0;
+        buffer_release(&cp->cp_narinfo_buf);
+        buffer_init(&cp->cp_narinfo_buf);
+
+        cp->cp_cache++;
+        if ( closurepath_fetch_narinfo(cp) == 0 ) return;
+        err = CLOSURE_STATUS_ERROR;
+      } else {
+        fprintf(stderr, "closurefn: could not fetch narinfo for %s: %d\n",
+                cp->cp_name, dl->dl_sts);
+        err = dl->dl_sts == DL_STATUS_NOT_FOUND ? CLOSURE_STATUS_NOT_FOUND : CLOSURE_STATUS_ERROR;
+      }
+    } else if ( buffer_size(&cp->cp_narinfo_buf) + dl->dl_bufsz > NARINFO_MAX_SIZE ||
+                buffer_write(&cp->cp_narinfo_buf, dl->dl_buf, dl->dl_bufsz) < 0 ) {
+      fprintf(stderr, "closurefn: narinfo for %s is too large\n", cp->cp_name);
+      download_cancel(dl);
+      err = CLOSURE_STATUS_ERROR;
+    } else {
+      download_continue(dl);
+      return;
+    }
+    break;
+
+  case OP_CLOSURE_NAR:
+    if ( download_complete(dl) ) {
+      if ( dl->dl_sts == DL_STATUS_COMPLETE )
+        err = closurepath_got_nar(cp);
+      else {
+        fprintf(stderr, "closurefn: could not fetch NAR for %s: %d\n",
+                cp->cp_name, dl->dl_sts);
+        err = CLOSURE_STATUS_ERROR;
+      }
+    } else {
+      err = closurepath_decompress(cp, dl->dl_buf, dl->dl_bufsz);
+      if ( err == 0 ) {
+        download_continue(dl);
+        return;
+      }
+      download_cancel(dl);
+    }
+    break;
+
+  default:
+    fprintf(stderr, "closurefn: unknown op %d\n", op);
+    return;
+  }
+
+  closurepath_finish(cp, err);
+}
+
+void closurefetch_clear(struct closurefetch *cf) {
+  cf->cf_eventloop = NULL;
+  cf->cf_downloader = NULL;
+  cf->cf_store_dir = cf->cf_cache_dir = NULL;
+  cf->cf_cache_count = 0;
+  cf->cf_caches = NULL;
+  cf->cf_progress = -1;
+  cf->cf_paths = NULL;
+  cf->cf_first_queued = cf->cf_last_queued = NULL;
+  cf->cf_active = 0;
+  cf->cf_fetched = cf->cf_skipped = cf->cf_deduped = 0;
+  cf->cf_bytes = 0;
+  cf->cf_sts = CLOSURE_STATUS_NOT_STARTED;
+  cf->cf_complete_queued = 0;
+}
+
+int closurefetch_init(struct closurefetch *cf, struct eventloop *el, struct downloader *dr,
+                      const char *store_dir, const char *cache_dir,
+                      struct bincache *caches, size_t cache_count, int progress,
+                      int op, evtctlfn fn) {
+  char path[PATH_MAX];
+  FILE *info;
+
+  closurefetch_clear(cf);
+
+  if ( pthread_mutex_init(&cf->cf_mutex, NULL) != 0 )
+    return -1;
+
+  cf->cf_eventloop = el;
+  cf->cf_downloader = dr;
+  cf->cf_caches = caches;
+  cf->cf_cache_count = cache_count;
+  cf->cf_progress = progress;
+  qdevtsub_init(&cf->cf_on_complete, op, fn);
+
+  cf->cf_store_dir = strdup(store_dir);
+  cf->cf_cache_dir = strdup(cache_dir);
+  if ( !cf->cf_store_dir || !cf->cf_cache_dir ) goto error;
+
+  if ( snprintf(path, sizeof(path), "%s/nar", cache_dir) >= sizeof(path) ) {
+    fprintf(stderr, "closurefetch_init: path overflow\n");
+    goto error;
+  }
+
+  if ( mkdir_recursive(path) < 0 ) {
+    perror("closurefetch_init: mkdir_recursive");
+    goto error;
+  }
+
+  if ( snprintf(path, sizeof(path), "%s/nix-cache-info", cache_dir) >= sizeof(path) ) {
+    fprintf(stderr, "closurefetch_init: path overflow\n");
+    goto error;
+  }
+
+  if ( access(path, F_OK) < 0 ) {
+    info = fopen(path, "wt");
+    if ( !info ) {
+      perror("closurefetch_init: fopen(nix-cache-info)");
+      goto error;
+    }
+    fprintf(info, NIX_CACHE_INFO);
+    fclose(info);
+  }
+
+  return 0;
+
+ error:
+  closurefetch_release(cf);
+  return -1;
+}
+
+int closurefetch_start(struct closurefetch *cf, const char *store_path) {
+  const char *name = strrchr(store_path, '/');
+  int err = -1;
+
+  if ( !name ) {
+    fprintf(stderr, "closurefetch_start: %s is not a store path\n", store_path);
+    return -1;
+  }
+  name++;
+
+  SAFE_MUTEX_LOCK(&cf->cf_mutex);
+  if ( cf->cf_sts == CLOSURE_STATUS_NOT_STARTED ) {
+    cf->cf_sts = CLOSURE_STATUS_IN_PROGRESS;
+    err = closurefetch_add(cf, name, strlen(name));
+    if ( err < 0 )
+      cf->cf_sts = CLOSURE_STATUS_ERROR;
+    else
+      closurefetch_pump(cf);
+
+    closurefetch_check_done(cf);
+  }
+  pthread_mutex_unlock(&cf->cf_mutex);
+
+  return err;
+}
+
+void closurefetch_cancel(struct closurefetch *cf) {
+  SAFE_MUTEX_LOCK(&cf->cf_mutex);
+  if ( cf->cf_sts == CLOSURE_STATUS_IN_PROGRESS ) {
+    cf->cf_sts = CLOSURE_STATUS_CANCELLED;
+    closurefetch_check_done(cf);
+  }
+  pthread_mutex_unlock(&cf->cf_mutex);
+}
+
+void closurefetch_release(struct closurefetch *cf) {
+  struct closurepath *cp, *tmp;
+
+  HASH_ITER(cp_hh, cf->cf_paths, cp, tmp) {
+    HASH_DELETE(cp_hh, cf->cf_paths, cp);
+    closurepath_release(cp);
+    free(cp->cp_name);
+    free(cp);
+  }
+  cf->cf_first_queued = cf->cf_last_queued = NULL;
+
+  if ( cf->cf_store_dir ) {
+    free(cf->cf_store_dir);
+    cf->cf_store_dir = NULL;
+  }
+
+  if ( cf->cf_cache_dir ) {
+    free(cf->cf_cache_dir);
+    cf->cf_cache_dir = NULL;
+  }
+
+  if ( cf->cf_eventloop ) {
+    pthread_mutex_destroy(&cf->cf_mutex);
+    cf->cf_eventloop = NULL;
+  }
+}
+
+// NARs referred to by some narinfo, while sweeping
+struct narref {
+  UT_hash_handle nr_hh;
+  char nr_name[NAME_MAX + 1];
+};
+
+static int closurecache_is_old(const char *path, time_t cutoff) {
+  struct stat st;
+
+  if ( stat(path, &st) < 0 ) return 0;
+  return st.st_mtime < cutoff;
+}
+
+static int closurecache_has_suffix(const char *name, const char *suffix) {
+  size_t name_sz = strlen(name), suffix_sz = strlen(suffix);
+  return name_sz > suffix_sz && strcmp(name + name_sz - suffix_sz, suffix) == 0;
+}
+
+// Remove the narinfos in cache_dir for paths that are in store_dir,
+// and add the NARs of the others to refs. Returns the number of files
+// removed, or -1
+static int closurecache_sweep_narinfos(const char *store_dir, const char *cache_dir,
+                                       time_t cutoff, struct narref **refs) {
+  char path[PATH_MAX];
+  DIR *cache_d;
+  struct dirent *ent;
+  int removed = 0;
+
+  cache_d = opendir(cache_dir);
+  if ( !cache_d ) {
+    if ( errno == ENOENT ) return 0;
+    perror("closurecache_sweep_narinfos: opendir");
+    return -1;
+  }
+
+  for ( errno = 0, ent = readdir(cache_d); ent; errno = 0, ent = readdir(cache_d) ) {
+    struct narinfo ni;
+    struct narref *ref;
+    const char *store_name, *nar_name, *data;
+    struct buffer b;
+    size_t nar_name_sz;
+
+    if ( snprintf(path, sizeof(path), "%s/%s", cache_dir, ent->d_name) >= sizeof(path) )
+      continue;
+
+    if ( closurecache_has_suffix(ent->d_name, ".tmp") ) {
+      if ( closurecache_is_old(path, cutoff) && unlink(path) == 0 )
+        removed++;
+      continue;
+    }
+
+    if ( !closurecache_has_suffix(ent->d_name, ".narinfo") ) continue;
+
+    buffer_init(&b);
+    if ( buffer_read_from_file(&b, path) < 0 ) {
+      buffer_release(&b);
+      continue;
+    }
+
+    buffer_finalize_str(&b, &data);
+    if ( !data ) continue;
+
+    if ( closure_parse_narinfo((char *) data, &ni) < 0 ) {
+      fprintf(stderr, "closurecache_sweep_narinfos: removing invalid %s\n", ent->d_name);
+      free((void *) data);
+      if ( unlink(path) == 0 ) removed++;
+      continue;
+    }
+
+    store_name = strrchr(ni.ni_store_path, '/');
+    if ( store_name ) {
+      char store_path[PATH_MAX];
+      struct stat st;
+
+      if ( snprintf(store_path, sizeof(store_path), "%s/%s", store_dir, store_name + 1) < sizeof(store_path) &&
+           stat(store_path, &st) == 0 ) {
+        // nix has it now, so nothing will substitute it from here
+        free((void *) data);
+        if ( unlink(path) == 0 ) removed++;
+        continue;
+      }
+    }
+
+    nar_name = strrchr(ni.ni_url, '/');
+    nar_name = nar_name ? nar_name + 1 : ni.ni_url;
+    nar_name_sz = strlen(nar_name);
+
+    HASH_FIND(nr_hh, *refs, nar_name, nar_name_sz, ref);
+    if ( !ref && nar_name_sz < sizeof(ref->nr_name) ) {
+      ref = malloc(sizeof(*ref));
+      if ( !ref ) {
+        free((void *) data);
+        closedir(cache_d);
+        return -1;
+      }
+
+      memcpy(ref->nr_name, nar_name, nar_name_sz + 1);
+      HASH_ADD(nr_hh, *refs, nr_name, nar_name_sz, ref);
+    }
+
+    free((void *) data);
+  }
+
+  if ( errno != 0 ) {
+    perror("closurecache_sweep_narinfos: readdir");
+    closedir(cache_d);
+    return -1;
+  }
+
+  closedir(cache_d);
+  return removed;
+}
+
+int closurecache_sweep(const char *store_dir, const char *cache_dir, int grace) {
+  char nar_dir[PATH_MAX], path[PATH_MAX];
+  struct narref *refs = NULL, *ref, *tmp_ref;
+  time_t cutoff = time(NULL) - grace;
+  DIR *nar_d;
+  struct dirent *ent;
+  int removed;
+
+  removed = closurecache_sweep_narinfos(store_dir, cache_dir, cutoff, &refs);
+  if ( removed < 0 ) goto done;
+
+  if ( snprintf(nar_dir, sizeof(nar_dir), "%s/nar", cache_dir) >= sizeof(nar_dir) ) {
+    fprintf(stderr, "closurecache_sweep: path overflow\n");
+    removed = -1;
+    goto done;
+  }
+
+  nar_d = opendir(nar_dir);
+  if ( !nar_d ) {
+    if ( errno != ENOENT ) {
+      perror("closurecache_sweep: opendir");
+      removed = -1;
+    }
+    goto done;
+  }
+
+  for ( errno = 0, ent = readdir(nar_d); ent; errno = 0, ent = readdir(nar_d) ) {
+    if ( !closurecache_has_suffix(ent->d_name, ".nar") &&
+         !closurecache_has_suffix(ent->d_name, ".tmp") )
+      continue;
+
+    HASH_FIND(nr_hh, refs, ent->d_name, strlen(ent->d_name), ref);
+    if ( ref ) continue;
+
+    // NARs are written before their narinfos, and fetches in progress
+    // may be about to refer to this one, so only old NARs are removed
+    if ( snprintf(path, sizeof(path), "%s/%s", nar_dir, ent->d_name) < sizeof(path) &&
+         closurecache_is_old(path, cutoff) &&
+         unlink(path) == 0 )
+      removed++;
+  }
+
+  if ( errno != 0 ) {
+    perror("closurecache_sweep: readdir");
+    removed = -1;
+  }
+
+  closedir(nar_d);
+
+ done:
+  HASH_ITER(nr_hh, refs, ref, tmp_ref) {
+    HASH_DELETE(nr_hh, refs, ref);
+    free(ref);
+  }
+
+  return removed;
+}
+
+static void closuregc_schedule(struct closuregc *cg) {
+  cg->cg_flags |= CLOSUREGC_FLAG_SCHEDULED;
+  timersub_set_from_now(&cg->cg_timer, CLOSURE_GC_DELAY);
+  eventloop_subscribe_timer(cg->cg_eventloop, &cg->cg_timer);
+}
+
+struct gcpath {
+  UT_hash_handle gp_hh;
+  char gp_path[];
+};
+
+struct gcdead {
+  struct gcpath *gd_closure, *gd_dead;
+  int gd_count;
+};
+
+static void closuregc_free_paths(struct gcpath **paths) {
+  struct gcpath *p, *tmp_p;
+
+  HASH_ITER(gp_hh, *paths, p, tmp_p) {
+    HASH_DELETE(gp_hh, *paths, p);
+    free(p);
+  }
+}
+
+// Runs nix-store with argv, and calls linefn (if not NULL) with each
+// line it prints. Returns -1 if nix-store fails, or if linefn does
+static int closuregc_nix_store(char *const argv[], int (*linefn)(char *, void *), void *data) {
+  int p[2], sts, ret = 0;
+  pid_t child;
+  FILE *out;
+  char *line = NULL;
+  size_t line_sz = 0;
+  ssize_t line_len;
+
+  if ( pipe(p) < 0 ) {
+    perror("closuregc_nix_store: pipe");
+    return -1;
+  }
+
+  child = fork();
+  if ( child < 0 ) {
+    perror("closuregc_nix_store: fork");
+    close(p[0]);
+    close(p[1]);
+    return -1;
+  } else if ( child == 0 ) {
+    close(p[0]);
+    dup2(p[1], STDOUT_FILENO);
+    close(p[1]);
+    close(STDIN_FILENO);
+
+    execvp("nix-store", argv);
+    perror("execvp(nix-store)");
+    exit(128);
+  }
+
+  close(p[1]);
+
+  out = fdopen(p[0], "r");
+  if ( !out ) {
+    perror("closuregc_nix_store: fdopen");
+    close(p[0]);
+    ret = -1;
+  } else {
+    while ( (line_len = getline(&line, &line_sz, out)) > 0 ) {
+      if ( line[line_len - 1] == '\n' )
+        line[line_len - 1] = '\0';
+      if ( linefn && linefn(line, data) < 0 )
+        ret = -1;
+    }
+
+    free(line);
+    fclose(out);
+  }
+
+  while ( waitpid(child, &sts, 0) < 0 ) {
+    if ( errno != EINTR ) {
+      perror("closuregc_nix_store: waitpid");
+      return -1;
+    }
+  }
+
+  if ( sts != 0 ) {
+    fprintf(stderr, "closuregc_nix_store: 'nix-store %s' exited with %d\n", argv[1], sts);
+    ret = -1;
+  }
+
+  return ret;
+}
+
+static int closuregc_add_path(char *line, void *data) {
+  struct gcpath **paths = data, *p;
+  size_t line_sz = strlen(line);
+
+  if ( line_sz == 0 ) return 0;
+
+  HASH_FIND(gp_hh, *paths, line, line_sz, p);
+  if ( p ) return 0;
+
+  p = malloc(sizeof(*p) + line_sz + 1);
+  if ( !p ) return -1;
+
+  memcpy(p->gp_path, line, line_sz + 1);
+  HASH_ADD_KEYPTR(gp_hh, *paths, p->gp_path, line_sz, p);
+  return 0;
+}
+
+// Moves dead paths from the replaced closures into the set to delete
+static int closuregc_add_dead(char *line, void *data) {
+  struct gcdead *gd = data;
+  struct gcpath *p;
+
+  HASH_FIND(gp_hh, gd->gd_closure, line, strlen(line), p);
+  if ( p ) {
+    HASH_DELETE(gp_hh, gd->gd_closure, p);
+    HASH_ADD_KEYPTR(gp_hh, gd->gd_dead, p->gp_path, strlen(p->gp_path), p);
+    gd->gd_count++;
+  }
+
+  return 0;
+}
+
+static void closuregc_collect(struct closuregc *cg) {
+  struct gcclosure *gcc;
+  struct gcdead gd = { NULL, NULL, 0 };
+  struct gcpath *p, *tmp_p;
+  char **argv;
+  int argc = 0;
+
+  for ( gcc = cg->cg_collecting; gcc; gcc = gcc->gcc_next )
+    argc++;
+  if ( argc == 0 ) return;
+
+  argv = calloc(argc + 3, sizeof(*argv));
+  if ( !argv ) goto nomem;
+
+  argc = 0;
+  argv[argc++] = "nix-store";
+  argv[argc++] = "-qR";
+  for ( gcc = cg->cg_collecting; gcc; gcc = gcc->gcc_next )
+    argv[argc++] = gcc->gcc_path;
+
+  if ( closuregc_nix_store(argv, closuregc_add_path, &gd.gd_closure) < 0 ) {
+    fprintf(stderr, "closuregc_collect: could not query the replaced closures\n");
+    goto done;
+  }
+  free(argv);
+  argv = NULL;
+
+  if ( closuregc_nix_store((char *[]) { "nix-store", "--gc", "--print-dead", NULL },
+                           closuregc_add_dead, &gd) < 0 ) {
+    fprintf(stderr, "closuregc_collect: could not find dead paths\n");
+    goto done;
+  }
+
+  if ( gd.gd_count == 0 ) goto done;
+
+  argv = calloc(gd.gd_count + 3, sizeof(*argv));
+  if ( !argv ) goto nomem;
+
+  argc = 0;
+  argv[argc++] = "nix-store";
+  argv[argc++] = "--delete";
+  HASH_ITER(gp_hh, gd.gd_dead, p, tmp_p) {
+    argv[argc++] = p->gp_path;
+  }
+
+  // nix refuses to delete paths that have become live since, in which
+  // case they are left for a later collection
+  if ( closuregc_nix_store(argv, NULL, NULL) == 0 )
+    fprintf(stderr, "closuregc_collect: deleted %d paths\n", gd.gd_count);
+
+  goto done;
+
+ nomem:
+  fprintf(stderr, "closuregc_collect: out of memory\n");
+
+ done:
+  if ( argv ) free(argv);
+  closuregc_free_paths(&gd.gd_closure);
+  closuregc_free_paths(&gd.gd_dead);
+}
+
+static void closuregc_free_closures(struct gcclosure **closures) {
+  struct gcclosure *gcc;
+
+  while ( *closures ) {
+    gcc = *closures;
+    *closures = gcc->gcc_next;
+    free(gcc);
+  }
+}
+
+static void closuregc_done(struct closuregc *cg) {
+  SAFE_MUTEX_LOCK(&cg->cg_mutex);
+  closuregc_free_closures(&cg->cg_collecting);
+  cg->cg_flags &= ~CLOSUREGC_FLAG_RUNNING;
+  if ( cg->cg_flags & CLOSUREGC_FLAG_PENDING ) {
+    cg->cg_flags &= ~CLOSUREGC_FLAG_PENDING;
+    closuregc_schedule(cg);
+  }
+  eventloop_queue_all(cg->cg_eventloop, &cg->cg_waiters);
+  pthread_mutex_unlock(&cg->cg_mutex);
+}
+
+static void closuregcfn(struct eventloop *el, int op, void *arg) {
+  struct closuregc *cg;
+  struct qdevent *qde = arg;
+  int removed;
+
+  switch ( op ) {
+  case OP_CLOSUREGC_TIMER:
+    cg = STRUCT_FROM_BASE(struct closuregc, cg_timer, qde->qde_timersub);
+
+    SAFE_MUTEX_LOCK(&cg->cg_mutex);
+    cg->cg_flags &= ~CLOSUREGC_FLAG_SCHEDULED;
+    if ( cg->cg_holds > 0 ) {
+      // An update is in progress. Run once it is done
+      cg->cg_flags |= CLOSUREGC_FLAG_DEFERRED;
+      pthread_mutex_unlock(&cg->cg_mutex);
+      break;
+    }
+    cg->cg_flags |= CLOSUREGC_FLAG_RUNNING;
+    cg->cg_collecting = cg->cg_closures;
+    cg->cg_closures = NULL;
+    pthread_mutex_unlock(&cg->cg_mutex);
+
+    // nix-store can take a while, so collect off the event loop threads
+    if ( eventloop_invoke_async(cg->cg_eventloop, &cg->cg_async) < 0 ) {
+      perror("closuregcfn: eventloop_invoke_async");
+      closuregc_done(cg);
+    }
+    break;
+
+  case OP_CLOSUREGC_ASYNC:
+    cg = STRUCT_FROM_BASE(struct closuregc, cg_async, qde->qde_sub);
+
+    removed = closurecache_sweep(cg->cg_store_dir, cg->cg_cache_dir, CLOSURE_CACHE_GRACE);
+    if ( removed > 0 )
+      fprintf(stderr, "closuregcfn: removed %d files from %s\n", removed, cg->cg_cache_dir);
+
+    closuregc_collect(cg);
+    closuregc_done(cg);
+    break;
+
+  default:
+    fprintf(stderr, "closuregcfn: unknown op %d\n", op);
+  }
+}
+
+void closuregc_clear(struct closuregc *cg) {
+  cg->cg_eventloop = NULL;
+  cg->cg_store_dir = cg->cg_cache_dir = NULL;
+  cg->cg_flags = 0;
+  cg->cg_holds = 0;
+  cg->cg_closures = cg->cg_collecting = NULL;
+  evtqueue_init(&cg->cg_waiters);
+}
+
+int closuregc_init(struct closuregc *cg, struct eventloop *el,
+                   const char *store_dir, const char *cache_dir) {
+  closuregc_clear(cg);
+
+  if ( pthread_mutex_init(&cg->cg_mutex, NULL) != 0 )
+    return -1;
+
+  cg->cg_eventloop = el;
+  timersub_init_default(&cg->cg_timer, OP_CLOSUREGC_TIMER, closuregcfn);
+  qdevtsub_init(&cg->cg_async, OP_CLOSUREGC_ASYNC, closuregcfn);
+
+  cg->cg_store_dir = strdup(store_dir);
+  cg->cg_cache_dir = strdup(cache_dir);
+  if ( !cg->cg_store_dir || !cg->cg_cache_dir ) {
+    closuregc_release(cg);
+    return -1;
+  }
+
+  return 0;
+}
+
+int closuregc_request(struct closuregc *cg, const char *old_closure) {
+  struct gcclosure *gcc;
+  size_t path_sz = strlen(old_closure);
+
+  gcc = malloc(sizeof(*gcc) + path_sz + 1);
+  if ( !gcc ) return -1;
+  memcpy(gcc->gcc_path, old_closure, path_sz + 1);
+
+  SAFE_MUTEX_LOCK(&cg->cg_mutex);
+  gcc->gcc_next = cg->cg_closures;
+  cg->cg_closures = gcc;
+
+  if ( cg->cg_flags & CLOSUREGC_FLAG_RUNNING )
+    cg->cg_flags |= CLOSUREGC_FLAG_PENDING;
+  else if ( !(cg->cg_flags & CLOSUREGC_FLAG_SCHEDULED) )
+    closuregc_schedule(cg);
+  else if ( eventloop_cancel_timer(cg->cg_eventloop, &cg->cg_timer) )
+    // Push back the collection that was already scheduled
+    closuregc_schedule(cg);
+  else
+    // The timer has fired, and the collection is about to start
+    cg->cg_flags |= CLOSUREGC_FLAG_PENDING;
+  pthread_mutex_unlock(&cg->cg_mutex);
+
+  return 0;
+}
+
+int closuregc_hold(struct closuregc *cg, struct qdevtsub *wake) {
+  int ret = 0;
+
+  SAFE_MUTEX_LOCK(&cg->cg_mutex);
+  if ( cg->cg_flags & CLOSUREGC_FLAG_RUNNING ) {
+    if ( wake )
+      evtqueue_queue(&cg->cg_waiters, wake);
+    ret = -1;
+  } else
+    cg->cg_holds++;
+  pthread_mutex_unlock(&cg->cg_mutex);
+
+  return ret;
+}
+
+void closuregc_unhold(struct closuregc *cg) {
+  SAFE_MUTEX_LOCK(&cg->cg_mutex);
+  SAFE_ASSERT( cg->cg_holds > 0 );
+  cg->cg_holds--;
+  if ( cg->cg_holds == 0 && (cg->cg_flags & CLOSUREGC_FLAG_DEFERRED) ) {
+    cg->cg_flags &= ~CLOSUREGC_FLAG_DEFERRED;
+    if ( !(cg->cg_flags & CLOSUREGC_FLAG_SCHEDULED) )
+      closuregc_schedule(cg);
+  }
+  pthread_mutex_unlock(&cg->cg_mutex);
+}
+
+void closuregc_release(struct closuregc *cg) {
+  if ( cg->cg_eventloop ) {
+    if ( cg->cg_flags & CLOSUREGC_FLAG_SCHEDULED )
+      eventloop_cancel_timer(cg->cg_eventloop, &cg->cg_timer);
+    pthread_mutex_destroy(&cg->cg_mutex);
+    cg->cg_eventloop = NULL;
+  }
+
+  if ( cg->cg_store_dir ) {
+    free(cg->cg_store_dir);
+    cg->cg_store_dir = NULL;
+  }
+
+  if ( cg->cg_cache_dir ) {
+    free(cg->cg_cache_dir);
+    cg->cg_cache_dir = NULL;
+  }
+
+  closuregc_free_closures(&cg->cg_closures);
+  closuregc_free_closures(&cg->cg_collecting);
+}
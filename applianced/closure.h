@@ -0,0 +1,170 @@
+#ifndef __appliance_closure_H__
+#define __appliance_closure_H__
+
+#include <uthash.h>
+
+#include "event.h"
+#include "download.h"
+
+// Fetching nix closures from binary caches
+//
+// Starting at the closure's top-level store path, the narinfo of each
+// path is fetched from the first binary cache that has it, its
+// signature is checked against that cache's keys, and its references
+// are queued in turn. Paths already in the nix store, or already
+// fetched into the local cache, are skipped. Up to
+// CLOSURE_MAX_ACTIVE paths are fetched at once, through the
+// appliance's downloader.
+//
+// NARs are decompressed as they arrive, and written uncompressed to
+// the local cache directory, which is itself laid out as a binary
+// cache:
+//
+//   nix-cache-info
+//   <hash>.narinfo    Written once the NAR has been verified
+//   nar/<sha256>.nar  Named for the hash of its contents
+//
+// Since NARs are stored by content, a path whose NAR is already in the
+// cache (under any store path) is not downloaded again.
+//
+// The closure can then be imported with 'nix-store --realise', using
+// the local cache as the only substituter, so that only nix writes to
+// the nix store.
+
+#define CLOSURE_MAX_ACTIVE 4
+#define CLOSURE_STORE_DIR "/nix/store"
+
+#define CLOSURE_STATUS_IN_PROGRESS 0
+#define CLOSURE_STATUS_COMPLETE 1
+#define CLOSURE_STATUS_NOT_STARTED 2
+#define CLOSURE_STATUS_ERROR (-1)
+#define CLOSURE_STATUS_NOT_FOUND (-2)
+#define CLOSURE_STATUS_CANCELLED (-3)
+#define CLOSURE_STATUS_BAD_SIGNATURE (-4)
+#define CLOSURE_STATUS_BAD_HASH (-5)
+
+struct bincache;
+struct closurepath;
+
+struct closurefetch {
+  pthread_mutex_t cf_mutex;
+
+  struct eventloop *cf_eventloop;
+  struct downloader *cf_downloader;
+
+  char *cf_store_dir, *cf_cache_dir;
+
+  // Not owned. Must outlive the fetch
+  size_t cf_cache_count;
+  struct bincache *cf_caches;
+
+  // Progress is written here, if not -1. Not owned
+  int cf_progress;
+
+  // Every path seen so far, by hash part
+  struct closurepath *cf_paths;
+  // Paths waiting to be fetched
+  struct closurepath *cf_first_queued, *cf_last_queued;
+  int cf_active;
+
+  // Paths downloaded, already present, and whose NAR was already in
+  // the cache
+  unsigned int cf_fetched, cf_skipped, cf_deduped;
+  unsigned long long cf_bytes;
+
+  int cf_sts;
+  int cf_complete_queued;
+  // Queued once the fetch is over, and no paths are active
+  struct qdevtsub cf_on_complete;
+};
+
+#define CLOSUREFETCH_FROM_COMPLETION_EVENT(arg) \
+  STRUCT_FROM_BASE(struct closurefetch, cf_on_complete, ((struct qdevent *)arg)->qde_sub)
+
+void closurefetch_clear(struct closurefetch *cf);
+// store_dir is where nix keeps its store (CLOSURE_STORE_DIR), and
+// cache_dir is the local cache, which is created if needed. op and fn
+// receive the completion event
+int closurefetch_init(struct closurefetch *cf, struct eventloop *el, struct downloader *dr,
+                      const char *store_dir, const char *cache_dir,
+                      struct bincache *caches, size_t cache_count, int progress,
+                      int op, evtctlfn fn);
+// Fetch the closure of store_path, a full path into the store
+int closurefetch_start(struct closurefetch *cf, const char *store_path);
+void closurefetch_cancel(struct closurefetch *cf);
+// Only once the completion event has been delivered, or if the fetch
+// was never started
+void closurefetch_release(struct closurefetch *cf);
+
+// Garbage collection
+//
+// Once an update has moved an app's root to its new closure, paths
+// only the old closure used are garbage. Collection is requested with
+// the replaced closure after every update, but only runs
+// CLOSURE_GC_DELAY milliseconds after the last request, so that a
+// burst of updates is collected once. It first removes the local cache
+// entries of paths now in the nix store (and anything else
+// unreferenced, and older than CLOSURE_CACHE_GRACE seconds). It then
+// deletes, with 'nix-store --delete', those paths in the closures of
+// the replaced closures that 'nix-store --gc --print-dead' reports as
+// dead. Nothing outside of these closures is touched, and nix refuses
+// to delete anything that has become live in the meantime.
+//
+// An update may still share paths with a replaced closure before it
+// has rooted its own, so active updaters hold the collector with
+// closuregc_hold, and a collection that comes due while held is
+// deferred until CLOSURE_GC_DELAY after the last hold is
+// released. Holds are refused while a collection is running, and the
+// given event is queued once it is done.
+#define CLOSURE_GC_DELAY (5 * 60 * 1000)
+#define CLOSURE_CACHE_GRACE (60 * 60)
+
+#define CLOSUREGC_FLAG_SCHEDULED 0x1
+#define CLOSUREGC_FLAG_RUNNING   0x2
+// Requested again while running
+#define CLOSUREGC_FLAG_PENDING   0x4
+// Came due while held
+#define CLOSUREGC_FLAG_DEFERRED  0x8
+
+struct gcclosure {
+  struct gcclosure *gcc_next;
+  char gcc_path[];
+};
+
+struct closuregc {
+  pthread_mutex_t cg_mutex;
+
+  struct eventloop *cg_eventloop;
+  char *cg_store_dir, *cg_cache_dir;
+
+  uint32_t cg_flags;
+  int cg_holds;
+
+  struct timersub cg_timer;
+  struct qdevtsub cg_async;
+
+  // Replaced closures, waiting to be collected, and those being
+  // collected by the running collection
+  struct gcclosure *cg_closures, *cg_collecting;
+
+  // Queued once the running collection is done
+  evtqueue cg_waiters;
+};
+
+void closuregc_clear(struct closuregc *cg);
+int closuregc_init(struct closuregc *cg, struct eventloop *el,
+                   const char *store_dir, const char *cache_dir);
+// Collect whatever only old_closure, a full path into the store, used
+int closuregc_request(struct closuregc *cg, const char *old_closure);
+// Returns 0 if held, or -1 if a collection is running, in which case
+// wake (if not NULL) is queued once it is done
+int closuregc_hold(struct closuregc *cg, struct qdevtsub *wake);
+void closuregc_unhold(struct closuregc *cg);
+void closuregc_release(struct closuregc *cg);
+
+// Remove the cache entries of paths present in store_dir, and
+// unreferenced NARs and temporary files older than grace
+// seconds. Returns the number of files removed, or -1
+int closurecache_sweep(const char *store_dir, const char *cache_dir, int grace);
+
+#endif
@@ -14,6 +14,8 @@
 #include "jsmn.h"
 #include "util.h"
 #include "configuration.h"
+#include "download.h"
+#include "update.h"
 
 #define VALGRIND_FLAG 0x201
 #define WEBRTC_PROXY_OPTION 0x202
@@ -25,6 +27,12 @@
 #define KITE_RESOLV_CONF_OPTION 0x208
 #define KITE_DAEMON_USER_OPTION 0x209
 #define KITE_DAEMON_GROUP_OPTION 0x20A
+#define WEBRTC_PROXY_WORKERS_OPTION 0x20B
+#define SESSION_POOL_SIZE_OPTION 0x20C
+#define CGROUP_ROOT_OPTION       0x20D
+#define MAX_DOWNLOADS_OPTION     0x20E
+#define MAX_HOST_DOWNLOADS_OPTION 0x20F
+#define MAX_UPDATES_OPTION       0x210
 
 static void usage(const char *msg) {
   if ( msg ) fprintf(stderr, "Error: %s\n", msg);
@@ -44,6 +52,25 @@ static void usage(const char *msg) {
           "  --iproute <IPROUTE>           Path to 'iproute' executable\n");
   fprintf(stderr,
           "  --webrtc-proxy <PROXY>        Path to 'webrtc-proxy' executable\n");
+  fprintf(stderr,
+          "  --webrtc-proxy-workers <N>    Serve all sessions of a persona from one shared\n"
+          "                                webrtc-proxy with N worker threads (Default: 0,\n"
+          "                                one webrtc-proxy per session)\n");
+  fprintf(stderr,
+          "  --session-pool-size <N>       Keep N idle containers ready for new WebRTC\n"
+          "                                sessions (Default: 0)\n");
+  fprintf(stderr,
+          "  --cgroup-root <DIR>           cgroup v2 group in which to freeze idle app\n"
+          "                                containers (Default: applianced's own group)\n");
+  fprintf(stderr,
+          "  --max-downloads <N>           Open at most N connections for downloads at once\n"
+          "                                (Default: 8, 0 for no limit)\n");
+  fprintf(stderr,
+          "  --max-host-downloads <N>      Open at most N download connections to any one\n"
+          "                                host (Default: 4, 0 for no limit)\n");
+  fprintf(stderr,
+          "  --max-updates <N>             Run at most N app updates at once. Others wait,\n"
+          "                                installs first (Default: 2, 0 for no limit)\n");
   fprintf(stderr,
           "  --persona-init <INIT>         Path to 'persona-init' executable\n");
   fprintf(stderr,
@@ -160,13 +187,34 @@ static const char *get_nix_system_config() {
   }
 }
 
-static const char *nix_build(const char *pkg_name, const char *suffix) {
+// Builds pkg_name and roots the result at <conf_dir>/nix-roots/<pkg_name>,
+// so the closure garbage collector never reclaims it while we run.
+static const char *nix_build(const char *conf_dir, const char *pkg_name, const char *suffix) {
   int p[2];
   int err;
   pid_t pid;
+  char root_path[PATH_MAX];
 
   fprintf(stderr, "Building nix package %s\n", pkg_name);
 
+  err = snprintf(root_path, sizeof(root_path), "%s/nix-roots", conf_dir);
+  if ( err >= sizeof(root_path) ) {
+    fprintf(stderr, "nix_build: path too long\n");
+    return NULL;
+  }
+
+  err = mkdir_recursive(root_path);
+  if ( err < 0 ) {
+    perror("nix_build: mkdir_recursive");
+    return NULL;
+  }
+
+  err = snprintf(root_path, sizeof(root_path), "%s/nix-roots/%s", conf_dir, pkg_name);
+  if ( err >= sizeof(root_path) ) {
+    fprintf(stderr, "nix_build: path too long\n");
+    return NULL;
+  }
+
   err = pipe(p);
   if ( err == -1 ) {
     perror("nix_build: pipe");
@@ -185,7 +233,8 @@ static const char *nix_build(const char *pkg_name, const char *suffix) {
     dup2(p[1], STDOUT_FILENO);
     close(STDIN_FILENO);
 
-    execlp("nix-build", "nix-build", "<nixpkgs>", "-A", pkg_name, "--no-out-link", NULL);
+    execlp("nix-build", "nix-build", "<nixpkgs>", "-A", pkg_name,
+           "--add-root", root_path, "--indirect", NULL);
     perror("execlp(nix-build)");
     exit(1);
   } else {
@@ -238,6 +287,12 @@ void appconf_init(struct appconf *ac) {
   ac->ac_app_instance_init_path = NULL;
   ac->ac_system_config = NULL;
   ac->ac_resolv_conf = NULL;
+  ac->ac_webrtc_proxy_workers = 0;
+  ac->ac_pconn_pool_size = 0;
+  ac->ac_cgroup_root = NULL;
+  ac->ac_max_downloads = DL_HTTP_DEFAULT_MAX_CONNECTIONS;
+  ac->ac_max_host_downloads = DL_HTTP_DEFAULT_MAX_HOST_CONNECTIONS;
+  ac->ac_max_updates = UPDATEQUEUE_DEFAULT_MAX_ACTIVE;
   ac->ac_kitepath = NULL;
   ac->ac_flags = 0;
   ac->ac_kite_user = -1;
@@ -328,6 +383,12 @@ int appconf_parse_options(struct appconf *ac, int argc, char **argv) {
     { "ebroute", required_argument, 0, 'E' },
     { "valgrind", no_argument, 0, VALGRIND_FLAG },
     { "webrtc-proxy", required_argument, 0, WEBRTC_PROXY_OPTION },
+    { "webrtc-proxy-workers", required_argument, 0, WEBRTC_PROXY_WORKERS_OPTION },
+    { "session-pool-size", required_argument, 0, SESSION_POOL_SIZE_OPTION },
+    { "cgroup-root", required_argument, 0, CGROUP_ROOT_OPTION },
+    { "max-downloads", required_argument, 0, MAX_DOWNLOADS_OPTION },
+    { "max-host-downloads", required_argument, 0, MAX_HOST_DOWNLOADS_OPTION },
+    { "max-updates", required_argument, 0, MAX_UPDATES_OPTION },
     { "persona-init", required_argument, 0, PERSONA_INIT_OPTION },
     { "app-instance-init", required_argument, 0, APP_INSTANCE_INIT_OPTION },
     { "kite-user", required_argument, 0, KITE_USER_OPTION },
@@ -358,6 +419,50 @@ int appconf_parse_options(struct appconf *ac, int argc, char **argv) {
       ac->ac_webrtc_proxy_path = optarg;
       break;
 
+    case WEBRTC_PROXY_WORKERS_OPTION:
+      if ( sscanf(optarg, "%d", &ac->ac_webrtc_proxy_workers) != 1 ||
+           ac->ac_webrtc_proxy_workers < 0 ) {
+        usage("--webrtc-proxy-workers must be a non-negative number");
+        return -1;
+      }
+      break;
+
+    case SESSION_POOL_SIZE_OPTION:
+      if ( sscanf(optarg, "%d", &ac->ac_pconn_pool_size) != 1 ||
+           ac->ac_pconn_pool_size < 0 ) {
+        usage("--session-pool-size must be a non-negative number");
+        return -1;
+      }
+      break;
+
+    case CGROUP_ROOT_OPTION:
+      ac->ac_cgroup_root = optarg;
+      break;
+
+    case MAX_DOWNLOADS_OPTION:
+      if ( sscanf(optarg, "%d", &ac->ac_max_downloads) != 1 ||
+           ac->ac_max_downloads < 0 ) {
+        usage("--max-downloads must be a non-negative number");
+        return -1;
+      }
+      break;
+
+    case MAX_HOST_DOWNLOADS_OPTION:
+      if ( sscanf(optarg, "%d", &ac->ac_max_host_downloads) != 1 ||
+           ac->ac_max_host_downloads < 0 ) {
+        usage("--max-host-downloads must be a non-negative number");
+        return -1;
+      }
+      break;
+
+    case MAX_UPDATES_OPTION:
+      if ( sscanf(optarg, "%d", &ac->ac_max_updates) != 1 ||
+           ac->ac_max_updates < 0 ) {
+        usage("--max-updates must be a non-negative number");
+        return -1;
+      }
+      break;
+
     case PERSONA_INIT_OPTION:
       ac->ac_persona_init_path = optarg;
       break;
@@ -505,7 +610,7 @@ int appconf_validate(struct appconf *ac, int do_debug) {
 
   if ( !ac->ac_iproute_bin ) {
     // Attempt to get iproute information using nix-build
-    ac->ac_iproute_bin = nix_build("iproute", "bin/ip");
+    ac->ac_iproute_bin = nix_build(ac->ac_conf_dir, "iproute", "bin/ip");
     if ( !ac->ac_iproute_bin ) {
       fprintf(stderr, "Could not build iproute via nix\n");
       return -1;
@@ -514,7 +619,7 @@ int appconf_validate(struct appconf *ac, int do_debug) {
 
   if ( !ac->ac_ebroute_bin ) {
     // Attempt to get ebroute information using nix-build
-    ac->ac_ebroute_bin = nix_build("ebtables", "bin/ebtables");
+    ac->ac_ebroute_bin = nix_build(ac->ac_conf_dir, "ebtables", "bin/ebtables");
     if ( !ac->ac_ebroute_bin ) {
       fprintf(stderr, "Could not build ebroute via nix\n");
       return -1;
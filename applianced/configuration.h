@@ -16,6 +16,24 @@ struct appconf {
 
   const char *ac_resolv_conf;
 
+  // If non-zero, each persona's sessions share one webrtc-proxy with
+  // this many worker threads, instead of one proxy per session
+  int ac_webrtc_proxy_workers;
+
+  // Idle containers to keep ready for new WebRTC sessions
+  int ac_pconn_pool_size;
+
+  // cgroup v2 group in which idle containers are frozen. If NULL, our
+  // own group is used
+  const char *ac_cgroup_root;
+
+  // Limits on simultaneous HTTP(S) connections for downloads, in
+  // total and to any one host. 0 means no limit
+  int ac_max_downloads, ac_max_host_downloads;
+
+  // App updates to run at once. 0 means no limit
+  int ac_max_updates;
+
   uint32_t ac_flags;
 
   uid_t ac_kite_user, ac_daemon_user;
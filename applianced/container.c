@@ -23,6 +23,15 @@
 #define OP_CONTAINER_TIMES_OUT EVT_CTL_CUSTOM
 #define OP_CONTAINER_CHECK_PERM (EVT_CTL_CUSTOM + 1)
 #define OP_CONTAINER_INIT_EXITS (EVT_CTL_CUSTOM + 2)
+#define OP_CONTAINER_POOL_REFILL (EVT_CTL_CUSTOM + 3)
+#define OP_CONTAINER_MEMORY_PRESSURE (EVT_CTL_CUSTOM + 4)
+#define OP_CONTAINER_THAW (EVT_CTL_CUSTOM + 5)
+
+// Flags that must match for a pool to serve a container. The others
+// only matter to the parent
+#define CONTAINER_POOL_FLAGS (CONTAINER_FLAG_NETWORK_ONLY | CONTAINER_FLAG_ENABLE_SCTP)
+
+#define CONTAINER_MAX_SPECIALIZE_SIZE (CONTAINER_MAX_SETUP_SIZE + 16 * 1024)
 
 struct containerchildinfo {
   struct container *cci_cont;
@@ -34,16 +43,46 @@ struct containerinit {
   struct in_addr ci_ip;
 };
 
+// Sent to a pooled container, to start it as another. Followed by
+// the hostname, init path, and cs_argc arguments, each NUL-terminated,
+// then cs_setup_sz bytes of setup description.
+struct containerspecialize {
+  uint32_t cs_argc;
+  uint32_t cs_setup_sz;
+  // The address of the container we start as
+  struct in_addr cs_ip;
+};
+
+struct pooledcontainer {
+  struct container      pco_container;
+  struct containerpool *pco_pool;
+  DLIST(struct pooledcontainer) pco_list;
+};
+
 struct containerwaiter {
   struct pssub cw_process;
   int          cw_init_comm;
   struct qdevtsub *cw_completion_evt;
+
+  // To remove the container's cgroup
+  struct brstate *cw_bridge;
+  int          cw_bridge_port;
 };
 
 static void containerevtfn(struct eventloop *el, int op, void *arg);
 static int containerpermfn(struct arpentry *ae, int op, void *arg, ssize_t sz);
 
 static int container_start_child(void *c_);
+static int containerpoolctl(struct container *c, int op, void *arg, ssize_t argl);
+static void container_pool_refill(struct eventloop *el, struct containerpool *cp);
+
+static void container_enter_cgroup(struct container *c, pid_t child);
+static void container_remove_cgroup(struct brstate *br, int port);
+static int container_can_freeze(struct container *c);
+static int container_freeze(struct container *c);
+static int container_thaw(struct container *c);
+static void container_thaw_on_traffic(struct container *c);
+static void container_freezer_evict(struct eventloop *el, struct containerfreezer *cf);
 
 static void ctrwaiterevtfn(struct eventloop *el, int op, void *arg);
 
@@ -58,6 +97,9 @@ void container_clear(struct container *c) {
   memset(c->c_mac, 0, sizeof(c->c_mac));
   c->c_control = NULL;
   c->c_running_refs = 0;
+  c->c_pool = NULL;
+  c->c_frozen = 0;
+  DLIST_ENTRY_CLEAR(&c->c_frozen_list);
 }
 
 int container_init(struct container *c, struct brstate *br, containerctlfn cfn, uint32_t flags, unsigned int keepalive) {
@@ -75,6 +117,7 @@ int container_init(struct container *c, struct brstate *br, containerctlfn cfn,
 
   pssub_init(&c->c_on_init_exit, OP_CONTAINER_INIT_EXITS, containerevtfn);
   timersub_init_default(&c->c_timeout, OP_CONTAINER_TIMES_OUT, containerevtfn);
+  qdevtsub_init(&c->c_thaw, OP_CONTAINER_THAW, containerevtfn);
 
   return 0;
 }
@@ -110,14 +153,19 @@ int container_ensure_running(struct container *c, struct eventloop *el) {
     if ( c->c_running_refs == 0 ) {
       eventloop_cancel_timer(el, &c->c_timeout);
 
+      if ( c->c_frozen && container_thaw(c) < 0 )
+        fprintf(stderr, "container_ensure_running: could not thaw container\n");
+
       if ( c->c_init_process < 0 ) {
         ret = container_start(c);
-        if ( ret >= 0 )
+        if ( ret >= 0 ) {
           c->c_running_refs++;
-      } else
+          ret = 1;
+        }
+      } else {
         c->c_running_refs++;
-
-      ret = 1;
+        ret = 1;
+      }
     } else
       c->c_running_refs++;
     pthread_mutex_unlock(&c->c_mutex);
@@ -135,6 +183,8 @@ int container_release_running(struct container *c, struct eventloop *el) {
     if ( c->c_running_refs == 0 ) {
       if ( c->c_flags & CONTAINER_FLAG_KILL_IMMEDIATELY ) {
         timersub_set_from_now(&c->c_timeout, 0);
+      } else if ( container_can_freeze(c) ) {
+        timersub_set_from_now(&c->c_timeout, CONTAINER_FREEZE_TIMEOUT);
       } else {
         timersub_set_from_now(&c->c_timeout, c->c_keepalive);
       }
@@ -158,6 +208,7 @@ static void ctrwaiterevtfn(struct eventloop *el, int op, void *arg) {
 
     fprintf(stderr, "Container exited with status %d\n", pe->pse_sts);
     close(cw->cw_init_comm);
+    container_remove_cgroup(cw->cw_bridge, cw->cw_bridge_port);
 
     if ( cw->cw_completion_evt )
       eventloop_queue(el, cw->cw_completion_evt);
@@ -174,7 +225,10 @@ static void ctrwaiterevtfn(struct eventloop *el, int op, void *arg) {
 static void containerevtfn(struct eventloop *el, int op, void *arg) {
   struct qdevent *te;
   struct psevent *pe;
+  struct fdevent *fde;
   struct container *c;
+  struct containerpool *cp;
+  struct containerfreezer *cf;
   struct brpermrequest *bpr;
 
   switch ( op ) {
@@ -183,8 +237,15 @@ static void containerevtfn(struct eventloop *el, int op, void *arg) {
     c = STRUCT_FROM_BASE(struct container, c_timeout, te->qde_timersub);
     if ( pthread_mutex_lock(&c->c_mutex) == 0 ) {
       if ( c->c_running_refs == 0 ) {
-        pthread_mutex_unlock(&c->c_mutex);
-        container_stop(c, el, NULL);
+        // Containers that can be frozen are kept around, until the
+        // memory is needed
+        if ( container_can_freeze(c) && c->c_init_process > 0 &&
+             container_freeze(c) == 0 ) {
+          pthread_mutex_unlock(&c->c_mutex);
+        } else {
+          pthread_mutex_unlock(&c->c_mutex);
+          container_stop(c, el, NULL);
+        }
       } else
         pthread_mutex_unlock(&c->c_mutex);
     }
@@ -206,12 +267,50 @@ static void containerevtfn(struct eventloop *el, int op, void *arg) {
     pe = (struct psevent *) arg;
     c = STRUCT_FROM_BASE(struct container, c_on_init_exit, pe->pse_sub);
 
+    if ( !(c->c_flags & CONTAINER_FLAG_POOLED) ) {
+      SAFE_MUTEX_LOCK(&c->c_mutex);
+      container_thaw(c);
+      pthread_mutex_unlock(&c->c_mutex);
+
+      container_remove_cgroup(c->c_bridge, c->c_bridge_port);
+    }
+
+    // Pooled containers may be freed here
     if ( c->c_control(c, CONTAINER_CTL_INIT_EXITS, NULL, pe->pse_sts) < 0 ) {
       fprintf(stderr, "containerevtfn: CONTAINER_CTL_INIT_EXITS fails\n");
     }
 
     return;
 
+  case OP_CONTAINER_MEMORY_PRESSURE:
+    fde = (struct fdevent *) arg;
+    cf = STRUCT_FROM_BASE(struct containerfreezer, cf_pressure_sub, fde->fde_sub);
+
+    if ( fde->fde_triggered & FD_SUB_ERROR ) {
+      fprintf(stderr, "containerevtfn: memory pressure trigger went away\n");
+      return;
+    }
+
+    if ( fde->fde_triggered & FD_SUB_PRIORITY )
+      container_freezer_evict(el, cf);
+
+    eventloop_subscribe_fd(el, cf->cf_pressure_fd, FD_SUB_PRIORITY, &cf->cf_pressure_sub);
+    return;
+
+  case OP_CONTAINER_POOL_REFILL:
+    te = (struct qdevent *) arg;
+    cp = STRUCT_FROM_BASE(struct containerpool, cp_refill, te->qde_sub);
+    container_pool_refill(el, cp);
+    return;
+
+  case OP_CONTAINER_THAW:
+    te = (struct qdevent *) arg;
+    c = STRUCT_FROM_BASE(struct container, c_thaw, te->qde_sub);
+    SAFE_MUTEX_LOCK(&c->c_mutex);
+    container_thaw_on_traffic(c);
+    pthread_mutex_unlock(&c->c_mutex);
+    return;
+
   default:
     fprintf(stderr, "containerevtfn: unknown op %d\n", op);
     return;
@@ -252,10 +351,11 @@ static int container_setup_sctp(struct container *c) {
   return ret;
 }
 
-int container_start(struct container *c) {
+// Clone the container's child, and wire it into the bridge. On
+// success, returns the child, and c->c_init_comm is set.
+static pid_t container_clone(struct container *c) {
   static const size_t child_stack_sz = 256 * 1024;
   int err, ipc_sockets[2] = { -1, -1 };
-  uint8_t sts;
   pid_t child = -1;
   struct containerinit ci_data;
   char *child_stack = NULL;
@@ -264,13 +364,13 @@ int container_start(struct container *c) {
 
   err = posix_memalign((void **)&child_stack, sysconf(_SC_PAGE_SIZE), child_stack_sz);
   if ( err != 0 ) {
-    fprintf(stderr, "container_start: could not allocate stack\n");
+    fprintf(stderr, "container_clone: could not allocate stack\n");
     return -1;
   }
 
   err = socketpair(AF_UNIX, SOCK_SEQPACKET, 0, ipc_sockets);
   if ( err < 0 ) {
-    perror("container_start: socketpair");
+    perror("container_clone: socketpair");
     goto error;
   }
 
@@ -290,12 +390,17 @@ int container_start(struct container *c) {
   child = clone(container_start_child, child_stack + child_stack_sz,
                      clone_flags, (void *) &cci);
   if ( child < 0 ) {
-      perror("container_start: clone");
-      close(ipc_sockets[1]);
-      close(ipc_sockets[0]);
-      return -1;
+      perror("container_clone: clone");
+      goto error;
   }
 
+  // The child has its own copy of the stack
+  free(child_stack);
+  child_stack = NULL;
+
+  // The child waits for ci_data, so nothing it starts escapes the group
+  container_enter_cgroup(c, child);
+
   close(ipc_sockets[1]);
   ipc_sockets[1] = -1;
 
@@ -304,16 +409,16 @@ int container_start(struct container *c) {
 
   err = send(ipc_sockets[0], &ci_data, sizeof(ci_data), 0);
   if ( err < 0 ) {
-    perror("container_start: send");
+    perror("container_clone: send");
     goto error;
   }
 
-  fprintf(stderr, "container_start: got child id %d... fetching arp\n", child);
+  fprintf(stderr, "container_clone: got child id %d... fetching arp\n", child);
 
   // Now receive the arp entry
   err = recv(ipc_sockets[0], &c->c_arp_entry, sizeof(c->c_arp_entry), 0);
   if ( err < 0 || err != sizeof(c->c_arp_entry) ) {
-    perror("container_start: recv(&c->c_arp_entry)");
+    perror("container_clone: recv(&c->c_arp_entry)");
     goto error;
   }
   c->c_arp_entry.ae_ctlfn = containerpermfn;
@@ -326,6 +431,22 @@ int container_start(struct container *c) {
 
   c->c_init_comm = ipc_sockets[0];
 
+  return child;
+
+ error:
+  if ( child_stack ) free(child_stack);
+  if ( ipc_sockets[0] >= 0 ) close(ipc_sockets[0]);
+  if ( ipc_sockets[1] >= 0 ) close(ipc_sockets[1]);
+  if ( child >= 0 )
+    kill(child, SIGKILL);
+  return -1;
+}
+
+// Wait for the init process of a cloned container to start
+static int container_finish_start(struct container *c, pid_t child) {
+  int err;
+  uint8_t sts;
+
   // Do any coordination with the setup program
   if ( c->c_control(c, CONTAINER_CTL_DO_HOST_SETUP, 0, 0) == -1 ) {
     fprintf(stderr, "container_start: host setup failed\n");
@@ -333,7 +454,7 @@ int container_start(struct container *c) {
   }
 
   // Finally... wait for init process to start
-  err = recv(ipc_sockets[0], &sts, 1, 0);
+  err = recv(c->c_init_comm, &sts, 1, 0);
   if ( err != 1 ) {
     perror("container_start: recv init status");
     goto error;
@@ -353,16 +474,215 @@ int container_start(struct container *c) {
   return 0;
 
  error:
-  close(ipc_sockets[0]);
-  close(ipc_sockets[1]);
-  if ( child >= 0 )
+  close(c->c_init_comm);
+  c->c_init_comm = -1;
+  c->c_init_process = -1;
+  kill(child, SIGKILL);
+  return -1;
+}
+
+int container_pack_string(char *buf, size_t buf_sz, size_t *ofs, const char *s) {
+  size_t sz = strlen(s) + 1;
+  if ( (buf_sz - *ofs) < sz ) return -1;
+
+  memcpy(buf + *ofs, s, sz);
+  *ofs += sz;
+  return 0;
+}
+
+const char *container_unpack_string(const char *buf, size_t buf_sz, size_t *ofs) {
+  const char *s = buf + *ofs, *end;
+  if ( *ofs >= buf_sz ) return NULL;
+
+  end = memchr(s, '\0', buf_sz - *ofs);
+  if ( !end ) return NULL;
+
+  *ofs += end - s + 1;
+  return s;
+}
+
+// Start c as an idle container from its pool. Returns 0 on success,
+// -1 on error, and 1 if c must be started without the pool.
+static int container_start_from_pool(struct container *c) {
+  struct containerpool *cp = c->c_pool;
+  struct pooledcontainer *pco;
+  struct container *idle;
+  struct eventloop *el = &c->c_bridge->br_appstate->as_eventloop;
+  struct containerspecialize cs;
+  const char *hostname_str = NULL, *init_path_str = NULL, *args[32];
+  char buf[CONTAINER_MAX_SPECIALIZE_SIZE];
+  size_t msg_sz = sizeof(cs);
+  ssize_t setup_sz = 0;
+  int err, i, argc = -1, ret = -1;
+  pid_t child;
+
+  if ( (c->c_flags & CONTAINER_POOL_FLAGS) != (cp->cp_flags & CONTAINER_POOL_FLAGS) ||
+       (cp->cp_control && cp->cp_control != c->c_control) )
+    return 1;
+
+  // Describe c to the pooled container
+  memset(buf, 0, sizeof(buf));
+
+  if ( c->c_control(c, CONTAINER_CTL_GET_HOSTNAME, (void *) &hostname_str, 0) < 0 ) {
+    fprintf(stderr, "container_start_from_pool: could not get host name\n");
+    goto release;
+  }
+
+  if ( c->c_control(c, CONTAINER_CTL_GET_INIT_PATH, (void *) &init_path_str, 0) < 0 ) {
+    fprintf(stderr, "container_start_from_pool: could not get init path\n");
+    goto release;
+  }
+
+  // The child needs room for argv[0] and the final NULL
+  argc = c->c_control(c, CONTAINER_CTL_GET_ARGS, (void *) args,
+                      (sizeof(args) / sizeof(args[0])) - 2);
+  if ( argc < 0 ) {
+    fprintf(stderr, "container_start_from_pool: could not get args\n");
+    goto release;
+  }
+
+  if ( container_pack_string(buf, sizeof(buf), &msg_sz, hostname_str) < 0 ||
+       container_pack_string(buf, sizeof(buf), &msg_sz, init_path_str) < 0 )
+    goto overflow;
+
+  for ( i = 0; i < argc; ++i ) {
+    if ( container_pack_string(buf, sizeof(buf), &msg_sz, args[i]) < 0 )
+      goto overflow;
+  }
+
+  if ( cp->cp_control ) {
+    setup_sz = c->c_control(c, CONTAINER_CTL_GET_SETUP, buf + msg_sz,
+                            sizeof(buf) - msg_sz);
+    if ( setup_sz < 0 ) {
+      fprintf(stderr, "container_start_from_pool: could not get setup description\n");
+      goto release;
+    }
+    msg_sz += setup_sz;
+  }
+
+  cs.cs_argc = argc;
+  cs.cs_setup_sz = setup_sz;
+  memcpy(&cs.cs_ip, &c->c_ip, sizeof(cs.cs_ip));
+  memcpy(buf, &cs, sizeof(cs));
+
+  ret = 0;
+  goto release;
+
+ overflow:
+  fprintf(stderr, "container_start_from_pool: container description is too large\n");
+  ret = 1;
+
+ release:
+  if ( hostname_str )
+    c->c_control(c, CONTAINER_CTL_RELEASE_HOSTNAME, (void *) hostname_str, 0);
+  if ( init_path_str )
+    c->c_control(c, CONTAINER_CTL_RELEASE_INIT_PATH, (void *) init_path_str, 0);
+  for ( i = 0; i < argc; ++i )
+    c->c_control(c, CONTAINER_CTL_RELEASE_ARG, (void *) args[i], i);
+
+  if ( ret != 0 ) return ret;
+
+  SAFE_MUTEX_LOCK(&cp->cp_mutex);
+  pco = cp->cp_idle.dh_first;
+  if ( pco ) {
+    DLIST_REMOVE(&cp->cp_idle, pco_list, pco);
+    cp->cp_count--;
+  }
+  pthread_mutex_unlock(&cp->cp_mutex);
+
+  // Whether or not we got one, the pool is short
+  eventloop_queue(el, &cp->cp_refill);
+
+  if ( !pco ) return 1;
+
+  idle = &pco->pco_container;
+  child = idle->c_init_process;
+
+  // pssub_detach fails only if the exit was already delivered. Then
+  // the exit event frees it, since it is no longer on cp_idle.
+  if ( pssub_detach(el, &idle->c_on_init_exit) < 0 ) {
+    fprintf(stderr, "container_start_from_pool: pooled container exited\n");
+    return 1;
+  }
+
+  // Take over the pooled container's port, but keep c's address,
+  // which others may already know. The port allocated for c is never
+  // used
+  err = bridge_del_arp(c->c_bridge, &idle->c_arp_entry);
+  if ( err < 0 ) {
+    fprintf(stderr, "container_start_from_pool: could not remove pooled arp entry\n");
+    // Its exit event frees it
+    SAFE_ASSERT( pssub_attach(el, &idle->c_on_init_exit, child) == 0 );
     kill(child, SIGKILL);
+    return 1;
+  }
+
+  c->c_bridge_port = idle->c_bridge_port;
+  memcpy(&c->c_arp_entry, &idle->c_arp_entry, sizeof(c->c_arp_entry));
+  c->c_arp_entry.ae_ctlfn = containerpermfn;
+  c->c_init_comm = idle->c_init_comm;
+
+  // The pooled child changes its own address once it gets buf
+  err = bridge_readdress_port(c->c_bridge, c->c_bridge_port, &idle->c_ip, &c->c_ip);
+
+  container_release(idle);
+  free(pco);
+
+  if ( err < 0 ) {
+    // The port's rules still name the pooled address, as does c_arp_entry
+    fprintf(stderr, "container_start_from_pool: could not readdress pooled container\n");
+    goto error;
+  }
+  memcpy(&c->c_arp_entry.ae_ip, &c->c_ip, sizeof(c->c_arp_entry.ae_ip));
+
+  fprintf(stderr, "container_start_from_pool: using pooled container %d\n", child);
+
+  err = bridge_add_arp(c->c_bridge, &c->c_arp_entry);
+  if ( err < 0 ) {
+    fprintf(stderr, "container_start_from_pool: bridge_add_arp failed\n");
+    goto error;
+  }
+
+  err = send(c->c_init_comm, buf, msg_sz, 0);
+  if ( err < 0 ) {
+    perror("container_start_from_pool: send");
+    goto error;
+  }
+
+  if ( container_finish_start(c, child) < 0 ) {
+    bridge_disconnect_port(c->c_bridge, c->c_bridge_port, &c->c_arp_entry);
+    return -1;
+  }
+
+  return 0;
+
+ error:
+  kill(child, SIGKILL);
+  bridge_disconnect_port(c->c_bridge, c->c_bridge_port, &c->c_arp_entry);
+  close(c->c_init_comm);
+  c->c_init_comm = -1;
   return -1;
 }
 
+int container_start(struct container *c) {
+  pid_t child;
+  int err;
+
+  if ( c->c_pool ) {
+    err = container_start_from_pool(c);
+    if ( err <= 0 ) return err;
+  }
+
+  child = container_clone(c);
+  if ( child < 0 ) return -1;
+
+  return container_finish_start(c, child);
+}
+
 int container_force_stop(struct container *c) {
   int err = 0;
   SAFE_MUTEX_LOCK(&c->c_mutex);
+  container_thaw(c);
   if ( c->c_init_process > 0 ) {
     SAFE_ASSERT( pssub_detach(&c->c_bridge->br_appstate->as_eventloop, &c->c_on_init_exit) == 0 );
 
@@ -388,6 +708,10 @@ int container_stop(struct container *c, struct eventloop *el, struct qdevtsub *c
   fprintf(stderr, "container_stop: stopping\n");
 
   SAFE_MUTEX_LOCK(&c->c_mutex);
+  // A frozen init could not handle SIGTERM
+  if ( container_thaw(c) < 0 )
+    fprintf(stderr, "container_stop: could not thaw container\n");
+
   // Refresh the IP address for the container
   //bridge_allocate(c->c_bridge, &c->c_ip, &c->c_bridge_port);
 
@@ -418,6 +742,8 @@ int container_stop(struct container *c, struct eventloop *el, struct qdevtsub *c
   } else {
     waiter->cw_init_comm = c->c_init_comm;
     waiter->cw_completion_evt = comp_event;
+    waiter->cw_bridge = c->c_bridge;
+    waiter->cw_bridge_port = port;
 
     pssub_init(&waiter->cw_process, OP_CONTAINER_WAITER_COMPLETE, ctrwaiterevtfn);
     err = pssub_detach_attach(el, &c->c_on_init_exit, &waiter->cw_process, c->c_init_process);
@@ -446,10 +772,70 @@ int container_stop(struct container *c, struct eventloop *el, struct qdevtsub *c
   return ret;
 }
 
+// Called in a pooled child. Wait for container_start_from_pool, and
+// fill in the description of the container we are being started as
+static int container_wait_specialize(struct container *c, char *buf, size_t buf_sz,
+                                     const char **hostname_str, const char **init_path_str,
+                                     const char **argv, int max_args,
+                                     const char **setup, size_t *setup_sz,
+                                     struct in_addr *ip) {
+  struct containerspecialize cs;
+  size_t ofs = sizeof(cs);
+  ssize_t err;
+  uint32_t i;
+
+  // Nothing else will tell us if applianced goes away
+  err = prctl(PR_SET_PDEATHSIG, SIGKILL);
+  if ( err < 0 ) {
+    perror("container_wait_specialize: prctl");
+    return -1;
+  }
+
+  err = recv(c->c_init_comm, buf, buf_sz, 0);
+  if ( err < 0 ) {
+    perror("container_wait_specialize: recv");
+    return -1;
+  }
+
+  if ( err < sizeof(cs) ) {
+    fprintf(stderr, "container_wait_specialize: no container description\n");
+    return -1;
+  }
+  buf_sz = err;
+
+  memcpy(&cs, buf, sizeof(cs));
+  if ( cs.cs_argc > max_args ) {
+    fprintf(stderr, "container_wait_specialize: too many arguments\n");
+    return -1;
+  }
+
+  *hostname_str = container_unpack_string(buf, buf_sz, &ofs);
+  *init_path_str = container_unpack_string(buf, buf_sz, &ofs);
+  if ( !*hostname_str || !*init_path_str ) goto malformed;
+
+  for ( i = 0; i < cs.cs_argc; ++i ) {
+    argv[i] = container_unpack_string(buf, buf_sz, &ofs);
+    if ( !argv[i] ) goto malformed;
+  }
+
+  if ( (buf_sz - ofs) != cs.cs_setup_sz ) goto malformed;
+
+  *setup = buf + ofs;
+  *setup_sz = cs.cs_setup_sz;
+  memcpy(ip, &cs.cs_ip, sizeof(*ip));
+
+  return cs.cs_argc;
+
+ malformed:
+  fprintf(stderr, "container_wait_specialize: malformed container description\n");
+  return -1;
+}
+
 // Called in the child
 static int container_start_child(void *c_) {
   struct containerchildinfo *cci = (struct containerchildinfo *) c_;
   struct container *c = cci->cci_cont;
+  struct containerpool *cp = NULL;
   int err, argc;
   struct containerinit ci;
 
@@ -457,11 +843,19 @@ static int container_start_child(void *c_) {
 
   const char *argv[32];
 
+  // Only for pooled containers
+  char specialize_buf[CONTAINER_MAX_SPECIALIZE_SIZE];
+  const char *setup = NULL;
+  size_t setup_sz = 0;
+
   struct arpentry arp_entry;
 
   c->c_init_comm = cci->cci_comm;
   memset(argv, 0, sizeof(argv));
 
+  if ( c->c_flags & CONTAINER_FLAG_POOLED )
+    cp = STRUCT_FROM_BASE(struct pooledcontainer, pco_container, c)->pco_pool;
+
   fprintf(stderr, "container_start_child: starting: %d\n", getpid());
 
   // Receive the setup data on this socket
@@ -471,48 +865,27 @@ static int container_start_child(void *c_) {
     return 1;
   }
 
-  // Get information
-  err = c->c_control(c, CONTAINER_CTL_GET_HOSTNAME, (void *) &hostname_str, 0);
-  if ( err < 0 ) {
-    fprintf(stderr, "Could not get host name\n");
-    return 1;
-  }
-
-  err = c->c_control(c, CONTAINER_CTL_GET_INIT_PATH, (void *) &init_path_str, 0);
-  if ( err < 0 ) {
-    fprintf(stderr, "Could not get init path\n");
-    return 1;
-  }
-
-  fprintf(stderr, "Launching container with init %s\n", init_path_str);
-
-  argv[0] = "init";
-  argc = c->c_control(c, CONTAINER_CTL_GET_ARGS, (void *) (argv + 1),
-                      (sizeof(argv)/sizeof(argv[0])) - 2);
-  if ( argc < 0 ) {
-    fprintf(stderr, "Could not get args\n");
-    return 1;
-  }
-  argc += 1;
-
-  if ( (argc + 1) < (sizeof(argv) / sizeof(argv[0])) )
-    argv[argc + 1] = NULL;
-  else
-    argv[sizeof(argv)/sizeof(argv[0]) - 1] = NULL;
-
-  // Set hostname
-  fprintf(stderr, "sethostname: %p %s\n", hostname_str, hostname_str);
+  // Pooled containers don't know what they are yet
+  if ( !cp ) {
+    // Get information
+    err = c->c_control(c, CONTAINER_CTL_GET_HOSTNAME, (void *) &hostname_str, 0);
+    if ( err < 0 ) {
+      fprintf(stderr, "Could not get host name\n");
+      return 1;
+    }
 
-  err = sethostname(hostname_str, strlen(hostname_str));
-  if ( err < 0 ) {
-    perror("container_start_child: sethostname");
-    return 1;
-  }
+    err = c->c_control(c, CONTAINER_CTL_GET_INIT_PATH, (void *) &init_path_str, 0);
+    if ( err < 0 ) {
+      fprintf(stderr, "Could not get init path\n");
+      return 1;
+    }
 
-  err = setdomainname("kite", 4);
-  if ( err < 0 ) {
-    perror("container_start_child: setdomainname");
-    return 1;
+    argc = c->c_control(c, CONTAINER_CTL_GET_ARGS, (void *) (argv + 1),
+                        (sizeof(argv)/sizeof(argv[0])) - 2);
+    if ( argc < 0 ) {
+      fprintf(stderr, "Could not get args\n");
+      return 1;
+    }
   }
 
   err = bridge_setup_container(c->c_bridge, c->c_bridge_port, &c->c_ip, "eth0", &arp_entry);
@@ -560,8 +933,55 @@ static int container_start_child(void *c_) {
     }
   }
 
+  if ( cp ) {
+    struct in_addr new_ip;
+
+    argc = container_wait_specialize(c, specialize_buf, sizeof(specialize_buf),
+                                     &hostname_str, &init_path_str,
+                                     argv + 1, (sizeof(argv)/sizeof(argv[0])) - 2,
+                                     &setup, &setup_sz, &new_ip);
+    if ( argc < 0 ) return 1;
+
+    if ( bridge_readdress_container(c->c_bridge, "eth0", &c->c_ip, &new_ip) < 0 ) {
+      fprintf(stderr, "container_start_child: could not take container address\n");
+      return 1;
+    }
+    memcpy(&c->c_ip, &new_ip, sizeof(c->c_ip));
+  }
+
+  fprintf(stderr, "Launching container with init %s\n", init_path_str);
+
+  argv[0] = "init";
+  argc += 1;
+
+  if ( (argc + 1) < (sizeof(argv) / sizeof(argv[0])) )
+    argv[argc + 1] = NULL;
+  else
+    argv[sizeof(argv)/sizeof(argv[0]) - 1] = NULL;
+
+  // Set hostname
+  fprintf(stderr, "sethostname: %p %s\n", hostname_str, hostname_str);
+
+  err = sethostname(hostname_str, strlen(hostname_str));
+  if ( err < 0 ) {
+    perror("container_start_child: sethostname");
+    return 1;
+  }
+
+  err = setdomainname("kite", 4);
+  if ( err < 0 ) {
+    perror("container_start_child: setdomainname");
+    return 1;
+  }
+
   // Now run container setup
-  if ( c->c_control(c, CONTAINER_CTL_DO_SETUP, 0, 0) == -1 ) {
+  if ( cp ) {
+    if ( cp->cp_control &&
+         cp->cp_control(c, CONTAINER_CTL_DO_SETUP, (void *) setup, setup_sz) == -1 ) {
+      fprintf(stderr, "Container setup failed\n");
+      return EXIT_FAILURE;
+    }
+  } else if ( c->c_control(c, CONTAINER_CTL_DO_SETUP, 0, 0) == -1 ) {
     fprintf(stderr, "Container setup failed\n");
     return EXIT_FAILURE;
   }
@@ -657,6 +1077,159 @@ int container_mod_host_entry(struct container *c, int direction,
   }
 }
 
+int container_mod_address(struct container *c, int direction,
+                          struct in_addr *addr, uint16_t port) {
+  int err;
+  struct stkinitmsg msg;
+
+  msg.sim_req = STK_REQ_MOD_ADDR;
+  msg.sim_flags = 0;
+  msg.un.modaddr.dir = direction == 0 ? 0 : (direction / abs(direction));
+  memcpy(&msg.un.modaddr.addr, addr, sizeof(msg.un.modaddr.addr));
+  msg.un.modaddr.port = port;
+
+  if ( pthread_mutex_lock(&c->c_mutex) == 0 ) {
+    int sts;
+
+    if ( c->c_init_comm < 0 ) {
+      pthread_mutex_unlock(&c->c_mutex);
+      return -1;
+    }
+
+    // The init process may have exited
+    err = send(c->c_init_comm, &msg, sizeof(msg), MSG_NOSIGNAL);
+    if ( err < 0 ) {
+      perror("container_mod_address: send");
+      pthread_mutex_unlock(&c->c_mutex);
+      return -1;
+    }
+
+    err = recv(c->c_init_comm, &sts, sizeof(sts), 0);
+    if ( err < 0 ) {
+      perror("container_mod_address: recv");
+      pthread_mutex_unlock(&c->c_mutex);
+      return -1;
+    }
+
+    if ( err != sizeof(sts) ) {
+      fprintf(stderr, "container_mod_address: did not receive enough in response\n");
+      sts = -100;
+    }
+
+    pthread_mutex_unlock(&c->c_mutex);
+    return sts;
+  } else {
+    fprintf(stderr, "container_mod_address: could not lock mutex\n");
+    return -1;
+  }
+}
+
+int container_get_health(struct container *c, struct stkhealth *health) {
+  struct stkinitmsg msg;
+  int err;
+
+  msg.sim_req = STK_REQ_HEALTH;
+  msg.sim_flags = 0;
+
+  if ( pthread_mutex_lock(&c->c_mutex) == 0 ) {
+    // A frozen init would never answer
+    if ( c->c_init_comm < 0 || c->c_init_process < 0 || c->c_frozen ) {
+      pthread_mutex_unlock(&c->c_mutex);
+      return -1;
+    }
+
+    err = send(c->c_init_comm, &msg, sizeof(msg), MSG_NOSIGNAL);
+    if ( err < 0 ) {
+      perror("container_get_health: send");
+      pthread_mutex_unlock(&c->c_mutex);
+      return -1;
+    }
+
+    err = recv(c->c_init_comm, health, sizeof(*health), 0);
+    pthread_mutex_unlock(&c->c_mutex);
+
+    if ( err < 0 ) {
+      perror("container_get_health: recv");
+      return -1;
+    }
+
+    if ( err != sizeof(*health) ) {
+      fprintf(stderr, "container_get_health: did not receive enough in response\n");
+      return -1;
+    }
+
+    return 0;
+  } else {
+    fprintf(stderr, "container_get_health: could not lock mutex\n");
+    return -1;
+  }
+}
+
+int container_add_alias(struct container *c, struct container *host, uint16_t port) {
+  int err;
+
+  if ( pthread_mutex_lock(&host->c_mutex) == 0 ) {
+    if ( host->c_init_process < 0 ) {
+      pthread_mutex_unlock(&host->c_mutex);
+      fprintf(stderr, "container_add_alias: host is not running\n");
+      return -1;
+    }
+
+    memcpy(c->c_arp_entry.ae_mac, host->c_arp_entry.ae_mac, ETH_ALEN);
+    pthread_mutex_unlock(&host->c_mutex);
+  } else
+    return -1;
+
+  memcpy(&c->c_arp_entry.ae_ip, &c->c_ip, sizeof(c->c_arp_entry.ae_ip));
+  c->c_arp_entry.ae_ctlfn = containerpermfn;
+
+  err = bridge_add_arp(c->c_bridge, &c->c_arp_entry);
+  if ( err < 0 ) {
+    fprintf(stderr, "container_add_alias: bridge_add_arp failed\n");
+    return -1;
+  }
+
+  err = bridge_add_alias(c->c_bridge, host->c_bridge_port, &c->c_ip);
+  if ( err < 0 ) {
+    fprintf(stderr, "container_add_alias: bridge_add_alias failed\n");
+    goto error;
+  }
+
+  err = container_mod_address(host, 1, &c->c_ip, port);
+  if ( err != 0 ) {
+    fprintf(stderr, "container_add_alias: could not add address to host: %d\n", err);
+    bridge_del_alias(c->c_bridge, host->c_bridge_port, &c->c_ip);
+    goto error;
+  }
+
+  return 0;
+
+ error:
+  bridge_del_arp(c->c_bridge, &c->c_arp_entry);
+  return -1;
+}
+
+int container_del_alias(struct container *c, struct container *host) {
+  int ret = 0;
+
+  // The host may have exited already, in which case the address went
+  // with it
+  if ( container_mod_address(host, -1, &c->c_ip, 0) != 0 ) {
+    fprintf(stderr, "container_del_alias: could not remove address from host\n");
+    ret = -1;
+  }
+
+  if ( bridge_del_alias(c->c_bridge, host->c_bridge_port, &c->c_ip) < 0 ) {
+    fprintf(stderr, "container_del_alias: bridge_del_alias failed\n");
+    ret = -1;
+  }
+
+  if ( bridge_del_arp(c->c_bridge, &c->c_arp_entry) < 0 )
+    ret = -1;
+
+  return ret;
+}
+
 int container_execute(struct container *c, uint32_t exec_flags, const char *path,
                       const char **argv, const char **envv) {
   struct containerexecinfo info;
@@ -891,8 +1464,464 @@ static int containerpermfn(struct arpentry *ae, int op, void * arg, ssize_t argl
   case ARP_ENTRY_DESCRIBE:
     return c->c_control(c, CONTAINER_CTL_DESCRIBE, arg, argl);
 
+  case ARP_ENTRY_TRAFFIC:
+    // Don't wait for c_mutex, since container_ensure_running holds it
+    // while adding arp entries. If it is busy, thaw from the event
+    // loop instead.
+    if ( c->c_frozen ) {
+      if ( pthread_mutex_trylock(&c->c_mutex) == 0 ) {
+        container_thaw_on_traffic(c);
+        pthread_mutex_unlock(&c->c_mutex);
+      } else
+        eventloop_queue(&c->c_bridge->br_appstate->as_eventloop, &c->c_thaw);
+    }
+    return 0;
+
   default:
     fprintf(stderr, "containerpermfn: unknown op %d\n", op);
     return -2;
   }
 }
+
+// Container pools
+
+void container_pool_clear(struct containerpool *cp) {
+  cp->cp_bridge = NULL;
+  cp->cp_flags = 0;
+  cp->cp_control = NULL;
+  cp->cp_size = cp->cp_max = cp->cp_count = 0;
+  DLIST_INIT(&cp->cp_idle);
+}
+
+int container_pool_init(struct containerpool *cp, struct brstate *br, uint32_t flags,
+                        containerctlfn cfn, int max) {
+  container_pool_clear(cp);
+
+  if ( pthread_mutex_init(&cp->cp_mutex, NULL) != 0 )
+    return -1;
+
+  cp->cp_bridge = br;
+  cp->cp_flags = flags & CONTAINER_POOL_FLAGS;
+  cp->cp_control = cfn;
+  cp->cp_max = max > CONTAINER_POOL_MAX ? CONTAINER_POOL_MAX : max;
+
+  qdevtsub_init(&cp->cp_refill, OP_CONTAINER_POOL_REFILL, containerevtfn);
+
+  return 0;
+}
+
+// cp_mutex must be held
+static int container_pool_target(struct containerpool *cp) {
+  return cp->cp_size < cp->cp_max ? cp->cp_size : cp->cp_max;
+}
+
+// cp_mutex must be held
+static void container_pool_retire(struct containerpool *cp, struct pooledcontainer *pco) {
+  DLIST_REMOVE(&cp->cp_idle, pco_list, pco);
+  cp->cp_count--;
+
+  // The exit event frees it
+  if ( kill(pco->pco_container.c_init_process, SIGKILL) < 0 )
+    perror("container_pool_retire: kill");
+}
+
+void container_pool_release(struct containerpool *cp) {
+  if ( cp->cp_bridge ) {
+    SAFE_MUTEX_LOCK(&cp->cp_mutex);
+    cp->cp_size = cp->cp_max = 0;
+    while ( cp->cp_idle.dh_first )
+      container_pool_retire(cp, cp->cp_idle.dh_first);
+    pthread_mutex_unlock(&cp->cp_mutex);
+
+    pthread_mutex_destroy(&cp->cp_mutex);
+    cp->cp_bridge = NULL;
+  }
+}
+
+void container_pool_resize(struct containerpool *cp, int delta) {
+  int target, grow;
+
+  SAFE_MUTEX_LOCK(&cp->cp_mutex);
+  cp->cp_size += delta;
+  if ( cp->cp_size < 0 ) cp->cp_size = 0;
+
+  target = container_pool_target(cp);
+  while ( cp->cp_count > target && cp->cp_idle.dh_first )
+    container_pool_retire(cp, cp->cp_idle.dh_first);
+
+  grow = cp->cp_count < target;
+  pthread_mutex_unlock(&cp->cp_mutex);
+
+  if ( grow )
+    eventloop_queue(&cp->cp_bridge->br_appstate->as_eventloop, &cp->cp_refill);
+}
+
+// Create one idle container, and queue ourselves again if the pool is
+// still short. Containers are created one at a time, so that other
+// events get a turn.
+static void container_pool_refill(struct eventloop *el, struct containerpool *cp) {
+  struct pooledcontainer *pco;
+  struct container *c;
+  pid_t child;
+  int need;
+
+  SAFE_MUTEX_LOCK(&cp->cp_mutex);
+  need = cp->cp_count < container_pool_target(cp);
+  if ( need ) cp->cp_count++;
+  pthread_mutex_unlock(&cp->cp_mutex);
+
+  if ( !need ) return;
+
+  pco = malloc(sizeof(*pco));
+  if ( !pco ) {
+    fprintf(stderr, "container_pool_refill: out of memory\n");
+    goto error;
+  }
+
+  c = &pco->pco_container;
+  if ( container_init(c, cp->cp_bridge, containerpoolctl,
+                      cp->cp_flags | CONTAINER_FLAG_POOLED, 0) < 0 ) {
+    fprintf(stderr, "container_pool_refill: could not initialize container\n");
+    free(pco);
+    goto error;
+  }
+
+  pco->pco_pool = cp;
+  DLIST_ENTRY_CLEAR(&pco->pco_list);
+
+  child = container_clone(c);
+  if ( child < 0 ) {
+    fprintf(stderr, "container_pool_refill: could not create container\n");
+    container_release(c);
+    free(pco);
+    goto error;
+  }
+
+  c->c_init_process = child;
+  SAFE_ASSERT( pssub_attach(el, &c->c_on_init_exit, child) == 0 );
+
+  SAFE_MUTEX_LOCK(&cp->cp_mutex);
+  DLIST_INSERT(&cp->cp_idle, pco_list, pco);
+  need = cp->cp_count < container_pool_target(cp);
+  pthread_mutex_unlock(&cp->cp_mutex);
+
+  if ( need )
+    eventloop_queue(el, &cp->cp_refill);
+
+  return;
+
+ error:
+  // The next container start from this pool tries again
+  SAFE_MUTEX_LOCK(&cp->cp_mutex);
+  cp->cp_count--;
+  pthread_mutex_unlock(&cp->cp_mutex);
+}
+
+static int containerpoolctl(struct container *c, int op, void *arg, ssize_t argl) {
+  struct pooledcontainer *pco = STRUCT_FROM_BASE(struct pooledcontainer, pco_container, c);
+  struct containerpool *cp = pco->pco_pool;
+
+  switch ( op ) {
+  case CONTAINER_CTL_DESCRIBE:
+  case CONTAINER_CTL_CHECK_PERMISSION:
+    // Idle containers have nothing running that could ask
+    return -1;
+
+  case CONTAINER_CTL_INIT_EXITS:
+    fprintf(stderr, "containerpoolctl: pooled container exits with %zd\n", argl);
+
+    SAFE_MUTEX_LOCK(&cp->cp_mutex);
+    if ( DLIST_ENTRY_IN_LIST(&cp->cp_idle, pco_list, pco) ) {
+      DLIST_REMOVE(&cp->cp_idle, pco_list, pco);
+      cp->cp_count--;
+    }
+    pthread_mutex_unlock(&cp->cp_mutex);
+
+    bridge_disconnect_port(c->c_bridge, c->c_bridge_port, &c->c_arp_entry);
+    container_remove_cgroup(c->c_bridge, c->c_bridge_port);
+    close(c->c_init_comm);
+    container_release(c);
+    free(pco);
+    return 0;
+
+  default:
+    fprintf(stderr, "containerpoolctl: unrecognized op %d\n", op);
+    return -2;
+  }
+}
+
+// Freezing idle containers
+
+static int container_cgroup_path(struct containerfreezer *cf, int port, const char *file,
+                                 char *path, size_t path_sz) {
+  int err;
+
+  if ( file )
+    err = snprintf(path, path_sz, "%s/kite-container-%d/%s", cf->cf_cgroup_root, port, file);
+  else
+    err = snprintf(path, path_sz, "%s/kite-container-%d", cf->cf_cgroup_root, port);
+
+  if ( err >= path_sz ) {
+    fprintf(stderr, "container_cgroup_path: path overflow\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+static int container_write_cgroup(struct containerfreezer *cf, int port, const char *file,
+                                  const char *value) {
+  char path[PATH_MAX];
+  int fd, err;
+
+  if ( container_cgroup_path(cf, port, file, path, sizeof(path)) < 0 )
+    return -1;
+
+  fd = open(path, O_WRONLY | O_CLOEXEC);
+  if ( fd < 0 ) {
+    perror("container_write_cgroup: open");
+    fprintf(stderr, "container_write_cgroup: while opening %s\n", path);
+    return -1;
+  }
+
+  err = write(fd, value, strlen(value));
+  if ( err < 0 ) {
+    perror("container_write_cgroup: write");
+    fprintf(stderr, "container_write_cgroup: while writing %s\n", path);
+  }
+
+  close(fd);
+  return err < 0 ? -1 : 0;
+}
+
+static void container_enter_cgroup(struct container *c, pid_t child) {
+  struct containerfreezer *cf = &c->c_bridge->br_appstate->as_freezer;
+  char path[PATH_MAX], pid_str[32];
+
+  if ( !cf->cf_cgroup_root ) return;
+
+  if ( container_cgroup_path(cf, c->c_bridge_port, NULL, path, sizeof(path)) < 0 )
+    return;
+
+  // A restarted container reuses its group
+  if ( mkdir(path, 0755) < 0 && errno != EEXIST ) {
+    perror("container_enter_cgroup: mkdir");
+    fprintf(stderr, "container_enter_cgroup: while making %s\n", path);
+    return;
+  }
+
+  snprintf(pid_str, sizeof(pid_str), "%d", child);
+  if ( container_write_cgroup(cf, c->c_bridge_port, "cgroup.procs", pid_str) < 0 )
+    fprintf(stderr, "container_enter_cgroup: container %d will not be frozen\n", child);
+}
+
+static void container_remove_cgroup(struct brstate *br, int port) {
+  struct containerfreezer *cf = &br->br_appstate->as_freezer;
+  char path[PATH_MAX];
+
+  if ( !cf->cf_cgroup_root ) return;
+
+  if ( container_cgroup_path(cf, port, NULL, path, sizeof(path)) < 0 )
+    return;
+
+  if ( rmdir(path) < 0 && errno != ENOENT ) {
+    perror("container_remove_cgroup: rmdir");
+    fprintf(stderr, "container_remove_cgroup: while removing %s\n", path);
+  }
+}
+
+static int container_can_freeze(struct container *c) {
+  return c->c_bridge->br_appstate->as_freezer.cf_cgroup_root &&
+    !(c->c_flags & CONTAINER_FLAG_KILL_IMMEDIATELY) &&
+    c->c_keepalive > CONTAINER_FREEZE_TIMEOUT;
+}
+
+// c_mutex must be held
+static int container_freeze(struct container *c) {
+  struct containerfreezer *cf = &c->c_bridge->br_appstate->as_freezer;
+
+  if ( c->c_frozen ) return 0;
+
+  if ( container_write_cgroup(cf, c->c_bridge_port, "cgroup.freeze", "1") < 0 )
+    return -1;
+
+  fprintf(stderr, "container_freeze: froze container %d\n", c->c_init_process);
+
+  c->c_frozen = 1;
+
+  SAFE_MUTEX_LOCK(&cf->cf_mutex);
+  DLIST_INSERT(&cf->cf_frozen, c_frozen_list, c);
+  pthread_mutex_unlock(&cf->cf_mutex);
+
+  return 0;
+}
+
+// c_mutex must be held
+static int container_thaw(struct container *c) {
+  struct containerfreezer *cf = &c->c_bridge->br_appstate->as_freezer;
+
+  if ( !c->c_frozen ) return 0;
+
+  SAFE_MUTEX_LOCK(&cf->cf_mutex);
+  if ( DLIST_ENTRY_IN_LIST(&cf->cf_frozen, c_frozen_list, c) )
+    DLIST_REMOVE(&cf->cf_frozen, c_frozen_list, c);
+  pthread_mutex_unlock(&cf->cf_mutex);
+
+  c->c_frozen = 0;
+
+  return container_write_cgroup(cf, c->c_bridge_port, "cgroup.freeze", "0");
+}
+
+// c_mutex must be held
+static void container_thaw_on_traffic(struct container *c) {
+  if ( c->c_frozen && container_thaw(c) == 0 && c->c_running_refs == 0 ) {
+    // Freeze again if the traffic stops
+    struct eventloop *el = &c->c_bridge->br_appstate->as_eventloop;
+    eventloop_cancel_timer(el, &c->c_timeout);
+    timersub_set_from_now(&c->c_timeout, CONTAINER_FREEZE_TIMEOUT);
+    eventloop_subscribe_timer(el, &c->c_timeout);
+  }
+}
+
+// Stop the least recently frozen container we can lock
+static void container_freezer_evict(struct eventloop *el, struct containerfreezer *cf) {
+  struct container *c, *next, *victim = NULL;
+
+  // Containers are locked before cf_mutex everywhere else
+  SAFE_MUTEX_LOCK(&cf->cf_mutex);
+  DLIST_ITER(&cf->cf_frozen, c_frozen_list, c, next) {
+    if ( pthread_mutex_trylock(&c->c_mutex) == 0 ) {
+      DLIST_REMOVE(&cf->cf_frozen, c_frozen_list, c);
+      victim = c;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&cf->cf_mutex);
+
+  if ( !victim ) return;
+
+  fprintf(stderr, "container_freezer_evict: memory pressure, stopping container %d\n",
+          victim->c_init_process);
+
+  // container_stop thaws it
+  pthread_mutex_unlock(&victim->c_mutex);
+  container_stop(victim, el, NULL);
+}
+
+static int container_freezer_find_cgroup(char *path, size_t path_sz) {
+  char line[PATH_MAX];
+  FILE *f;
+  int ret = -1;
+
+  f = fopen("/proc/self/cgroup", "rt");
+  if ( !f ) {
+    perror("container_freezer_find_cgroup: fopen /proc/self/cgroup");
+    return -1;
+  }
+
+  while ( fgets(line, sizeof(line), f) ) {
+    // The cgroup v2 hierarchy has the id 0, and no controllers
+    if ( strncmp(line, "0::", 3) == 0 ) {
+      line[strcspn(line, "\n")] = '\0';
+      if ( snprintf(path, path_sz, "/sys/fs/cgroup%s", line + 3) < path_sz )
+        ret = 0;
+      break;
+    }
+  }
+
+  fclose(f);
+  return ret;
+}
+
+static int container_freezer_open_pressure(const char *path) {
+  int fd, err;
+
+  fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+  if ( fd < 0 ) {
+    perror("container_freezer_open_pressure: open");
+    fprintf(stderr, "container_freezer_open_pressure: while opening %s\n", path);
+    return -1;
+  }
+
+  // The trigger is written with its terminating NUL
+  err = write(fd, CONTAINER_PRESSURE_TRIGGER, sizeof(CONTAINER_PRESSURE_TRIGGER));
+  if ( err < 0 ) {
+    perror("container_freezer_open_pressure: write");
+    fprintf(stderr, "container_freezer_open_pressure: could not set trigger on %s\n", path);
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+void container_freezer_clear(struct containerfreezer *cf) {
+  cf->cf_cgroup_root = NULL;
+  cf->cf_pressure_fd = -1;
+  DLIST_INIT(&cf->cf_frozen);
+  fdsub_clear(&cf->cf_pressure_sub);
+}
+
+int container_freezer_init(struct containerfreezer *cf, struct eventloop *el,
+                           const char *cgroup_root) {
+  char path[PATH_MAX], root[PATH_MAX];
+
+  container_freezer_clear(cf);
+
+  if ( pthread_mutex_init(&cf->cf_mutex, NULL) != 0 )
+    return -1;
+
+  if ( cgroup_root ) {
+    strncpy_fixed(root, sizeof(root), cgroup_root, strlen(cgroup_root));
+  } else if ( container_freezer_find_cgroup(root, sizeof(root)) < 0 ) {
+    fprintf(stderr, "container_freezer_init: not in a cgroup v2 hierarchy, idle containers will not be frozen\n");
+    return 0;
+  }
+
+  if ( snprintf(path, sizeof(path), "%s/cgroup.controllers", root) >= sizeof(path) ||
+       access(path, F_OK) < 0 || access(root, W_OK) < 0 ) {
+    fprintf(stderr, "container_freezer_init: %s is not a cgroup v2 group we can write, idle containers will not be frozen\n",
+            root);
+    return 0;
+  }
+
+  // Frozen containers are never stopped without a pressure trigger,
+  // so we need one. Prefer our own group's pressure
+  if ( snprintf(path, sizeof(path), "%s/memory.pressure", root) < sizeof(path) )
+    cf->cf_pressure_fd = container_freezer_open_pressure(path);
+  if ( cf->cf_pressure_fd < 0 )
+    cf->cf_pressure_fd = container_freezer_open_pressure("/proc/pressure/memory");
+  if ( cf->cf_pressure_fd < 0 ) {
+    fprintf(stderr, "container_freezer_init: cannot watch memory pressure, idle containers will not be frozen\n");
+    return 0;
+  }
+
+  cf->cf_cgroup_root = strdup(root);
+  if ( !cf->cf_cgroup_root ) {
+    fprintf(stderr, "container_freezer_init: out of memory\n");
+    close(cf->cf_pressure_fd);
+    cf->cf_pressure_fd = -1;
+    return -1;
+  }
+
+  fdsub_init(&cf->cf_pressure_sub, el, cf->cf_pressure_fd, OP_CONTAINER_MEMORY_PRESSURE, containerevtfn);
+  eventloop_subscribe_fd(el, cf->cf_pressure_fd, FD_SUB_PRIORITY, &cf->cf_pressure_sub);
+
+  fprintf(stderr, "Freezing idle containers in %s\n", cf->cf_cgroup_root);
+
+  return 0;
+}
+
+void container_freezer_release(struct containerfreezer *cf, struct eventloop *el) {
+  if ( cf->cf_pressure_fd >= 0 ) {
+    eventloop_unsubscribe_fd(el, cf->cf_pressure_fd, FD_SUB_ALL, &cf->cf_pressure_sub);
+    close(cf->cf_pressure_fd);
+    cf->cf_pressure_fd = -1;
+  }
+
+  if ( cf->cf_cgroup_root ) {
+    free(cf->cf_cgroup_root);
+    cf->cf_cgroup_root = NULL;
+    pthread_mutex_destroy(&cf->cf_mutex);
+  }
+}
@@ -12,7 +12,17 @@
 #define CONTAINER_MAX_ENVC 255
 #define APP_CONTAINER_TIMEOUT (10 * 60000) // Ten minutes
 
+// How long a container with a longer keepalive may be idle before it
+// is frozen (see struct containerfreezer)
+#define CONTAINER_FREEZE_TIMEOUT (60 * 1000) // One minute
+
+// Largest setup description (see CONTAINER_CTL_GET_SETUP)
+#define CONTAINER_MAX_SETUP_SIZE (16 * 1024)
+// Largest number of idle containers a pool keeps
+#define CONTAINER_POOL_MAX 32
+
 struct container;
+struct containerpool;
 typedef int(*containerctlfn)(struct container *, int, void *, ssize_t);
 
 // Return negative on error, 0 on success
@@ -34,6 +44,10 @@ typedef int(*containerctlfn)(struct container *, int, void *, ssize_t);
 // event.
 #define CONTAINER_CTL_CHECK_PERMISSION 8
 
+// Called in the child, before the init process is executed. If the
+// container was started from a pool, c is the pooled container, not
+// the one being started, and the pointer and ssize_t parameters are
+// the description returned by CONTAINER_CTL_GET_SETUP.
 #define CONTAINER_CTL_DO_SETUP         9
 #define CONTAINER_CTL_DO_HOST_SETUP    10
 
@@ -42,6 +56,12 @@ typedef int(*containerctlfn)(struct container *, int, void *, ssize_t);
 #define CONTAINER_CTL_INIT_EXITS      12
 #define CONTAINER_CTL_AFTER_RUN_HOOK   13
 
+// Only called for containers with a pool whose control function is
+// set. Write everything CONTAINER_CTL_DO_SETUP needs into the buffer
+// given by the pointer parameter (ssize_t parameter is its size).
+// Return the number of bytes written, or negative on error.
+#define CONTAINER_CTL_GET_SETUP       14
+
 struct container {
   struct brstate *c_bridge;
   pthread_mutex_t c_mutex;
@@ -71,11 +91,104 @@ struct container {
   struct arpentry c_arp_entry;
 
   struct pssub    c_on_init_exit;
+
+  // If set, container_start takes an idle container from this pool,
+  // if it has one, instead of creating a new one
+  struct containerpool *c_pool;
+
+  // Set if the container's cgroup is frozen
+  int             c_frozen;
+  // Entry in cf_frozen
+  DLIST(struct container) c_frozen_list;
+  // Queued to thaw the container when traffic for it arrives while
+  // c_mutex is held elsewhere
+  struct qdevtsub c_thaw;
 };
 
 #define CONTAINER_FLAG_KILL_IMMEDIATELY 0x1
 #define CONTAINER_FLAG_NETWORK_ONLY     0x2
 #define CONTAINER_FLAG_ENABLE_SCTP      0x4
+// Set on the idle containers of a pool
+#define CONTAINER_FLAG_POOLED           0x8
+
+// Container pools
+//
+// A pool keeps idle containers whose namespaces are already created,
+// and whose interfaces are already wired into the bridge. Their
+// children wait for a single message, carrying the hostname, init
+// path, arguments, and setup description of the container being
+// started, before doing the container setup and executing init.
+//
+// Containers in a pool all have the same namespace flags, and are set
+// up by the same control function, so a pool only serves containers
+// with these. The pool is refilled from the event loop.
+struct pooledcontainer;
+struct containerpool {
+  struct brstate *cp_bridge;
+  pthread_mutex_t cp_mutex;
+
+  uint32_t        cp_flags;
+  // Called in the child with CONTAINER_CTL_DO_SETUP, or NULL if the
+  // containers served need no setup
+  containerctlfn  cp_control;
+
+  // Number of idle containers requested, and the most we will keep
+  int             cp_size, cp_max;
+  // Idle containers, plus the ones being created
+  int             cp_count;
+  DLIST_HEAD(struct pooledcontainer) cp_idle;
+
+  struct qdevtsub cp_refill;
+};
+
+// Freezing idle containers
+//
+// Each container runs in its own cgroup v2 group, under
+// cf_cgroup_root. Once the last running reference to a container with
+// a keepalive longer than CONTAINER_FREEZE_TIMEOUT is released, the
+// container is frozen after CONTAINER_FREEZE_TIMEOUT, instead of being
+// stopped after its keepalive. It keeps its memory and sockets, and
+// container_ensure_running thaws it.
+//
+// Frozen containers are only stopped when the memory pressure (PSI)
+// trigger fires, least recently frozen first, one per trigger.
+#define CONTAINER_PRESSURE_TRIGGER "some 150000 2000000" // 150ms stalled every 2s
+
+struct containerfreezer {
+  pthread_mutex_t cf_mutex;
+
+  // NULL if idle containers are not frozen
+  char           *cf_cgroup_root;
+
+  // Least recently frozen first
+  DLIST_HEAD(struct container) cf_frozen;
+
+  int             cf_pressure_fd;
+  struct fdsub    cf_pressure_sub;
+};
+
+void container_freezer_clear(struct containerfreezer *cf);
+// cgroup_root is a cgroup v2 directory we can create groups in. If
+// NULL, our own cgroup is used. If containers cannot be frozen there,
+// or memory pressure cannot be watched, freezing is disabled, and 0 is
+// still returned.
+int container_freezer_init(struct containerfreezer *cf, struct eventloop *el,
+                           const char *cgroup_root);
+void container_freezer_release(struct containerfreezer *cf, struct eventloop *el);
+
+void container_pool_clear(struct containerpool *cp);
+int container_pool_init(struct containerpool *cp, struct brstate *br, uint32_t flags,
+                        containerctlfn cfn, int max);
+void container_pool_release(struct containerpool *cp);
+// Ask for delta more (or fewer) idle containers
+void container_pool_resize(struct containerpool *cp, int delta);
+
+// Helpers for the pool's specialize message and CONTAINER_CTL_GET_SETUP
+// descriptions, which are sequences of NUL-terminated strings.
+// container_pack_string returns -1 if s does not fit in buf.
+// container_unpack_string returns NULL if no terminated string is left
+int container_pack_string(char *buf, size_t buf_sz, size_t *ofs, const char *s);
+const char *container_unpack_string(const char *buf, size_t buf_sz, size_t *ofs);
 
 void container_clear(struct container *c);
 int container_init(struct container *c, struct brstate *br, containerctlfn cfn, uint32_t flags, unsigned int keepalive);
@@ -105,6 +218,23 @@ struct containerexecinfo {
 
 int container_mod_host_entry(struct container *c, int direction,
                              const char *app_domain, const char *target);
+// Ask the init process to add (direction > 0) or remove (direction <
+// 0) addr on the container's interface. See STK_REQ_MOD_ADDR
+int container_mod_address(struct container *c, int direction,
+                          struct in_addr *addr, uint16_t port);
+
+// Ask the init process how its health checks are going. Returns -1
+// if the container is not running, is frozen, or does not answer.
+// See STK_REQ_HEALTH
+struct stkhealth;
+int container_get_health(struct container *c, struct stkhealth *health);
+
+// Serve c's address from host, which must be running, instead of
+// starting c. The address is added to host's interface (listening on
+// port), and traffic from it is described by c's control function.
+int container_add_alias(struct container *c, struct container *host, uint16_t port);
+int container_del_alias(struct container *c, struct container *host);
+
 int container_execute(struct container *c, uint32_t exec_flags, const char *path,
                       const char **argv, const char **envp);
 int container_execute_ex(struct container *c, struct containerexecinfo *opts);
@@ -14,6 +14,9 @@
 #define OP_FLOCK_REGISTRATION_TIMEOUT (EVT_CTL_CUSTOM + 2)
 #define OP_FLOCK_REFRESH (EVT_CTL_CUSTOM + 3)
 #define OP_FLOCK_RETRY_CONNECTION (EVT_CTL_CUSTOM + 4)
+#define OP_FLOCK_HANDSHAKE (EVT_CTL_CUSTOM + 5)
+#define OP_FLOCK_SRFLX_TIMER (EVT_CTL_CUSTOM + 6)
+#define OP_FLOCK_SRFLX_SOCKET (EVT_CTL_CUSTOM + 7)
 
 // #define FLOCK_DEBUG 1
 #ifdef FLOCK_DEBUG
@@ -28,6 +31,32 @@ static int flock_receive_request(struct flock *f, struct appstate *app);
 static int flock_process_request(struct flock *f, struct appstate *app, const char *pkt_buf, int pkt_sz);
 static void flock_successful_registration(struct flock *f, struct appstate *app);
 static void flock_fn(struct eventloop *el, int op, void *arg);
+static void flock_srflx_close(struct flock *f, struct flocksrflx *fsr);
+
+static void flock_srflx_clear(struct flock *f) {
+  int i;
+
+  for ( i = 0; i < FLOCK_SRFLX_POOL_SIZE; ++i ) {
+    f->f_srflx[i].fsr_flock = f;
+    f->f_srflx[i].fsr_socket = 0;
+    fdsub_clear(&f->f_srflx[i].fsr_sub);
+    f->f_srflx[i].fsr_state = FLOCK_SRFLX_EMPTY;
+    f->f_srflx[i].fsr_age = 0;
+  }
+
+  f->f_srflx_interval = 0;
+  f->f_srflx_el = NULL;
+  timersub_init_default(&f->f_srflx_timer, OP_FLOCK_SRFLX_TIMER, flock_fn);
+}
+
+static void flock_free_fn(const struct shared *s, int level) {
+  struct flock *f = STRUCT_FROM_BASE(struct flock, f_shared, s);
+
+  if ( level == SHFREE_NO_MORE_REFS ) {
+    flock_release(f);
+    free(f);
+  }
+}
 
 void flock_clear(struct flock *f) {
   f->f_uri_str = NULL;
@@ -40,10 +69,12 @@ void flock_clear(struct flock *f) {
   f->f_cur_addr.sin_family = AF_UNSPEC;
   f->f_pconns = NULL;
   DLIST_INIT(&f->f_pconns_with_response);
+  flock_srflx_clear(f);
 }
 
 void flock_release(struct flock *f) {
   struct pconn *cur_pconn, *tmp_pconn;
+  int i;
 
   if ( f->f_uri_str ) {
     free(f->f_uri_str);
@@ -85,6 +116,12 @@ void flock_release(struct flock *f) {
   HASH_ITER(pc_hh, f->f_pconns, cur_pconn, tmp_pconn) {
     PCONN_UNREF(cur_pconn);
   }
+
+  if ( f->f_srflx_el )
+    eventloop_cancel_timer(f->f_srflx_el, &f->f_srflx_timer);
+
+  for ( i = 0; i < FLOCK_SRFLX_POOL_SIZE; ++i )
+    flock_srflx_close(f, &f->f_srflx[i]);
 }
 
 #define URL_SLICE_LENGTH(slice) ((int) ((slice)->afterLast - (slice)->first))
@@ -155,6 +192,10 @@ void flock_move(struct flock *dst, struct flock *src) {
   dst->f_flock_state = src->f_flock_state;
   dst->f_pconns = src->f_pconns;
   DLIST_MOVE(&dst->f_pconns_with_response, &src->f_pconns_with_response);
+  flock_srflx_clear(dst);
+
+  SHARED_INIT(&dst->f_shared, flock_free_fn);
+  qdevtsub_init(&dst->f_handshake_evt, OP_FLOCK_HANDSHAKE, flock_fn);
 
   if ( pthread_mutex_init(&dst->f_mutex, NULL) != 0 )
     fprintf(stderr, "flock_move: could not initialize dst->f_mutex\n");
@@ -174,15 +215,21 @@ void flock_move(struct flock *dst, struct flock *src) {
 }
 
 // closes any active connections
+//
+// If a handshake step is running, it owns the SSL object and socket
+// until it returns, so they are only detached here and the step
+// frees them (see flock_run_handshake).
 static void flock_shutdown_connection(struct flock *f, struct eventloop *el) {
+  int busy = f->f_flags & FLOCK_FLAG_HANDSHAKE_BUSY;
+
   if ( f->f_dtls_client ) {
-    SSL_free(f->f_dtls_client);
+    if ( !busy ) SSL_free(f->f_dtls_client);
     f->f_dtls_client = NULL;
   }
 
   if ( f->f_socket ) {
     eventloop_unsubscribe_fd(el, f->f_socket, FD_SUB_ALL, &f->f_socket_sub);
-    close(f->f_socket);
+    if ( !busy ) close(f->f_socket);
     f->f_socket = 0;
   }
 }
@@ -749,6 +796,324 @@ static void flock_send_pconn_responses(struct flock *f) {
   }
 }
 
+static void flock_srflx_close(struct flock *f, struct flocksrflx *fsr) {
+  if ( fsr->fsr_socket ) {
+    if ( f->f_srflx_el )
+      eventloop_unsubscribe_fd(f->f_srflx_el, fsr->fsr_socket, FD_SUB_ALL, &fsr->fsr_sub);
+    close(fsr->fsr_socket);
+    fsr->fsr_socket = 0;
+  }
+  fsr->fsr_state = FLOCK_SRFLX_EMPTY;
+}
+
+static void flock_srflx_send_binding(struct flock *f, struct flocksrflx *fsr) {
+  struct stunmsg msg;
+  struct stunattr *attr;
+  kite_sock_addr svr;
+  int err;
+
+  memset(&svr, 0, sizeof(svr));
+  memcpy(&svr.ksa_ipv4, &f->f_cur_addr, sizeof(f->f_cur_addr));
+
+  STUN_INIT_MSG(&msg, STUN_BINDING);
+  memcpy(&msg.sm_tx_id, &fsr->fsr_tx_id, sizeof(msg.sm_tx_id));
+  attr = STUN_FIRSTATTR(&msg);
+
+  err = stun_add_mapped_address_attrs(&attr, &msg, sizeof(msg), &svr, sizeof(svr));
+  assert(err == 0);
+
+  STUN_FINISH_WITH_FINGERPRINT(attr, &msg, sizeof(msg), err);
+  assert(err == 0);
+
+  err = sendto(fsr->fsr_socket, &msg, STUN_MSG_LENGTH(&msg), 0,
+               &svr.ksa, sizeof(svr));
+  if ( err < 0 && errno != EWOULDBLOCK )
+    perror("flock_srflx_send_binding: sendto");
+}
+
+// Opens a socket on the interface we use to reach the flock, and
+// sends the first binding request
+static int flock_srflx_open(struct flock *f, struct flocksrflx *fsr) {
+  struct sockaddr disconnect_addr;
+  socklen_t addrsz = sizeof(fsr->fsr_local_addr);
+  int err;
+
+  fsr->fsr_socket = socket(AF_INET, SOCK_DGRAM, 0);
+  if ( fsr->fsr_socket < 0 ) {
+    perror("flock_srflx_open: socket");
+    fsr->fsr_socket = 0;
+    return -1;
+  }
+
+  if ( set_socket_nonblocking(fsr->fsr_socket) < 0 ) {
+    perror("flock_srflx_open: set_socket_nonblocking");
+    goto error;
+  }
+
+  // connect() chooses the local address and port. As in
+  // candsrc_add_host_candidate, we then disconnect and bind to that
+  // address, since the socket will be used for ICE with any peer.
+  err = connect(fsr->fsr_socket, (struct sockaddr *) &f->f_cur_addr, sizeof(f->f_cur_addr));
+  if ( err < 0 ) {
+    perror("flock_srflx_open: connect");
+    goto error;
+  }
+
+  err = getsockname(fsr->fsr_socket, &fsr->fsr_local_addr.ksa, &addrsz);
+  if ( err < 0 ) {
+    perror("flock_srflx_open: getsockname");
+    goto error;
+  }
+
+  disconnect_addr.sa_family = AF_UNSPEC;
+  err = connect(fsr->fsr_socket, &disconnect_addr, sizeof(disconnect_addr));
+  if ( err < 0 )
+    perror("flock_srflx_open: connect (disconnect)");
+
+  err = bind(fsr->fsr_socket, &fsr->fsr_local_addr.ksa, addrsz);
+  if ( err < 0 )
+    perror("flock_srflx_open: bind");
+
+  fsr->fsr_state = FLOCK_SRFLX_BINDING;
+  fsr->fsr_retries = 0;
+  fsr->fsr_age = 0;
+  stun_random_tx_id(&fsr->fsr_tx_id);
+
+  fdsub_init(&fsr->fsr_sub, f->f_srflx_el, fsr->fsr_socket, OP_FLOCK_SRFLX_SOCKET, flock_fn);
+  eventloop_subscribe_fd(f->f_srflx_el, fsr->fsr_socket, FD_SUB_READ, &fsr->fsr_sub);
+
+  flock_srflx_send_binding(f, fsr);
+
+  return 0;
+
+ error:
+  flock_srflx_close(f, fsr);
+  return -1;
+}
+
+// Reads any binding responses that have arrived on the socket
+static void flock_srflx_receive(struct flock *f, struct flocksrflx *fsr) {
+  char pkt[PCONN_MAX_PACKET_SIZE];
+  kite_sock_addr addr;
+  socklen_t addr_sz;
+  struct stunvalidation sv;
+  int err;
+
+  while ( 1 ) {
+    err = recv(fsr->fsr_socket, pkt, sizeof(pkt), MSG_DONTWAIT);
+    if ( err < 0 ) {
+      if ( errno != EWOULDBLOCK && errno != EAGAIN )
+        perror("flock_srflx_receive: recv");
+      return;
+    }
+
+    sv.sv_flags = STUN_VALIDATE_RESPONSE | STUN_VALIDATE_TX_ID;
+    sv.sv_req_code = STUN_BINDING;
+    sv.sv_tx_id = &fsr->fsr_tx_id;
+    sv.sv_user_cb = NULL;
+    sv.sv_unknown_cb = STUN_ACCEPT_UNKNOWN;
+    sv.sv_user_data = NULL;
+    sv.sv_unknown_attrs = NULL;
+    sv.sv_unknown_attrs_sz = 0;
+
+    if ( stun_validate(pkt, err, &sv) != STUN_SUCCESS ) continue;
+
+    addr_sz = sizeof(addr);
+    if ( stun_process_binding_response((struct stunmsg *) pkt, &addr.ksa, &addr_sz) < 0 ) {
+      fprintf(stderr, "flock_srflx_receive: invalid binding response\n");
+      continue;
+    }
+
+    memset(&fsr->fsr_srflx_addr, 0, sizeof(fsr->fsr_srflx_addr));
+    memcpy(&fsr->fsr_srflx_addr, &addr, addr_sz);
+    fsr->fsr_state = FLOCK_SRFLX_READY;
+    fsr->fsr_retries = 0;
+    fsr->fsr_age = 0;
+    stun_random_tx_id(&fsr->fsr_tx_id);
+  }
+}
+
+// f_mutex must be held
+static void flock_srflx_schedule(struct flock *f, struct eventloop *el, int millis) {
+  eventloop_cancel_timer(el, &f->f_srflx_timer);
+  f->f_srflx_interval = millis;
+  timersub_set_from_now(&f->f_srflx_timer, millis);
+  eventloop_subscribe_timer(el, &f->f_srflx_timer);
+}
+
+// f_mutex must be held
+static void flock_srflx_tick(struct flock *f, struct eventloop *el) {
+  int i, next = FLOCK_SRFLX_REFRESH_INTERVAL;
+
+  for ( i = 0; i < FLOCK_SRFLX_POOL_SIZE; ++i ) {
+    struct flocksrflx *fsr = &f->f_srflx[i];
+
+    fsr->fsr_age += f->f_srflx_interval;
+
+    switch ( fsr->fsr_state ) {
+    case FLOCK_SRFLX_EMPTY:
+      if ( fsr->fsr_age >= 0 && flock_srflx_open(f, fsr) == 0 )
+        next = FLOCK_SRFLX_RTO;
+      break;
+
+    case FLOCK_SRFLX_READY:
+      if ( fsr->fsr_age < FLOCK_SRFLX_REFRESH_INTERVAL ) break;
+      fsr->fsr_state = FLOCK_SRFLX_REFRESHING;
+      fsr->fsr_retries = 0;
+      flock_srflx_send_binding(f, fsr);
+      next = FLOCK_SRFLX_RTO;
+      break;
+
+    case FLOCK_SRFLX_BINDING:
+    case FLOCK_SRFLX_REFRESHING:
+      fsr->fsr_retries++;
+      if ( fsr->fsr_retries >= FLOCK_SRFLX_MAX_RETRIES ) {
+        fprintf(stderr, "flock_srflx_tick: no binding response from %s\n", f->f_uri_str);
+        flock_srflx_close(f, fsr);
+        fsr->fsr_age = -FLOCK_SRFLX_RETRY_INTERVAL;
+      } else {
+        flock_srflx_send_binding(f, fsr);
+        next = FLOCK_SRFLX_RTO;
+      }
+      break;
+
+    default:
+      break;
+    }
+  }
+
+  flock_srflx_schedule(f, el, next);
+}
+
+// Called when the flock address is (re)resolved. f_mutex must be held
+static void flock_srflx_restart(struct flock *f, struct eventloop *el) {
+  int i;
+
+  for ( i = 0; i < FLOCK_SRFLX_POOL_SIZE; ++i ) {
+    flock_srflx_close(f, &f->f_srflx[i]);
+    f->f_srflx[i].fsr_age = 0;
+  }
+
+  flock_srflx_schedule(f, el, 0);
+}
+
+int flock_take_srflx(struct flock *f, struct eventloop *el, int *sk,
+                     kite_sock_addr *local_addr, kite_sock_addr *srflx_addr) {
+  int i;
+
+  for ( i = 0; i < FLOCK_SRFLX_POOL_SIZE; ++i ) {
+    struct flocksrflx *fsr = &f->f_srflx[i];
+    if ( !FLOCK_SRFLX_HAS_ADDR(fsr) ) continue;
+
+    // Pick up any refreshed mapping first
+    flock_srflx_receive(f, fsr);
+
+    // The caller subscribes the socket itself
+    eventloop_unsubscribe_fd(el, fsr->fsr_socket, FD_SUB_ALL, &fsr->fsr_sub);
+
+    *sk = fsr->fsr_socket;
+    memcpy(local_addr, &fsr->fsr_local_addr, sizeof(*local_addr));
+    memcpy(srflx_addr, &fsr->fsr_srflx_addr, sizeof(*srflx_addr));
+
+    fsr->fsr_socket = 0;
+    fsr->fsr_state = FLOCK_SRFLX_EMPTY;
+    fsr->fsr_age = 0;
+
+    // Replace it right away
+    flock_srflx_schedule(f, el, 0);
+    return 0;
+  }
+
+  return -1;
+}
+
+// f_mutex must be held, and f must be in FLOCK_STATE_CONNECTING. err
+// is the result of SSL_do_handshake
+static void flock_continue_handshake(struct flock *f, struct eventloop *el, int err) {
+  if ( err == 0 ) {
+    fprintf(stderr, "The flock connection was rejected gracefully\n");
+    ERR_print_errors_fp(stderr);
+
+    flock_shutdown_connection(f, el);
+    f->f_flock_state = FLOCK_STATE_SUSPENDED;
+  } else if ( err < 0 ) {
+    if ( flock_handle_ssl_error(f, el, err) < 0 ) {
+      fprintf(stderr, "The flock connection is being aborted because of an ssl error\n");
+      ERR_print_errors_fp(stderr);
+
+      flock_shutdown_connection(f, el);
+      f->f_flock_state = FLOCK_STATE_SUSPENDED;
+    }
+  } else {
+    fprintf(stderr, "The DTLS handshake has been completed\n");
+
+    f->f_flock_state = FLOCK_STATE_SEND_REGISTRATION;
+    f->f_retries = 0;
+
+    eventloop_subscribe_fd(el, f->f_socket, FD_SUB_ERROR | FD_SUB_READ | FD_SUB_WRITE,
+                           &f->f_socket_sub);
+  }
+}
+
+// f_mutex must be held
+static void flock_queue_handshake(struct flock *f, struct eventloop *el) {
+  if ( f->f_flags & FLOCK_FLAG_HANDSHAKE_BUSY ) {
+    // The running step picks this up before it finishes
+    f->f_flags |= FLOCK_FLAG_HANDSHAKE_AGAIN;
+    return;
+  }
+
+  f->f_flags |= FLOCK_FLAG_HANDSHAKE_BUSY;
+  FLOCK_REF(f);
+  if ( eventloop_invoke_async(el, &f->f_handshake_evt) < 0 ) {
+    perror("flock_queue_handshake: eventloop_invoke_async");
+    f->f_flags &= ~FLOCK_FLAG_HANDSHAKE_BUSY;
+    flock_shutdown_connection(f, el);
+    f->f_flock_state = FLOCK_STATE_SUSPENDED;
+    // The flock table still holds a reference
+    FLOCK_UNREF(f);
+  }
+}
+
+// Runs on the async pool. f_mutex must be held, and is released while
+// SSL_do_handshake runs, since verifying the certificate and the key
+// exchange are slow.
+static void flock_run_handshake(struct flock *f, struct eventloop *el) {
+  SSL *dtls;
+  int sk, err;
+
+  for (;;) {
+    f->f_flags &= ~FLOCK_FLAG_HANDSHAKE_AGAIN;
+    if ( f->f_flock_state != FLOCK_STATE_CONNECTING || !f->f_dtls_client )
+      break;
+
+    dtls = f->f_dtls_client;
+    sk = f->f_socket;
+
+    pthread_mutex_unlock(&f->f_mutex);
+    fprintf(stderr, "Attempting connection\n");
+    err = SSL_do_handshake(dtls);
+    SAFE_MUTEX_LOCK(&f->f_mutex);
+
+    if ( f->f_dtls_client != dtls ) {
+      // The connection was shut down while we ran
+      SSL_free(dtls);
+      close(sk);
+      break;
+    }
+
+    // We are done with dtls, so a shutdown from here on may free it
+    f->f_flags &= ~FLOCK_FLAG_HANDSHAKE_BUSY;
+    flock_continue_handshake(f, el, err);
+
+    if ( !(f->f_flags & FLOCK_FLAG_HANDSHAKE_AGAIN) )
+      break;
+    f->f_flags |= FLOCK_FLAG_HANDSHAKE_BUSY;
+  }
+
+  f->f_flags &= ~(FLOCK_FLAG_HANDSHAKE_BUSY | FLOCK_FLAG_HANDSHAKE_AGAIN);
+}
+
 static void flock_fn(struct eventloop *el, int op, void *arg) {
   struct qdevent *dns_ev, *tmr_ev;
   struct fdevent *fd_ev;
@@ -791,6 +1156,9 @@ static void flock_fn(struct eventloop *el, int op, void *arg) {
 
           dnssub_release(&f->f_resolver);
 
+          if ( (f->f_flags & FLOCK_FLAG_INSECURE) && !(f->f_flags & FLOCK_FLAG_KITE_ONLY) )
+            flock_srflx_restart(f, el);
+
           // Now launch the connection, unless this is a 'STUN-only' flock
           if ( (f->f_flags & FLOCK_FLAG_STUN_ONLY) == 0 )
             flock_start_connection(f, el);
@@ -816,32 +1184,9 @@ static void flock_fn(struct eventloop *el, int op, void *arg) {
     SAFE_MUTEX_LOCK(&f->f_mutex);
     switch ( f->f_flock_state ) {
     case FLOCK_STATE_CONNECTING:
-      fprintf(stderr, "Attempting connection\n");
-      // attempt to connect
-      err = SSL_do_handshake(f->f_dtls_client);
-      if ( err == 0 ) {
-        fprintf(stderr, "The flock connection was rejected gracefully\n");
-        ERR_print_errors_fp(stderr);
-
-        flock_shutdown_connection(f, el);
-        f->f_flock_state = FLOCK_STATE_SUSPENDED;
-      } else if ( err < 0 ) {
-        if ( flock_handle_ssl_error(f, el, err) < 0 ) {
-          fprintf(stderr, "The flock connection is being aborted because of an ssl error\n");
-          ERR_print_errors_fp(stderr);
-
-          flock_shutdown_connection(f, el);
-          f->f_flock_state = FLOCK_STATE_SUSPENDED;
-        }
-      } else {
-        fprintf(stderr, "The DTLS handshake has been completed\n");
-
-        f->f_flock_state = FLOCK_STATE_SEND_REGISTRATION;
-        f->f_retries = 0;
-
-        eventloop_subscribe_fd(el, f->f_socket, FD_SUB_ERROR | FD_SUB_READ | FD_SUB_WRITE,
-                               &f->f_socket_sub);
-      }
+      // The handshake verifies the flock certificate and does the key
+      // exchange, so it is run on the async pool
+      flock_queue_handshake(f, el);
       break;
 
     case FLOCK_STATE_SUSPENDED:
@@ -940,6 +1285,37 @@ static void flock_fn(struct eventloop *el, int op, void *arg) {
 
     break;
 
+  case OP_FLOCK_SRFLX_TIMER:
+    tmr_ev = (struct qdevent *) arg;
+    f = STRUCT_FROM_BASE(struct flock, f_srflx_timer, tmr_ev->qde_timersub);
+    SAFE_MUTEX_LOCK(&f->f_mutex);
+    flock_srflx_tick(f, el);
+    pthread_mutex_unlock(&f->f_mutex);
+    break;
+
+  case OP_FLOCK_SRFLX_SOCKET:
+    fd_ev = (struct fdevent *) arg;
+    do {
+      struct flocksrflx *fsr = STRUCT_FROM_BASE(struct flocksrflx, fsr_sub, fd_ev->fde_sub);
+      f = fsr->fsr_flock;
+
+      SAFE_MUTEX_LOCK(&f->f_mutex);
+      if ( fsr->fsr_socket && FD_READ_PENDING(fd_ev) ) {
+        flock_srflx_receive(f, fsr);
+        eventloop_subscribe_fd(el, fsr->fsr_socket, FD_SUB_READ, &fsr->fsr_sub);
+      }
+      pthread_mutex_unlock(&f->f_mutex);
+    } while (0);
+    break;
+
+  case OP_FLOCK_HANDSHAKE:
+    f = STRUCT_FROM_BASE(struct flock, f_handshake_evt, ((struct qdevent *) arg)->qde_sub);
+    SAFE_MUTEX_LOCK(&f->f_mutex);
+    flock_run_handshake(f, el);
+    pthread_mutex_unlock(&f->f_mutex);
+    FLOCK_UNREF(f);
+    break;
+
   case OP_FLOCK_REGISTRATION_TIMEOUT:
     tmr_ev = (struct qdevent *) arg;
     f = STRUCT_FROM_BASE(struct flock, f_registration_timeout, tmr_ev->qde_timersub);
@@ -1000,6 +1376,8 @@ void flock_start_service(struct flock *f, struct eventloop *el) {
     int err = 0;
     struct addrinfo hints;
 
+    f->f_srflx_el = el;
+
     switch ( f->f_flock_state ) {
     case FLOCK_STATE_NM_NOT_RES:
       eventloop_unsubscribe_timer(el, &f->f_resolve_timer);
@@ -27,6 +27,17 @@
 #define FLOCK_MAX_RETRIES              7
 #define FLOCK_RETRY_RESOLUTION_INTERVAL 60000
 
+// Each flock keeps a few UDP sockets whose server reflexive address
+// is already known, so a new pconn can offer its srflx candidate
+// without waiting for a binding round trip.
+#define FLOCK_SRFLX_POOL_SIZE        2
+#define FLOCK_SRFLX_RTO              500
+#define FLOCK_SRFLX_MAX_RETRIES      5
+// Most NATs drop idle UDP mappings after 30 seconds
+#define FLOCK_SRFLX_REFRESH_INTERVAL 15000
+// Wait this long before opening a new socket after a binding fails
+#define FLOCK_SRFLX_RETRY_INTERVAL   60000
+
 #define FLOCK_TIMEOUT(f, initial) (initial << (f)->f_retries)
 #define FLOCK_HAS_FAILED(f) ((f)->f_flock_state >= FLOCK_STATE_SUSPENDED)
 #define FLOCK_IS_FAILING(f) ((f)->f_flags & FLOCK_FLAG_FAILING)
@@ -42,7 +53,34 @@
     }                                                        \
   }
 
+struct flock;
+struct flocksrflx {
+  struct flock *fsr_flock;
+  int fsr_socket;
+  struct fdsub fsr_sub;
+  int fsr_state;
+  int fsr_retries;
+  // Milliseconds since the mapping was last confirmed. Negative while
+  // backing off after a failure
+  int fsr_age;
+
+  struct stuntxid fsr_tx_id;
+  kite_sock_addr fsr_local_addr, fsr_srflx_addr;
+};
+
+#define FLOCK_SRFLX_EMPTY      0
+// Waiting for the first binding response
+#define FLOCK_SRFLX_BINDING    1
+// fsr_srflx_addr is valid
+#define FLOCK_SRFLX_READY      2
+// fsr_srflx_addr is valid, and a keepalive binding is outstanding
+#define FLOCK_SRFLX_REFRESHING 3
+
+#define FLOCK_SRFLX_HAS_ADDR(fsr) ((fsr)->fsr_state == FLOCK_SRFLX_READY || \
+                                   (fsr)->fsr_state == FLOCK_SRFLX_REFRESHING)
+
 struct flock {
+  struct shared f_shared;
   pthread_mutex_t f_mutex;
 
   char *f_uri_str; // Dynamically allocated raw normalized flock URI string
@@ -66,6 +104,20 @@ struct flock {
   // Pending connections which have things to write on this flock
   DLIST_HEAD(struct pconn) f_pconns_with_response;
 
+  // Server reflexive candidate cache. Only used for insecure flocks,
+  // since those are the only ones pconns send bindings to.
+  struct flocksrflx f_srflx[FLOCK_SRFLX_POOL_SIZE];
+  struct timersub f_srflx_timer;
+  int f_srflx_interval;
+  // The event loop the srflx sockets and timer are subscribed on, or
+  // NULL if service was never started
+  struct eventloop *f_srflx_el;
+
+  // Runs the DTLS handshake on the async pool. Only one step may be
+  // queued at a time (see FLOCK_FLAG_HANDSHAKE_BUSY), and the queued
+  // step holds a reference to the flock.
+  struct qdevtsub f_handshake_evt;
+
   union {
     struct dnssub f_resolver;
     struct timersub f_resolve_timer;
@@ -123,6 +175,13 @@ struct flock {
 #define FLOCK_FLAG_KITE_ONLY          0x100
 // The flock encountered a conflict during registration
 #define FLOCK_FLAG_CONFLICT           0x200
+// A handshake step is queued or running on the async pool
+#define FLOCK_FLAG_HANDSHAKE_BUSY     0x400
+// The socket became ready while a handshake step was running
+#define FLOCK_FLAG_HANDSHAKE_AGAIN    0x800
+
+#define FLOCK_REF(f) SHARED_REF(&(f)->f_shared)
+#define FLOCK_UNREF(f) SHARED_UNREF(&(f)->f_shared)
 
 void flock_clear(struct flock *f);
 void flock_release(struct flock *f);
@@ -134,6 +193,14 @@ int flock_assign_uri(struct flock *dst, UriUriA *uri);
 void flock_start_service(struct flock *f, struct eventloop *el);
 void flock_pconn_expires(struct flock *f, struct pconn *pc);
 
+// Hands over a socket from the server reflexive candidate cache. On
+// success, returns 0 and the caller owns *sk. Returns -1 if no socket
+// with a known mapping is available.
+//
+// f_mutex must be held
+int flock_take_srflx(struct flock *f, struct eventloop *el, int *sk,
+                     kite_sock_addr *local_addr, kite_sock_addr *srflx_addr);
+
 void flock_request_pconn_write(struct flock *f, struct pconn *pc);
 void flock_request_pconn_write_unlocked(struct flock *f, struct pconn *pc);
 
@@ -10,6 +10,8 @@
 #include "flock.h"
 #include "update.h"
 #include "token.h"
+#include "site.h"
+#include "init_proto.h"
 
 #define OP_LOCALAPI_RECV_MSG EVT_CTL_CUSTOM
 #define OP_LOCALAPI_UPDATE_COMPLETE (EVT_CTL_CUSTOM + 1)
@@ -684,6 +686,187 @@ static void localsock_crud_system(struct localapi *api, struct eventloop *el,
   }
 }
 
+static void localsock_get_updates(struct localapi *api, struct eventloop *el,
+                                  struct kitelocalmsg *msg, int msgsz) {
+  struct appupdater *cur, *tmp;
+  unsigned int au_count;
+
+  SAFE_RWLOCK_RDLOCK(&api->la_app_state->as_applications_mutex);
+  au_count = HASH_CNT(au_hh, api->la_app_state->as_updates);
+  if ( localsock_start_list(api, KLM_REQ_ENTITY_UPDATE, au_count) == 0 ) {
+    unsigned int i = 0;
+    HASH_ITER(au_hh, api->la_app_state->as_updates, cur, tmp) {
+      APPUPDATER_REF(cur);
+      api->la_listing[i] = &cur->au_shared;
+      i++;
+    }
+  } else
+    localsock_return_internal_error(api, el, msg);
+  pthread_rwlock_unlock(&api->la_app_state->as_applications_mutex);
+}
+
+static void localsock_cancel_update(struct localapi *api, struct eventloop *el,
+                                    struct kitelocalmsg *msg, int msgsz) {
+  struct kitelocalattr *attr;
+  struct appupdater *au;
+
+  const char *app_uri = NULL;
+  size_t app_uri_sz = 0;
+
+  for ( attr = KLM_FIRSTATTR(msg, msgsz); attr; attr = KLM_NEXTATTR(msg, attr, msgsz) ) {
+    switch ( KLA_NAME(attr) ) {
+    case KLA_APP_MANIFEST_URL:
+      app_uri = KLA_DATA_UNSAFE(attr, char *);
+      app_uri_sz = KLA_PAYLOAD_SIZE(attr);
+      break;
+    default:
+      break;
+    }
+  }
+
+  if ( !app_uri ) {
+    localsock_return_missing_attrs(api, el, msg, KLA_APP_MANIFEST_URL, -1);
+    return;
+  }
+
+  au = appstate_get_update(api->la_app_state, app_uri, app_uri_sz);
+  if ( !au ) {
+    localsock_return_not_found(api, el, msg);
+    return;
+  }
+
+  if ( appupdater_cancel(au) < 0 )
+    localsock_return_not_allowed(api, el, msg);
+  else
+    localsock_return_simple(api, el, msg, KLE_SUCCESS);
+
+  APPUPDATER_UNREF(au);
+}
+
+static void localsock_crud_update(struct localapi *api, struct eventloop *el,
+                                  struct kitelocalmsg *msg, int msgsz) {
+  switch ( KLM_REQ_OP(msg) ) {
+  case KLM_REQ_GET:
+    localsock_get_updates(api, el, msg, msgsz);
+    break;
+
+  case KLM_REQ_DELETE:
+    localsock_cancel_update(api, el, msg, msgsz);
+    break;
+
+  default:
+    localsock_return_bad_method(api, el, msg, KLM_REQ_ENTITY(msg), KLM_REQ_OP(msg));
+    break;
+  }
+}
+
+// Site IDs are written <digest>:<hex fingerprint>, as returned for
+// persona containers
+static int localsock_parse_site_id(struct kitelocalattr *attr, struct sitekey *key) {
+  char site_id[64 + BR_SITE_FINGERPRINT_MAX * 2 + 1], *fingerprint;
+  const EVP_MD *digest;
+  int sz = KLA_PAYLOAD_SIZE(attr), digest_sz;
+
+  if ( sz >= sizeof(site_id) ) return -1;
+
+  memcpy(site_id, KLA_DATA_UNSAFE(attr, void *), sz);
+  site_id[sz] = '\0';
+
+  fingerprint = strchr(site_id, ':');
+  if ( !fingerprint ) return -1;
+  *(fingerprint++) = '\0';
+
+  digest = EVP_get_digestbyname(site_id);
+  if ( !digest ) return -1;
+
+  digest_sz = EVP_MD_size(digest);
+  if ( digest_sz > sizeof(key->sk_fingerprint) ||
+       strlen(fingerprint) != digest_sz * 2 ||
+       parse_hex_str(fingerprint, key->sk_fingerprint, digest_sz) != digest_sz )
+    return -1;
+
+  key->sk_fingerprint_sz = digest_sz;
+  return 0;
+}
+
+// Grant (KLA_APP_PERMISSION) or revoke (KLA_APP_PERMISSION_REVOKED)
+// app permissions for one site of a persona. Changes are applied in
+// order, so an invalid permission leaves the earlier ones in place
+static void localsock_update_persona(struct localapi *api, struct eventloop *el,
+                                     struct kitelocalmsg *msg, int msgsz) {
+  struct kitelocalattr *attr;
+  struct sitekey key;
+  struct persona *p;
+
+  int has_persona_id = 0, has_site_id = 0, change_count = 0;
+  char persona_id[PERSONA_ID_LENGTH];
+
+  for ( attr = KLM_FIRSTATTR(msg, msgsz); attr; attr = KLM_NEXTATTR(msg, attr, msgsz) ) {
+    switch ( KLA_NAME(attr) ) {
+    case KLA_PERSONA_ID:
+      if ( KLA_PAYLOAD_SIZE(attr) == PERSONA_ID_LENGTH ) {
+        has_persona_id = 1;
+        memcpy(persona_id, KLA_DATA_UNSAFE(attr, void *), PERSONA_ID_LENGTH);
+      } else {
+        localsock_return_bad_method(api, el, msg, KLM_REQ_ENTITY(msg), KLM_REQ_OP(msg));
+        return;
+      }
+      break;
+    case KLA_SITE_ID:
+      if ( localsock_parse_site_id(attr, &key) < 0 ) {
+        localsock_return_bad_method(api, el, msg, KLM_REQ_ENTITY(msg), KLM_REQ_OP(msg));
+        return;
+      }
+      has_site_id = 1;
+      break;
+    case KLA_APP_PERMISSION:
+    case KLA_APP_PERMISSION_REVOKED:
+      change_count++;
+      break;
+    default:
+      localsock_return_bad_method(api, el, msg, KLM_REQ_ENTITY(msg), KLM_REQ_OP(msg));
+      return;
+    }
+  }
+
+  if ( !has_persona_id || !has_site_id || change_count == 0 ) {
+    localsock_return_missing_attrs(api, el, msg, KLA_PERSONA_ID, KLA_SITE_ID,
+                                   KLA_APP_PERMISSION, -1);
+    return;
+  }
+
+  if ( appstate_lookup_persona(api->la_app_state, persona_id, &p) < 0 || !p ) {
+    localsock_return_not_found(api, el, msg);
+    return;
+  }
+  PERSONA_UNREF(p);
+
+  memcpy(key.sk_persona_id, persona_id, sizeof(key.sk_persona_id));
+
+  for ( attr = KLM_FIRSTATTR(msg, msgsz); attr; attr = KLM_NEXTATTR(msg, attr, msgsz) ) {
+    char perm[PATH_MAX];
+    int grant = KLA_NAME(attr) == KLA_APP_PERMISSION;
+
+    if ( !grant && KLA_NAME(attr) != KLA_APP_PERMISSION_REVOKED )
+      continue;
+
+    if ( KLA_PAYLOAD_SIZE(attr) >= sizeof(perm) ) {
+      localsock_return_simple(api, el, msg, KLE_INVALID_URL);
+      return;
+    }
+
+    memcpy(perm, KLA_DATA_UNSAFE(attr, void *), KLA_PAYLOAD_SIZE(attr));
+    perm[KLA_PAYLOAD_SIZE(attr)] = '\0';
+
+    if ( siteindex_update(&api->la_app_state->as_sites, &key, perm, grant) < 0 ) {
+      localsock_return_simple(api, el, msg, KLE_INVALID_URL);
+      return;
+    }
+  }
+
+  localsock_return_simple(api, el, msg, KLE_SUCCESS);
+}
+
 static void localsock_crud_persona(struct localapi *api, struct eventloop *el,
                                    struct kitelocalmsg *msg, int msgsz) {
   switch ( KLM_REQ_OP(msg) ) {
@@ -695,6 +878,10 @@ static void localsock_crud_persona(struct localapi *api, struct eventloop *el,
     localsock_create_persona(api, el, msg, msgsz);
     break;
 
+  case KLM_REQ_UPDATE:
+    localsock_update_persona(api, el, msg, msgsz);
+    break;
+
   default:
     localsock_return_bad_method(api, el, msg, KLM_REQ_ENTITY(msg), KLM_REQ_OP(msg));
     break;
@@ -976,6 +1163,7 @@ static void localsock_create_app(struct localapi *api, struct eventloop *el,
   size_t app_uri_sz, sign_uri_sz = 0;
 
   int rspsz = KLM_SIZE_INIT, found_app_manifest = 0, do_force = 0, progress = -1, infer_app_sign = 1;
+  int reason = AU_UPDATE_REASON_MANUAL;
 
   rsp->klm_req = htons(KLM_RESPONSE | htons(msg->klm_req));
   rsp->klm_req_flags = 0;
@@ -1007,6 +1195,18 @@ static void localsock_create_app(struct localapi *api, struct eventloop *el,
       do_force = 1;
       break;
 
+    case KLA_UPDATE_REASON:
+      if ( KLA_PAYLOAD_SIZE(attr) == sizeof(uint16_t) ) {
+        uint16_t req_reason;
+        memcpy(&req_reason, KLA_DATA_UNSAFE(attr, void *), sizeof(req_reason));
+        req_reason = ntohs(req_reason);
+        if ( req_reason == AU_UPDATE_REASON_AUTOMATIC ||
+             req_reason == AU_UPDATE_REASON_MANUAL ||
+             req_reason == AU_UPDATE_REASON_SECURITY )
+          reason = req_reason;
+      }
+      break;
+
     case KLA_STDOUT:
       if ( KLA_PAYLOAD_SIZE(attr) == sizeof(uint8_t) ) {
         uint8_t fdix;
@@ -1061,8 +1261,7 @@ static void localsock_create_app(struct localapi *api, struct eventloop *el,
     u = appstate_queue_update_ex(api->la_app_state,
                                  app_uri, app_uri_sz,
                                  sign_uri, sign_uri_sz,
-                                 AU_UPDATE_REASON_MANUAL,
-                                 progress_fd, NULL);
+                                 reason, progress_fd, NULL);
     if ( !u ) {
       *(KLA_DATA_UNSAFE(attr, uint16_t *)) = htons(KLE_SYSTEM_ERROR);
       KLM_SIZE_ADD_ATTR(rspsz, attr);
@@ -1122,6 +1321,7 @@ static void localsock_get_container(struct localapi *api, struct eventloop *el,
   } else {
     int err;
     struct arpdesc desc;
+    struct stkhealth health;
 
     err = bridge_describe_arp(&api->la_app_state->as_bridge, &addr, &desc, sizeof(desc));
     if ( err == 0 )
@@ -1272,6 +1472,20 @@ static void localsock_get_container(struct localapi *api, struct eventloop *el,
                strlen(desc.ad_app_instance.ad_app_url));
         KLM_SIZE_ADD_ATTR(rspsz, attr);
 
+        // Only running instances have health to report
+        if ( container_get_health(&desc.ad_app_instance.ad_app_instance->inst_container,
+                                  &health) == 0 ) {
+          uint32_t health_attr[3] = { htonl(health.sh_status), htonl(health.sh_failures),
+                                      htonl(health.sh_checks) };
+
+          attr = KLM_NEXTATTR(rsp, attr, sizeof(ret_buf));
+          assert(attr);
+          attr->kla_name = htons(KLA_HEALTH);
+          attr->kla_length = htons(KLA_SIZE(sizeof(health_attr)));
+          memcpy(KLA_DATA_UNSAFE(attr, void *), health_attr, sizeof(health_attr));
+          KLM_SIZE_ADD_ATTR(rspsz, attr);
+        }
+
         break;
 
       default:
@@ -1621,6 +1835,9 @@ static void localsock_handle_message(struct localapi *api, struct eventloop *el,
   case KLM_REQ_ENTITY_SYSTEM:
     localsock_crud_system(api, el, msg, buf_sz);
     break;
+  case KLM_REQ_ENTITY_UPDATE:
+    localsock_crud_update(api, el, msg, buf_sz);
+    break;
   default:
     localsock_return_bad_entity(api, el, msg, KLM_REQ_ENTITY(msg));
     break;
@@ -1633,6 +1850,8 @@ static void localsock_handle_message(struct localapi *api, struct eventloop *el,
 static int localsock_list_current( struct localapi *api, struct eventloop *el,
                                    int is_empty ) {
   struct persona *p;
+  struct appupdater *au;
+  int au_sts, au_priority, au_queued;
 
   char buf[KITE_MAX_LOCAL_MSG_SZ];
   struct kitelocalmsg *msg;
@@ -1675,6 +1894,43 @@ static int localsock_list_current( struct localapi *api, struct eventloop *el,
 
       return localsock_respond(api, el, buf, sz);
 
+    case KLM_REQ_ENTITY_UPDATE:
+      au = STRUCT_FROM_BASE(struct appupdater, au_shared, cur);
+      appupdater_queue_state(au, &au_sts, &au_priority, &au_queued);
+
+      attr = KLM_NEXTATTR(msg, attr, sizeof(buf));
+      attr->kla_name = htons(KLA_APP_MANIFEST_URL);
+      attr->kla_length = htons(KLA_SIZE(strlen(au->au_url)));
+      if ( !KLA_DATA(attr, msg, sizeof(buf)) ) {
+        fprintf(stderr, "localsock_list_current: update URL is too long\n");
+        return 0;
+      }
+      memcpy(KLA_DATA_UNSAFE(attr, void *), au->au_url, strlen(au->au_url));
+      KLM_SIZE_ADD_ATTR(sz, attr);
+
+      attr = KLM_NEXTATTR(msg, attr, sizeof(buf));
+      assert(attr);
+      attr->kla_name = htons(KLA_UPDATE_STATUS);
+      attr->kla_length = htons(KLA_SIZE(sizeof(uint16_t)));
+      *(KLA_DATA_UNSAFE(attr, uint16_t *)) = htons((uint16_t)(int16_t)au_sts);
+      KLM_SIZE_ADD_ATTR(sz, attr);
+
+      attr = KLM_NEXTATTR(msg, attr, sizeof(buf));
+      assert(attr);
+      attr->kla_name = htons(KLA_UPDATE_PRIORITY);
+      attr->kla_length = htons(KLA_SIZE(sizeof(uint16_t)));
+      *(KLA_DATA_UNSAFE(attr, uint16_t *)) = htons(au_priority);
+      KLM_SIZE_ADD_ATTR(sz, attr);
+
+      attr = KLM_NEXTATTR(msg, attr, sizeof(buf));
+      assert(attr);
+      attr->kla_name = htons(KLA_UPDATE_QUEUE);
+      attr->kla_length = htons(KLA_SIZE(sizeof(uint16_t)));
+      *(KLA_DATA_UNSAFE(attr, uint16_t *)) = htons(au_queued);
+      KLM_SIZE_ADD_ATTR(sz, attr);
+
+      return localsock_respond(api, el, buf, sz);
+
     default:
       fprintf(stderr, "localsock_list_current: unknown entity %d\n", api->la_listing_ent);
       return 0;
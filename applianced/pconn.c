@@ -6,6 +6,8 @@
 #include <stdlib.h>
 #include <signal.h>
 #include <assert.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
 
 #include "pconn.h"
 #include "flock.h"
@@ -62,6 +64,12 @@ struct candsrc {
 #define CS_FLAG_INSECURE   0x2
 // Attempt to create a TURN tunnel if necessary
 #define CS_FLAG_TURN       0x4
+// The kernel coalesces incoming datagrams on this socket (UDP_GRO)
+#define CS_FLAG_GRO        0x8
+// The kernel can segment outgoing datagrams on this socket (UDP_SEGMENT)
+#define CS_FLAG_GSO        0x10
+// The socket came from the flock's server reflexive candidate cache
+#define CS_FLAG_CACHED     0x20
 
 // We have errored out
 #define CS_STATE_ERROR          (-1)
@@ -159,11 +167,16 @@ static int icecand_parse(struct icecand *ic, const char *vls, const char *vle);
 #define OP_PCONN_CONN_CHECK_TIMER_RINGS (EVT_CTL_CUSTOM + 4)
 #define OP_PCONN_CONN_CHECK_TIMEOUT (EVT_CTL_CUSTOM + 5)
 #define OP_PCONN_NEW_TOKEN (EVT_CTL_CUSTOM + 6)
+#define OP_PCONN_PMTU_TIMER (EVT_CTL_CUSTOM + 7)
+#define OP_PCONN_DTLS_HANDSHAKE (EVT_CTL_CUSTOM + 8)
 
 static void pconn_fn(struct eventloop *el, int op, void *arg);
 static void pconn_free(struct pconn *pc);
 
 static int pconn_container_fn(struct container *c, int op, void *argp, ssize_t argl);
+static int pconn_shared_proxy_fn(struct container *c, int op, void *argp, ssize_t argl);
+static int pconn_attach_shared_proxy(struct pconn *pc);
+static void pconn_detach_shared_proxy(struct pconn *pc);
 
 // Call when the pc->pc_state may have changed
 static void pconn_ice_gathering_state_may_change(struct pconn *pc);
@@ -174,6 +187,10 @@ static void pconn_teardown_established(struct pconn *pc);
 
 static void pconn_connectivity_check_succeeds(struct pconn *pc, int cand_pair_ix, int flags);
 
+static void pconn_pmtu_start(struct pconn *pc);
+static void pconn_pmtu_next_probe(struct pconn *pc);
+static void pconn_pmtu_probe_succeeds(struct pconn *pc);
+
 static void pconn_on_new_tokens(struct pconn *pc);
 static void pconn_enable_traffic_deferred(struct pconn *pc);
 
@@ -204,7 +221,8 @@ static struct icecandpair *pconn_find_candidate_pair(struct pconn *pc, struct ca
 
 // Returns 0 if the DTLS is right, -1 otherwise
 static int pconn_ensure_dtls(struct pconn *pc);
-static void pconn_dtls_handshake(struct pconn *pc);
+static void pconn_dtls_handshake(struct pconn *pc, int pkt_sz);
+static void pconn_dtls_run_handshake(struct pconn *pc);
 
 static int pconn_sdp_new_media_fn(void *pc_);
 static int pconn_sdp_media_ctl_fn(void *pc_, int, void *arg);
@@ -264,6 +282,37 @@ static void candsrc_transmit_binding(struct candsrc *src) {
   }
 }
 
+// Adds the server reflexive candidate addr, using cs_local_addr as
+// the related address. Returns non-zero if the candidate was added.
+//
+// pc_mutex must be held
+static int candsrc_add_srflx_candidate(struct candsrc *cs, kite_sock_addr *addr, socklen_t addr_sz) {
+  struct icecand candidate;
+
+  candidate.ic_component = 1;
+  candidate.ic_transport = IPPROTO_UDP;
+  candidate.ic_type = ICE_TYPE_SRFLX;
+
+  assert(addr_sz <= sizeof(candidate.ic_addr));
+  assert(cs->cs_local_addr.ksa.sa_family != AF_UNSPEC);
+  memcpy(&candidate.ic_addr, addr, addr_sz);
+  memcpy(&candidate.ic_raddr, &cs->cs_local_addr, sizeof(candidate.ic_raddr));
+
+  candidate.ic_candsrc_ix = pconn_cs_idx(cs->cs_pconn, cs);
+  assert(candidate.ic_candsrc_ix >= 0);
+
+  if ( pconn_add_ice_candidate(cs->cs_pconn, PCONN_LOCAL_CANDIDATE, &candidate) ) {
+    fprintf(stderr, "This candidate was accepted, so we will keep this alive\n");
+    // If we generate a server reflexive candidate, we have to keep
+    // it alive, per the ICE spec
+    cs->cs_state = CS_STATE_KEEPALIVE;
+    // TODO set a timer to resend a binding request
+    return 1;
+  }
+
+  return 0;
+}
+
 static int candsrc_process_binding_response(struct candsrc *cs, struct stunmsg *msg) {
   kite_sock_addr addr;
   socklen_t addr_sz = sizeof(addr);
@@ -274,36 +323,13 @@ static int candsrc_process_binding_response(struct candsrc *cs, struct stunmsg *
     if ( err < 0 ) {
       fprintf(stderr, "candsrc_receive_response: invalid binding response\n");
     } else {
-      struct icecand candidate;
-
       if ( eventloop_cancel_timer(&cs->cs_pconn->pc_appstate->as_eventloop, &cs->cs_retransmit) )
         PCONN_WUNREF(cs->cs_pconn);
 
-      // Get raddr
-
-      // Note, both these functions need to be called while pc_mutex
-      // is held, but that occurs in the OP_PCONN_SOCKET handler.
-      candidate.ic_component = 1;
-      candidate.ic_transport = IPPROTO_UDP;
-      candidate.ic_type = ICE_TYPE_SRFLX;
-
-      assert(addr_sz <= sizeof(candidate.ic_addr));
-      assert(cs->cs_local_addr.ksa.sa_family != AF_UNSPEC);
-      memcpy(&candidate.ic_addr, &addr, addr_sz);
-      memcpy(&candidate.ic_raddr, &cs->cs_local_addr, sizeof(candidate.ic_raddr));
-
-      candidate.ic_candsrc_ix = pconn_cs_idx(cs->cs_pconn, cs);
-      assert(candidate.ic_candsrc_ix >= 0);
-
-      if ( pconn_add_ice_candidate(cs->cs_pconn, PCONN_LOCAL_CANDIDATE, &candidate) ) {
-        fprintf(stderr, "This candidate was accepted, so we will keep this alive\n");
-        // If we generate a server reflexive candidate, we have to keep
-        // it alive, per the ICE spec
-        cs->cs_state = CS_STATE_KEEPALIVE;
-
+      // Note, this needs to be called while pc_mutex is held, but
+      // that occurs in the OP_PCONN_SOCKET handler.
+      if ( candsrc_add_srflx_candidate(cs, &addr, addr_sz) )
         pconn_ice_gathering_state_may_change(cs->cs_pconn);
-        // TODO set a timer to resend a binding request
-      }
     }
   }
   return 0;
@@ -529,34 +555,21 @@ static void candsrc_send_error_response(struct candsrc *cs, const struct stunmsg
   }
 }
 
-// pconn mutex is locked, so we can use the incoming_pkt buffer
-static int candsrc_handle_response(struct candsrc *cs) {
-  int err, pkt_sz, i;
-  kite_sock_addr peer_addr;
-  socklen_t peer_addr_sz = sizeof(peer_addr);
-
-  pkt_sz = err = recvfrom(cs->cs_socket, cs->cs_pconn->pc_incoming_pkt,
-                          sizeof(cs->cs_pconn->pc_incoming_pkt), 0,
-                          &peer_addr.ksa, &peer_addr_sz);
-  if ( err < 0 ) {
-    if ( errno == EWOULDBLOCK || errno == EAGAIN )
-      return 0;
-    else {
-      perror("candsrc_handle_response: recv");
-      return -1;
-    }
-  }
+// pconn mutex is locked, and the packet of size pkt_sz is in pc_incoming_pkt
+static int candsrc_handle_packet(struct candsrc *cs, int pkt_sz,
+                                 kite_sock_addr *peer_addr, socklen_t peer_addr_sz) {
+  int err, i;
 
   // Check if this is DTLS media
   if ( pkt_sz > 0 && IS_DTLS_PACKET(cs->cs_pconn->pc_incoming_pkt[0]) ) {
     if ( pconn_ensure_dtls(cs->cs_pconn) < 0 ) {
       fprintf(stderr, "Ignoring DTLS packet, because we could not create DTLS context\n");
     } else {
-      (void) BIO_reset(SSL_get_rbio(cs->cs_pconn->pc_dtls));
-      BIO_STATIC_SET_READ_SZ(&cs->cs_pconn->pc_static_pkt_bio, pkt_sz);
       //fprintf(stderr, "Accepting DTLS packet of size %d\n", pkt_sz);
       if ( cs->cs_pconn->pc_state == PCONN_STATE_ESTABLISHED ) {
 	unsigned char my_buf[sizeof(cs->cs_pconn->pc_incoming_pkt)];
+	(void) BIO_reset(SSL_get_rbio(cs->cs_pconn->pc_dtls));
+	BIO_STATIC_SET_READ_SZ(&cs->cs_pconn->pc_static_pkt_bio, pkt_sz);
 	pkt_sz = SSL_read(cs->cs_pconn->pc_dtls, my_buf, sizeof(my_buf));
 	if ( pkt_sz <= 0 ) {
 	  fprintf(stderr, "error while trying to read packet: %d\n", pkt_sz);
@@ -569,11 +582,11 @@ static int candsrc_handle_response(struct candsrc *cs) {
 
 	  bridge_write_from_foreign_pkt(&cs->cs_pconn->pc_appstate->as_bridge,
 					&cs->cs_pconn->pc_container,
-					&peer_addr.ksa, peer_addr_sz,
+					&peer_addr->ksa, peer_addr_sz,
 					my_buf, pkt_sz);
 	}
       } else {
-	pconn_dtls_handshake(cs->cs_pconn);
+	pconn_dtls_handshake(cs->cs_pconn, pkt_sz);
       }
     }
   } else {
@@ -592,6 +605,13 @@ static int candsrc_handle_response(struct candsrc *cs) {
     if ( err == STUN_SUCCESS ) {
       struct stunmsg *msg = (struct stunmsg *)cs->cs_pconn->pc_incoming_pkt;
 
+      // An answer to a path MTU probe means the probe size made it through
+      if ( cs->cs_pconn->pc_pmtu_probe_size &&
+           memcmp(&cs->cs_pconn->pc_pmtu_probe_tx_id, &msg->sm_tx_id, sizeof(msg->sm_tx_id)) == 0 ) {
+        pconn_pmtu_probe_succeeds(cs->cs_pconn);
+        return 0;
+      }
+
       // If this is STUN, attempt to match up
       if ( memcmp(&cs->cs_tx_id, &msg->sm_tx_id, sizeof(msg->sm_tx_id)) == 0 ) {
         candsrc_process_binding_response(cs, msg);
@@ -620,12 +640,12 @@ static int candsrc_handle_response(struct candsrc *cs) {
 
           //fprintf(stderr, "Received binding request\n");
           if ( STUN_REQUEST_TYPE(msg) == STUN_BINDING ) {
-            candsrc_send_binding_response(cs, msg, &peer_addr.ksa, peer_addr_sz);
+            candsrc_send_binding_response(cs, msg, &peer_addr->ksa, peer_addr_sz);
           } else
             fprintf(stderr, "STUN message of unknown type %04x\n", STUN_REQUEST_TYPE(msg));
         } else if ( err > 0 ) { // Error to send back
           candsrc_send_error_response(cs, (struct stunmsg *) cs->cs_pconn->pc_incoming_pkt,
-                                      err, &sv, &peer_addr.ksa, peer_addr_sz);
+                                      err, &sv, &peer_addr->ksa, peer_addr_sz);
         } else {
           fprintf(stderr, "error: stun_validate returned %d: %s\n", err, stun_strerror(err));
         }
@@ -637,9 +657,204 @@ static int candsrc_handle_response(struct candsrc *cs) {
   return 0;
 }
 
+// pconn mutex is locked, so we can use the incoming_pkt buffer
+static int candsrc_handle_response(struct candsrc *cs) {
+  struct pconn *pc = cs->cs_pconn;
+  int err, pkt_sz;
+  kite_sock_addr peer_addr;
+  socklen_t peer_addr_sz = sizeof(peer_addr);
+
+  if ( cs->cs_flags & CS_FLAG_GRO ) {
+    size_t seg_sz, offs, this_sz;
+
+    if ( !pc->pc_gro_pkt ) {
+      pc->pc_gro_pkt = malloc(UDP_GRO_BUF_SIZE);
+      if ( !pc->pc_gro_pkt ) {
+        fprintf(stderr, "candsrc_handle_response: could not allocate GRO buffer\n");
+        return -1;
+      }
+    }
+
+    pkt_sz = err = udp_recv_gro(cs->cs_socket, pc->pc_gro_pkt, UDP_GRO_BUF_SIZE,
+                                &peer_addr.ksa, &peer_addr_sz, &seg_sz);
+    if ( err < 0 ) {
+      if ( errno == EWOULDBLOCK || errno == EAGAIN )
+        return 0;
+      else {
+        perror("candsrc_handle_response: udp_recv_gro");
+        return -1;
+      }
+    }
+
+    // The kernel may have coalesced a train of datagrams from this
+    // peer. Each is handled as if it had been received on its own.
+    for ( offs = 0; offs < pkt_sz; offs += seg_sz ) {
+      this_sz = MIN(seg_sz, pkt_sz - offs);
+      if ( this_sz > sizeof(pc->pc_incoming_pkt) ) {
+        fprintf(stderr, "candsrc_handle_response: dropping oversized datagram of %zu bytes\n", this_sz);
+        continue;
+      }
+
+      memcpy(pc->pc_incoming_pkt, pc->pc_gro_pkt + offs, this_sz);
+      if ( candsrc_handle_packet(cs, this_sz, &peer_addr, peer_addr_sz) < 0 )
+        return -1;
+    }
+
+    return 0;
+  }
+
+  pkt_sz = err = recvfrom(cs->cs_socket, pc->pc_incoming_pkt,
+                          sizeof(pc->pc_incoming_pkt), 0,
+                          &peer_addr.ksa, &peer_addr_sz);
+  if ( err < 0 ) {
+    if ( errno == EWOULDBLOCK || errno == EAGAIN )
+      return 0;
+    else {
+      perror("candsrc_handle_response: recv");
+      return -1;
+    }
+  }
+
+  return candsrc_handle_packet(cs, pkt_sz, &peer_addr, peer_addr_sz);
+}
+
+// Send the datagrams batched up in pc_gso_pkt to the DTLS peer.
+//
+// Returns 0 if the batch was sent (or dropped due to an error), and -1
+// if the socket would block, in which case whatever remains is kept for
+// the next write event.
+static int candsrc_flush_gso(struct candsrc *cs, BIO *dgram) {
+  struct pconn *pc = cs->cs_pconn;
+  kite_sock_addr peer;
+  socklen_t peer_sz;
+  size_t offs = 0, seg_sz;
+  ssize_t err;
+
+  if ( pc->pc_gso_pending == 0 ) return 0;
+
+  memset(&peer, 0, sizeof(peer));
+  err = BIO_ctrl(dgram, BIO_CTRL_DGRAM_GET_PEER, sizeof(peer), &peer);
+  if ( err <= 0 ) {
+    fprintf(stderr, "candsrc_flush_gso: could not get BIO_dgram peer\n");
+    pc->pc_gso_pending = 0;
+    return 0;
+  }
+  peer_sz = err;
+
+  err = udp_send_gso(cs->cs_socket, pc->pc_gso_pkt, pc->pc_gso_pending,
+                     pc->pc_gso_seg_sz, &peer.ksa, peer_sz);
+  if ( err < 0 && errno == EOPNOTSUPP ) {
+    fprintf(stderr, "candsrc_flush_gso: segmentation offload refused, falling back to single datagrams\n");
+    cs->cs_flags &= ~CS_FLAG_GSO;
+
+    for ( offs = 0; offs < pc->pc_gso_pending; offs += seg_sz ) {
+      seg_sz = MIN(pc->pc_gso_seg_sz, pc->pc_gso_pending - offs);
+      err = sendto(cs->cs_socket, pc->pc_gso_pkt + offs, seg_sz, 0,
+                   &peer.ksa, peer_sz);
+      if ( err < 0 ) break;
+    }
+  }
+
+  if ( err < 0 ) {
+    if ( errno == EWOULDBLOCK || errno == EAGAIN ) {
+      memmove(pc->pc_gso_pkt, pc->pc_gso_pkt + offs, pc->pc_gso_pending - offs);
+      pc->pc_gso_pending -= offs;
+      return -1;
+    }
+
+    perror("candsrc_flush_gso: send");
+  }
+
+  pc->pc_gso_pending = 0;
+  return 0;
+}
+
+// Grow pc_gso_pkt to hold at least sz bytes. Returns 0 on success,
+// -1 if it could not be allocated
+static int pconn_reserve_gso(struct pconn *pc, size_t sz) {
+  size_t new_sz;
+  char *new_pkt;
+
+  if ( sz <= pc->pc_gso_pkt_sz ) return 0;
+  if ( sz > UDP_GRO_BUF_SIZE ) return -1;
+
+  new_sz = pc->pc_gso_pkt_sz ? pc->pc_gso_pkt_sz : PCONN_MAX_PACKET_SIZE;
+  while ( new_sz < sz )
+    new_sz *= 2;
+  new_sz = MIN(new_sz, UDP_GRO_BUF_SIZE);
+
+  new_pkt = realloc(pc->pc_gso_pkt, new_sz);
+  if ( !new_pkt ) return -1;
+
+  pc->pc_gso_pkt = new_pkt;
+  pc->pc_gso_pkt_sz = new_sz;
+  return 0;
+}
+
+// Move the DTLS record just written into pc_gso_bio onto the current
+// batch. The kernel requires every segment but the last to be the same
+// size, so a record of a different size closes the batch.
+//
+// Returns 0 on success, -1 if the socket would block. The record then
+// stays in pc_gso_bio, and is queued once the socket is writable
+static int candsrc_queue_gso(struct candsrc *cs, BIO *dgram) {
+  struct pconn *pc = cs->cs_pconn;
+  int rec_sz = BIO_pending(pc->pc_gso_bio);
+
+  if ( rec_sz <= 0 ) return 0;
+
+  if ( pc->pc_gso_pending > 0 &&
+       ( rec_sz > pc->pc_gso_seg_sz ||
+         (pc->pc_gso_pending + rec_sz) > UDP_GRO_BUF_SIZE ||
+         (pc->pc_gso_pending / pc->pc_gso_seg_sz) >= UDP_GSO_MAX_SEGMENTS ) ) {
+    if ( candsrc_flush_gso(cs, dgram) < 0 )
+      return -1;
+  }
+
+  if ( pconn_reserve_gso(pc, pc->pc_gso_pending + rec_sz) < 0 ) {
+    fprintf(stderr, "candsrc_queue_gso: could not grow batch. Not using segmentation offload\n");
+    cs->cs_flags &= ~CS_FLAG_GSO;
+    (void) BIO_reset(pc->pc_gso_bio);
+    return 0;
+  }
+
+  if ( pc->pc_gso_pending == 0 )
+    pc->pc_gso_seg_sz = rec_sz;
+
+  if ( BIO_read(pc->pc_gso_bio, pc->pc_gso_pkt + pc->pc_gso_pending, rec_sz) != rec_sz ) {
+    fprintf(stderr, "candsrc_queue_gso: short read from memory BIO\n");
+    (void) BIO_reset(pc->pc_gso_bio);
+    return 0;
+  }
+  pc->pc_gso_pending += rec_sz;
+
+  // A short segment must be the last one
+  if ( rec_sz < pc->pc_gso_seg_sz )
+    return candsrc_flush_gso(cs, dgram);
+
+  return 0;
+}
+
 static void candsrc_send_outgoing(struct candsrc *cs) {
   struct pconn *pc = cs->cs_pconn;
   char outgoing[PCONN_MAX_PACKET_SIZE];
+  BIO *dgram = NULL;
+  int blocked = 0;
+
+  if ( (cs->cs_flags & CS_FLAG_GSO) && pc->pc_gso_bio ) {
+    // Have OpenSSL write records into pc_gso_bio rather than the
+    // socket, so that runs of records can be sent with one system call
+    dgram = SSL_get_wbio(pc->pc_dtls);
+    if ( candsrc_flush_gso(cs, dgram) < 0 ||
+         candsrc_queue_gso(cs, dgram) < 0 ) {
+      CANDSRC_SUBSCRIBE_WRITE(cs);
+      return;
+    }
+
+    BIO_up_ref(dgram);
+    BIO_up_ref(pc->pc_gso_bio);
+    SSL_set0_wbio(pc->pc_dtls, pc->pc_gso_bio);
+  }
 
   while ( pc->pc_outgoing_size > 4 ) {
     int err;
@@ -702,17 +917,40 @@ static void candsrc_send_outgoing(struct candsrc *cs) {
       //      fprintf(stderr, "candsrc_send_outgoing: sent packet of size %u. Next offset is %lu\n", sz, next_offs);
       pc->pc_outgoing_offs = next_offs;
       pc->pc_outgoing_size -= 4 + sz;
+
+      if ( dgram && candsrc_queue_gso(cs, dgram) < 0 ) {
+        blocked = 1;
+        break;
+      }
     }
   }
 
   if ( pc->pc_outgoing_size < 4 ) pc->pc_outgoing_size = 0;
+
+  if ( dgram ) {
+    if ( candsrc_flush_gso(cs, dgram) < 0 ||
+         candsrc_queue_gso(cs, dgram) < 0 ||
+         candsrc_flush_gso(cs, dgram) < 0 )
+      blocked = 1;
+
+    // Whatever is left goes out on the next write event
+    if ( blocked || pc->pc_outgoing_size > 0 )
+      CANDSRC_SUBSCRIBE_WRITE(cs);
+
+    SSL_set0_wbio(pc->pc_dtls, dgram);
+  }
   return;
 }
 
-static void candsrc_send_connectivity_check(struct candsrc *cs) {
-  struct icecandpair *pair = cs->cs_scheduled_connectivity_check;
-  struct icecand *remote;
-  struct stunmsg msg;
+// Format an ICE connectivity check to the remote candidate in msg,
+// which has room for msg_sz bytes. If padded_sz is non-zero, the
+// message is padded to exactly padded_sz bytes.
+//
+// Returns the message length on success, -1 on error
+static int candsrc_format_connectivity_check(struct candsrc *cs, struct icecand *remote,
+                                             const struct stuntxid *tx_id,
+                                             struct stunmsg *msg, int msg_sz,
+                                             int padded_sz) {
   struct stunattr *attr;
   int remote_ufrag_len, err;
 
@@ -720,24 +958,6 @@ static void candsrc_send_connectivity_check(struct candsrc *cs) {
   uint32_t peer_priority;
   uint64_t tie_breaker_network = htonll(cs->cs_pconn->pc_tie_breaker);
 
-  cs->cs_scheduled_connectivity_check = NULL;
-
-  if ( !PCONN_READY_FOR_ICE(cs->cs_pconn) ) {
-    fprintf(stderr, "candsrc_send_connectivity_check: failed because we're not ready for ice\n");
-    return;
-  }
-
-  if ( !pair || pair->icp_remote_ix >= cs->cs_pconn->pc_remote_ice_candidates_count ) {
-    fprintf(stderr, "candsrc_send_connectivity_check: invalid pair or remote ix out of range\n");
-    return;
-  }
-
-  remote = &cs->cs_pconn->pc_remote_ice_candidates[pair->icp_remote_ix];
-  if ( !remote ) {
-    fprintf(stderr, "candsrc_send_connectivity_check: NULL in pc_remote_ice_candidates\n");
-    return;
-  }
-
   fake_peer.ic_component = remote->ic_component;
   fake_peer.ic_transport = remote->ic_transport;
   fake_peer.ic_type = ICE_TYPE_PRFLX;
@@ -747,54 +967,101 @@ static void candsrc_send_connectivity_check(struct candsrc *cs) {
   // attributes. If we're in the controlling role, then we should send USE-CANDIDATE and
   // ICE-CONTROLLING attributes as well. Otherwise, send ICE-CONTROLLED
 
-  STUN_INIT_MSG(&msg, STUN_BINDING);
-  memcpy(&msg.sm_tx_id, &pair->icp_tx_id, sizeof(msg.sm_tx_id));
+  STUN_INIT_MSG(msg, STUN_BINDING);
+  memcpy(&msg->sm_tx_id, tx_id, sizeof(msg->sm_tx_id));
 
-  attr = STUN_FIRSTATTR(&msg);
+  attr = STUN_FIRSTATTR(msg);
   remote_ufrag_len = strlen(cs->cs_pconn->pc_remote_ufrag);
-  assert( STUN_CAN_WRITE_ATTR(attr, &msg, sizeof(msg)) );
+  assert( STUN_CAN_WRITE_ATTR(attr, msg, msg_sz) );
   STUN_INIT_ATTR(attr, STUN_ATTR_USERNAME, PCONN_OUR_UFRAG_SIZE + 1 + remote_ufrag_len);
-  assert( STUN_ATTR_IS_VALID(attr, &msg, sizeof(msg)) );
+  assert( STUN_ATTR_IS_VALID(attr, msg, msg_sz) );
   memcpy(STUN_ATTR_DATA(attr), cs->cs_pconn->pc_remote_ufrag, remote_ufrag_len);
   memcpy(STUN_ATTR_DATA(attr) + remote_ufrag_len, ":", 1);
   memcpy(STUN_ATTR_DATA(attr) + remote_ufrag_len + 1, cs->cs_pconn->pc_our_ufrag, PCONN_OUR_UFRAG_SIZE);
 
   attr = STUN_NEXTATTR(attr);
-  assert( STUN_CAN_WRITE_ATTR(attr, &msg, sizeof(msg)) );
+  assert( STUN_CAN_WRITE_ATTR(attr, msg, msg_sz) );
   STUN_INIT_ATTR(attr, STUN_ATTR_PRIORITY, sizeof(peer_priority));
-  assert( STUN_ATTR_IS_VALID(attr, &msg, sizeof(msg)) );
+  assert( STUN_ATTR_IS_VALID(attr, msg, msg_sz) );
   memcpy(STUN_ATTR_DATA(attr), &peer_priority, sizeof(peer_priority));
 
   attr = STUN_NEXTATTR(attr);
-  assert( STUN_CAN_WRITE_ATTR(attr, &msg, sizeof(msg)) );
+  assert( STUN_CAN_WRITE_ATTR(attr, msg, msg_sz) );
   STUN_INIT_ATTR(attr,
                  (cs->cs_pconn->pc_ice_role == ICE_ROLE_CONTROLLING ?
                   STUN_ATTR_ICE_CONTROLLING :
                   STUN_ATTR_ICE_CONTROLLED),
                  sizeof(tie_breaker_network));
-  assert( STUN_ATTR_IS_VALID(attr, &msg, sizeof(msg)) );
+  assert( STUN_ATTR_IS_VALID(attr, msg, msg_sz) );
   memcpy(STUN_ATTR_DATA(attr), &tie_breaker_network, sizeof(tie_breaker_network));
 
   if ( cs->cs_pconn->pc_ice_role == ICE_ROLE_CONTROLLING ) {
     attr = STUN_NEXTATTR(attr);
-    assert( STUN_CAN_WRITE_ATTR(attr, &msg, sizeof(msg)) );
+    assert( STUN_CAN_WRITE_ATTR(attr, msg, msg_sz) );
     STUN_INIT_ATTR(attr, STUN_ATTR_USE_CANDIDATE, 0);
   }
 
+  if ( padded_sz > 0 ) {
+    // Room left once the padding header, MESSAGE-INTEGRITY and
+    // FINGERPRINT are accounted for
+    int pad_sz = padded_sz - (((uintptr_t) STUN_NEXTATTR(attr)) - ((uintptr_t) msg)) -
+      sizeof(struct stunattr) -
+      (sizeof(struct stunattr) + STUN_MESSAGE_INTEGRITY_LENGTH) -
+      (sizeof(struct stunattr) + 4);
+    if ( pad_sz < 0 || padded_sz > msg_sz ) return -1;
+
+    attr = STUN_NEXTATTR(attr);
+    assert( STUN_CAN_WRITE_ATTR(attr, msg, msg_sz) );
+    STUN_INIT_ATTR(attr, STUN_ATTR_KITE_PADDING, pad_sz);
+    assert( STUN_ATTR_IS_VALID(attr, msg, msg_sz) );
+    memset(STUN_ATTR_DATA(attr), 0, pad_sz);
+  }
+
   attr = STUN_NEXTATTR(attr);
-  err = stun_add_message_integrity(&attr, &msg, sizeof(msg), cs->cs_pconn->pc_remote_pwd, strlen(cs->cs_pconn->pc_remote_pwd));
+  err = stun_add_message_integrity(&attr, msg, msg_sz, cs->cs_pconn->pc_remote_pwd, strlen(cs->cs_pconn->pc_remote_pwd));
   if ( err < 0 ) {
     fprintf(stderr, "Could not add message integrity to connectivity check\n");
-    return;
+    return -1;
   }
 
-  STUN_FINISH_WITH_FINGERPRINT(attr, &msg, sizeof(msg), err);
+  STUN_FINISH_WITH_FINGERPRINT(attr, msg, msg_sz, err);
   if ( err < 0 ) {
     fprintf(stderr, "Could not add fingerprint to connectivity check\n");
+    return -1;
+  }
+
+  return STUN_MSG_LENGTH(msg);
+}
+
+static void candsrc_send_connectivity_check(struct candsrc *cs) {
+  struct icecandpair *pair = cs->cs_scheduled_connectivity_check;
+  struct icecand *remote;
+  struct stunmsg msg;
+  int msg_sz, err;
+
+  cs->cs_scheduled_connectivity_check = NULL;
+
+  if ( !PCONN_READY_FOR_ICE(cs->cs_pconn) ) {
+    fprintf(stderr, "candsrc_send_connectivity_check: failed because we're not ready for ice\n");
+    return;
+  }
+
+  if ( !pair || pair->icp_remote_ix >= cs->cs_pconn->pc_remote_ice_candidates_count ) {
+    fprintf(stderr, "candsrc_send_connectivity_check: invalid pair or remote ix out of range\n");
+    return;
+  }
+
+  remote = &cs->cs_pconn->pc_remote_ice_candidates[pair->icp_remote_ix];
+  if ( !remote ) {
+    fprintf(stderr, "candsrc_send_connectivity_check: NULL in pc_remote_ice_candidates\n");
     return;
   }
 
-  err = sendto(cs->cs_socket, &msg, STUN_MSG_LENGTH(&msg), 0,
+  msg_sz = candsrc_format_connectivity_check(cs, remote, &pair->icp_tx_id,
+                                             &msg, sizeof(msg), 0);
+  if ( msg_sz < 0 ) return;
+
+  err = sendto(cs->cs_socket, &msg, msg_sz, 0,
                &remote->ic_addr.ksa, sizeof(remote->ic_addr));
   if ( err < 0 ) {
     err = errno;
@@ -806,6 +1073,61 @@ static void candsrc_send_connectivity_check(struct candsrc *cs) {
   }
 }
 
+// Send a connectivity check padded to probe_sz bytes, as a path MTU
+// probe. Only the probe is sent with IP_PMTUDISC_PROBE, so that it is
+// never fragmented, even past the kernel's own path MTU estimate. The
+// socket's setting is restored for DTLS records, which must not be
+// black-holed while the search is on. pconn mutex must be held, since
+// every send on the socket happens under it.
+//
+// Returns 0 if the probe was sent, -1 if it could not be (including
+// if it is larger than the local interface MTU)
+static int candsrc_send_pmtu_probe(struct candsrc *cs, struct icecand *remote,
+                                   const struct stuntxid *tx_id, int probe_sz) {
+  char buf[PCONN_PMTU_MAX_IPV4];
+  struct stunmsg *msg = (struct stunmsg *) buf;
+  int msg_sz, err, level, opt, pmtudisc, old_pmtudisc, saved_errno;
+  socklen_t old_pmtudisc_sz = sizeof(old_pmtudisc);
+
+  memset(buf, 0, sizeof(buf));
+
+  msg_sz = candsrc_format_connectivity_check(cs, remote, tx_id, msg, sizeof(buf), probe_sz);
+  if ( msg_sz < 0 ) return -1;
+
+  if ( remote->ic_addr.ksa.sa_family == AF_INET6 ) {
+    level = IPPROTO_IPV6;
+    opt = IPV6_MTU_DISCOVER;
+    pmtudisc = IPV6_PMTUDISC_PROBE;
+  } else {
+    level = IPPROTO_IP;
+    opt = IP_MTU_DISCOVER;
+    pmtudisc = IP_PMTUDISC_PROBE;
+  }
+
+  if ( getsockopt(cs->cs_socket, level, opt, &old_pmtudisc, &old_pmtudisc_sz) < 0 ||
+       setsockopt(cs->cs_socket, level, opt, &pmtudisc, sizeof(pmtudisc)) < 0 ) {
+    perror("candsrc_send_pmtu_probe: setsockopt");
+    errno = 0;
+    return -1;
+  }
+
+  err = sendto(cs->cs_socket, buf, msg_sz, 0,
+               &remote->ic_addr.ksa, sizeof(remote->ic_addr));
+  saved_errno = errno;
+
+  if ( setsockopt(cs->cs_socket, level, opt, &old_pmtudisc, sizeof(old_pmtudisc)) < 0 )
+    perror("candsrc_send_pmtu_probe: setsockopt(restore)");
+
+  if ( err < 0 ) {
+    errno = saved_errno;
+    if ( errno != EMSGSIZE && errno != EWOULDBLOCK )
+      perror("candsrc_send_pmtu_probe: sendto");
+    return -1;
+  }
+
+  return 0;
+}
+
 // Adds the given cand src's host candidate to the pconn. pconn_mutex
 // must be held.
 //
@@ -814,9 +1136,20 @@ static void candsrc_send_connectivity_check(struct candsrc *cs) {
 //
 // According to http://man7.org/linux/man-pages/man2/connect.2.html
 // connecting to AF_UNSPEC disconnects the socket.x
+static void candsrc_report_host_candidate(struct candsrc *cs, int cs_idx, socklen_t addrsz) {
+  struct icecand candidate;
+
+  candidate.ic_component = 1;
+  candidate.ic_transport = IPPROTO_UDP;
+  candidate.ic_type = ICE_TYPE_HOST;
+  memcpy(&candidate.ic_addr, &cs->cs_local_addr, addrsz);
+  candidate.ic_candsrc_ix = cs_idx;
+
+  pconn_add_ice_candidate(cs->cs_pconn, PCONN_LOCAL_CANDIDATE, &candidate);
+}
+
 static void candsrc_add_host_candidate(struct candsrc *cs) {
   socklen_t addrsz = sizeof(cs->cs_local_addr);
-  struct icecand candidate;
   struct sockaddr disconnect_addr;
   int err, cs_idx;
 
@@ -832,13 +1165,7 @@ static void candsrc_add_host_candidate(struct candsrc *cs) {
     return;
   }
 
-  candidate.ic_component = 1;
-  candidate.ic_transport = IPPROTO_UDP;
-  candidate.ic_type = ICE_TYPE_HOST;
-  memcpy(&candidate.ic_addr, &cs->cs_local_addr, addrsz);
-  candidate.ic_candsrc_ix = cs_idx;
-
-  pconn_add_ice_candidate(cs->cs_pconn, PCONN_LOCAL_CANDIDATE, &candidate);
+  candsrc_report_host_candidate(cs, cs_idx, addrsz);
 
   // Now disconnect and rebind the socket
   disconnect_addr.sa_family = AF_UNSPEC;
@@ -891,10 +1218,37 @@ uint64_t icecand_pair_priority(struct pconn *pc, struct icecand *local, struct i
   return ((g < d ? g : d) << 32) + 2 * (g > d ? g : d) + (g > d ? 1 : 0);
 }
 
+// Sets up a candidate source whose socket was taken from the flock's
+// server reflexive candidate cache. Both candidates are known, so no
+// binding request needs to be sent.
+static void candsrc_start_cached(struct candsrc *cs, kite_sock_addr *srflx_addr) {
+  struct pconn *pc = cs->cs_pconn;
+
+  if ( udp_enable_gro(cs->cs_socket) )
+    cs->cs_flags |= CS_FLAG_GRO;
+  if ( udp_gso_supported(cs->cs_socket) )
+    cs->cs_flags |= CS_FLAG_GSO;
+
+  cs->cs_host_candidate_added = 1;
+  timersub_init_default(&cs->cs_retransmit, OP_PCONN_CANDSRC_RETRANSMIT, pconn_fn);
+
+  SAFE_MUTEX_LOCK(&pc->pc_mutex);
+  candsrc_report_host_candidate(cs, pconn_cs_idx(pc, cs), sizeof(cs->cs_local_addr));
+  if ( !candsrc_add_srflx_candidate(cs, srflx_addr, sizeof(*srflx_addr)) )
+    cs->cs_state = CS_STATE_DONE;
+  pthread_mutex_unlock(&pc->pc_mutex);
+
+  fdsub_init(&cs->cs_socket_sub, &pc->pc_appstate->as_eventloop,
+             cs->cs_socket, OP_PCONN_SOCKET, pconn_fn);
+
+  CANDSRC_SUBSCRIBE_READ(cs);
+}
+
 static void pconn_delayed_start(struct pconn *pc) {
   struct appstate *app = pc->pc_appstate;
   struct flock *cur_flock, *tmp_flock;
-  int err;
+  kite_sock_addr srflx_addr;
+  int err, any_cached = 0;
 
   pc->pc_ice_gathering_state = PCONN_ICE_GATHERING_STATE_GATHERING;
   // Collect all flocks and personas
@@ -930,6 +1284,13 @@ static void pconn_delayed_start(struct pconn *pc) {
 
         stun_random_tx_id(&cursrc->cs_tx_id);
 
+        // Skip the binding request if the flock already has a socket
+        // with a known mapping
+        if ( (cursrc->cs_flags & CS_FLAG_INSECURE) &&
+             flock_take_srflx(cur_flock, &app->as_eventloop, &cursrc->cs_socket,
+                              &cursrc->cs_local_addr, &srflx_addr) == 0 )
+          cursrc->cs_flags |= CS_FLAG_CACHED;
+
         pthread_mutex_unlock(&cur_flock->f_mutex);
       } else {
         // TODO stop pconn
@@ -938,6 +1299,12 @@ static void pconn_delayed_start(struct pconn *pc) {
         continue;
       }
 
+      if ( cursrc->cs_flags & CS_FLAG_CACHED ) {
+        candsrc_start_cached(cursrc, &srflx_addr);
+        any_cached = 1;
+        continue;
+      }
+
       // Open socket
       cursrc->cs_socket = socket(cursrc->cs_svr.ksa.sa_family, SOCK_DGRAM, 0);
       if ( cursrc->cs_socket < 0 ) {
@@ -950,6 +1317,11 @@ static void pconn_delayed_start(struct pconn *pc) {
           perror("pconn_delayed_start: set_socket_nonblocking");
         }
 
+        if ( udp_enable_gro(cursrc->cs_socket) )
+          cursrc->cs_flags |= CS_FLAG_GRO;
+        if ( udp_gso_supported(cursrc->cs_socket) )
+          cursrc->cs_flags |= CS_FLAG_GSO;
+
         // Attempt to connect to the given endpoint
         err = connect(cursrc->cs_socket, &cursrc->cs_svr.ksa, sizeof(cursrc->cs_svr));
         if ( err < 0 ) {
@@ -978,6 +1350,12 @@ static void pconn_delayed_start(struct pconn *pc) {
   } else
     fprintf(stderr, "pconn_delayed_start: out of memory to store flocks\n");
   pthread_rwlock_unlock(&app->as_flocks_mutex);
+
+  if ( any_cached ) {
+    SAFE_MUTEX_LOCK(&pc->pc_mutex);
+    pconn_ice_gathering_state_may_change(pc);
+    pthread_mutex_unlock(&pc->pc_mutex);
+  }
 }
 
 static void pconn_fn(struct eventloop *el, int op, void *arg) {
@@ -1029,6 +1407,23 @@ static void pconn_fn(struct eventloop *el, int op, void *arg) {
       PCONN_UNREF(pc);
     }
 
+    break;
+  case OP_PCONN_PMTU_TIMER:
+    pc = STRUCT_FROM_BASE(struct pconn, pc_pmtu_timer, evt->qde_sub);
+    if ( PCONN_LOCK(pc) == 0 ) {
+      SAFE_MUTEX_LOCK(&pc->pc_mutex);
+      if ( pc->pc_state == PCONN_STATE_ESTABLISHED )
+        pconn_pmtu_next_probe(pc);
+      pthread_mutex_unlock(&pc->pc_mutex);
+      PCONN_UNREF(pc);
+    }
+    break;
+  case OP_PCONN_DTLS_HANDSHAKE:
+    pc = STRUCT_FROM_BASE(struct pconn, pc_dtls_handshake_evt, evt->qde_sub);
+    if ( PCONN_LOCK(pc) == 0 ) {
+      pconn_dtls_run_handshake(pc);
+      PCONN_UNREF(pc);
+    }
     break;
   case OP_PCONN_CONN_CHECK_TIMER_RINGS:
     pc = STRUCT_FROM_BASE(struct pconn, pc_conn_check_timer, evt->qde_sub);
@@ -1111,11 +1506,12 @@ static void pconn_fn(struct eventloop *el, int op, void *arg) {
            pc->pc_state == PCONN_STATE_DTLS_CONNECTING ) {
         //fprintf(stderr, "do handshake\n");
         if ( pc->pc_dtls_needs_write )
-          pconn_dtls_handshake(pc);
+          pconn_dtls_handshake(pc, 0);
       } else if ( local_cand &&
                   pc->pc_state == PCONN_STATE_ESTABLISHED &&
                   pconn_cs_idx(pc, cs) == local_cand->ic_candsrc_ix &&
-                  pc->pc_outgoing_size > 0 ) {
+                  (pc->pc_outgoing_size > 0 || pc->pc_gso_pending > 0 ||
+                   (pc->pc_gso_bio && BIO_pending(pc->pc_gso_bio) > 0)) ) {
         //        fprintf(stderr, "candsrc_send_outgoing being called\n");
         candsrc_send_outgoing(cs);
       }
@@ -1185,6 +1581,8 @@ struct pconn *pconn_alloc(uint64_t conn_id, struct flock *f, struct appstate *as
   ret->pc_sctp_port = DEFAULT_SCTP_PORT;
   ret->pc_dtls = NULL;
   ret->pc_dtls_needs_write = ret->pc_dtls_needs_read = 0;
+  ret->pc_dtls_busy = ret->pc_dtls_again = 0;
+  ret->pc_dtls_queue_head = ret->pc_dtls_queue_count = 0;
   ret->pc_is_logged_in = 0;
   ret->pc_is_guest = 0;
 
@@ -1205,6 +1603,7 @@ struct pconn *pconn_alloc(uint64_t conn_id, struct flock *f, struct appstate *as
     free(ret);
     return NULL;
   }
+  ret->pc_container.c_pool = &as->as_pconn_pool;
 
   ret->pc_appstate = as;
   ret->pc_flock = f;
@@ -1236,6 +1635,13 @@ struct pconn *pconn_alloc(uint64_t conn_id, struct flock *f, struct appstate *as
   ret->pc_outgoing_size = 0;
   ret->pc_outgoing_offs = 0;
 
+  ret->pc_gro_pkt = NULL;
+  ret->pc_gso_bio = NULL;
+  ret->pc_gso_pending = 0;
+  ret->pc_gso_seg_sz = 0;
+  ret->pc_gso_pkt = NULL;
+  ret->pc_gso_pkt_sz = 0;
+
   ret->pc_answer_flags = 0;
   ret->pc_answer_sctp = 0;
   ret->pc_remote_cert_fingerprint_digest = NULL;
@@ -1244,6 +1650,8 @@ struct pconn *pconn_alloc(uint64_t conn_id, struct flock *f, struct appstate *as
 
   ret->pc_tokens = NULL;
   ret->pc_apps = NULL;
+  ret->pc_shares_proxy = 0;
+  ret->pc_next_webrtc_session = NULL;
 
   ret->pc_static_pkt_bio.bs_buf = ret->pc_incoming_pkt;
   BIO_STATIC_SET_READ_SZ(&ret->pc_static_pkt_bio, 0);
@@ -1269,8 +1677,15 @@ struct pconn *pconn_alloc(uint64_t conn_id, struct flock *f, struct appstate *as
   timersub_init_from_now(&ret->pc_timeout, PCONN_TIMEOUT, OP_PCONN_EXPIRES, pconn_fn);
   timersub_init_default(&ret->pc_conn_check_timer, OP_PCONN_CONN_CHECK_TIMER_RINGS, pconn_fn);
   timersub_init_default(&ret->pc_conn_check_timeout_timer, OP_PCONN_CONN_CHECK_TIMEOUT, pconn_fn);
+  timersub_init_default(&ret->pc_pmtu_timer, OP_PCONN_PMTU_TIMER, pconn_fn);
+  ret->pc_pmtu_state = PCONN_PMTU_DISABLED;
+  ret->pc_pmtu = PCONN_PMTU_BASE;
+  ret->pc_pmtu_search_high = PCONN_PMTU_BASE;
+  ret->pc_pmtu_probe_size = 0;
+  ret->pc_pmtu_probe_count = 0;
   qdevtsub_init(&ret->pc_start_evt, OP_PCONN_STARTS, pconn_fn);
   qdevtsub_init(&ret->pc_new_token_evt, OP_PCONN_NEW_TOKEN, pconn_fn);
+  qdevtsub_init(&ret->pc_dtls_handshake_evt, OP_PCONN_DTLS_HANDSHAKE, pconn_fn);
 
   return ret;
 }
@@ -1347,6 +1762,22 @@ static void pconn_free(struct pconn *pc) {
     pc->pc_dtls = NULL;
   }
 
+  if ( pc->pc_gso_bio ) {
+    BIO_free(pc->pc_gso_bio);
+    pc->pc_gso_bio = NULL;
+  }
+
+  if ( pc->pc_gro_pkt ) {
+    free(pc->pc_gro_pkt);
+    pc->pc_gro_pkt = NULL;
+  }
+
+  if ( pc->pc_gso_pkt ) {
+    free(pc->pc_gso_pkt);
+    pc->pc_gso_pkt = NULL;
+    pc->pc_gso_pkt_sz = 0;
+  }
+
   pthread_mutex_unlock(&pc->pc_mutex);
 
   pthread_mutex_destroy(&pc->pc_mutex);
@@ -1630,6 +2061,10 @@ void pconn_finish(struct pconn *pc) {
   if ( eventloop_cancel_timer(&pc->pc_appstate->as_eventloop, &pc->pc_timeout) )
     PCONN_WUNREF(pc);
 
+  if ( eventloop_cancel_timer(&pc->pc_appstate->as_eventloop, &pc->pc_pmtu_timer) )
+    PCONN_WUNREF(pc);
+  pc->pc_pmtu_state = PCONN_PMTU_DISABLED;
+
   SHARED_DEBUG(&pc->pc_shared, "after cancel timers");
 
   for ( i = 0; i < pc->pc_candidate_sources_count; ++i ) {
@@ -1883,8 +2318,16 @@ static void pconn_activate_best_pair(struct pconn *pc) {
       FORMAT_ICE_CANDIDATE(&pc->pc_local_ice_candidates[ new_pair->icp_local_ix ], dbgprintf);
       fprintf(stderr, "(cs ix: %d)\n  Remote: ",pc->pc_local_ice_candidates[ new_pair->icp_local_ix ].ic_candsrc_ix);
       FORMAT_ICE_CANDIDATE(&pc->pc_remote_ice_candidates[ new_pair->icp_remote_ix ], dbgprintf);
-    } else
+    } else if ( pc->pc_active_candidate_pair != i ) {
       pc->pc_active_candidate_pair = i;
+
+      // What was confirmed for the old path says nothing about the
+      // new one
+      if ( pc->pc_pmtu_state != PCONN_PMTU_DISABLED ) {
+        fprintf(stderr, "pconn_activate_best_pair: active pair changed, restarting path MTU search\n");
+        pconn_pmtu_start(pc);
+      }
+    }
   }
 }
 
@@ -1942,6 +2385,152 @@ static void pconn_reset_connectivity_check_timeout(struct pconn *pc) {
   eventloop_subscribe_timer(&pc->pc_appstate->as_eventloop, &pc->pc_conn_check_timeout_timer);
 }
 
+// Path MTU discovery
+//
+// Once DTLS is established, we search for the path MTU by sending
+// connectivity checks padded to the probe size on the active
+// candidate pair (RFC 8899, section 4.1). A response means the probe
+// size made it to the peer. A probe size is given up on after
+// PCONN_PMTU_MAX_PROBES unanswered probes.
+//
+// The result caps the DTLS record size. Once the search completes,
+// SCTP packets from the container that would not fit in one DTLS
+// record are answered with an ICMP 'fragmentation needed', so that
+// the SCTP stack in webrtc-proxy lowers its path MTU accordingly.
+
+static struct candsrc *pconn_active_candsrc(struct pconn *pc, struct icecand **remote) {
+  struct icecandpair *pair;
+  struct icecand *local;
+
+  if ( pc->pc_active_candidate_pair < 0 ||
+       pc->pc_active_candidate_pair >= pc->pc_candidate_pairs_count ) return NULL;
+
+  pair = pc->pc_candidate_pairs_sorted[pc->pc_active_candidate_pair];
+  if ( !pair || pair->icp_local_ix >= pc->pc_local_ice_candidates_count ||
+       pair->icp_remote_ix >= pc->pc_remote_ice_candidates_count ) return NULL;
+
+  local = &pc->pc_local_ice_candidates[pair->icp_local_ix];
+  if ( local->ic_candsrc_ix < 0 || local->ic_candsrc_ix >= pc->pc_candidate_sources_count )
+    return NULL;
+
+  *remote = &pc->pc_remote_ice_candidates[pair->icp_remote_ix];
+  return &pc->pc_candidate_sources[local->ic_candsrc_ix];
+}
+
+static void pconn_pmtu_schedule(struct pconn *pc, int millis) {
+  if ( !eventloop_cancel_timer(&pc->pc_appstate->as_eventloop, &pc->pc_pmtu_timer) ) {
+    PCONN_WREF(pc);
+  }
+  timersub_set_from_now(&pc->pc_pmtu_timer, millis);
+  eventloop_subscribe_timer(&pc->pc_appstate->as_eventloop, &pc->pc_pmtu_timer);
+}
+
+static void pconn_pmtu_apply(struct pconn *pc) {
+  fprintf(stderr, "pconn_pmtu_apply: path MTU is now %u\n", pc->pc_pmtu);
+
+  if ( pc->pc_dtls ) {
+    // We set the MTU ourselves, so don't let OpenSSL ask the BIO
+    SSL_set_options(pc->pc_dtls, SSL_OP_NO_QUERY_MTU);
+    if ( !SSL_set_mtu(pc->pc_dtls, pc->pc_pmtu) ) {
+      fprintf(stderr, "pconn_pmtu_apply: could not set DTLS MTU\n");
+      ERR_print_errors_fp(stderr);
+    }
+  }
+}
+
+// (Re)start the search on the active candidate pair. Until a size is
+// confirmed, DTLS records are kept to PCONN_PMTU_BASE
+static void pconn_pmtu_start(struct pconn *pc) {
+  struct icecand *remote;
+  struct candsrc *cs = pconn_active_candsrc(pc, &remote);
+
+  if ( !cs ) {
+    fprintf(stderr, "pconn_pmtu_start: no active candidate pair\n");
+    return;
+  }
+
+  if ( remote->ic_addr.ksa.sa_family == AF_INET6 )
+    pc->pc_pmtu_search_high = PCONN_PMTU_MAX_IPV6;
+  else
+    pc->pc_pmtu_search_high = PCONN_PMTU_MAX_IPV4;
+
+  pc->pc_pmtu_state = PCONN_PMTU_SEARCHING;
+  pc->pc_pmtu = PCONN_PMTU_BASE;
+  pc->pc_pmtu_probe_size = 0;
+  pc->pc_pmtu_probe_count = 0;
+
+  pconn_pmtu_apply(pc);
+  pconn_pmtu_schedule(pc, 0);
+}
+
+static void pconn_pmtu_next_probe(struct pconn *pc) {
+  struct icecand *remote;
+  struct candsrc *cs;
+
+  switch ( pc->pc_pmtu_state ) {
+  case PCONN_PMTU_SEARCH_COMPLETE:
+    // The raise timer went off. See if the path can take more now
+    pc->pc_pmtu_state = PCONN_PMTU_SEARCHING;
+    pc->pc_pmtu_search_high = PCONN_PMTU_MAX_IPV4;
+    break;
+  case PCONN_PMTU_SEARCHING:
+    break;
+  default:
+    return;
+  }
+
+  cs = pconn_active_candsrc(pc, &remote);
+  if ( !cs ) return;
+
+  if ( remote->ic_addr.ksa.sa_family == AF_INET6 )
+    pc->pc_pmtu_search_high = MIN(pc->pc_pmtu_search_high, PCONN_PMTU_MAX_IPV6);
+
+  if ( pc->pc_pmtu_probe_size &&
+       pc->pc_pmtu_probe_count >= PCONN_PMTU_MAX_PROBES ) {
+    // This size does not make it through
+    pc->pc_pmtu_search_high = pc->pc_pmtu_probe_size - 1;
+    pc->pc_pmtu_probe_size = 0;
+    pc->pc_pmtu_probe_count = 0;
+  }
+
+  if ( !pc->pc_pmtu_probe_size ) {
+    if ( (pc->pc_pmtu_search_high - pc->pc_pmtu) < PCONN_PMTU_SEARCH_GRANULARITY ) {
+      pc->pc_pmtu_state = PCONN_PMTU_SEARCH_COMPLETE;
+      pconn_pmtu_apply(pc);
+      pconn_pmtu_schedule(pc, PCONN_PMTU_RAISE_TIMEOUT);
+      return;
+    }
+
+    // STUN messages are always a multiple of four bytes
+    pc->pc_pmtu_probe_size = ((pc->pc_pmtu + pc->pc_pmtu_search_high + 1) / 2) & ~3;
+  }
+
+  // Each probe gets its own transaction, so late answers to earlier
+  // probes do not confirm a larger size
+  stun_random_tx_id(&pc->pc_pmtu_probe_tx_id);
+  pc->pc_pmtu_probe_count++;
+
+  if ( candsrc_send_pmtu_probe(cs, remote, &pc->pc_pmtu_probe_tx_id,
+                               pc->pc_pmtu_probe_size) < 0 &&
+       errno == EMSGSIZE ) {
+    // Larger than the local interface allows
+    pc->pc_pmtu_probe_count = PCONN_PMTU_MAX_PROBES;
+    pconn_pmtu_schedule(pc, 0);
+  } else
+    pconn_pmtu_schedule(pc, PCONN_PMTU_PROBE_TIMEOUT);
+}
+
+static void pconn_pmtu_probe_succeeds(struct pconn *pc) {
+  if ( pc->pc_pmtu_state != PCONN_PMTU_SEARCHING ) return;
+
+  pc->pc_pmtu = pc->pc_pmtu_probe_size;
+  pc->pc_pmtu_probe_size = 0;
+  pc->pc_pmtu_probe_count = 0;
+
+  pconn_pmtu_apply(pc);
+  pconn_pmtu_schedule(pc, 0);
+}
+
 static int cmp_candidates(const void *app, const void *bpp) {
   const struct icecandpair *const *ap = app, *const *bp = bpp;
 
@@ -2659,6 +3248,16 @@ static int pconn_ensure_dtls(struct pconn *pc) {
 
   SSL_set_bio(pc->pc_dtls, dg_in, dg_out);
 
+  // Once established, records are batched through a memory BIO so
+  // they can be sent with UDP_SEGMENT (see candsrc_send_outgoing)
+  if ( (local_src->cs_flags & CS_FLAG_GSO) && !pc->pc_gso_bio ) {
+    pc->pc_gso_bio = BIO_new(BIO_s_mem());
+    if ( !pc->pc_gso_bio ) {
+      fprintf(stderr, "pconn_ensure_dtls: could not create GSO BIO. Not using segmentation offload\n");
+      local_src->cs_flags &= ~CS_FLAG_GSO;
+    }
+  }
+
   if ( pc->pc_answer_flags & PCONN_ANSWER_IS_ACTIVE )
     SSL_set_accept_state(pc->pc_dtls);
   else
@@ -2680,135 +3279,213 @@ static int pconn_ensure_dtls(struct pconn *pc) {
   return -1;
 }
 
-static void pconn_dtls_handshake(struct pconn *pc) {
-  int err;
-  struct icecandpair *active;
-  struct icecand *local;
-  struct candsrc *src;
-  BIO_ADDR *addr;
+#define PCONN_DTLS_STEP_ERROR      (-1)
+#define PCONN_DTLS_STEP_WANT_READ  0
+#define PCONN_DTLS_STEP_WANT_WRITE 1
+#define PCONN_DTLS_STEP_LISTENED   2
+#define PCONN_DTLS_STEP_DONE       3
+
+// pc_mutex must be held. Queues the handshake packet of size pkt_sz
+// in pc_incoming_pkt for the async handshake thread. If pkt_sz is 0,
+// the handshake is just run again (for example, because the socket
+// became writable).
+static void pconn_dtls_handshake(struct pconn *pc, int pkt_sz) {
+  unsigned int slot;
 
   assert(pc->pc_dtls);
 
-  if ( pc->pc_active_candidate_pair < 0 || pc->pc_active_candidate_pair >= pc->pc_candidate_pairs_count )
-    return;
-  active = pc->pc_candidate_pairs_sorted[pc->pc_active_candidate_pair];
+  if ( pkt_sz > 0 ) {
+    if ( pc->pc_dtls_queue_count >= PCONN_DTLS_HANDSHAKE_QUEUE_LENGTH ) {
+      fprintf(stderr, "pconn_dtls_handshake: dropping handshake packet, because the queue is full\n");
+      return;
+    }
 
-  if ( active->icp_local_ix >= pc->pc_local_ice_candidates_count )
-    return;
-  local = &pc->pc_local_ice_candidates[active->icp_local_ix];
+    slot = (pc->pc_dtls_queue_head + pc->pc_dtls_queue_count) % PCONN_DTLS_HANDSHAKE_QUEUE_LENGTH;
+    memcpy(pc->pc_dtls_queue[slot], pc->pc_incoming_pkt, pkt_sz);
+    pc->pc_dtls_queue_sz[slot] = pkt_sz;
+    pc->pc_dtls_queue_count++;
+  } else
+    pc->pc_dtls_again = 1;
 
-  if ( local->ic_candsrc_ix < 0 || local->ic_candsrc_ix >= pc->pc_candidate_sources_count )
-    return;
-  src = &pc->pc_candidate_sources[local->ic_candsrc_ix];
+  if ( pc->pc_dtls_busy ) return;
 
-  if ( pc->pc_state == PCONN_STATE_DTLS_STARTING ) {
-    if ( pc->pc_answer_flags & PCONN_ANSWER_IS_PASSIVE )
-      pc->pc_state = PCONN_STATE_DTLS_CONNECTING;
-    else
-      pc->pc_state = PCONN_STATE_DTLS_LISTENING;
+  pc->pc_dtls_busy = 1;
+  PCONN_WREF(pc);
+  if ( eventloop_invoke_async(&pc->pc_appstate->as_eventloop, &pc->pc_dtls_handshake_evt) < 0 ) {
+    perror("pconn_dtls_handshake: eventloop_invoke_async");
+    pc->pc_dtls_busy = 0;
+    PCONN_WUNREF(pc);
   }
+}
 
-  pc->pc_dtls_needs_write = pc->pc_dtls_needs_read = 0;
+// Runs one step of the handshake in the given state. This is called
+// without pc_mutex, since this is where OpenSSL does the expensive
+// key exchange and certificate verification. While pc_dtls_busy is
+// set, only the async handshake thread touches pc_dtls.
+static int pconn_dtls_handshake_step(struct pconn *pc, int state) {
+  BIO_ADDR *addr;
+  int err;
 
-  switch ( pc->pc_state ) {
+  switch ( state ) {
   case PCONN_STATE_DTLS_LISTENING:
     addr = BIO_ADDR_new();
     if ( !addr ) {
       fprintf(stderr, "Could not allocate BIO_ADDR\n");
-      return;
+      return PCONN_DTLS_STEP_ERROR;
     }
 
     errno = 0;
     BIO_ADDR_clear(addr);
     err = DTLSv1_listen(pc->pc_dtls, addr);
-    if ( err <= 0 ) {
-      err = SSL_get_error(pc->pc_dtls, err);
-      switch ( err ) {
-      case SSL_ERROR_WANT_READ:
-        pc->pc_dtls_needs_read = 1;
-        BIO_ADDR_free(addr);
-        return;
-      case SSL_ERROR_WANT_WRITE:
-        pc->pc_dtls_needs_write = 1;
-        CANDSRC_SUBSCRIBE_WRITE(src);
-        BIO_ADDR_free(addr);
-        return;
-      case SSL_ERROR_SYSCALL:
-        fprintf(stderr, "dtlsv1_listen: system error: %s\n", strerror(errno));
-        BIO_ADDR_free(addr);
-        return;
-      default:
-        perror("dtlsv1_listen");
-        fprintf(stderr, "Error running DTLSv1_listen: %d\n", err);
-        ERR_print_errors_fp(stderr);
-        BIO_ADDR_free(addr);
-        return;
-      }
-    } else {
-      BIO_ADDR_free(addr);
-      pc->pc_state = PCONN_STATE_DTLS_ACCEPTING;
+    BIO_ADDR_free(addr);
+    if ( err > 0 ) return PCONN_DTLS_STEP_LISTENED;
+
+    err = SSL_get_error(pc->pc_dtls, err);
+    switch ( err ) {
+    case SSL_ERROR_WANT_READ:
+      return PCONN_DTLS_STEP_WANT_READ;
+    case SSL_ERROR_WANT_WRITE:
+      return PCONN_DTLS_STEP_WANT_WRITE;
+    case SSL_ERROR_SYSCALL:
+      fprintf(stderr, "dtlsv1_listen: system error: %s\n", strerror(errno));
+      return PCONN_DTLS_STEP_ERROR;
+    default:
+      perror("dtlsv1_listen");
+      fprintf(stderr, "Error running DTLSv1_listen: %d\n", err);
+      ERR_print_errors_fp(stderr);
+      return PCONN_DTLS_STEP_ERROR;
     }
 
   case PCONN_STATE_DTLS_ACCEPTING:
     err = SSL_accept(pc->pc_dtls);
-    if ( err <= 0 ) {
-      err = SSL_get_error(pc->pc_dtls, err);
-      switch ( err ) {
-      case SSL_ERROR_WANT_READ:
-        pc->pc_dtls_needs_read = 1;
-        return;
-      case SSL_ERROR_WANT_WRITE:
-        pc->pc_dtls_needs_write = 1;
-        CANDSRC_SUBSCRIBE_WRITE(src);
-        return;
-      default:
-        fprintf(stderr, "Error running SSL_accept:\n");
-        ERR_print_errors_fp(stderr);
-        return;
-      }
-    } else {
-      pc->pc_state = PCONN_STATE_ESTABLISHED;
+    if ( err > 0 ) return PCONN_DTLS_STEP_DONE;
+
+    err = SSL_get_error(pc->pc_dtls, err);
+    switch ( err ) {
+    case SSL_ERROR_WANT_READ:
+      return PCONN_DTLS_STEP_WANT_READ;
+    case SSL_ERROR_WANT_WRITE:
+      return PCONN_DTLS_STEP_WANT_WRITE;
+    default:
+      fprintf(stderr, "Error running SSL_accept:\n");
+      ERR_print_errors_fp(stderr);
+      return PCONN_DTLS_STEP_ERROR;
     }
 
-    pconn_on_established(pc);
-
-    return;
-
   case PCONN_STATE_DTLS_CONNECTING:
     fprintf(stderr, "Running SSL_connect\n");
     err = SSL_connect(pc->pc_dtls);
-    if ( err <= 0 ) {
-      err = SSL_get_error(pc->pc_dtls, err);
-      switch ( err ) {
-      case SSL_ERROR_WANT_READ:
-        fprintf(stderr, "SSL_connect wants read\n");
-        return;
-      case SSL_ERROR_WANT_WRITE:
-        fprintf(stderr, "SSL_connect wants write\n");
-        CANDSRC_SUBSCRIBE_WRITE(src);
-        return;
-      default:
-        fprintf(stderr, "Error running SSL_connect:\n");
-        ERR_print_errors_fp(stderr);
-        return;
-      };
-    } else {
+    if ( err > 0 ) {
       fprintf(stderr, "Successfully ran SSL_connect\n");
-      pc->pc_state = PCONN_STATE_ESTABLISHED;
+      return PCONN_DTLS_STEP_DONE;
     }
 
-    pconn_on_established(pc);
-    return;
+    err = SSL_get_error(pc->pc_dtls, err);
+    switch ( err ) {
+    case SSL_ERROR_WANT_READ:
+      fprintf(stderr, "SSL_connect wants read\n");
+      return PCONN_DTLS_STEP_WANT_READ;
+    case SSL_ERROR_WANT_WRITE:
+      fprintf(stderr, "SSL_connect wants write\n");
+      return PCONN_DTLS_STEP_WANT_WRITE;
+    default:
+      fprintf(stderr, "Error running SSL_connect:\n");
+      ERR_print_errors_fp(stderr);
+      return PCONN_DTLS_STEP_ERROR;
+    }
 
   default:
     abort();
   }
 }
 
+static int pconn_is_handshaking(struct pconn *pc) {
+  return pc->pc_state == PCONN_STATE_DTLS_STARTING ||
+    pc->pc_state == PCONN_STATE_DTLS_LISTENING ||
+    pc->pc_state == PCONN_STATE_DTLS_ACCEPTING ||
+    pc->pc_state == PCONN_STATE_DTLS_CONNECTING;
+}
+
+// Called on an async thread. Feeds queued handshake packets to
+// OpenSSL until the queue is drained or the handshake is over.
+static void pconn_dtls_run_handshake(struct pconn *pc) {
+  struct candsrc *src;
+  struct icecand *remote;
+  unsigned int slot;
+  int state, ret, has_pkt;
+
+  SAFE_MUTEX_LOCK(&pc->pc_mutex);
+  while ( pc->pc_dtls_queue_count > 0 || pc->pc_dtls_again ) {
+    src = pconn_active_candsrc(pc, &remote);
+    if ( !src || !pconn_is_handshaking(pc) ) break;
+
+    has_pkt = pc->pc_dtls_queue_count > 0;
+    slot = pc->pc_dtls_queue_head;
+    pc->pc_static_pkt_bio.bs_buf = has_pkt ? pc->pc_dtls_queue[slot] : pc->pc_incoming_pkt;
+    (void) BIO_reset(SSL_get_rbio(pc->pc_dtls));
+    BIO_STATIC_SET_READ_SZ(&pc->pc_static_pkt_bio, has_pkt ? pc->pc_dtls_queue_sz[slot] : 0);
+    pc->pc_dtls_again = 0;
+
+    if ( pc->pc_state == PCONN_STATE_DTLS_STARTING ) {
+      if ( pc->pc_answer_flags & PCONN_ANSWER_IS_PASSIVE )
+        pc->pc_state = PCONN_STATE_DTLS_CONNECTING;
+      else
+        pc->pc_state = PCONN_STATE_DTLS_LISTENING;
+    }
+
+    pc->pc_dtls_needs_write = pc->pc_dtls_needs_read = 0;
+
+    state = pc->pc_state;
+    pthread_mutex_unlock(&pc->pc_mutex);
+    ret = pconn_dtls_handshake_step(pc, state);
+    SAFE_MUTEX_LOCK(&pc->pc_mutex);
+
+    if ( has_pkt ) {
+      pc->pc_dtls_queue_head = (slot + 1) % PCONN_DTLS_HANDSHAKE_QUEUE_LENGTH;
+      pc->pc_dtls_queue_count--;
+    }
+
+    switch ( ret ) {
+    case PCONN_DTLS_STEP_WANT_READ:
+      pc->pc_dtls_needs_read = 1;
+      break;
+    case PCONN_DTLS_STEP_WANT_WRITE:
+      pc->pc_dtls_needs_write = 1;
+      CANDSRC_SUBSCRIBE_WRITE(src);
+      break;
+    case PCONN_DTLS_STEP_LISTENED:
+      // The ClientHello had a valid cookie. Continue with SSL_accept
+      pc->pc_state = PCONN_STATE_DTLS_ACCEPTING;
+      pc->pc_dtls_again = 1;
+      break;
+    case PCONN_DTLS_STEP_DONE:
+      // Anything else in the queue arrived before the handshake was
+      // done. The peer will retransmit whatever it still needs.
+      pc->pc_dtls_queue_head = pc->pc_dtls_queue_count = 0;
+      pc->pc_static_pkt_bio.bs_buf = pc->pc_incoming_pkt;
+      BIO_STATIC_SET_READ_SZ(&pc->pc_static_pkt_bio, 0);
+      pc->pc_state = PCONN_STATE_ESTABLISHED;
+      pconn_on_established(pc);
+      break;
+    default:
+      break;
+    }
+  }
+
+  if ( pc->pc_state != PCONN_STATE_ESTABLISHED )
+    pc->pc_dtls_queue_head = pc->pc_dtls_queue_count = 0;
+
+  pc->pc_static_pkt_bio.bs_buf = pc->pc_incoming_pkt;
+  pc->pc_dtls_again = 0;
+  pc->pc_dtls_busy = 0;
+  pthread_mutex_unlock(&pc->pc_mutex);
+}
+
 static void pconn_on_established(struct pconn *pc) {
   int err;
 
   pconn_reset_connectivity_check_timeout(pc);
+  pconn_pmtu_start(pc);
 
   switch ( pc->pc_type ) {
   case PCONN_TYPE_WEBRTC:
@@ -2824,34 +3501,44 @@ static void pconn_on_established(struct pconn *pc) {
       return;
     }
 
-    err = container_ensure_running(&pc->pc_container, &pc->pc_appstate->as_eventloop);
-    if ( err < 0 ) {
-      fprintf(stderr, "pconn_on_established: could not start container\n");
-      return;
-    } else if ( err == 0 ) {
-      // We didn't start this, so release it
-      container_release_running(&pc->pc_container, &pc->pc_appstate->as_eventloop);
+    if ( pc->pc_appstate->as_webrtc_proxy_workers > 0 ) {
+      if ( pconn_attach_shared_proxy(pc) < 0 ) {
+        fprintf(stderr, "pconn_on_established: could not attach to shared webrtc proxy\n");
+        return;
+      }
     } else {
+      err = container_ensure_running(&pc->pc_container, &pc->pc_appstate->as_eventloop);
+      if ( err < 0 ) {
+        fprintf(stderr, "pconn_on_established: could not start container\n");
+        return;
+      } else if ( err == 0 ) {
+        // We didn't start this, so release it
+        container_release_running(&pc->pc_container, &pc->pc_appstate->as_eventloop);
+        break;
+      }
+
       // We started the container, so keep a reference
       PCONN_REF(pc);
+    }
 
-      // Also add this to the bridge
-      pc->pc_sctp_capture.se_source.sin_addr.s_addr = pc->pc_container.c_ip.s_addr;
-      pc->pc_sctp_capture.se_source.sin_port = htons(pc->pc_sctp_port);
+    // Also add this to the bridge. With a shared proxy, our
+    // container's address is an alias in the proxy, so the capture
+    // is the same
+    pc->pc_sctp_capture.se_source.sin_addr.s_addr = pc->pc_container.c_ip.s_addr;
+    pc->pc_sctp_capture.se_source.sin_port = htons(pc->pc_sctp_port);
 
-      fprintf(stderr, "Started webrtc proxy\n");
-      if ( bridge_register_sctp(&pc->pc_appstate->as_bridge, &pc->pc_sctp_capture) < 0 ) {
-        fprintf(stderr, "pconn_on_established: could not register with bridge\n");
-        // TODO kill the webrtc-proxy process
-        return;
-      } else
-        // We must keep this alive while the bridge is delivering events...
-        // TODO undo this reference
-        PCONN_WREF(pc);
+    fprintf(stderr, "Started webrtc proxy\n");
+    if ( bridge_register_sctp(&pc->pc_appstate->as_bridge, &pc->pc_sctp_capture) < 0 ) {
+      fprintf(stderr, "pconn_on_established: could not register with bridge\n");
+      // TODO kill the webrtc-proxy process
+      return;
+    } else
+      // We must keep this alive while the bridge is delivering events...
+      // TODO undo this reference
+      PCONN_WREF(pc);
 
-      // Open up all bridge ports for registered apps
-      pconn_enable_traffic_deferred(pc);
-    }
+    // Open up all bridge ports for registered apps
+    pconn_enable_traffic_deferred(pc);
     break;
 
   default:
@@ -2902,6 +3589,18 @@ static void pconn_on_sctp_packet(struct sctpentry *se, const void *buf, size_t s
       goto done;
     }
     candsrc = &pc->pc_candidate_sources[local_cand->ic_candsrc_ix];
+
+    // Act like a router on the path, and tell the container's SCTP
+    // stack when its packets will not fit
+    if ( pc->pc_pmtu_state == PCONN_PMTU_SEARCH_COMPLETE && pc->pc_dtls ) {
+      size_t max_sctp = DTLS_get_data_mtu(pc->pc_dtls);
+      if ( max_sctp > 0 && sz > max_sctp ) {
+        bridge_write_frag_needed(&pc->pc_appstate->as_bridge, &pc->pc_container,
+                                 buf, sz, max_sctp + sizeof(struct iphdr));
+        goto done;
+      }
+    }
+
     //    fprintf(stderr, "Writing on cand pair %d\n", pc->pc_active_candidate_pair);
     //fprintf(stderr, "Requesting write for cs ix %d\n", local_cand->ic_candsrc_ix);
 
@@ -2952,7 +3651,10 @@ static void pconn_teardown_established(struct pconn *pc) {
     PCONN_WUNREF(pc); // For bridge capture
     SHARED_DEBUG(&pc->pc_shared, "after bridge unregister");
 
-    assert( container_release_running(&pc->pc_container, &pc->pc_appstate->as_eventloop) );
+    if ( pc->pc_shares_proxy )
+      pconn_detach_shared_proxy(pc);
+    else
+      assert( container_release_running(&pc->pc_container, &pc->pc_appstate->as_eventloop) );
 
     pconn_finish(pc);
   }
@@ -2983,6 +3685,11 @@ static int pconn_container_fn(struct container *c, int op, void *argp, ssize_t a
     if ( perm->bpr_perm.bp_type == BR_PERM_APPLICATION ) {
       PERSONA_REF(pc->pc_persona);
       perm->bpr_persona = pc->pc_persona;
+      if ( pc->pc_remote_cert_fingerprint_digest &&
+           EVP_MD_size(pc->pc_remote_cert_fingerprint_digest) <= sizeof(perm->bpr_site) ) {
+        perm->bpr_site_sz = EVP_MD_size(pc->pc_remote_cert_fingerprint_digest);
+        memcpy(perm->bpr_site, pc->pc_remote_cert_fingerprint, perm->bpr_site_sz);
+      }
       return 0;
     }
     return 0;
@@ -3047,6 +3754,192 @@ static int pconn_container_fn(struct container *c, int op, void *argp, ssize_t a
   }
 }
 
+// Shared webrtc-proxy
+//
+// With as_webrtc_proxy_workers set, all established connections of a
+// persona are served by one webrtc-proxy in p_webrtc_proxy. The proxy
+// listens for each connection's association on that connection's own
+// container address (an alias on the proxy's interface), and proxies
+// the connection's channels from it. The bridge capture, the ARP
+// table, and app permissions therefore see each connection exactly as
+// they would with a dedicated proxy.
+//
+// The tunnels from the proxy port to app ports are shared by all of
+// the persona's connections. What keeps a connection to the apps its
+// own tokens allow is the proxy: app descriptors returned from an open
+// are bound to the address of the association that opened the app, so
+// a connect naming a descriptor from another connection is refused.
+
+static int pconn_shared_proxy_fn(struct container *c, int op, void *argp, ssize_t argl) {
+  struct persona *p = STRUCT_FROM_BASE(struct persona, p_webrtc_proxy, c);
+  struct pconn *pc, *next;
+  char *workers_str, *hostname;
+  char persona_id_str[PERSONA_ID_X_LENGTH + 1];
+  const char **cp;
+  int err;
+
+  switch ( op ) {
+  case CONTAINER_CTL_DESCRIBE:
+  case CONTAINER_CTL_CHECK_PERMISSION:
+    // The proxy only acts for connections, from their own addresses
+    return -1;
+
+  case CONTAINER_CTL_GET_INIT_PATH:
+    cp = argp;
+    *cp = p->p_appstate->as_webrtc_proxy_path;
+    return 0;
+
+  case CONTAINER_CTL_GET_ARGS:
+    if ( argl < 3 ) {
+      fprintf(stderr, "pconn_shared_proxy_fn: not enough space for args\n");
+      return -1;
+    }
+
+    cp = argp;
+    err = snprintf(NULL, 0, "%d", p->p_appstate->as_webrtc_proxy_workers);
+    workers_str = malloc(err + 1);
+    if ( !workers_str ) return -1;
+    snprintf(workers_str, err + 1, "%d", p->p_appstate->as_webrtc_proxy_workers);
+
+    // The proxy serves connections from many peers, so it is not given
+    // a capability. Apps see each connection's own address instead.
+    cp[0] = "-s";
+    cp[1] = "-w";
+    cp[2] = workers_str;
+    return 3;
+
+  case CONTAINER_CTL_GET_HOSTNAME:
+    cp = argp;
+    err = snprintf(NULL, 0, "%s%.16s", PERSONA_HOSTNAME_PREFIX,
+                   hex_digest_str((const unsigned char *) p->p_persona_id,
+                                  persona_id_str, PERSONA_ID_LENGTH));
+
+    *cp = hostname = malloc(err + 1);
+    if ( !hostname ) return -1;
+    snprintf(hostname, err + 1, "%s%.16s", PERSONA_HOSTNAME_PREFIX, persona_id_str);
+    return 0;
+
+  case CONTAINER_CTL_RELEASE_HOSTNAME:
+    free((char *)argp);
+    return 0;
+
+  case CONTAINER_CTL_RELEASE_ARG:
+    // Only the worker count is allocated
+    if ( argl == 2 )
+      free((char *) argp);
+    return 0;
+
+  case CONTAINER_CTL_RELEASE_INIT_PATH:
+  case CONTAINER_CTL_ON_SHUTDOWN:
+    return 0;
+
+  case CONTAINER_CTL_INIT_EXITS:
+    fprintf(stderr, "pconn_shared_proxy_fn: shared webrtc-proxy exits with %zd\n", argl);
+
+    // Take over the list's references, and tear down every
+    // connection the proxy was serving. pconn_teardown_established
+    // locks p_mutex, so we can't hold it here.
+    SAFE_MUTEX_LOCK(&p->p_mutex);
+    pc = p->p_webrtc_sessions;
+    p->p_webrtc_sessions = NULL;
+    pthread_mutex_unlock(&p->p_mutex);
+
+    for ( ; pc; pc = next ) {
+      next = pc->pc_next_webrtc_session;
+
+      if ( pthread_mutex_lock(&pc->pc_mutex) == 0 ) {
+        pconn_teardown_established(pc);
+        pthread_mutex_unlock(&pc->pc_mutex);
+      } else
+        fprintf(stderr, "pconn_shared_proxy_fn: could not lock pconn\n");
+
+      PCONN_UNREF(pc);
+    }
+    return 0;
+
+  default:
+    return -2;
+  }
+}
+
+// pc_mutex should be locked
+static int pconn_attach_shared_proxy(struct pconn *pc) {
+  struct persona *p = pc->pc_persona;
+  struct eventloop *el = &pc->pc_appstate->as_eventloop;
+
+  if ( pthread_mutex_lock(&p->p_mutex) != 0 ) {
+    fprintf(stderr, "pconn_attach_shared_proxy: could not lock persona\n");
+    return -1;
+  }
+
+  if ( !p->p_webrtc_proxy_ready ) {
+    if ( container_init(&p->p_webrtc_proxy, &pc->pc_appstate->as_bridge, pconn_shared_proxy_fn,
+                        CONTAINER_FLAG_KILL_IMMEDIATELY | CONTAINER_FLAG_NETWORK_ONLY |
+                        CONTAINER_FLAG_ENABLE_SCTP, 0) < 0 ) {
+      fprintf(stderr, "pconn_attach_shared_proxy: could not allocate container\n");
+      goto error;
+    }
+    p->p_webrtc_proxy.c_pool = &pc->pc_appstate->as_pconn_pool;
+    p->p_webrtc_proxy_ready = 1;
+  }
+
+  // container_ensure_running does not take a reference if the
+  // container could not be started
+  if ( container_ensure_running(&p->p_webrtc_proxy, el) < 0 ||
+       !container_is_running(&p->p_webrtc_proxy) ) {
+    fprintf(stderr, "pconn_attach_shared_proxy: could not start webrtc proxy\n");
+    goto error;
+  }
+
+  if ( container_add_alias(&pc->pc_container, &p->p_webrtc_proxy, pc->pc_sctp_port) < 0 ) {
+    fprintf(stderr, "pconn_attach_shared_proxy: could not add our address to the proxy\n");
+    container_release_running(&p->p_webrtc_proxy, el);
+    goto error;
+  }
+
+  PCONN_REF(pc);
+  pc->pc_shares_proxy = 1;
+  pc->pc_next_webrtc_session = p->p_webrtc_sessions;
+  p->p_webrtc_sessions = pc;
+
+  pthread_mutex_unlock(&p->p_mutex);
+  return 0;
+
+ error:
+  pthread_mutex_unlock(&p->p_mutex);
+  return -1;
+}
+
+// pc_mutex should be locked
+static void pconn_detach_shared_proxy(struct pconn *pc) {
+  struct persona *p = pc->pc_persona;
+  struct pconn **cur;
+  int was_listed = 0;
+
+  if ( !pc->pc_shares_proxy ) return;
+  pc->pc_shares_proxy = 0;
+
+  SAFE_MUTEX_LOCK(&p->p_mutex);
+  for ( cur = &p->p_webrtc_sessions; *cur; cur = &(*cur)->pc_next_webrtc_session ) {
+    if ( *cur == pc ) {
+      *cur = pc->pc_next_webrtc_session;
+      was_listed = 1;
+      break;
+    }
+  }
+  pc->pc_next_webrtc_session = NULL;
+
+  if ( container_del_alias(&pc->pc_container, &p->p_webrtc_proxy) < 0 )
+    fprintf(stderr, "pconn_detach_shared_proxy: could not remove our address from the proxy\n");
+
+  container_release_running(&p->p_webrtc_proxy, &pc->pc_appstate->as_eventloop);
+  pthread_mutex_unlock(&p->p_mutex);
+
+  // Otherwise, pconn_shared_proxy_fn owns the list reference
+  if ( was_listed )
+    PCONN_UNREF(pc);
+}
+
 int pconn_add_token(struct pconn *pc, struct token *tok) {
   if ( pthread_mutex_lock(&pc->pc_mutex) == 0 ) {
     int ret = pconn_add_token_unlocked(pc, tok);
@@ -3129,15 +4022,18 @@ static int pconn_launch_app(struct pconn *pc, const char *app_uri, struct pconna
 static int pconnapp_enable_traffic(struct pconn *pc, struct pconnapp *pca) {
   if ( pca->pca_tun ) return 1;
   else {
-    if ( container_is_running(&pc->pc_container) ) {
+    struct container *proxy = pc->pc_shares_proxy ?
+      &pc->pc_persona->p_webrtc_proxy : &pc->pc_container;
+
+    if ( container_is_running(proxy) ) {
       struct brtunnel *tun =
         bridge_create_tunnel(&pc->pc_appstate->as_bridge,
-                             pc->pc_container.c_bridge_port,
+                             proxy->c_bridge_port,
                              pca->pca_app->inst_container.c_bridge_port);
       if ( !tun ) return -1;
 
       fprintf(stderr, "pconnapp: create tunnel %d -> %d\n",
-              pc->pc_container.c_bridge_port,
+              proxy->c_bridge_port,
               pca->pca_app->inst_container.c_bridge_port);
 
       pca->pca_tun = tun;
@@ -17,6 +17,10 @@
 #define PCONN_MAX_AUTH_ATTEMPTS 3
 #define PCONN_MAX_MESSAGE_SIZE (8 * 1024)
 #define PCONN_MAX_PACKET_SIZE (2 * 1024)
+// DTLS handshake packets that can arrive while a handshake step is
+// running on the async pool. Further packets are dropped, and the
+// peer will retransmit them.
+#define PCONN_DTLS_HANDSHAKE_QUEUE_LENGTH 8
 #define PCONN_OUTGOING_QUEUE_SIZE (64 * 1024)
 #define PCONN_MAX_SCTP_STREAMS 1024
 #define PCONN_OUR_UFRAG_SIZE 4
@@ -33,6 +37,25 @@
 // If we don't receive an answer to our connectivity check after two minutes, fault
 #define PCONN_CONNECTIVITY_CHECK_TIMEOUT (2 * 60 * 1000)
 
+// Packetization layer path MTU discovery (RFC 8899). Sizes are UDP
+// payload sizes.
+//
+// We start at BASE_PLPMTU and search up to what fits in an Ethernet frame.
+#define PCONN_PMTU_BASE 1200
+#define PCONN_PMTU_MAX_IPV4 (1500 - 20 - 8)
+#define PCONN_PMTU_MAX_IPV6 (1500 - 40 - 8)
+// Stop searching once the bounds are this close
+#define PCONN_PMTU_SEARCH_GRANULARITY 16
+// A probe size is considered lost after this many unanswered probes
+#define PCONN_PMTU_MAX_PROBES 3
+#define PCONN_PMTU_PROBE_TIMEOUT 1000
+// Search again for a larger MTU after ten minutes
+#define PCONN_PMTU_RAISE_TIMEOUT (10 * 60 * 1000)
+
+#define PCONN_PMTU_DISABLED        0
+#define PCONN_PMTU_SEARCHING       1
+#define PCONN_PMTU_SEARCH_COMPLETE 2
+
 struct flock;
 struct appstate;
 struct candsrc;
@@ -120,6 +143,15 @@ struct pconn {
   int pc_dtls_needs_read : 1;
   int pc_is_logged_in : 1; // Whether or not this pconn was authenticated using username/password
   int pc_is_guest : 1; // Whether or not this is a hosted connection
+  int pc_dtls_busy : 1; // A handshake step is running on the async pool
+  int pc_dtls_again : 1; // Run another handshake step without a new packet
+
+  // Handshake steps are run on the eventloop async threads, so that
+  // the public key operations do not hold up the event threads.
+  struct qdevtsub pc_dtls_handshake_evt;
+  unsigned int pc_dtls_queue_head, pc_dtls_queue_count;
+  uint16_t pc_dtls_queue_sz[PCONN_DTLS_HANDSHAKE_QUEUE_LENGTH];
+  char pc_dtls_queue[PCONN_DTLS_HANDSHAKE_QUEUE_LENGTH][PCONN_MAX_PACKET_SIZE];
 
   // An event that is triggered to start action on this PCONN (ICE
   // candidate collection and other delayed initialization)
@@ -177,6 +209,16 @@ struct pconn {
 
   struct timersub pc_timeout, pc_conn_check_timer, pc_conn_check_timeout_timer;
 
+  // Path MTU discovery state. pc_pmtu is the largest UDP payload
+  // confirmed to reach the peer. The search is between pc_pmtu and
+  // pc_pmtu_search_high. pc_pmtu_probe_size is non-zero while a probe
+  // is in flight.
+  int pc_pmtu_state;
+  uint16_t pc_pmtu, pc_pmtu_search_high, pc_pmtu_probe_size;
+  int pc_pmtu_probe_count;
+  struct stuntxid pc_pmtu_probe_tx_id;
+  struct timersub pc_pmtu_timer;
+
   struct personaset *pc_personaset;
 
   struct persona *pc_persona;
@@ -192,10 +234,31 @@ struct pconn {
   size_t pc_outgoing_size, pc_outgoing_offs;
   char pc_outgoing_pkt[PCONN_OUTGOING_QUEUE_SIZE];
 
+  // Coalesced datagrams received with UDP_GRO. UDP_GRO_BUF_SIZE
+  // bytes, allocated the first time a GRO socket is read
+  char *pc_gro_pkt;
+
+  // DTLS records waiting to be sent in one UDP_SEGMENT send. Every
+  // record is pc_gso_seg_sz bytes, except possibly the last. The
+  // buffer grows with the batches, up to UDP_GRO_BUF_SIZE bytes. A
+  // record still in pc_gso_bio did not fit in a batch before the
+  // socket blocked, and is queued on the next write event.
+  BIO *pc_gso_bio;
+  size_t pc_gso_pending, pc_gso_seg_sz;
+  char *pc_gso_pkt;
+  size_t pc_gso_pkt_sz;
+
   struct pconntoken *pc_tokens;
   struct pconnapp *pc_apps;
 
+  // With a shared webrtc-proxy (as_webrtc_proxy_workers), pc_container
+  // is never started. Its address is an alias in the persona's proxy
+  // instead, so our association and app traffic are still ours.
   struct container pc_container;
+
+  // Set while we're in pc_persona's p_webrtc_sessions
+  int pc_shares_proxy;
+  struct pconn *pc_next_webrtc_session;
 };
 
 #define PCONN_REF(pc) SHARED_REF(&(pc)->pc_shared)
@@ -39,6 +39,8 @@ static int persona_init_default(struct persona *p, struct appstate *as) {
   //  p->p_last_port = SCTP_LOWEST_PRIVATE_PORT;
   p->p_flags = 0;
   p->p_instances = NULL;
+  p->p_webrtc_proxy_ready = 0;
+  p->p_webrtc_sessions = NULL;
 
   if ( pthread_mutex_init(&p->p_mutex, NULL) != 0 )
     return -1;
@@ -246,6 +248,11 @@ static void persona_release(struct persona *p) {
     free(a);
   }
   p->p_auths = NULL;
+
+  if ( p->p_webrtc_proxy_ready ) {
+    container_release(&p->p_webrtc_proxy);
+    p->p_webrtc_proxy_ready = 0;
+  }
 }
 
 int persona_add_password(struct persona *p,
@@ -57,6 +57,13 @@ struct persona {
   uint32_t p_flags;
 
   struct appinstance *p_instances;
+
+  // The webrtc-proxy shared by all of this persona's sessions, if
+  // as_webrtc_proxy_workers is set. Initialized with the first
+  // session. Protected by p_mutex
+  int p_webrtc_proxy_ready;
+  struct container p_webrtc_proxy;
+  struct pconn *p_webrtc_sessions;
 };
 
 #define PERSONA_REF(p) SHARED_REF(&(p)->p_shared)
@@ -89,9 +96,6 @@ int persona_lookup_guest_credential(struct persona **p, struct pconn *pc,
 // int persona_allocate_port(struct persona *p, uint16_t *port);
 // void persona_release_port(struct persona *p, uint16_t port);
 
-// Runs a new webrtc proxy and returns the PID of the proxy.
-pid_t persona_run_webrtc_proxy(struct persona *p, uint16_t port);
-
 pid_t persona_run_ping_test(struct persona *p);
 
 // Send the given signal to the process
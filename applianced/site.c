@@ -0,0 +1,499 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "site.h"
+#include "state.h"
+#include "persona.h"
+#include "application.h"
+
+#define OP_SITE_WRITE_JOURNAL EVT_CTL_CUSTOM
+
+#define SITE_PERMS_FILE   "perms"
+#define SITE_JOURNAL_FILE "perms.journal"
+
+static void sitefn(struct eventloop *el, int op, void *arg);
+
+static int site_path(struct site *s, const char *file, char *path, size_t path_sz) {
+  char persona_digest[PERSONA_ID_X_LENGTH + 1];
+  char site_digest[BR_SITE_FINGERPRINT_MAX * 2 + 1];
+  int n;
+
+  if ( file )
+    n = snprintf(path, path_sz, "%s/personas/%s/sites/%s/%s",
+                 s->s_index->si_appstate->as_conf_dir,
+                 hex_digest_str((unsigned char *) s->s_key.sk_persona_id,
+                                persona_digest, PERSONA_ID_LENGTH),
+                 hex_digest_str(s->s_key.sk_fingerprint, site_digest,
+                                s->s_key.sk_fingerprint_sz),
+                 file);
+  else
+    n = snprintf(path, path_sz, "%s/personas/%s/sites/%s",
+                 s->s_index->si_appstate->as_conf_dir,
+                 hex_digest_str((unsigned char *) s->s_key.sk_persona_id,
+                                persona_digest, PERSONA_ID_LENGTH),
+                 hex_digest_str(s->s_key.sk_fingerprint, site_digest,
+                                s->s_key.sk_fingerprint_sz));
+
+  if ( n >= path_sz ) {
+    fprintf(stderr, "site_path: path overflow\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+// Permissions are kept by app URL. A permission URL grants access to
+// its app. Returns the length of the app URL, or 0 if entry is invalid
+static int site_app_url(const char *entry, char *app_url, size_t app_url_sz) {
+  size_t entry_sz = strlen(entry);
+
+  if ( validate_perm_url(entry, NULL, 0, app_url, app_url_sz) )
+    return strlen(app_url);
+
+  if ( entry_sz == 0 || entry_sz >= app_url_sz ||
+       strpbrk(entry, " \t/") )
+    return 0;
+
+  memcpy(app_url, entry, entry_sz + 1);
+  return entry_sz;
+}
+
+// s_mutex must be held
+static int site_set_app(struct site *s, const char *url, size_t url_sz, int grant) {
+  struct siteapp *sa;
+
+  HASH_FIND(sa_hh, s->s_apps, url, url_sz, sa);
+  if ( grant ) {
+    if ( sa ) return 0;
+
+    sa = malloc(sizeof(*sa) + url_sz + 1);
+    if ( !sa ) {
+      fprintf(stderr, "site_set_app: out of memory\n");
+      return -1;
+    }
+
+    memcpy(sa->sa_url, url, url_sz);
+    sa->sa_url[url_sz] = '\0';
+    HASH_ADD(sa_hh, s->s_apps, sa_url, url_sz, sa);
+  } else if ( sa ) {
+    HASH_DELETE(sa_hh, s->s_apps, sa);
+    free(sa);
+  }
+
+  return 0;
+}
+
+// Read perms, then replay the journal. Lines of the journal start
+// with '+' (granted) or '-' (revoked)
+static int site_load(struct site *s) {
+  char path[PATH_MAX], line[PATH_MAX];
+  FILE *fp;
+  int err = 0;
+
+  if ( site_path(s, SITE_PERMS_FILE, path, sizeof(path)) < 0 )
+    return -1;
+
+  fp = fopen(path, "rt");
+  if ( fp ) {
+    while ( err == 0 && fgets(line, sizeof(line), fp) ) {
+      char app_url[PATH_MAX];
+      int app_url_sz;
+
+      line[strcspn(line, "\n")] = '\0';
+      app_url_sz = site_app_url(line, app_url, sizeof(app_url));
+      if ( app_url_sz > 0 )
+        err = site_set_app(s, app_url, app_url_sz, 1);
+    }
+
+    if ( ferror(fp) ) err = -1;
+    fclose(fp);
+  } else if ( errno != ENOENT ) {
+    perror("site_load: fopen");
+    fprintf(stderr, "site_load: while opening %s\n", path);
+    return -1;
+  }
+
+  if ( err < 0 ) return -1;
+
+  if ( site_path(s, SITE_JOURNAL_FILE, path, sizeof(path)) < 0 )
+    return -1;
+
+  fp = fopen(path, "rt");
+  if ( fp ) {
+    while ( err == 0 && fgets(line, sizeof(line), fp) ) {
+      char app_url[PATH_MAX];
+      int app_url_sz;
+
+      line[strcspn(line, "\n")] = '\0';
+      app_url_sz = site_app_url(line + 1, app_url, sizeof(app_url));
+      if ( (line[0] == '+' || line[0] == '-') && app_url_sz > 0 )
+        err = site_set_app(s, app_url, app_url_sz, line[0] == '+');
+      s->s_journal_length++;
+    }
+
+    if ( ferror(fp) ) err = -1;
+    fclose(fp);
+  } else if ( errno != ENOENT ) {
+    perror("site_load: fopen");
+    fprintf(stderr, "site_load: while opening %s\n", path);
+    return -1;
+  }
+
+  return err;
+}
+
+static void site_free(struct site *s) {
+  struct siteapp *sa, *tmp_sa;
+  struct sitechange *sc, *tmp_sc;
+
+  HASH_ITER(sa_hh, s->s_apps, sa, tmp_sa) {
+    HASH_DELETE(sa_hh, s->s_apps, sa);
+    free(sa);
+  }
+
+  DLIST_ITER(&s->s_changes, sc_list, sc, tmp_sc) {
+    free(sc);
+  }
+
+  pthread_cond_destroy(&s->s_written);
+  pthread_mutex_destroy(&s->s_mutex);
+  free(s);
+}
+
+// Find the site, loading it if needed
+static struct site *siteindex_get(struct siteindex *si, const struct sitekey *key) {
+  struct site *s, *existing;
+  struct sitekey k;
+  size_t key_sz;
+
+  if ( key->sk_fingerprint_sz > sizeof(k.sk_fingerprint) ) {
+    fprintf(stderr, "siteindex_get: fingerprint too large\n");
+    return NULL;
+  }
+
+  // Keys are hashed as bytes, so clear any padding
+  memset(&k, 0, sizeof(k));
+  memcpy(k.sk_persona_id, key->sk_persona_id, sizeof(k.sk_persona_id));
+  k.sk_fingerprint_sz = key->sk_fingerprint_sz;
+  memcpy(k.sk_fingerprint, key->sk_fingerprint, key->sk_fingerprint_sz);
+  key_sz = offsetof(struct sitekey, sk_fingerprint) + k.sk_fingerprint_sz;
+
+  SAFE_RWLOCK_RDLOCK(&si->si_mutex);
+  HASH_FIND(s_hh, si->si_sites, &k, key_sz, s);
+  pthread_rwlock_unlock(&si->si_mutex);
+  if ( s ) return s;
+
+  s = malloc(sizeof(*s));
+  if ( !s ) {
+    fprintf(stderr, "siteindex_get: out of memory\n");
+    return NULL;
+  }
+
+  memcpy(&s->s_key, &k, sizeof(k));
+  s->s_index = si;
+  s->s_apps = NULL;
+  DLIST_INIT(&s->s_changes);
+  s->s_journal_length = 0;
+  s->s_writing = 0;
+  qdevtsub_init(&s->s_write_evt, OP_SITE_WRITE_JOURNAL, sitefn);
+
+  if ( pthread_mutex_init(&s->s_mutex, NULL) != 0 ) {
+    free(s);
+    return NULL;
+  }
+
+  if ( pthread_cond_init(&s->s_written, NULL) != 0 ) {
+    pthread_mutex_destroy(&s->s_mutex);
+    free(s);
+    return NULL;
+  }
+
+  // Loaded outside the lock. If someone beat us to it, theirs is used
+  if ( site_load(s) < 0 ) {
+    fprintf(stderr, "siteindex_get: could not load site permissions\n");
+    site_free(s);
+    return NULL;
+  }
+
+  SAFE_RWLOCK_WRLOCK(&si->si_mutex);
+  HASH_FIND(s_hh, si->si_sites, &k, key_sz, existing);
+  if ( existing ) {
+    site_free(s);
+    s = existing;
+  } else
+    HASH_ADD(s_hh, si->si_sites, s_key, key_sz, s);
+  pthread_rwlock_unlock(&si->si_mutex);
+
+  return s;
+}
+
+// Write out one batch of changes, from the async pool
+static void site_write_journal(struct site *s) {
+  char path[PATH_MAX], tmp_path[PATH_MAX];
+  DLIST_HEAD(struct sitechange) changes;
+  struct sitechange *sc, *tmp_sc;
+  struct siteapp *sa, *tmp_sa;
+  int compact;
+  FILE *fp;
+
+  SAFE_MUTEX_LOCK(&s->s_mutex);
+  DLIST_MOVE(&changes, &s->s_changes);
+  pthread_mutex_unlock(&s->s_mutex);
+
+  if ( site_path(s, NULL, path, sizeof(path)) < 0 )
+    goto done;
+
+  if ( mkdir_recursive(path) < 0 ) {
+    perror("site_write_journal: mkdir_recursive");
+    goto done;
+  }
+
+  if ( site_path(s, SITE_JOURNAL_FILE, path, sizeof(path)) < 0 )
+    goto done;
+
+  fp = fopen(path, "at");
+  if ( !fp ) {
+    perror("site_write_journal: fopen");
+    fprintf(stderr, "site_write_journal: while opening %s\n", path);
+    goto done;
+  }
+
+  DLIST_ITER(&changes, sc_list, sc, tmp_sc) {
+    fprintf(fp, "%c%s\n", sc->sc_grant ? '+' : '-', sc->sc_url);
+    s->s_journal_length++;
+  }
+
+  if ( fflush(fp) != 0 || fdatasync(fileno(fp)) < 0 )
+    perror("site_write_journal: could not sync journal");
+  fclose(fp);
+
+  compact = s->s_journal_length > SITE_JOURNAL_MAX;
+  if ( !compact ) goto done;
+
+  // Fold the journal into perms. Changes made since are journaled
+  // again later, and replaying them is harmless
+  if ( site_path(s, SITE_PERMS_FILE, path, sizeof(path)) < 0 ||
+       snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >= sizeof(tmp_path) )
+    goto done;
+
+  fp = fopen(tmp_path, "wt");
+  if ( !fp ) {
+    perror("site_write_journal: fopen");
+    fprintf(stderr, "site_write_journal: while opening %s\n", tmp_path);
+    goto done;
+  }
+
+  SAFE_MUTEX_LOCK(&s->s_mutex);
+  HASH_ITER(sa_hh, s->s_apps, sa, tmp_sa) {
+    fprintf(fp, "%s\n", sa->sa_url);
+  }
+  pthread_mutex_unlock(&s->s_mutex);
+
+  if ( fflush(fp) != 0 || fdatasync(fileno(fp)) < 0 ) {
+    perror("site_write_journal: could not sync permissions");
+    fclose(fp);
+    unlink(tmp_path);
+    goto done;
+  }
+  fclose(fp);
+
+  if ( rename(tmp_path, path) < 0 ) {
+    perror("site_write_journal: rename");
+    fprintf(stderr, "while renaming %s -> %s\n", tmp_path, path);
+    unlink(tmp_path);
+    goto done;
+  }
+
+  if ( site_path(s, SITE_JOURNAL_FILE, path, sizeof(path)) == 0 ) {
+    if ( truncate(path, 0) < 0 )
+      perror("site_write_journal: truncate");
+    else
+      s->s_journal_length = 0;
+  }
+
+ done:
+  DLIST_ITER(&changes, sc_list, sc, tmp_sc) {
+    free(sc);
+  }
+}
+
+// s_mutex must be held. s may be freed as soon as it is released
+static void site_written(struct site *s) {
+  s->s_writing = 0;
+  pthread_cond_broadcast(&s->s_written);
+}
+
+static void sitefn(struct eventloop *el, int op, void *arg) {
+  struct qdevent *evt = arg;
+  struct site *s;
+  int again;
+
+  switch ( op ) {
+  case OP_SITE_WRITE_JOURNAL:
+    s = STRUCT_FROM_BASE(struct site, s_write_evt, evt->qde_sub);
+
+    site_write_journal(s);
+
+    // Changes made while we were writing need another pass
+    SAFE_MUTEX_LOCK(&s->s_mutex);
+    again = s->s_changes.dh_first != NULL;
+    if ( !again ) site_written(s);
+    pthread_mutex_unlock(&s->s_mutex);
+
+    if ( again && eventloop_invoke_async(el, &s->s_write_evt) < 0 ) {
+      perror("sitefn: eventloop_invoke_async");
+      SAFE_MUTEX_LOCK(&s->s_mutex);
+      site_written(s);
+      pthread_mutex_unlock(&s->s_mutex);
+    }
+    break;
+
+  default:
+    fprintf(stderr, "sitefn: unknown op %d\n", op);
+  }
+}
+
+void siteindex_clear(struct siteindex *si) {
+  si->si_appstate = NULL;
+  si->si_sites = NULL;
+}
+
+int siteindex_init(struct siteindex *si, struct appstate *as) {
+  siteindex_clear(si);
+
+  if ( pthread_rwlock_init(&si->si_mutex, NULL) != 0 )
+    return -1;
+
+  si->si_appstate = as;
+  return 0;
+}
+
+void siteindex_release(struct siteindex *si) {
+  struct site *s, *tmp;
+
+  if ( !si->si_appstate ) return;
+
+  HASH_ITER(s_hh, si->si_sites, s, tmp) {
+    // Wait for the async pool to finish with s, then write out
+    // whatever it did not get to
+    SAFE_MUTEX_LOCK(&s->s_mutex);
+    while ( s->s_writing )
+      pthread_cond_wait(&s->s_written, &s->s_mutex);
+    pthread_mutex_unlock(&s->s_mutex);
+
+    if ( s->s_changes.dh_first )
+      site_write_journal(s);
+
+    HASH_DELETE(s_hh, si->si_sites, s);
+    site_free(s);
+  }
+
+  pthread_rwlock_destroy(&si->si_mutex);
+  si->si_appstate = NULL;
+}
+
+int siteindex_is_permitted(struct siteindex *si, const struct sitekey *key,
+                           const char *app_url, size_t app_url_sz) {
+  struct site *s = siteindex_get(si, key);
+  struct siteapp *sa;
+
+  if ( !s ) return -1;
+
+  SAFE_MUTEX_LOCK(&s->s_mutex);
+  HASH_FIND(sa_hh, s->s_apps, app_url, app_url_sz, sa);
+  pthread_mutex_unlock(&s->s_mutex);
+
+  return sa ? 1 : 0;
+}
+
+int siteindex_update(struct siteindex *si, const struct sitekey *key,
+                     const char *app_url, int grant) {
+  struct site *s;
+  struct sitechange *sc;
+  char url[PATH_MAX];
+  int url_sz, queue = 0;
+
+  url_sz = site_app_url(app_url, url, sizeof(url));
+  if ( url_sz <= 0 ) {
+    fprintf(stderr, "siteindex_update: invalid permission %s\n", app_url);
+    return -1;
+  }
+
+  s = siteindex_get(si, key);
+  if ( !s ) return -1;
+
+  sc = malloc(sizeof(*sc) + url_sz + 1);
+  if ( !sc ) {
+    fprintf(stderr, "siteindex_update: out of memory\n");
+    return -1;
+  }
+
+  sc->sc_grant = grant;
+  memcpy(sc->sc_url, url, url_sz + 1);
+  DLIST_ENTRY_CLEAR(&sc->sc_list);
+
+  SAFE_MUTEX_LOCK(&s->s_mutex);
+  if ( site_set_app(s, url, url_sz, grant) < 0 ) {
+    pthread_mutex_unlock(&s->s_mutex);
+    free(sc);
+    return -1;
+  }
+
+  DLIST_INSERT(&s->s_changes, sc_list, sc);
+  if ( !s->s_writing ) {
+    s->s_writing = 1;
+    queue = 1;
+  }
+  pthread_mutex_unlock(&s->s_mutex);
+
+  if ( queue &&
+       eventloop_invoke_async(&si->si_appstate->as_eventloop, &s->s_write_evt) < 0 ) {
+    // Written out with the next change
+    perror("siteindex_update: eventloop_invoke_async");
+    SAFE_MUTEX_LOCK(&s->s_mutex);
+    site_written(s);
+    pthread_mutex_unlock(&s->s_mutex);
+  }
+
+  return 0;
+}
+
+// A site is routed to apps it is permitted, and to apps with
+// universal access
+int siteindex_resolve(struct siteindex *si, const struct sitekey *key, struct persona *p,
+                      const char *app_url, size_t app_url_sz, struct in_addr *addr) {
+  struct appstate *as = si->si_appstate;
+  struct appinstance *ai;
+  struct app *a;
+  int ret;
+
+  a = appstate_get_app_by_url_ex(as, app_url, app_url_sz);
+  if ( !a ) return 0;
+
+  SAFE_MUTEX_LOCK(&a->app_mutex);
+  ret = APP_HAS_UNIVERSAL_ACCESS(a) ? 1 : 0;
+  pthread_mutex_unlock(&a->app_mutex);
+
+  if ( !ret )
+    ret = siteindex_is_permitted(si, key, a->app_domain, strlen(a->app_domain));
+
+  if ( ret == 1 ) {
+    ai = reserve_app_instance(as, p, a);
+    if ( !ai ) {
+      ret = -1;
+    } else {
+      memcpy(addr, &ai->inst_container.c_ip, sizeof(*addr));
+      appinstance_request_start(ai);
+      APPINSTANCE_UNREF(ai);
+      ret = 1;
+    }
+  }
+
+  APPLICATION_UNREF(a);
+  return ret;
+}
@@ -0,0 +1,96 @@
+#ifndef __appliance_site_H__
+#define __appliance_site_H__
+
+#include <pthread.h>
+#include <netinet/in.h>
+#include <uthash.h>
+
+#include "event.h"
+#include "util.h"
+#include "bridge.h"
+
+// In-memory index of site permissions
+//
+// A site is a remote certificate fingerprint, as seen by one
+// persona. Each site has a set of permitted app URLs. The routes of a
+// site are its permitted apps that are installed, along with apps
+// with universal access, each at the address of the persona's
+// (reserved) instance.
+//
+// A site's permissions are read once, on first use, from
+// <conf-dir>/personas/<persona-id>/sites/<fingerprint>/perms, and are
+// only kept in memory after that. Changes are appended to perms.journal
+// in the same directory, from the async pool. Once the journal is
+// longer than SITE_JOURNAL_MAX entries, it is folded back into perms.
+
+#define SITE_JOURNAL_MAX 64
+
+struct appstate;
+struct persona;
+struct app;
+
+struct sitekey {
+  char sk_persona_id[PERSONA_ID_LENGTH];
+  unsigned int sk_fingerprint_sz;
+  unsigned char sk_fingerprint[BR_SITE_FINGERPRINT_MAX];
+};
+
+struct siteapp {
+  UT_hash_handle sa_hh;
+  char sa_url[];
+};
+
+// A change not yet written to the journal
+struct sitechange {
+  DLIST(struct sitechange) sc_list;
+  int sc_grant;
+  char sc_url[];
+};
+
+struct site {
+  UT_hash_handle s_hh;
+  struct sitekey s_key;
+
+  struct siteindex *s_index;
+
+  pthread_mutex_t s_mutex;
+  struct siteapp *s_apps;
+
+  DLIST_HEAD(struct sitechange) s_changes;
+  // Entries in perms.journal
+  int s_journal_length;
+  // Set while s_write_evt is queued or running. s_written is
+  // signaled when it is cleared
+  int s_writing;
+  pthread_cond_t s_written;
+  struct qdevtsub s_write_evt;
+};
+
+struct siteindex {
+  struct appstate *si_appstate;
+
+  pthread_rwlock_t si_mutex;
+  struct site *si_sites;
+};
+
+void siteindex_clear(struct siteindex *si);
+int siteindex_init(struct siteindex *si, struct appstate *as);
+void siteindex_release(struct siteindex *si);
+
+// Returns 1 if the site permits app_url, 0 if not, and -1 on error
+int siteindex_is_permitted(struct siteindex *si, const struct sitekey *key,
+                           const char *app_url, size_t app_url_sz);
+
+// Grant (grant != 0) or revoke a permission. The index is updated
+// immediately, and the change is journaled in the background. Called
+// by the local API (KLM_REQ_UPDATE on a persona)
+int siteindex_update(struct siteindex *si, const struct sitekey *key,
+                     const char *app_url, int grant);
+
+// Find the address of app_url, if it is one of the site's routes.
+// Returns 1 and fills in addr if so, 0 if the app is not routed to
+// this site, and -1 on error. The instance is asked to start
+int siteindex_resolve(struct siteindex *si, const struct sitekey *key, struct persona *p,
+                      const char *app_url, size_t app_url_sz, struct in_addr *addr);
+
+#endif
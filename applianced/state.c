@@ -1031,6 +1031,14 @@ void appstate_clear(struct appstate *as) {
   as->as_app_instance_init_path = NULL;
   as->as_system = NULL;
   as->as_resolv_conf = NULL;
+  as->as_webrtc_proxy_workers = 0;
+  container_pool_clear(&as->as_app_pool);
+  container_pool_clear(&as->as_pconn_pool);
+  container_freezer_clear(&as->as_freezer);
+  siteindex_clear(&as->as_sites);
+  downloader_clear(&as->as_downloader);
+  closuregc_clear(&as->as_closure_gc);
+  updatequeue_clear(&as->as_update_queue);
   as->as_mutexes_initialized = 0;
   as->as_cert = NULL;
   as->as_privkey = NULL;
@@ -1091,6 +1099,7 @@ int appstate_setup(struct appstate *as, struct appconf *ac) {
   as->as_app_instance_init_path = ac->ac_app_instance_init_path;
   as->as_system = ac->ac_system_config;
   as->as_resolv_conf = ac->ac_resolv_conf;
+  as->as_webrtc_proxy_workers = ac->ac_webrtc_proxy_workers;
 
   err = mkdir_recursive(ac->ac_conf_dir);
   if ( err < 0 ) {
@@ -1142,6 +1151,47 @@ int appstate_setup(struct appstate *as, struct appconf *ac) {
     goto error;
   }
 
+  // Without the bridge, there are no containers to keep
+  if ( appinstance_pool_init(as, AC_VALGRIND(ac) ? 0 : CONTAINER_POOL_MAX) < 0 ||
+       container_pool_init(&as->as_pconn_pool, &as->as_bridge,
+                           CONTAINER_FLAG_NETWORK_ONLY | CONTAINER_FLAG_ENABLE_SCTP,
+                           NULL, AC_VALGRIND(ac) ? 0 : CONTAINER_POOL_MAX) < 0 ) {
+    fprintf(stderr, "appstate_setup: could not initialize container pools\n");
+    goto error;
+  }
+  container_pool_resize(&as->as_pconn_pool, ac->ac_pconn_pool_size);
+
+  // Valgrind does not cope with frozen processes
+  if ( !AC_VALGRIND(ac) &&
+       container_freezer_init(&as->as_freezer, &as->as_eventloop, ac->ac_cgroup_root) < 0 ) {
+    fprintf(stderr, "appstate_setup: could not initialize container freezer\n");
+    goto error;
+  }
+
+  if ( siteindex_init(&as->as_sites, as) < 0 ) {
+    fprintf(stderr, "appstate_setup: could not initialize site index\n");
+    goto error;
+  }
+
+  if ( downloader_init(&as->as_downloader, &as->as_eventloop,
+                       ac->ac_max_downloads, ac->ac_max_host_downloads) < 0 ) {
+    fprintf(stderr, "appstate_setup: could not initialize downloader\n");
+    goto error;
+  }
+
+  err = snprintf(path, sizeof(path), "%s/nix-cache", ac->ac_conf_dir);
+  if ( err >= sizeof(path) ||
+       closuregc_init(&as->as_closure_gc, &as->as_eventloop, CLOSURE_STORE_DIR, path) < 0 ) {
+    fprintf(stderr, "appstate_setup: could not initialize closure collection\n");
+    goto error;
+  }
+
+  if ( updatequeue_init(&as->as_update_queue, ac->ac_max_updates,
+                        &as->as_closure_gc) < 0 ) {
+    fprintf(stderr, "appstate_setup: could not initialize update queue\n");
+    goto error;
+  }
+
   err = pthread_rwlock_init(&as->as_flocks_mutex, NULL);
   if ( err != 0 ) {
     fprintf(stderr, "appstate_setup: could not initialize flocks mutex: %s\n", strerror(err));
@@ -1220,6 +1270,14 @@ void appstate_release(struct appstate *as) {
     as->as_dtls_ctx = NULL;
   }
 
+  container_pool_release(&as->as_app_pool);
+  container_pool_release(&as->as_pconn_pool);
+  container_freezer_release(&as->as_freezer, &as->as_eventloop);
+  siteindex_release(&as->as_sites);
+  downloader_release(&as->as_downloader);
+  closuregc_release(&as->as_closure_gc);
+  updatequeue_release(&as->as_update_queue);
+
   bridge_release(&as->as_bridge);
 
   if ( as->as_local_fd ) {
@@ -1340,6 +1398,7 @@ static void appstatefn(struct eventloop *el, int op, void *arg) {
 
   case OP_APPSTATE_APPLICATION_UPDATED:
     au = APPUPDATER_FROM_COMPLETION_EVENT(arg);
+    updatequeue_finished(&as->as_update_queue, au);
     do {
       struct appupdater *existing;
       SAFE_RWLOCK_WRLOCK(&as->as_applications_mutex);
@@ -1667,7 +1726,9 @@ struct appupdater *appstate_queue_update_ex(struct appstate *as,
   if ( pthread_rwlock_wrlock(&as->as_applications_mutex) == 0 ) {
     struct appupdater *ret;
     HASH_FIND(au_hh, as->as_updates, uri, uri_len, ret);
-    if ( !ret ) {
+    if ( ret )
+      appupdater_prioritize(ret, AU_PRIORITY_FOR_REASON(reason));
+    else {
       ret = appupdater_new(as, uri, uri_len, sign_uri, sign_uri_len, reason, progress, app);
       if ( ret ) {
         APPUPDATER_REF(ret);
@@ -1682,6 +1743,18 @@ struct appupdater *appstate_queue_update_ex(struct appstate *as,
     return NULL;
 }
 
+struct appupdater *appstate_get_update(struct appstate *as, const char *uri, size_t uri_len) {
+  if ( pthread_rwlock_rdlock(&as->as_applications_mutex) == 0 ) {
+    struct appupdater *ret;
+    HASH_FIND(au_hh, as->as_updates, uri, uri_len, ret);
+    if ( ret )
+      APPUPDATER_REF(ret);
+    pthread_rwlock_unlock(&as->as_applications_mutex);
+    return ret;
+  } else
+    return NULL;
+}
+
 struct app *appstate_get_app_by_url(struct appstate *as, const char *domain) {
   return appstate_get_app_by_url_ex(as, domain, strlen(domain));
 }
@@ -1727,6 +1800,17 @@ int appstate_install_app_from_manifest(struct appstate *as, struct appmanifest *
     return -1;
 }
 
+// Keep the app instance pool in line with the warm containers the
+// app's current manifest asks for. app_mutex must be held
+static void appstate_update_warm_containers(struct appstate *as, struct app *a) {
+  int delta = a->app_current_manifest->am_warm_containers - a->app_warm_containers;
+
+  if ( delta != 0 ) {
+    a->app_warm_containers += delta;
+    container_pool_resize(&as->as_app_pool, delta);
+  }
+}
+
 int appstate_update_app_from_manifest(struct appstate *as, struct app *a, struct appmanifest *mf) {
   if ( pthread_rwlock_wrlock(&as->as_applications_mutex) == 0 ) {
     int ret = 0;
@@ -1752,11 +1836,17 @@ int appstate_update_app_from_manifest(struct appstate *as, struct app *a, struct
         existing->app_current_manifest = mf;
         APPMANIFEST_REF(mf);
 
+        appstate_update_warm_containers(as, existing);
+
         // Requests that the instances reset themselves
         application_request_instance_resets(&as->as_eventloop, existing);
 
         pthread_mutex_unlock(&existing->app_mutex);
 
+        // Moves the app's root to the new closure, so the old one can
+        // be collected
+        appstate_update_application_state(as, existing);
+
         APPMANIFEST_UNREF(old);
       } else
         ret = -1;
@@ -1958,6 +2048,7 @@ void appstate_update_application_state(struct appstate *as, struct app *a) {
   struct appmanifest *am;
 
   SAFE_MUTEX_LOCK(&a->app_mutex);
+  appstate_update_warm_containers(as, a);
   a->app_flags &= ~(APP_FLAG_RUN_AS_ADMIN | APP_FLAG_SINGLETON | APP_FLAG_SIGNED);
   if ( a->app_current_manifest->am_flags &
          (APPMANIFEST_FLAG_RUN_AS_ADMIN | APPMANIFEST_FLAG_SINGLETON) ) {
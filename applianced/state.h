@@ -14,6 +14,9 @@
 #include "flock.h"
 #include "dtls.h"
 #include "download.h"
+#include "closure.h"
+#include "site.h"
+#include "update.h"
 
 #define DEFAULT_EC_CURVE_NAME NID_X9_62_prime256v1
 
@@ -35,6 +38,30 @@ struct appstate {
   const char *as_system;
   const char *as_resolv_conf;
 
+  // Worker threads in each persona's shared webrtc-proxy, or 0 to run
+  // one webrtc-proxy per session
+  int as_webrtc_proxy_workers;
+
+  // Idle containers, ready to be started as app instances (sized by
+  // the apps' manifests) or as WebRTC session containers
+  struct containerpool as_app_pool;
+  struct containerpool as_pconn_pool;
+
+  // Idle app instances, frozen instead of stopped
+  struct containerfreezer as_freezer;
+
+  // Permissions and routes of each site
+  struct siteindex as_sites;
+
+  // HTTP(S) downloads of manifests, signatures, and closures
+  struct downloader as_downloader;
+
+  // Collects closures no app uses any longer, after updates
+  struct closuregc as_closure_gc;
+
+  // Limits and orders the app updates running at once
+  struct updatequeue as_update_queue;
+
   X509     *as_cert;
   EVP_PKEY *as_privkey;
 
@@ -115,6 +142,8 @@ struct appupdater *appstate_queue_update_ex(struct appstate *as,
                                             const char *uri, size_t uri_len,
                                             const char *sign_uri, size_t sign_uri_len,
                                             int reason, int progress, struct app *app);
+// Returns the queued or running update of uri, with a reference, or NULL
+struct appupdater *appstate_get_update(struct appstate *as, const char *uri, size_t uri_len);
 int appstate_log_path(struct appstate *as, const char *mf_digest_str, const char *extra,
                       char *out, size_t out_sz);
 
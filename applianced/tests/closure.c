@@ -0,0 +1,376 @@
+#include "fixture.h"
+
+#include <lzma.h>
+#include <openssl/evp.h>
+
+#include "../closure.h"
+#include "../application.h"
+
+// Builds a file:// binary cache holding a two path closure, and
+// fetches it. A (xz compressed) refers to B (uncompressed) and to
+// itself
+
+#define OP_TEST_CLOSURE_DONE EVT_CTL_CUSTOM
+
+#define HASH_A "0123456789abcdfghijklmnpqrsvwxyz"
+#define HASH_B "zyxwvsrqpnmlkjihgfdcba9876543210"
+#define NAME_A HASH_A "-app"
+#define NAME_B HASH_B "-lib"
+
+#define KEY_NAME "test-1"
+
+static pthread_mutex_t g_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_cond = PTHREAD_COND_INITIALIZER;
+static int g_done;
+
+struct testcache {
+  char tc_root[64];
+  char tc_store[128], tc_remote[128], tc_local[128];
+  char tc_remote_uri[160];
+  char tc_key[128];
+
+  unsigned char tc_nar_a[4096], tc_nar_b[1000];
+
+  struct eventloop tc_el;
+  struct downloader tc_dr;
+};
+
+static void closuredonefn(struct eventloop *el, int op, void *arg) {
+  pthread_mutex_lock(&g_mutex);
+  g_done = 1;
+  pthread_cond_broadcast(&g_cond);
+  pthread_mutex_unlock(&g_mutex);
+}
+
+static void hex(const unsigned char *d, size_t sz, char *out) {
+  size_t i;
+  for ( i = 0; i < sz; ++i )
+    sprintf(out + i * 2, "%02x", d[i]);
+}
+
+static void sha256_hex(const void *d, size_t sz, char *out) {
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  unsigned int digest_sz;
+
+  ck_assert(EVP_Digest(d, sz, digest, &digest_sz, EVP_sha256(), NULL));
+  hex(digest, digest_sz, out);
+}
+
+static void write_file(const char *dir, const char *name, const void *d, size_t sz) {
+  char path[256];
+  FILE *fl;
+
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+  fl = fopen(path, "wb");
+  ck_assert(fl);
+  ck_assert_int_eq(fwrite(d, 1, sz, fl), sz);
+  fclose(fl);
+}
+
+static void write_narinfo(struct testcache *tc, EVP_PKEY *pkey, const char *name,
+                          const char *url, const char *compression, const char *file_hash,
+                          const void *nar, size_t nar_sz, const char *refs,
+                          const char *ref_paths) {
+  char nar_hash[65], fingerprint[512], narinfo[1024], sig_b64[128], file_name[64];
+  unsigned char sig[64];
+  size_t sig_sz = sizeof(sig);
+  EVP_MD_CTX *ctx;
+
+  sha256_hex(nar, nar_sz, nar_hash);
+  snprintf(fingerprint, sizeof(fingerprint), "1;/nix/store/%s;sha256:%s;%zu;%s",
+           name, nar_hash, nar_sz, ref_paths);
+
+  ctx = EVP_MD_CTX_new();
+  ck_assert(ctx);
+  ck_assert_int_eq(EVP_DigestSignInit(ctx, NULL, NULL, NULL, pkey), 1);
+  ck_assert_int_eq(EVP_DigestSign(ctx, sig, &sig_sz, (unsigned char *) fingerprint,
+                                  strlen(fingerprint)), 1);
+  EVP_MD_CTX_free(ctx);
+  EVP_EncodeBlock((unsigned char *) sig_b64, sig, sig_sz);
+
+  snprintf(narinfo, sizeof(narinfo),
+           "StorePath: /nix/store/%s\nURL: %s\nCompression: %s\n%s%s%s"
+           "NarHash: sha256:%s\nNarSize: %zu\nReferences: %s\nSig: " KEY_NAME ":%s\n",
+           name, url, compression,
+           file_hash ? "FileHash: sha256:" : "", file_hash ? file_hash : "",
+           file_hash ? "\n" : "", nar_hash, nar_sz, refs, sig_b64);
+
+  snprintf(file_name, sizeof(file_name), "%.32s.narinfo", name);
+  write_file(tc->tc_remote, file_name, narinfo, strlen(narinfo));
+}
+
+static EVP_PKEY *gen_key(char *pub, size_t pub_sz) {
+  EVP_PKEY_CTX *ctx;
+  EVP_PKEY *pkey = NULL;
+  unsigned char raw[32];
+  char raw_b64[64];
+  size_t raw_sz = sizeof(raw);
+
+  ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_ED25519, NULL);
+  ck_assert(ctx);
+  ck_assert_int_eq(EVP_PKEY_keygen_init(ctx), 1);
+  ck_assert_int_eq(EVP_PKEY_keygen(ctx, &pkey), 1);
+  EVP_PKEY_CTX_free(ctx);
+
+  ck_assert_int_eq(EVP_PKEY_get_raw_public_key(pkey, raw, &raw_sz), 1);
+  EVP_EncodeBlock((unsigned char *) raw_b64, raw, raw_sz);
+  snprintf(pub, pub_sz, KEY_NAME ":%s", raw_b64);
+
+  return pkey;
+}
+
+static void setup_cache(struct testcache *tc) {
+  unsigned char xz[8192];
+  size_t xz_sz = 0, i;
+  char file_hash[65];
+  EVP_PKEY *pkey;
+
+  fixture_mkdtemp(tc->tc_root, sizeof(tc->tc_root), "closure");
+
+  snprintf(tc->tc_store, sizeof(tc->tc_store), "%s/store", tc->tc_root);
+  snprintf(tc->tc_remote, sizeof(tc->tc_remote), "%s/remote", tc->tc_root);
+  snprintf(tc->tc_local, sizeof(tc->tc_local), "%s/local", tc->tc_root);
+  snprintf(tc->tc_remote_uri, sizeof(tc->tc_remote_uri), "file://%s", tc->tc_remote);
+  ck_assert_int_eq(mkdir(tc->tc_store, 0755), 0);
+  ck_assert_int_eq(mkdir(tc->tc_remote, 0755), 0);
+
+  for ( i = 0; i < sizeof(tc->tc_nar_a); ++i )
+    tc->tc_nar_a[i] = (i / 16) & 0xFF;
+  for ( i = 0; i < sizeof(tc->tc_nar_b); ++i )
+    tc->tc_nar_b[i] = (i * 7) & 0xFF;
+
+  ck_assert_int_eq(lzma_easy_buffer_encode(6, LZMA_CHECK_CRC64, NULL,
+                                           tc->tc_nar_a, sizeof(tc->tc_nar_a),
+                                           xz, &xz_sz, sizeof(xz)), LZMA_OK);
+  write_file(tc->tc_remote, "a.nar.xz", xz, xz_sz);
+  write_file(tc->tc_remote, "b.nar", tc->tc_nar_b, sizeof(tc->tc_nar_b));
+  sha256_hex(xz, xz_sz, file_hash);
+
+  pkey = gen_key(tc->tc_key, sizeof(tc->tc_key));
+  write_narinfo(tc, pkey, NAME_A, "a.nar.xz", "xz", file_hash,
+                tc->tc_nar_a, sizeof(tc->tc_nar_a), NAME_B " " NAME_A,
+                "/nix/store/" NAME_B ",/nix/store/" NAME_A);
+  write_narinfo(tc, pkey, NAME_B, "b.nar", "none", NULL,
+                tc->tc_nar_b, sizeof(tc->tc_nar_b), "", "");
+  EVP_PKEY_free(pkey);
+
+  fixture_block_signals();
+
+  ck_assert_int_eq(eventloop_init(&tc->tc_el), 0);
+  eventloop_prepare(&tc->tc_el);
+  ck_assert_int_eq(downloader_init(&tc->tc_dr, &tc->tc_el, 0, 0), 0);
+  fixture_start_loop(&tc->tc_el);
+}
+
+// The event loop threads keep running until the test process exits,
+// but curl must be cleaned up before then
+static void teardown_cache(struct testcache *tc) {
+  downloader_release(&tc->tc_dr);
+  fixture_remove_tree(tc->tc_root);
+}
+
+static int fetch(struct testcache *tc, const char *key, const char *path,
+                 struct closurefetch *cf) {
+  struct bincache bc;
+  int sts;
+
+  bc.bc_uri = tc->tc_remote_uri;
+  bc.bc_key_count = 1;
+  bc.bc_keys = &key;
+
+  g_done = 0;
+  ck_assert_int_eq(closurefetch_init(cf, &tc->tc_el, &tc->tc_dr, tc->tc_store, tc->tc_local,
+                                     &bc, 1, -1, OP_TEST_CLOSURE_DONE, closuredonefn), 0);
+  ck_assert_int_eq(closurefetch_start(cf, path), 0);
+
+  pthread_mutex_lock(&g_mutex);
+  while ( !g_done )
+    pthread_cond_wait(&g_cond, &g_mutex);
+  pthread_mutex_unlock(&g_mutex);
+
+  sts = cf->cf_sts;
+  closurefetch_release(cf);
+  return sts;
+}
+
+static void nar_path(struct testcache *tc, const void *nar, size_t nar_sz, char *path, size_t path_sz) {
+  char nar_hash[65];
+
+  sha256_hex(nar, nar_sz, nar_hash);
+  snprintf(path, path_sz, "%s/nar/%s.nar", tc->tc_local, nar_hash);
+}
+
+static void check_cached(struct testcache *tc, const char *hash, const void *nar, size_t nar_sz) {
+  char path[256];
+  unsigned char *actual;
+  struct stat st;
+  FILE *fl;
+
+  snprintf(path, sizeof(path), "%s/%s.narinfo", tc->tc_local, hash);
+  ck_assert_int_eq(stat(path, &st), 0);
+
+  nar_path(tc, nar, nar_sz, path, sizeof(path));
+  fl = fopen(path, "rb");
+  ck_assert(fl);
+
+  actual = malloc(nar_sz + 1);
+  ck_assert(actual);
+  ck_assert_int_eq(fread(actual, 1, nar_sz + 1, fl), nar_sz);
+  ck_assert(memcmp(actual, nar, nar_sz) == 0);
+  free(actual);
+  fclose(fl);
+}
+
+START_TEST(test_fetch_closure)
+{
+  struct testcache tc;
+  struct closurefetch cf;
+
+  setup_cache(&tc);
+
+  ck_assert_int_eq(fetch(&tc, tc.tc_key, "/nix/store/" NAME_A, &cf), CLOSURE_STATUS_COMPLETE);
+  ck_assert_int_eq(cf.cf_fetched, 2);
+  ck_assert_int_eq(cf.cf_skipped, 0);
+
+  check_cached(&tc, HASH_A, tc.tc_nar_a, sizeof(tc.tc_nar_a));
+  check_cached(&tc, HASH_B, tc.tc_nar_b, sizeof(tc.tc_nar_b));
+
+  // Everything is in the local cache now
+  ck_assert_int_eq(fetch(&tc, tc.tc_key, "/nix/store/" NAME_A, &cf), CLOSURE_STATUS_COMPLETE);
+  ck_assert_int_eq(cf.cf_fetched, 0);
+  ck_assert_int_eq(cf.cf_skipped, 2);
+
+  teardown_cache(&tc);
+}
+END_TEST
+
+START_TEST(test_skip_present)
+{
+  struct testcache tc;
+  struct closurefetch cf;
+  char path[256];
+
+  setup_cache(&tc);
+
+  snprintf(path, sizeof(path), "%s/%s", tc.tc_store, NAME_B);
+  ck_assert_int_eq(mkdir(path, 0755), 0);
+
+  ck_assert_int_eq(fetch(&tc, tc.tc_key, "/nix/store/" NAME_A, &cf), CLOSURE_STATUS_COMPLETE);
+  ck_assert_int_eq(cf.cf_fetched, 1);
+  ck_assert_int_eq(cf.cf_skipped, 1);
+
+  teardown_cache(&tc);
+}
+END_TEST
+
+START_TEST(test_reuse_cached_nar)
+{
+  struct testcache tc;
+  struct closurefetch cf;
+  char path[256];
+
+  setup_cache(&tc);
+
+  ck_assert_int_eq(fetch(&tc, tc.tc_key, "/nix/store/" NAME_A, &cf), CLOSURE_STATUS_COMPLETE);
+
+  // Only the NARs are left, so no NAR is downloaded again
+  snprintf(path, sizeof(path), "%s/%s.narinfo", tc.tc_local, HASH_A);
+  ck_assert_int_eq(unlink(path), 0);
+  snprintf(path, sizeof(path), "%s/%s.narinfo", tc.tc_local, HASH_B);
+  ck_assert_int_eq(unlink(path), 0);
+
+  ck_assert_int_eq(fetch(&tc, tc.tc_key, "/nix/store/" NAME_A, &cf), CLOSURE_STATUS_COMPLETE);
+  ck_assert_int_eq(cf.cf_fetched, 0);
+  ck_assert_int_eq(cf.cf_deduped, 2);
+
+  check_cached(&tc, HASH_A, tc.tc_nar_a, sizeof(tc.tc_nar_a));
+  check_cached(&tc, HASH_B, tc.tc_nar_b, sizeof(tc.tc_nar_b));
+
+  teardown_cache(&tc);
+}
+END_TEST
+
+START_TEST(test_sweep_cache)
+{
+  struct testcache tc;
+  struct closurefetch cf;
+  struct stat st;
+  char path[256];
+
+  setup_cache(&tc);
+
+  ck_assert_int_eq(fetch(&tc, tc.tc_key, "/nix/store/" NAME_A, &cf), CLOSURE_STATUS_COMPLETE);
+  ck_assert_int_eq(closurecache_sweep(tc.tc_store, tc.tc_local, CLOSURE_CACHE_GRACE), 0);
+
+  // Once B is in the store, its narinfo goes, but its NAR is recent
+  snprintf(path, sizeof(path), "%s/%s", tc.tc_store, NAME_B);
+  ck_assert_int_eq(mkdir(path, 0755), 0);
+  ck_assert_int_eq(closurecache_sweep(tc.tc_store, tc.tc_local, CLOSURE_CACHE_GRACE), 1);
+
+  snprintf(path, sizeof(path), "%s/%s.narinfo", tc.tc_local, HASH_B);
+  ck_assert_int_ne(stat(path, &st), 0);
+  nar_path(&tc, tc.tc_nar_b, sizeof(tc.tc_nar_b), path, sizeof(path));
+  ck_assert_int_eq(stat(path, &st), 0);
+
+  // Without a grace period, the unreferenced NAR goes too
+  ck_assert_int_eq(closurecache_sweep(tc.tc_store, tc.tc_local, -1), 1);
+  ck_assert_int_ne(stat(path, &st), 0);
+
+  check_cached(&tc, HASH_A, tc.tc_nar_a, sizeof(tc.tc_nar_a));
+
+  teardown_cache(&tc);
+}
+END_TEST
+
+START_TEST(test_bad_signature)
+{
+  struct testcache tc;
+  struct closurefetch cf;
+  char other_key[128];
+  EVP_PKEY *pkey;
+
+  setup_cache(&tc);
+
+  pkey = gen_key(other_key, sizeof(other_key));
+  EVP_PKEY_free(pkey);
+
+  ck_assert_int_eq(fetch(&tc, other_key, "/nix/store/" NAME_A, &cf),
+                   CLOSURE_STATUS_BAD_SIGNATURE);
+  ck_assert_int_eq(cf.cf_fetched, 0);
+
+  teardown_cache(&tc);
+}
+END_TEST
+
+START_TEST(test_not_found)
+{
+  struct testcache tc;
+  struct closurefetch cf;
+
+  setup_cache(&tc);
+
+  ck_assert_int_eq(fetch(&tc, tc.tc_key, "/nix/store/11111111111111111111111111111111-missing", &cf),
+                   CLOSURE_STATUS_NOT_FOUND);
+
+  teardown_cache(&tc);
+}
+END_TEST
+
+Suite *closure_suite() {
+  Suite *s;
+  TCase *tc;
+
+  s = suite_create("Closures");
+
+  tc = tcase_create("Fetch closure");
+  tcase_add_test(tc, test_fetch_closure);
+  tcase_add_test(tc, test_skip_present);
+  tcase_add_test(tc, test_reuse_cached_nar);
+  tcase_add_test(tc, test_sweep_cache);
+  tcase_add_test(tc, test_bad_signature);
+  tcase_add_test(tc, test_not_found);
+
+  suite_add_tcase(s, tc);
+
+  return s;
+}
@@ -0,0 +1,40 @@
+#define _GNU_SOURCE
+#include <ftw.h>
+
+#include "fixture.h"
+
+void fixture_mkdtemp(char *root, size_t root_sz, const char *name) {
+  ck_assert(snprintf(root, root_sz, "/tmp/%s-test-XXXXXX", name) < root_sz);
+  ck_assert(mkdtemp(root));
+}
+
+void fixture_block_signals() {
+  sigset_t all_signals;
+
+  sigfillset(&all_signals);
+  sigdelset(&all_signals, SIGINT);
+  pthread_sigmask(SIG_SETMASK, &all_signals, NULL);
+}
+
+static void *eventloop_thread(void *arg) {
+  eventloop_run((struct eventloop *) arg);
+  return NULL;
+}
+
+void fixture_start_loop(struct eventloop *el) {
+  pthread_t t;
+  int i;
+
+  for ( i = 0; i < LOOP_THREADS; ++i ) {
+    ck_assert_int_eq(pthread_create(&t, NULL, eventloop_thread, el), 0);
+    pthread_detach(t);
+  }
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+  return remove(path);
+}
+
+void fixture_remove_tree(const char *root) {
+  nftw(root, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
@@ -0,0 +1,34 @@
+#ifndef __appliance_tests_fixture_H__
+#define __appliance_tests_fixture_H__
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <check.h>
+
+#include "event.h"
+
+// Pieces shared by the test suites that run a real event loop over a
+// temporary directory
+
+#define LOOP_THREADS 2
+
+// Creates /tmp/<name>-test-XXXXXX, and stores its path in root
+void fixture_mkdtemp(char *root, size_t root_sz, const char *name);
+// Timer signals must go to the event loop threads, so every other
+// thread blocks them. Call before starting any thread
+void fixture_block_signals();
+// Runs el on LOOP_THREADS detached threads. These keep running until
+// the test process exits
+void fixture_start_loop(struct eventloop *el);
+// Removes root, and everything in it
+void fixture_remove_tree(const char *root);
+
+#endif
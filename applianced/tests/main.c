@@ -2,6 +2,9 @@
 #include <check.h>
 
 Suite *token_suite();
+Suite *closure_suite();
+Suite *site_suite();
+Suite *update_suite();
 
 int main(void) {
   int number_failed;
@@ -11,6 +14,9 @@ int main(void) {
   s = token_suite();
 
   sr = srunner_create(s);
+  srunner_add_suite(sr, closure_suite());
+  srunner_add_suite(sr, site_suite());
+  srunner_add_suite(sr, update_suite());
 
   srunner_run_all(sr, CK_NORMAL);
   number_failed = srunner_ntests_failed(sr);
@@ -0,0 +1,144 @@
+#include "fixture.h"
+#include "../site.h"
+#include "../state.h"
+
+// Grants and revocations against a site index backed by a temporary
+// configuration directory
+
+struct testsites {
+  char ts_root[64];
+  struct appstate ts_as;
+  struct sitekey ts_key;
+};
+
+static void setup_sites(struct testsites *ts) {
+  int i;
+
+  fixture_mkdtemp(ts->ts_root, sizeof(ts->ts_root), "site");
+
+  memset(&ts->ts_as, 0, sizeof(ts->ts_as));
+  ts->ts_as.as_conf_dir = ts->ts_root;
+
+  memset(&ts->ts_key, 0, sizeof(ts->ts_key));
+  memset(ts->ts_key.sk_persona_id, 0xAB, sizeof(ts->ts_key.sk_persona_id));
+  ts->ts_key.sk_fingerprint_sz = 32;
+  for ( i = 0; i < ts->ts_key.sk_fingerprint_sz; ++i )
+    ts->ts_key.sk_fingerprint[i] = i;
+
+  fixture_block_signals();
+
+  ck_assert_int_eq(eventloop_init(&ts->ts_as.as_eventloop), 0);
+  eventloop_prepare(&ts->ts_as.as_eventloop);
+  fixture_start_loop(&ts->ts_as.as_eventloop);
+
+  ck_assert_int_eq(siteindex_init(&ts->ts_as.as_sites, &ts->ts_as), 0);
+}
+
+// siteindex_release waits for the journal writes in flight, and
+// writes out the rest itself, so nothing is lost by releasing early
+static void teardown_sites(struct testsites *ts) {
+  siteindex_release(&ts->ts_as.as_sites);
+  fixture_remove_tree(ts->ts_root);
+}
+
+static void reload(struct testsites *ts) {
+  siteindex_release(&ts->ts_as.as_sites);
+  ck_assert_int_eq(siteindex_init(&ts->ts_as.as_sites, &ts->ts_as), 0);
+}
+
+static int permitted(struct testsites *ts, const char *app_url) {
+  return siteindex_is_permitted(&ts->ts_as.as_sites, &ts->ts_key, app_url, strlen(app_url));
+}
+
+START_TEST(test_grant_revoke)
+{
+  struct testsites ts;
+
+  setup_sites(&ts);
+
+  ck_assert_int_eq(permitted(&ts, "photos.example.com"), 0);
+
+  ck_assert_int_eq(siteindex_update(&ts.ts_as.as_sites, &ts.ts_key, "photos.example.com", 1), 0);
+  ck_assert_int_eq(siteindex_update(&ts.ts_as.as_sites, &ts.ts_key, "mail.example.com", 1), 0);
+  ck_assert_int_eq(siteindex_update(&ts.ts_as.as_sites, &ts.ts_key, "photos.example.com", 0), 0);
+
+  ck_assert_int_eq(permitted(&ts, "photos.example.com"), 0);
+  ck_assert_int_eq(permitted(&ts, "mail.example.com"), 1);
+
+  // Other sites of the persona are unaffected
+  ts.ts_key.sk_fingerprint[0] ^= 0xFF;
+  ck_assert_int_eq(permitted(&ts, "mail.example.com"), 0);
+  ts.ts_key.sk_fingerprint[0] ^= 0xFF;
+
+  ck_assert_int_eq(siteindex_update(&ts.ts_as.as_sites, &ts.ts_key, "not a url", 1), -1);
+
+  teardown_sites(&ts);
+}
+END_TEST
+
+START_TEST(test_journal_reload)
+{
+  struct testsites ts;
+
+  setup_sites(&ts);
+
+  ck_assert_int_eq(siteindex_update(&ts.ts_as.as_sites, &ts.ts_key, "photos.example.com", 1), 0);
+  ck_assert_int_eq(siteindex_update(&ts.ts_as.as_sites, &ts.ts_key, "mail.example.com", 1), 0);
+  ck_assert_int_eq(siteindex_update(&ts.ts_as.as_sites, &ts.ts_key, "photos.example.com", 0), 0);
+
+  reload(&ts);
+
+  ck_assert_int_eq(permitted(&ts, "photos.example.com"), 0);
+  ck_assert_int_eq(permitted(&ts, "mail.example.com"), 1);
+
+  teardown_sites(&ts);
+}
+END_TEST
+
+START_TEST(test_journal_compaction)
+{
+  struct testsites ts;
+  char app_url[64], persona_digest[PERSONA_ID_X_LENGTH + 1], site_digest[65], path[256];
+  struct stat st;
+  int i;
+
+  setup_sites(&ts);
+
+  for ( i = 0; i <= SITE_JOURNAL_MAX; ++i ) {
+    snprintf(app_url, sizeof(app_url), "app%d.example.com", i);
+    ck_assert_int_eq(siteindex_update(&ts.ts_as.as_sites, &ts.ts_key, app_url, 1), 0);
+  }
+
+  reload(&ts);
+
+  // The journal was folded into perms at least once
+  snprintf(path, sizeof(path), "%s/personas/%s/sites/%s/perms", ts.ts_root,
+           hex_digest_str((unsigned char *) ts.ts_key.sk_persona_id, persona_digest, PERSONA_ID_LENGTH),
+           hex_digest_str(ts.ts_key.sk_fingerprint, site_digest, ts.ts_key.sk_fingerprint_sz));
+  ck_assert_int_eq(stat(path, &st), 0);
+  ck_assert(st.st_size > 0);
+
+  for ( i = 0; i <= SITE_JOURNAL_MAX; ++i ) {
+    snprintf(app_url, sizeof(app_url), "app%d.example.com", i);
+    ck_assert_int_eq(permitted(&ts, app_url), 1);
+  }
+
+  teardown_sites(&ts);
+}
+END_TEST
+
+Suite *site_suite() {
+  Suite *s;
+  TCase *tc;
+
+  s = suite_create("Sites");
+
+  tc = tcase_create("Site permissions");
+  tcase_add_test(tc, test_grant_revoke);
+  tcase_add_test(tc, test_journal_reload);
+  tcase_add_test(tc, test_journal_compaction);
+
+  suite_add_tcase(s, tc);
+
+  return s;
+}
@@ -0,0 +1,313 @@
+#include "fixture.h"
+#include "../update.h"
+#include "../state.h"
+
+// Update scheduling, with manifests downloaded from a temporary
+// directory. An empty manifest finishes the update as done, and one
+// that does not parse finishes it with an error, so no update gets as
+// far as fetching a closure.
+
+#define MAX_UPDATES 4
+
+#define EMPTY_MANIFEST ""
+#define BAD_MANIFEST   "{"
+
+struct testupdate {
+  struct testupdates *tu_tests;
+  struct appupdater *tu_updater;
+  struct qdevtsub tu_done;
+
+  // Protected by ts_mutex
+  int tu_finished, tu_order, tu_sts;
+  // Set to hold the completion handler until released
+  int tu_hold, tu_held;
+};
+
+struct testupdates {
+  char ts_root[64];
+  struct appstate ts_as;
+
+  pthread_mutex_t ts_mutex;
+  pthread_cond_t ts_cond;
+  int ts_reported, ts_finished;
+
+  struct testupdate ts_updates[MAX_UPDATES];
+};
+
+// Does what appstatefn does once an update is over
+static void testupdatefn(struct eventloop *el, int op, void *arg) {
+  struct qdevent *qde = arg;
+  struct testupdate *tu = STRUCT_FROM_BASE(struct testupdate, tu_done, qde->qde_sub);
+  struct testupdates *ts = tu->tu_tests;
+
+  SAFE_MUTEX_LOCK(&ts->ts_mutex);
+  tu->tu_held = tu->tu_hold;
+  pthread_cond_broadcast(&ts->ts_cond);
+  while ( tu->tu_hold )
+    pthread_cond_wait(&ts->ts_cond, &ts->ts_mutex);
+  // Before updatequeue_finished, which may complete followers
+  tu->tu_order = ts->ts_reported++;
+  pthread_mutex_unlock(&ts->ts_mutex);
+
+  updatequeue_finished(&ts->ts_as.as_update_queue, tu->tu_updater);
+
+  SAFE_MUTEX_LOCK(&ts->ts_mutex);
+  tu->tu_finished = 1;
+  ts->ts_finished++;
+  tu->tu_sts = tu->tu_updater->au_sts;
+  pthread_cond_broadcast(&ts->ts_cond);
+  pthread_mutex_unlock(&ts->ts_mutex);
+}
+
+static void setup_updates(struct testupdates *ts, int max_active) {
+  char path[PATH_MAX];
+
+  fixture_mkdtemp(ts->ts_root, sizeof(ts->ts_root), "update");
+
+  memset(&ts->ts_as, 0, sizeof(ts->ts_as));
+  memset(ts->ts_updates, 0, sizeof(ts->ts_updates));
+  ts->ts_as.as_conf_dir = ts->ts_root;
+  ts->ts_reported = ts->ts_finished = 0;
+
+  ck_assert_int_eq(pthread_mutex_init(&ts->ts_mutex, NULL), 0);
+  ck_assert_int_eq(pthread_cond_init(&ts->ts_cond, NULL), 0);
+
+  snprintf(path, sizeof(path), "%s/manifests", ts->ts_root);
+  ck_assert_int_eq(mkdir(path, 0755), 0);
+
+  // Events are queued before the event loop threads start
+  fixture_block_signals();
+
+  ck_assert_int_eq(eventloop_init(&ts->ts_as.as_eventloop), 0);
+  eventloop_prepare(&ts->ts_as.as_eventloop);
+  ck_assert_int_eq(downloader_init(&ts->ts_as.as_downloader, &ts->ts_as.as_eventloop, 0, 0), 0);
+  ck_assert_int_eq(updatequeue_init(&ts->ts_as.as_update_queue, max_active, NULL), 0);
+}
+
+// Until this is called, downloads and completions stay queued
+static void start_loop(struct testupdates *ts) {
+  fixture_start_loop(&ts->ts_as.as_eventloop);
+}
+
+// The event loop threads keep running until the test process exits,
+// so the updaters are only freed once each has finished
+static void teardown_updates(struct testupdates *ts) {
+  int i;
+
+  for ( i = 0; i < MAX_UPDATES; ++i ) {
+    if ( ts->ts_updates[i].tu_updater )
+      APPUPDATER_UNREF(ts->ts_updates[i].tu_updater);
+  }
+
+  fixture_remove_tree(ts->ts_root);
+}
+
+static struct testupdate *new_update(struct testupdates *ts, int ix, const char *manifest, int reason) {
+  struct testupdate *tu = &ts->ts_updates[ix];
+  char path[PATH_MAX], uri[PATH_MAX + 16];
+  FILE *mf;
+
+  snprintf(path, sizeof(path), "%s/manifest-%d.json", ts->ts_root, ix);
+  mf = fopen(path, "wb");
+  ck_assert(mf);
+  ck_assert_int_eq(fwrite(manifest, 1, strlen(manifest), mf), strlen(manifest));
+  fclose(mf);
+
+  snprintf(uri, sizeof(uri), "file://%s", path);
+
+  tu->tu_tests = ts;
+  tu->tu_updater = appupdater_new(&ts->ts_as, uri, strlen(uri), NULL, 0, reason, -1, NULL);
+  ck_assert(tu->tu_updater);
+
+  qdevtsub_init(&tu->tu_done, EVT_CTL_CUSTOM, testupdatefn);
+  appupdater_request_event(tu->tu_updater, &tu->tu_done);
+
+  return tu;
+}
+
+static int queue_state(struct testupdate *tu) {
+  int sts, priority, queued;
+  appupdater_queue_state(tu->tu_updater, &sts, &priority, &queued);
+  return queued;
+}
+
+static void wait_finished(struct testupdates *ts, int count) {
+  SAFE_MUTEX_LOCK(&ts->ts_mutex);
+  while ( ts->ts_finished < count )
+    pthread_cond_wait(&ts->ts_cond, &ts->ts_mutex);
+  pthread_mutex_unlock(&ts->ts_mutex);
+}
+
+static void wait_held(struct testupdates *ts, struct testupdate *tu) {
+  SAFE_MUTEX_LOCK(&ts->ts_mutex);
+  while ( !tu->tu_held )
+    pthread_cond_wait(&ts->ts_cond, &ts->ts_mutex);
+  pthread_mutex_unlock(&ts->ts_mutex);
+}
+
+static void release_held(struct testupdates *ts, struct testupdate *tu) {
+  SAFE_MUTEX_LOCK(&ts->ts_mutex);
+  tu->tu_hold = 0;
+  pthread_cond_broadcast(&ts->ts_cond);
+  pthread_mutex_unlock(&ts->ts_mutex);
+}
+
+static void wait_following(struct testupdate *tu) {
+  while ( queue_state(tu) != AU_QUEUE_FOLLOWING )
+    usleep(1000);
+}
+
+START_TEST(test_pump_priority)
+{
+  static struct testupdates ts;
+  struct testupdate *background, *security, *interactive;
+
+  setup_updates(&ts, 1);
+
+  background = new_update(&ts, 0, EMPTY_MANIFEST, AU_UPDATE_REASON_AUTOMATIC);
+  security = new_update(&ts, 1, EMPTY_MANIFEST, AU_UPDATE_REASON_SECURITY);
+  interactive = new_update(&ts, 2, EMPTY_MANIFEST, AU_UPDATE_REASON_MANUAL);
+
+  appupdater_start(background->tu_updater);
+  appupdater_start(security->tu_updater);
+  appupdater_start(interactive->tu_updater);
+
+  ck_assert_int_eq(queue_state(background), AU_QUEUE_ACTIVE);
+  ck_assert_int_eq(queue_state(security), AU_QUEUE_WAITING);
+  ck_assert_int_eq(queue_state(interactive), AU_QUEUE_WAITING);
+
+  start_loop(&ts);
+  wait_finished(&ts, 3);
+
+  // One slot, so each waiting update starts once the last finishes,
+  // highest priority first
+  ck_assert_int_eq(background->tu_order, 0);
+  ck_assert_int_eq(interactive->tu_order, 1);
+  ck_assert_int_eq(security->tu_order, 2);
+
+  ck_assert_int_eq(background->tu_sts, AU_STATUS_DONE);
+  ck_assert_int_eq(interactive->tu_sts, AU_STATUS_DONE);
+  ck_assert_int_eq(security->tu_sts, AU_STATUS_DONE);
+
+  ck_assert_int_eq(ts.ts_as.as_update_queue.uq_active, 0);
+
+  teardown_updates(&ts);
+}
+END_TEST
+
+START_TEST(test_follow)
+{
+  static struct testupdates ts;
+  struct testupdate *leader, *follower;
+
+  setup_updates(&ts, 2);
+  start_loop(&ts);
+
+  leader = new_update(&ts, 0, EMPTY_MANIFEST, AU_UPDATE_REASON_MANUAL);
+  follower = new_update(&ts, 1, EMPTY_MANIFEST, AU_UPDATE_REASON_MANUAL);
+
+  // Keep the leader active, with its manifest downloaded
+  leader->tu_hold = 1;
+  appupdater_start(leader->tu_updater);
+  wait_held(&ts, leader);
+  ck_assert_int_eq(queue_state(leader), AU_QUEUE_ACTIVE);
+
+  appupdater_start(follower->tu_updater);
+  wait_following(follower);
+
+  release_held(&ts, leader);
+  wait_finished(&ts, 2);
+
+  ck_assert_int_eq(leader->tu_order, 0);
+  ck_assert_int_eq(leader->tu_sts, AU_STATUS_DONE);
+  ck_assert_int_eq(follower->tu_sts, AU_STATUS_DONE);
+  ck_assert_int_eq(queue_state(follower), AU_QUEUE_NONE);
+
+  teardown_updates(&ts);
+}
+END_TEST
+
+START_TEST(test_requeue)
+{
+  static struct testupdates ts;
+  struct testupdate *leader, *follower;
+
+  setup_updates(&ts, 2);
+  start_loop(&ts);
+
+  leader = new_update(&ts, 0, BAD_MANIFEST, AU_UPDATE_REASON_MANUAL);
+  follower = new_update(&ts, 1, BAD_MANIFEST, AU_UPDATE_REASON_MANUAL);
+
+  leader->tu_hold = 1;
+  appupdater_start(leader->tu_updater);
+  wait_held(&ts, leader);
+  ck_assert_int_eq(leader->tu_updater->au_sts, AU_STATUS_ERROR);
+
+  appupdater_start(follower->tu_updater);
+  wait_following(follower);
+
+  // The leader did not succeed, so the follower applies the manifest
+  // itself
+  release_held(&ts, leader);
+  wait_finished(&ts, 2);
+
+  ck_assert_int_eq(leader->tu_order, 0);
+  ck_assert_int_eq(follower->tu_order, 1);
+  ck_assert_int_eq(follower->tu_sts, AU_STATUS_ERROR);
+  ck_assert_int_eq(ts.ts_as.as_update_queue.uq_active, 0);
+
+  teardown_updates(&ts);
+}
+END_TEST
+
+START_TEST(test_cancel)
+{
+  static struct testupdates ts;
+  struct testupdate *downloading, *waiting;
+
+  setup_updates(&ts, 1);
+
+  downloading = new_update(&ts, 0, EMPTY_MANIFEST, AU_UPDATE_REASON_MANUAL);
+  waiting = new_update(&ts, 1, EMPTY_MANIFEST, AU_UPDATE_REASON_MANUAL);
+
+  appupdater_start(downloading->tu_updater);
+  appupdater_start(waiting->tu_updater);
+
+  ck_assert_int_eq(queue_state(downloading), AU_QUEUE_ACTIVE);
+  ck_assert_int_eq(queue_state(waiting), AU_QUEUE_WAITING);
+
+  // The download event is still queued. The cancel is reported once
+  // it is delivered
+  ck_assert_int_eq(appupdater_cancel(downloading->tu_updater), 0);
+  ck_assert_int_eq(appupdater_cancel(waiting->tu_updater), 0);
+
+  start_loop(&ts);
+  wait_finished(&ts, 2);
+
+  ck_assert_int_eq(downloading->tu_sts, AU_STATUS_CANCELED);
+  ck_assert_int_eq(waiting->tu_sts, AU_STATUS_CANCELED);
+  ck_assert_int_eq(ts.ts_as.as_update_queue.uq_active, 0);
+
+  // Over, so there is nothing left to cancel
+  ck_assert_int_eq(appupdater_cancel(downloading->tu_updater), -1);
+
+  teardown_updates(&ts);
+}
+END_TEST
+
+Suite *update_suite() {
+  Suite *s;
+  TCase *tc;
+
+  s = suite_create("Updates");
+
+  tc = tcase_create("Update queue");
+  tcase_add_test(tc, test_pump_priority);
+  tcase_add_test(tc, test_follow);
+  tcase_add_test(tc, test_requeue);
+  tcase_add_test(tc, test_cancel);
+
+  suite_add_tcase(s, tc);
+
+  return s;
+}
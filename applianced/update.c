@@ -10,15 +10,23 @@
 #define OP_APPUPDATER_PARSE_ASYNC (EVT_CTL_CUSTOM + 1)
 #define OP_APPUPDATER_BUILD_PROCESS_EVENT (EVT_CTL_CUSTOM + 2)
 #define OP_APPUPDATER_DL_SIGN_PROGRESS (EVT_CTL_CUSTOM + 3)
+#define OP_APPUPDATER_CLOSURE_DONE (EVT_CTL_CUSTOM + 4)
+#define OP_UPDATEQUEUE_GC_DONE (EVT_CTL_CUSTOM + 5)
 
 #define MF_TMPFILE_TEMPLATE "%s/manifests/.%08"PRIuPTR"-download.tmp"
 #define MF_FINAL_TEMPLATE "%s/manifests/%s"
 #define SIGN_SUFFIX ".sign"
 
+static void appupdater_run(struct appupdater *au);
+static void appupdater_manifest_downloaded(struct appupdater *au);
 static void appupdater_parse_manifest(struct appupdater *au);
 static void appupdater_error(struct appupdater *au, int sts);
 static void appupdater_build_from_manifest(struct appupdater *au);
+static void appupdater_import_closure(struct appupdater *au);
+static void appupdater_apply(struct appupdater *au);
+static void appupdater_remove_pending_root(struct appupdater *au);
 static void appupdater_free(const struct shared *sh, int level);
+static void updatequeue_pump(struct updatequeue *uq);
 
 static void appupdaterfn(struct eventloop *el, int op, void *arg) {
   struct appupdater *au;
@@ -35,25 +43,40 @@ static void appupdaterfn(struct eventloop *el, int op, void *arg) {
       if ( au->au_application )
         application_unset_flags(au->au_application, APP_FLAG_UPDATING);
       if ( pse->pse_sts == 0 ) {
-        int err;
-        if ( au->au_application )
-          err = appstate_update_app_from_manifest(au->au_appstate, au->au_application, au->au_manifest);
-        else
-          err = appstate_install_app_from_manifest(au->au_appstate, au->au_manifest);
-
-        if ( err < 0 )
-          appupdater_error(au, AU_STATUS_ERROR);
-        else
-          appupdater_error(au, AU_STATUS_DONE);
+        appupdater_apply(au);
       } else {
-        fprintf(stderr, "appupdaterfn: nix-build ended with status %d\n", pse->pse_sts);
+        fprintf(stderr, "appupdaterfn: nix-store --realise ended with status %d\n", pse->pse_sts);
         appupdater_error(au, AU_STATUS_ERROR);
       }
+      appupdater_remove_pending_root(au);
       pssub_release(&au->au_build_ps);
     }
     APPUPDATER_UNREF(au);
     break;
 
+  case OP_APPUPDATER_CLOSURE_DONE:
+    au = STRUCT_FROM_BASE(struct appupdater, au_closure, CLOSUREFETCH_FROM_COMPLETION_EVENT(arg));
+    SAFE_MUTEX_LOCK(&au->au_mutex);
+    if ( au->au_canceled ) {
+      pthread_mutex_unlock(&au->au_mutex);
+      if ( au->au_application )
+        application_unset_flags(au->au_application, APP_FLAG_UPDATING);
+      appupdater_error(au, AU_STATUS_CANCELED);
+    } else if ( au->au_closure.cf_sts == CLOSURE_STATUS_COMPLETE ) {
+      pthread_mutex_unlock(&au->au_mutex);
+      appupdater_import_closure(au);
+    } else {
+      pthread_mutex_unlock(&au->au_mutex);
+      fprintf(stderr, "appupdaterfn: could not fetch closure %s: %d\n",
+              au->au_manifest->am_nix_closure, au->au_closure.cf_sts);
+      if ( au->au_application )
+        application_unset_flags(au->au_application, APP_FLAG_UPDATING);
+      appupdater_error(au, AU_STATUS_ERROR);
+    }
+    // Taken in appupdater_build_from_manifest
+    APPUPDATER_UNREF(au);
+    break;
+
   case OP_APPUPDATER_PARSE_ASYNC:
     qde = arg;
     au = STRUCT_FROM_BASE(struct appupdater, au_parse_async, qde->qde_sub);
@@ -63,15 +86,21 @@ static void appupdaterfn(struct eventloop *el, int op, void *arg) {
   case OP_APPUPDATER_DL_SIGN_PROGRESS:
     dle = arg;
     au = STRUCT_FROM_BASE(struct appupdater, au_sign_download, dle->dle_dl);
+    SAFE_MUTEX_LOCK(&au->au_mutex);
 
-    if ( download_complete(dle->dle_dl) ) {
+    if ( au->au_sts == AU_STATUS_CANCELED ) {
+      // Already reported
+    } else if ( au->au_canceled ) {
+      // See appupdater_cancel
+      download_cancel(&au->au_sign_download);
+      appupdater_error(au, AU_STATUS_CANCELED);
+    } else if ( download_complete(dle->dle_dl) ) {
       fclose(au->au_sign_output);
       au->au_sign_output = NULL;
 
       if ( dle->dle_dl->dl_sts == DL_STATUS_NOT_FOUND ||
            dle->dle_dl->dl_sts >= 0 ) {
-        au->au_sts = AU_STATUS_PARSING;
-        eventloop_invoke_async(&au->au_appstate->as_eventloop, &au->au_parse_async);
+        appupdater_manifest_downloaded(au);
       } else if ( dle->dle_dl->dl_sts < 0 ) {
         fprintf(stderr, "appupdater: %p: failed: %d\n", au, dle->dle_dl->dl_sts);;
         appupdater_error(au,AU_STATUS_ERROR);
@@ -88,13 +117,20 @@ static void appupdaterfn(struct eventloop *el, int op, void *arg) {
         download_continue(&au->au_sign_download);
       }
     }
+    pthread_mutex_unlock(&au->au_mutex);
     break;
 
   case OP_APPUPDATER_DL_PROGRESS:
     dle = arg;
     au = STRUCT_FROM_BASE(struct appupdater, au_download, dle->dle_dl);
     SAFE_MUTEX_LOCK(&au->au_mutex);
-    if ( download_complete(dle->dle_dl) ) {
+    if ( au->au_sts == AU_STATUS_CANCELED ) {
+      // Already reported
+    } else if ( au->au_canceled ) {
+      // See appupdater_cancel
+      download_cancel(&au->au_download);
+      appupdater_error(au, AU_STATUS_CANCELED);
+    } else if ( download_complete(dle->dle_dl) ) {
       if ( dle->dle_dl->dl_sts < 0 ) {
         fprintf(stderr, "appupdater: %p errored: %d\n", au, dle->dle_dl->dl_sts);
         appupdater_error(au, AU_STATUS_ERROR);
@@ -102,7 +138,7 @@ static void appupdaterfn(struct eventloop *el, int op, void *arg) {
         if ( au->au_application )
           application_unset_flags(au->au_application, APP_FLAG_DOWNLOADING_MFST);
         fprintf(stderr, "appupdater: %p complete\n", au);
-        if ( !SHA256_Final(au->au_sha256_digest, &au->au_sha256_ctx) ) {
+        if ( download_digest(&au->au_download, au->au_sha256_digest, NULL) < 0 ) {
           fprintf(stderr, "appupdater: could not calculate digest\n");
           appupdater_error(au, AU_STATUS_ERROR);
         } else {
@@ -150,10 +186,8 @@ static void appupdaterfn(struct eventloop *el, int op, void *arg) {
                   download_start(&au->au_sign_download);
                 }
               }
-            } else {
-              au->au_sts = AU_STATUS_PARSING;
-              eventloop_invoke_async(&au->au_appstate->as_eventloop, &au->au_parse_async);
-            }
+            } else
+              appupdater_manifest_downloaded(au);
           }
         }
       }
@@ -163,14 +197,9 @@ static void appupdaterfn(struct eventloop *el, int op, void *arg) {
       if ( fwrite(dle->dle_dl->dl_buf, 1, dle->dle_dl->dl_bufsz, au->au_output) != dle->dle_dl->dl_bufsz ) {
         perror("fwrite");
         download_cancel(&au->au_download);
-      } else {
-        if ( !SHA256_Update(&au->au_sha256_ctx, dle->dle_dl->dl_buf, dle->dle_dl->dl_bufsz) ) {
-          fprintf(stderr, "appupdater: could not compute sha256\n");
-          ERR_print_errors_fp(stderr);
-          download_cancel(&au->au_download);
-        } else
-          download_continue(&au->au_download);
-      }
+        appupdater_error(au, AU_STATUS_ERROR);
+      } else
+        download_continue(&au->au_download);
     }
     pthread_mutex_unlock(&au->au_mutex);
     break;
@@ -228,14 +257,16 @@ struct appupdater *appupdater_new(struct appstate *as,
     }
 
     memset(u->au_sha256_digest, 0, sizeof(u->au_sha256_digest));
-    if ( !SHA256_Init(&u->au_sha256_ctx) ) {
-      pthread_mutex_destroy(&u->au_mutex);
-      free(u);
-      return NULL;
-    }
 
     SHARED_INIT(&u->au_shared, appupdater_free);
 
+    u->au_priority = AU_PRIORITY_FOR_REASON(reason);
+    u->au_queued = AU_QUEUE_NONE;
+    DLIST_ENTRY_CLEAR(&u->au_queue);
+    u->au_manifest_ready = 0;
+    u->au_leader = NULL;
+    u->au_canceled = 0;
+
     u->au_output = NULL;
     u->au_sign_output = NULL;
     u->au_application = NULL;
@@ -243,6 +274,7 @@ struct appupdater *appupdater_new(struct appstate *as,
     u->au_progress = progress;
     download_clear(&u->au_download);
     download_clear(&u->au_sign_download);
+    closurefetch_clear(&u->au_closure);
     u->au_url = au_url = malloc(uri_len + 1);
     if ( !u->au_url ) goto error;
 
@@ -280,14 +312,19 @@ struct appupdater *appupdater_new(struct appstate *as,
       goto error;
     }
 
-    if ( download_init(&u->au_download, &u->au_appstate->as_eventloop, &uri_uri,
+    if ( download_init(&u->au_download, &u->au_appstate->as_downloader, &uri_uri,
                        OP_APPUPDATER_DL_PROGRESS, appupdaterfn) < 0 ) {
       fprintf(stderr, "appupdater_new: download_init error\n");
       goto error;
     }
 
+    if ( download_set_digest(&u->au_download, EVP_sha256()) < 0 ) {
+      fprintf(stderr, "appupdater_new: could not hash download\n");
+      goto error;
+    }
+
     if ( u->au_sign_url ) {
-      if ( download_init(&u->au_sign_download, &u->au_appstate->as_eventloop, &sign_uri,
+      if ( download_init(&u->au_sign_download, &u->au_appstate->as_downloader, &sign_uri,
                          OP_APPUPDATER_DL_SIGN_PROGRESS, appupdaterfn) < 0 ) {
         fprintf(stderr, "appupdater_new: download_init(signature) error\n");
         goto error;
@@ -322,6 +359,7 @@ void appupdater_free(const struct shared *sh, int level) {
     }
 
     assert( evtqueue_is_empty(au->au_completion) );
+    assert( au->au_queued == AU_QUEUE_NONE );
 
     if ( au->au_url ) {
       free((void *)au->au_url);
@@ -335,6 +373,7 @@ void appupdater_free(const struct shared *sh, int level) {
 
     download_release(&au->au_download);
     download_release(&au->au_sign_download);
+    closurefetch_release(&au->au_closure);
 
     if ( au->au_output ) {
       fclose(au->au_output);
@@ -366,14 +405,160 @@ void appupdater_request_event(struct appupdater *au, struct qdevtsub *e) {
 }
 
 void appupdater_start(struct appupdater *au) {
+  struct updatequeue *uq = &au->au_appstate->as_update_queue;
+
+  SAFE_MUTEX_LOCK(&au->au_mutex);
+  if ( au->au_sts == AU_STATUS_WAITING ) {
+    SAFE_MUTEX_LOCK(&uq->uq_mutex);
+    if ( au->au_queued == AU_QUEUE_NONE ) {
+      au->au_queued = AU_QUEUE_WAITING;
+      DLIST_INSERT(&uq->uq_waiting[au->au_priority], au_queue, au);
+    }
+    pthread_mutex_unlock(&uq->uq_mutex);
+  }
+  pthread_mutex_unlock(&au->au_mutex);
+
+  updatequeue_pump(uq);
+}
+
+void appupdater_prioritize(struct appupdater *au, int priority) {
+  struct updatequeue *uq = &au->au_appstate->as_update_queue;
+
+  SAFE_MUTEX_LOCK(&uq->uq_mutex);
+  if ( priority < au->au_priority ) {
+    if ( au->au_queued == AU_QUEUE_WAITING ) {
+      DLIST_REMOVE(&uq->uq_waiting[au->au_priority], au_queue, au);
+      DLIST_INSERT(&uq->uq_waiting[priority], au_queue, au);
+    }
+    au->au_priority = priority;
+  }
+  pthread_mutex_unlock(&uq->uq_mutex);
+}
+
+// Called by the updatequeue, once the updater has a slot
+static void appupdater_run(struct appupdater *au) {
   SAFE_MUTEX_LOCK(&au->au_mutex);
   if ( au->au_sts == AU_STATUS_WAITING ) {
     au->au_sts = AU_STATUS_DOWNLOADING;
     if ( au->au_application )
       application_set_flags(au->au_application, APP_FLAG_DOWNLOADING_MFST);
     download_start(&au->au_download);
+  } else if ( au->au_sts == AU_STATUS_PARSING ) {
+    // Requeued, after the updater it followed did not succeed
+    eventloop_invoke_async(&au->au_appstate->as_eventloop, &au->au_parse_async);
+  }
+  pthread_mutex_unlock(&au->au_mutex);
+}
+
+// The manifest (and its signature) are downloaded. If another active
+// updater is already applying the same manifest, give up our slot and
+// follow it. Otherwise, parse the manifest. Au mutex must be locked
+static void appupdater_manifest_downloaded(struct appupdater *au) {
+  struct updatequeue *uq = &au->au_appstate->as_update_queue;
+  struct appupdater *leader = NULL, *cur, *tmp;
+
+  au->au_sts = AU_STATUS_PARSING;
+
+  SAFE_MUTEX_LOCK(&uq->uq_mutex);
+  if ( !au->au_force && au->au_queued == AU_QUEUE_ACTIVE ) {
+    DLIST_ITER(&uq->uq_running, au_queue, cur, tmp) {
+      if ( cur != au && cur->au_manifest_ready &&
+           memcmp(cur->au_sha256_digest, au->au_sha256_digest,
+                  sizeof(au->au_sha256_digest)) == 0 ) {
+        leader = cur;
+        break;
+      }
+    }
+  }
+
+  if ( leader ) {
+    DLIST_REMOVE(&uq->uq_running, au_queue, au);
+    DLIST_INSERT(&uq->uq_following, au_queue, au);
+    au->au_queued = AU_QUEUE_FOLLOWING;
+    au->au_leader = leader;
+    uq->uq_active--;
+    if ( uq->uq_gc )
+      closuregc_unhold(uq->uq_gc);
+  } else
+    au->au_manifest_ready = 1;
+  pthread_mutex_unlock(&uq->uq_mutex);
+
+  if ( leader ) {
+    fprintf(stderr, "appupdater: %p: manifest is already being applied by %p\n", au, leader);
+    updatequeue_pump(uq);
+  } else
+    eventloop_invoke_async(&au->au_appstate->as_eventloop, &au->au_parse_async);
+}
+
+int appupdater_cancel(struct appupdater *au) {
+  struct updatequeue *uq = &au->au_appstate->as_update_queue;
+  int ret = 0, was_following = 0;
+
+  SAFE_MUTEX_LOCK(&au->au_mutex);
+  switch ( au->au_sts ) {
+  case AU_STATUS_WAITING:
+    au->au_canceled = 1;
+    appupdater_error(au, AU_STATUS_CANCELED);
+    break;
+
+  case AU_STATUS_DOWNLOADING:
+  case AU_STATUS_DOWNLOADING_SIG:
+    // The download has one event outstanding, which may already be
+    // queued. Reporting the cancel here would let it run after the
+    // updater is freed, so appupdaterfn cancels the download, and
+    // reports, once it is delivered
+    au->au_canceled = 1;
+    break;
+
+  case AU_STATUS_PARSING:
+    au->au_canceled = 1;
+
+    SAFE_MUTEX_LOCK(&uq->uq_mutex);
+    if ( au->au_queued == AU_QUEUE_FOLLOWING ) {
+      DLIST_REMOVE(&uq->uq_following, au_queue, au);
+      au->au_queued = AU_QUEUE_NONE;
+      au->au_leader = NULL;
+      was_following = 1;
+    }
+    pthread_mutex_unlock(&uq->uq_mutex);
+
+    // Otherwise, appupdater_parse_manifest notices
+    if ( was_following )
+      appupdater_error(au, AU_STATUS_CANCELED);
+    break;
+
+  case AU_STATUS_UPDATING:
+  case AU_STATUS_INSTALLING:
+    // Once the closure is fetched, it is imported and applied
+    if ( au->au_closure.cf_eventloop &&
+         au->au_closure.cf_sts == CLOSURE_STATUS_COMPLETE )
+      ret = -1;
+    else {
+      au->au_canceled = 1;
+      if ( au->au_closure.cf_eventloop )
+        closurefetch_cancel(&au->au_closure);
+    }
+    break;
+
+  default:
+    ret = -1;
+    break;
   }
   pthread_mutex_unlock(&au->au_mutex);
+
+  return ret;
+}
+
+void appupdater_queue_state(struct appupdater *au, int *sts, int *priority, int *queued) {
+  struct updatequeue *uq = &au->au_appstate->as_update_queue;
+
+  SAFE_MUTEX_LOCK(&au->au_mutex);
+  *sts = au->au_sts;
+  SAFE_MUTEX_LOCK(&uq->uq_mutex);
+  *priority = au->au_priority;
+  *queued = au->au_queued;
+  pthread_mutex_unlock(&uq->uq_mutex);
+  pthread_mutex_unlock(&au->au_mutex);
 }
 
 // Au mutex must be locked
@@ -387,6 +572,18 @@ int appupdater_manifest_path(struct appupdater *au, char *new_name, size_t new_n
   else return 0;
 }
 
+static int appupdater_same_closure(struct appupdater *au, struct app *cur_app) {
+  int ret = 0;
+
+  SAFE_MUTEX_LOCK(&cur_app->app_mutex);
+  if ( cur_app->app_current_manifest )
+    ret = strcmp(cur_app->app_current_manifest->am_nix_closure,
+                 au->au_manifest->am_nix_closure) == 0;
+  pthread_mutex_unlock(&cur_app->app_mutex);
+
+  return ret;
+}
+
 static void appupdater_parse_manifest(struct appupdater *au) {
   struct buffer b;
   char mf_path[PATH_MAX];
@@ -395,6 +592,14 @@ static void appupdater_parse_manifest(struct appupdater *au) {
   struct app *cur_app;
   size_t bufsz;
 
+  SAFE_MUTEX_LOCK(&au->au_mutex);
+  err = au->au_canceled;
+  pthread_mutex_unlock(&au->au_mutex);
+  if ( err ) {
+    appupdater_error(au, AU_STATUS_CANCELED);
+    return;
+  }
+
   fprintf(stderr, "Parsing app manifest\n");
 
   err = appupdater_manifest_path(au, mf_path, sizeof(mf_path));
@@ -441,7 +646,16 @@ static void appupdater_parse_manifest(struct appupdater *au) {
       if ( appmanifest_newer(au->au_manifest, cur_app->app_current_manifest) ||
            au->au_force ) {
         au->au_sts = AU_STATUS_UPDATING;
-        appupdater_build_from_manifest(au);
+
+        // The closure the app runs now is rooted, and so complete in
+        // the store. If the new manifest only changes metadata, there
+        // is nothing to fetch
+        if ( appupdater_same_closure(au, cur_app) ) {
+          fprintf(stderr, "appupdater_parse_manifest: %s is already installed\n",
+                  au->au_manifest->am_nix_closure);
+          appupdater_apply(au);
+        } else
+          appupdater_build_from_manifest(au);
       } else {
         //        fprintf(stderr, "Marking done\n");
         appupdater_error(au, AU_STATUS_DONE);
@@ -450,22 +664,87 @@ static void appupdater_parse_manifest(struct appupdater *au) {
       APPLICATION_UNREF(cur_app);
     } else {
       au->au_sts = AU_STATUS_INSTALLING;
-      // TODO use binary caches and nix closure to download the application
       appupdater_build_from_manifest(au);
     }
   }
 }
 
+// Switch the app to the new manifest, now that its closure is in the
+// store. Whatever only the old closure used can then be collected
+static void appupdater_apply(struct appupdater *au) {
+  struct appmanifest *old = NULL;
+  int err;
+
+  if ( au->au_application ) {
+    SAFE_MUTEX_LOCK(&au->au_application->app_mutex);
+    old = au->au_application->app_current_manifest;
+    if ( old )
+      APPMANIFEST_REF(old);
+    pthread_mutex_unlock(&au->au_application->app_mutex);
+
+    err = appstate_update_app_from_manifest(au->au_appstate, au->au_application, au->au_manifest);
+  } else
+    err = appstate_install_app_from_manifest(au->au_appstate, au->au_manifest);
+
+  if ( err < 0 )
+    appupdater_error(au, AU_STATUS_ERROR);
+  else {
+    if ( old && strcmp(old->am_nix_closure, au->au_manifest->am_nix_closure) != 0 &&
+         closuregc_request(&au->au_appstate->as_closure_gc, old->am_nix_closure) < 0 )
+      fprintf(stderr, "appupdater_apply: could not request collection of %s\n",
+              old->am_nix_closure);
+    appupdater_error(au, AU_STATUS_DONE);
+  }
+
+  if ( old )
+    APPMANIFEST_UNREF(old);
+}
+
+// The closure is rooted here from the moment it is imported until the
+// app's own root points to it, so that a garbage collection in between
+// does not remove it
+static int appupdater_pending_root(struct appupdater *au, char *path, size_t path_sz) {
+  char mf_digest[SHA256_DIGEST_LENGTH * 2 + 1];
+  int err;
+
+  err = snprintf(path, path_sz, "%s/nix-roots/.update-%s", au->au_appstate->as_conf_dir,
+                 hex_digest_str(au->au_manifest->am_digest, mf_digest, SHA256_DIGEST_LENGTH));
+  if ( err >= path_sz ) {
+    fprintf(stderr, "appupdater_pending_root: path overflow\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+static void appupdater_remove_pending_root(struct appupdater *au) {
+  char path[PATH_MAX];
+
+  if ( appupdater_pending_root(au, path, sizeof(path)) == 0 &&
+       unlink(path) < 0 && errno != ENOENT )
+    perror("appupdater_remove_pending_root: unlink");
+}
+
 static void appupdater_error(struct appupdater *au, int sts) {
+  if ( au->au_canceled && sts == AU_STATUS_ERROR )
+    sts = AU_STATUS_CANCELED;
   au->au_sts = sts;
   eventloop_queue_all(&au->au_appstate->as_eventloop, &au->au_completion);
 }
 
+static int appupdater_cache_dir(struct appupdater *au, char *path, size_t path_sz) {
+  int err = snprintf(path, path_sz, "%s/nix-cache", au->au_appstate->as_conf_dir);
+  if ( err >= path_sz ) {
+    fprintf(stderr, "appupdater_cache_dir: path overflow\n");
+    return -1;
+  }
+  return 0;
+}
+
+// Fetch the closure into the local cache. The import continues in
+// appupdater_import_closure
 static void appupdater_build_from_manifest(struct appupdater *au) {
-  char log_path[PATH_MAX], cache_path[PATH_MAX], home_path[PATH_MAX], mf_digest[SHA256_DIGEST_LENGTH * 2 + 1];
-  FILE *stdout_log = NULL, *stderr_log = NULL, *caches = NULL;
-  struct pssubopts ps;
-  int err;
+  char log_path[PATH_MAX], cache_path[PATH_MAX], mf_digest[SHA256_DIGEST_LENGTH * 2 + 1];
 
   if ( au->au_application )
     application_set_flags(au->au_application, APP_FLAG_UPDATING);
@@ -474,18 +753,67 @@ static void appupdater_build_from_manifest(struct appupdater *au) {
                          hex_digest_str(au->au_manifest->am_digest, mf_digest, SHA256_DIGEST_LENGTH),
                          NULL, log_path, sizeof(log_path)) < 0 ) {
     fprintf(stderr, "appupdater_build_from_manifest: could not fit log path\n");
-    appupdater_error(au, AU_STATUS_ERROR);
-    return;
+    goto error;
   }
 
   if ( mkdir_recursive(log_path) < 0 ) {
     fprintf(stderr, "appupdater_build_from_manifest: could not make directory %s\n", log_path);
-    appupdater_error(au, AU_STATUS_ERROR);
-    return;
+    goto error;
   }
 
   fprintf(stderr, "Made log path: %s\n", log_path);
 
+  if ( appupdater_cache_dir(au, cache_path, sizeof(cache_path)) < 0 )
+    goto error;
+
+  if ( closurefetch_init(&au->au_closure, &au->au_appstate->as_eventloop,
+                         &au->au_appstate->as_downloader, CLOSURE_STORE_DIR, cache_path,
+                         au->au_manifest->am_bin_caches, au->au_manifest->am_bin_caches_count,
+                         au->au_progress, OP_APPUPDATER_CLOSURE_DONE, appupdaterfn) < 0 ) {
+    fprintf(stderr, "appupdater_build_from_manifest: could not set up closure fetch\n");
+    goto error;
+  }
+
+  // Checked together with starting the fetch, so that appupdater_cancel
+  // either sees the fetch, or the update never starts it
+  SAFE_MUTEX_LOCK(&au->au_mutex);
+  if ( au->au_canceled ) {
+    pthread_mutex_unlock(&au->au_mutex);
+    goto error;
+  }
+
+  // Released once the fetch completes
+  APPUPDATER_REF(au);
+  if ( closurefetch_start(&au->au_closure, au->au_manifest->am_nix_closure) < 0 ) {
+    fprintf(stderr, "appupdater_build_from_manifest: could not fetch %s\n",
+            au->au_manifest->am_nix_closure);
+    // The completion event is still delivered
+  }
+  pthread_mutex_unlock(&au->au_mutex);
+
+  return;
+
+ error:
+  if ( au->au_application )
+    application_unset_flags(au->au_application, APP_FLAG_UPDATING);
+  appupdater_error(au, AU_STATUS_ERROR);
+}
+
+// Import the fetched closure into the nix store, using the local cache
+// as the only substituter. The signatures were checked as the paths
+// were fetched, but nix checks them again
+static void appupdater_import_closure(struct appupdater *au) {
+  char log_path[PATH_MAX], cache_path[PATH_MAX], cache_url[PATH_MAX + 8],
+    root_path[PATH_MAX], mf_digest[SHA256_DIGEST_LENGTH * 2 + 1];
+  FILE *stdout_log = NULL, *stderr_log = NULL;
+  struct pssubopts ps;
+  struct buffer keys_buf;
+  const char *keys;
+  size_t i;
+  int k;
+
+  hex_digest_str(au->au_manifest->am_digest, mf_digest, SHA256_DIGEST_LENGTH);
+
   if ( au->au_progress < 0 &&
        appstate_log_path(au->au_appstate, mf_digest, "stdout.log", log_path, sizeof(log_path)) >= 0 ) {
     stdout_log = fopen(log_path, "wb");
@@ -499,29 +827,11 @@ static void appupdater_build_from_manifest(struct appupdater *au) {
       perror("fopen(stderr.log)");
   }
 
-  if ( appstate_log_path(au->au_appstate, mf_digest, "caches", cache_path, sizeof(cache_path)) >= 0 ) {
-    caches = fopen(cache_path, "wt");
-    if ( !caches )
-      perror("fopen(caches)");
-    else {
-      int i, k;
-      for ( i = 0; i < au->au_manifest->am_bin_caches_count; ++i ) {
-        fprintf(caches, "%s", au->au_manifest->am_bin_caches[i].bc_uri);
-        for ( k = 0; k < au->au_manifest->am_bin_caches[i].bc_key_count; ++k ) {
-          fprintf(caches, " %s", au->au_manifest->am_bin_caches[i].bc_keys[k]);
-        }
-      }
-      fprintf(caches, "\n");
-    }
-    fclose(caches);
-  }
-
-  if ( (au->au_progress < 0 && !stdout_log) || !stderr_log || !caches ) {
-    fprintf(stderr, "appupdater_build_from_manifest: could not find stdout.log, stderr.log, or caches\n");
+  if ( (au->au_progress < 0 && !stdout_log) || !stderr_log ) {
+    fprintf(stderr, "appupdater_import_closure: could not open stdout.log or stderr.log\n");
     if ( stdout_log ) fclose(stdout_log);
     if ( stderr_log ) fclose(stderr_log);
-    appupdater_error(au, AU_STATUS_ERROR);
-    return;
+    goto error;
   }
 
   pssubopts_init(&ps);
@@ -529,55 +839,239 @@ static void appupdater_build_from_manifest(struct appupdater *au) {
   if ( au->au_progress >= 0 ) {
     if ( pssubopts_pipe_to_fd(&ps, PSSUB_STDOUT, au->au_progress) < 0 ) {
       pssubopts_release(&ps);
-      fprintf(stderr, "appupdate_build_from_manifest: could not set up progress output\n");
-      appupdater_error(au, AU_STATUS_ERROR);
-      return;
+      fprintf(stderr, "appupdater_import_closure: could not set up progress output\n");
+      goto error;
     }
   } else {
     if ( pssubopts_pipe_to_file(&ps, PSSUB_STDOUT, stdout_log) < 0 ) {
       pssubopts_release(&ps);
-      fprintf(stderr, "appupdate_build_from_manifest: could not direct stdout to log\n");
-      appupdater_error(au, AU_STATUS_ERROR);
-      return;
+      fprintf(stderr, "appupdater_import_closure: could not direct stdout to log\n");
+      goto error;
     }
   }
 
   if ( pssubopts_pipe_to_file(&ps, PSSUB_STDERR, stderr_log) < 0 ) {
     pssubopts_release(&ps);
-    fprintf(stderr, "appupdater_build_from_manifest: could not direct stderr to log\n");
-    appupdater_error(au, AU_STATUS_ERROR);
-    return;
+    fprintf(stderr, "appupdater_import_closure: could not direct stderr to log\n");
+    goto error;
   }
 
-  pssubopts_set_command(&ps, "nix-fetch", NULL);
-  pssubopts_push_arg(&ps, "nix-fetch", NULL);
-  pssubopts_push_arg(&ps, "--caches", NULL);
-  pssubopts_push_arg(&ps, cache_path, NULL);
-  pssubopts_push_arg(&ps, au->au_manifest->am_nix_closure, NULL);
+  if ( appupdater_cache_dir(au, cache_path, sizeof(cache_path)) < 0 ) {
+    pssubopts_release(&ps);
+    goto error;
+  }
+  snprintf(cache_url, sizeof(cache_url), "file://%s", cache_path);
 
-  err = snprintf(home_path, sizeof(home_path), "%s/nix-cache", au->au_appstate->as_conf_dir);
-  if ( err >= sizeof(home_path) ) {
+  if ( appupdater_pending_root(au, root_path, sizeof(root_path)) < 0 ) {
     pssubopts_release(&ps);
-    fprintf(stderr, "appupdater_build_from_manifest: path overflow\n");
-    appupdater_error(au, AU_STATUS_ERROR);
-    return;
+    goto error;
   }
 
-  pssubopts_push_env(&ps, "HOME", home_path);
+  buffer_init(&keys_buf);
+  for ( i = 0; i < au->au_manifest->am_bin_caches_count; ++i ) {
+    struct bincache *bc = au->au_manifest->am_bin_caches + i;
+    for ( k = 0; k < bc->bc_key_count; ++k )
+      buffer_printf(&keys_buf, "%s%s", buffer_size(&keys_buf) ? " " : "", bc->bc_keys[k]);
+  }
+  buffer_finalize_str(&keys_buf, &keys);
+  if ( !keys ) {
+    pssubopts_release(&ps);
+    fprintf(stderr, "appupdater_import_closure: out of memory\n");
+    goto error;
+  }
+
+  pssubopts_set_command(&ps, "nix-store", NULL);
+  pssubopts_push_arg(&ps, "nix-store", NULL);
+  pssubopts_push_arg(&ps, "--realise", NULL);
+  pssubopts_push_arg(&ps, au->au_manifest->am_nix_closure, NULL);
+  pssubopts_push_arg(&ps, "--add-root", NULL);
+  pssubopts_push_arg(&ps, root_path, NULL);
+  pssubopts_push_arg(&ps, "--indirect", NULL);
+  // Files the new closure shares with paths already in the store are
+  // hard linked to them, rather than stored twice
+  pssubopts_push_arg(&ps, "--option", NULL);
+  pssubopts_push_arg(&ps, "auto-optimise-store", NULL);
+  pssubopts_push_arg(&ps, "true", NULL);
+  pssubopts_push_arg(&ps, "--option", NULL);
+  pssubopts_push_arg(&ps, "substituters", NULL);
+  pssubopts_push_arg(&ps, cache_url, NULL);
+  pssubopts_push_arg(&ps, "--option", NULL);
+  pssubopts_push_arg(&ps, "trusted-public-keys", NULL);
+  if ( pssubopts_push_arg(&ps, keys, free) < 0 )
+    free((void *) keys);
+  pssubopts_push_env(&ps, "HOME", cache_path);
 
   if ( pssubopts_error(&ps) ) {
     pssubopts_release(&ps);
-    fprintf(stderr, "appupdater_build_from_manifest: could not set up build process\n");
-    appupdater_error(au, AU_STATUS_ERROR);
-    return;
+    fprintf(stderr, "appupdater_import_closure: could not set up import process\n");
+    goto error;
   }
 
   if ( pssub_run_from_opts(&au->au_appstate->as_eventloop, &au->au_build_ps, &ps) < 0 ) {
     pssubopts_release(&ps);
-    fprintf(stderr, "appupdater_build_from_manifest: could not launch nix build process\n");
-    appupdater_error(au, AU_STATUS_ERROR);
-    return;
+    fprintf(stderr, "appupdater_import_closure: could not launch nix-store\n");
+    goto error;
   }
 
   pssubopts_release(&ps);
+  return;
+
+ error:
+  if ( au->au_application )
+    application_unset_flags(au->au_application, APP_FLAG_UPDATING);
+  appupdater_error(au, AU_STATUS_ERROR);
+}
+
+// updatequeue
+
+static void updatequeuefn(struct eventloop *el, int op, void *arg) {
+  struct qdevent *qde = arg;
+  struct updatequeue *uq;
+
+  switch ( op ) {
+  case OP_UPDATEQUEUE_GC_DONE:
+    uq = STRUCT_FROM_BASE(struct updatequeue, uq_gc_done, qde->qde_sub);
+
+    SAFE_MUTEX_LOCK(&uq->uq_mutex);
+    uq->uq_gc_waiting = 0;
+    pthread_mutex_unlock(&uq->uq_mutex);
+
+    updatequeue_pump(uq);
+    break;
+
+  default:
+    fprintf(stderr, "updatequeuefn: unknown op %d\n", op);
+  }
+}
+
+void updatequeue_clear(struct updatequeue *uq) {
+  int i;
+
+  uq->uq_max_active = -1;
+  uq->uq_active = 0;
+  uq->uq_gc = NULL;
+  uq->uq_gc_waiting = 0;
+  for ( i = 0; i < AU_PRIORITY_COUNT; ++i )
+    DLIST_INIT(&uq->uq_waiting[i]);
+  DLIST_INIT(&uq->uq_running);
+  DLIST_INIT(&uq->uq_following);
+}
+
+int updatequeue_init(struct updatequeue *uq, int max_active, struct closuregc *gc) {
+  updatequeue_clear(uq);
+
+  if ( pthread_mutex_init(&uq->uq_mutex, NULL) != 0 )
+    return -1;
+
+  uq->uq_max_active = max_active;
+  uq->uq_gc = gc;
+  qdevtsub_init(&uq->uq_gc_done, OP_UPDATEQUEUE_GC_DONE, updatequeuefn);
+
+  return 0;
+}
+
+void updatequeue_release(struct updatequeue *uq) {
+  if ( uq->uq_max_active >= 0 ) {
+    pthread_mutex_destroy(&uq->uq_mutex);
+    uq->uq_max_active = -1;
+  }
+}
+
+// Start waiting updaters, highest priority first, while there are
+// slots free, and no collection is running
+static void updatequeue_pump(struct updatequeue *uq) {
+  struct appupdater *au;
+  int i;
+
+  do {
+    au = NULL;
+
+    SAFE_MUTEX_LOCK(&uq->uq_mutex);
+    if ( !uq->uq_gc_waiting &&
+         (uq->uq_max_active == 0 || uq->uq_active < uq->uq_max_active) ) {
+      for ( i = 0; i < AU_PRIORITY_COUNT && !au; ++i )
+        au = uq->uq_waiting[i].dh_first;
+
+      if ( au && uq->uq_gc &&
+           closuregc_hold(uq->uq_gc, &uq->uq_gc_done) < 0 ) {
+        // Pumped again once the collection is done
+        uq->uq_gc_waiting = 1;
+        au = NULL;
+      }
+
+      if ( au ) {
+        DLIST_REMOVE(&uq->uq_waiting[au->au_priority], au_queue, au);
+        DLIST_INSERT(&uq->uq_running, au_queue, au);
+        au->au_queued = AU_QUEUE_ACTIVE;
+        uq->uq_active++;
+
+        // A waiting updater may be canceled, and finish, at any time
+        APPUPDATER_REF(au);
+      }
+    }
+    pthread_mutex_unlock(&uq->uq_mutex);
+
+    if ( au ) {
+      appupdater_run(au);
+      APPUPDATER_UNREF(au);
+    }
+  } while ( au );
+}
+
+void updatequeue_finished(struct updatequeue *uq, struct appupdater *au) {
+  DLIST_HEAD(struct appupdater) done;
+  struct appupdater *cur, *tmp;
+
+  DLIST_INIT(&done);
+
+  SAFE_MUTEX_LOCK(&uq->uq_mutex);
+  switch ( au->au_queued ) {
+  case AU_QUEUE_WAITING:
+    DLIST_REMOVE(&uq->uq_waiting[au->au_priority], au_queue, au);
+    break;
+
+  case AU_QUEUE_ACTIVE:
+    DLIST_REMOVE(&uq->uq_running, au_queue, au);
+    uq->uq_active--;
+    if ( uq->uq_gc )
+      closuregc_unhold(uq->uq_gc);
+    break;
+
+  case AU_QUEUE_FOLLOWING:
+    DLIST_REMOVE(&uq->uq_following, au_queue, au);
+    au->au_leader = NULL;
+    break;
+
+  default:
+    break;
+  }
+  au->au_queued = AU_QUEUE_NONE;
+
+  DLIST_ITER(&uq->uq_following, au_queue, cur, tmp) {
+    if ( cur->au_leader != au ) continue;
+
+    DLIST_REMOVE(&uq->uq_following, au_queue, cur);
+    cur->au_leader = NULL;
+
+    if ( au->au_sts == AU_STATUS_DONE ) {
+      cur->au_queued = AU_QUEUE_NONE;
+      APPUPDATER_REF(cur);
+      DLIST_INSERT(&done, au_queue, cur);
+    } else {
+      // Apply the manifest ourselves, ahead of the other updates
+      // waiting at our priority
+      cur->au_queued = AU_QUEUE_WAITING;
+      cur->au_manifest_ready = 1;
+      DLIST_INSERT_HEAD(&uq->uq_waiting[cur->au_priority], au_queue, cur);
+    }
+  }
+  pthread_mutex_unlock(&uq->uq_mutex);
+
+  DLIST_ITER(&done, au_queue, cur, tmp) {
+    DLIST_REMOVE(&done, au_queue, cur);
+    appupdater_error(cur, AU_STATUS_DONE);
+    APPUPDATER_UNREF(cur);
+  }
+
+  updatequeue_pump(uq);
 }
@@ -7,9 +7,25 @@
 #include "event.h"
 #include "process.h"
 #include "download.h"
+#include "closure.h"
 
+// Given by whoever requests the update, in KLA_UPDATE_REASON. Requests
+// without one are manual
 #define AU_UPDATE_REASON_AUTOMATIC 1
 #define AU_UPDATE_REASON_MANUAL    2
+#define AU_UPDATE_REASON_SECURITY  3
+
+// Updates are started in order of priority, and then in the order
+// they were queued
+#define AU_PRIORITY_INTERACTIVE 0
+#define AU_PRIORITY_SECURITY    1
+#define AU_PRIORITY_BACKGROUND  2
+#define AU_PRIORITY_COUNT       3
+
+#define AU_PRIORITY_FOR_REASON(reason)                        \
+  ((reason) == AU_UPDATE_REASON_MANUAL ? AU_PRIORITY_INTERACTIVE : \
+   ((reason) == AU_UPDATE_REASON_SECURITY ? AU_PRIORITY_SECURITY : \
+    AU_PRIORITY_BACKGROUND))
 
 #define AU_STATUS_ERROR (-2)
 #define AU_STATUS_CANCELED (-1)
@@ -21,6 +37,13 @@
 #define AU_STATUS_INSTALLING 5
 #define AU_STATUS_DONE 6
 
+// Where an updater is in its updatequeue
+#define AU_QUEUE_NONE      0
+#define AU_QUEUE_WAITING   1
+#define AU_QUEUE_ACTIVE    2
+// Another active updater is applying the same manifest
+#define AU_QUEUE_FOLLOWING 3
+
 struct appupdater {
   struct shared au_shared;
 
@@ -35,11 +58,11 @@ struct appupdater {
   FILE *au_output, *au_sign_output;
   int au_reason;
   int au_force : 1;
+  int au_canceled : 1;
 
   int au_progress;
 
   unsigned char au_sha256_digest[SHA256_DIGEST_LENGTH];
-  SHA256_CTX au_sha256_ctx;
 
   int au_sts;
 
@@ -48,7 +71,49 @@ struct appupdater {
 
   struct appmanifest *au_manifest;
   struct qdevtsub au_parse_async;
+  // Fetches the closure into the local cache, before au_build_ps
+  // imports it
+  struct closurefetch au_closure;
   struct pssub au_build_ps;
+
+  // Protected by the updatequeue's mutex
+  int au_priority, au_queued;
+  DLIST(struct appupdater) au_queue;
+  // Set once the manifest is downloaded, and can be followed
+  int au_manifest_ready : 1;
+  // The updater we are following, if AU_QUEUE_FOLLOWING
+  struct appupdater *au_leader;
+};
+
+// Update scheduling
+//
+// At most uq_max_active updaters run at once. The rest wait in a queue
+// for each priority. An updater whose manifest turns out to be one
+// another active updater is already applying gives up its slot, and
+// finishes when the other does. If the other did not succeed, it is
+// requeued ahead of its priority, and applies the manifest itself.
+//
+// Active updaters hold the closure collector (see closuregc_hold), so
+// nix-store --gc never runs while an update is in progress. Updaters
+// are not started while a collection is running, and the queue is
+// pumped again once it is done.
+#define UPDATEQUEUE_DEFAULT_MAX_ACTIVE 2
+
+struct updatequeue {
+  pthread_mutex_t uq_mutex;
+
+  // 0 means no limit
+  int uq_max_active, uq_active;
+
+  // May be NULL
+  struct closuregc *uq_gc;
+  // Set while uq_gc_done is waiting for a collection to finish
+  int uq_gc_waiting;
+  struct qdevtsub uq_gc_done;
+
+  DLIST_HEAD(struct appupdater) uq_waiting[AU_PRIORITY_COUNT];
+  DLIST_HEAD(struct appupdater) uq_running;
+  DLIST_HEAD(struct appupdater) uq_following;
 };
 
 #define APPUPDATER_FROM_COMPLETION_EVENT(arg) STRUCT_FROM_BASE(struct appupdater, au_completion_evt, ((struct qdevent *)arg)->qde_sub)
@@ -63,8 +128,22 @@ struct appupdater *appupdater_new(struct appstate *as,
                                   int reason, int progress, struct app *app);
 #define appupdater_force(au) ((au)->au_force = 1)
 
+// Queues the updater on its appstate's updatequeue
 void appupdater_start(struct appupdater *au);
+// Moves the updater ahead, if priority is higher than its own
+void appupdater_prioritize(struct appupdater *au, int priority);
+// Returns -1 if the update is already being applied, or is over
+int appupdater_cancel(struct appupdater *au);
+// Fills in the status, priority, and AU_QUEUE_* state of the updater
+void appupdater_queue_state(struct appupdater *au, int *sts, int *priority, int *queued);
 void appupdater_request_event(struct appupdater *au, struct qdevtsub *e);
 int appupdater_manifest_path(struct appupdater *au, char *new_name, size_t new_name_size);
 
+// updatequeue
+void updatequeue_clear(struct updatequeue *uq);
+int updatequeue_init(struct updatequeue *uq, int max_active, struct closuregc *gc);
+void updatequeue_release(struct updatequeue *uq);
+// Called once the updater's completion event is delivered
+void updatequeue_finished(struct updatequeue *uq, struct appupdater *au);
+
 #endif
@@ -3,6 +3,7 @@
 
 #include <uriparser/Uri.h>
 #include <curl/curl.h>
+#include <openssl/evp.h>
 
 #include "event.h"
 
@@ -19,13 +20,59 @@
 #define DL_TYPE_FILE    1
 #define DL_TYPE_DATA    2
 #define DL_TYPE_B64DATA 3
+#define DL_TYPE_HTTP    4
+
+// HTTP(S) downloads
+//
+// All HTTP and HTTPS downloads started through a downloader share one
+// curl multi handle, which is driven by the event loop. Curl tells us
+// which sockets to wait on and when to time out, and we call back
+// into curl when either happens, so no thread ever blocks on a
+// transfer. Connections are cached by the multi handle, and reused by
+// later downloads from the same host.
+//
+// Transfers beyond the connection limits are queued by curl until a
+// connection is free.
+#define DL_HTTP_DEFAULT_MAX_CONNECTIONS      8
+#define DL_HTTP_DEFAULT_MAX_HOST_CONNECTIONS 4
+// An interrupted transfer is restarted with a Range request for the
+// rest of the body, at most this many times. The first restart waits
+// DL_HTTP_RETRY_DELAY_MS, and each later one waits twice as long
+#define DL_HTTP_MAX_RETRIES 3
+#define DL_HTTP_RETRY_DELAY_MS 500
+// A transfer is interrupted if it receives nothing for this long
+#define DL_HTTP_STALL_TIMEOUT 60
+
+struct dlsocket;
+
+struct downloader {
+  pthread_mutex_t dr_mutex;
+
+  struct eventloop *dr_eventloop;
+
+  CURLM *dr_multi;
+  struct timersub dr_timeout;
+
+  // Sockets curl no longer uses, reused for the next sockets curl
+  // opens. They are only freed when the downloader is released, so an
+  // event delivered late always lands on a live entry. It is ignored
+  // if the entry is still free (ds_fd is -1). If the entry has been
+  // reused, it is passed to curl for the new socket, which curl
+  // tolerates as a spurious wakeup
+  struct dlsocket *dr_free_sockets;
+};
+
+void downloader_clear(struct downloader *dr);
+// max_connections and max_host_connections may be 0 for no limit
+int downloader_init(struct downloader *dr, struct eventloop *el,
+                    long max_connections, long max_host_connections);
+void downloader_release(struct downloader *dr);
 
 struct download {
   pthread_mutex_t dl_mutex;
 
   union {
     CURL *dl_hdl;
-    FILE *dl_fl;
     size_t dl_offs;
   };
   char *dl_buf;
@@ -33,12 +80,41 @@ struct download {
 
   const char *dl_target;
 
+  // File only. Read with pread() into dl_buf, FLCHUNKSZ at a time
+  int dl_fd;
+
+  // Base64 data only. Length of the unescaped data in dl_target
+  size_t dl_srcsz;
+
+  // Digest of everything downloaded so far, if requested. Updated as
+  // data arrives, on the thread that produced it
+  EVP_MD_CTX *dl_digest;
+  int dl_digest_err;
+
   struct eventloop *dl_eventloop;
+  struct downloader *dl_downloader;
 
   size_t dl_complete, dl_total;
   int dl_sts;
   unsigned int dl_type : 4;
 
+  // HTTP only. dl_buf can hold dl_bufcap bytes
+  uint32_t dl_flags;
+  size_t dl_bufcap;
+  int dl_retries;
+  // Status to report once the last chunk is consumed
+  int dl_final_sts;
+  // Set if dl_hdl is in the downloader's multi handle. Protected by
+  // dr_mutex
+  int dl_attached;
+  // Set while dl_retry is waiting to restart the transfer. Protected
+  // by dr_mutex
+  int dl_retry_pending;
+  struct timersub dl_retry;
+  // Hands over a partial chunk once data has sat in dl_buf for
+  // HTTPFLUSHMS. Armed while DL_FLAG_FLUSH_ARMED is set
+  struct timersub dl_flush;
+
   int dl_op;
   evtctlfn dl_evtfn;
 
@@ -59,9 +135,33 @@ struct dlevent {
   size_t dle_bufsz;
 };
 
+// dl_buf holds a chunk the consumer has not yet continued past
+#define DL_FLAG_WAITING  0x1
+// Curl was asked to hold on to data until the consumer continues
+#define DL_FLAG_PAUSED   0x2
+// The transfer is over, but dl_buf still holds a chunk
+#define DL_FLAG_DONE     0x4
+// dl_total has been set for the current request
+#define DL_FLAG_HAVE_LENGTH 0x8
+// dl_flush is armed
+#define DL_FLAG_FLUSH_ARMED 0x10
+
 void download_clear(struct download *dl);
-int download_init(struct download *dl, struct eventloop *el, UriUriA *uri,
+int download_init(struct download *dl, struct downloader *dr, UriUriA *uri,
                     int op, evtctlfn evtfn);
+// Start an HTTP download at the given byte offset, using a Range
+// request. Must be called before download_start. Returns -1 if the
+// download is not HTTP
+int download_set_offset(struct download *dl, size_t offset);
+// Compute a digest (md, e.g. EVP_sha256()) of the data as it is
+// downloaded, so that the consumer does not have to. Must be called
+// before download_start. For HTTP downloads started at an offset, only
+// the data after the offset is hashed
+int download_set_digest(struct download *dl, const EVP_MD *md);
+// Write the digest of a completed download to out, which must be large
+// enough for it (EVP_MAX_MD_SIZE always is). out_sz may be NULL. Can only be called once.
+// Returns -1 if the download is not complete or no digest was set
+int download_digest(struct download *dl, unsigned char *out, unsigned int *out_sz);
 void download_start(struct download *dl);
 void download_release(struct download *dl);
 
@@ -8,6 +8,9 @@
 #include <string.h>
 #include <sys/epoll.h>
 #include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
 #include <limits.h>
 #include <inttypes.h>
 
@@ -71,6 +74,7 @@ static uint32_t translate_from_epoll_flags(int epevs) {
   if ( epevs & EPOLLRDBAND ) events |= FD_SUB_READ_OOB;
   if ( epevs & EPOLLWRBAND ) events |= FD_SUB_WRITE_OOB;
   if ( epevs & EPOLLERR ) events |= FD_SUB_ERROR;
+  if ( epevs & EPOLLPRI ) events |= FD_SUB_PRIORITY;
 
   return events;
 }
@@ -84,6 +88,7 @@ static int translate_to_epoll_flags(uint32_t evs) {
   if ( evs & FD_SUB_RDHUP ) events |= EPOLLRDHUP;
   if ( evs & FD_SUB_READ_OOB ) events |= EPOLLRDBAND;
   if ( evs & FD_SUB_WRITE_OOB ) events |= EPOLLWRBAND;
+  if ( evs & FD_SUB_PRIORITY ) events |= EPOLLPRI;
 
   return events;
 }
@@ -460,7 +465,9 @@ int eventloop_cancel_timer(struct eventloop *el, struct timersub *sub) {
     if ( el->el_flags & EL_FLAG_DEBUG )
       eventloop_dbg_verify_timers(el);
     ret = 1;
-  } else if ( el->el_first_finished == &sub->ts_queued || (!sub->ts_left && sub->ts_right) ) {
+  } else if ( el->el_first_finished == &sub->ts_queued ||
+              el->el_last_finished == &sub->ts_queued ||
+              (!sub->ts_left && sub->ts_right) ) {
     // The child is part of the queue and needs to be removed from it
     struct qdevtsub *left, *cur;
 
@@ -472,7 +479,13 @@ int eventloop_cancel_timer(struct eventloop *el, struct timersub *sub) {
           left = cur, cur = cur->qe_next );
 
     if ( cur == &sub->ts_queued ) {
-      left->qe_next = sub->ts_queued.qe_next;
+      if ( left )
+        left->qe_next = sub->ts_queued.qe_next;
+      else
+        el->el_first_finished = sub->ts_queued.qe_next;
+
+      if ( el->el_last_finished == cur )
+        el->el_last_finished = left;
     } else {
       fprintf(stderr, "eventloop_cancel_timer: timer not found in completion queue\n");
       abort();
@@ -664,7 +677,9 @@ static void eventloop_reset_timer(struct eventloop *el) {
   timespec_to_timeval(&now, &now_tv);
   timespec_to_timeval(&el->el_next_tmr->ts_when, &when_tv);
 
-  if ( timeval_subtract(&it.it_value, &when_tv, &now_tv) ) {
+  // A zero it_value would disarm the timer
+  if ( timeval_subtract(&it.it_value, &when_tv, &now_tv) ||
+       (it.it_value.tv_sec == 0 && it.it_value.tv_usec == 0) ) {
     it.it_value.tv_sec = 0;
     it.it_value.tv_usec = 1;
   }
@@ -954,6 +969,95 @@ int set_socket_nonblocking(int sk) {
   return 0;
 }
 
+int udp_enable_gro(int sk) {
+  int one = 1;
+
+  if ( setsockopt(sk, SOL_UDP, UDP_GRO, &one, sizeof(one)) < 0 ) {
+    if ( errno != ENOPROTOOPT && errno != EINVAL )
+      perror("udp_enable_gro: setsockopt UDP_GRO");
+    return 0;
+  }
+
+  return 1;
+}
+
+int udp_gso_supported(int sk) {
+  int seg_sz = 0;
+  socklen_t seg_sz_len = sizeof(seg_sz);
+
+  return getsockopt(sk, SOL_UDP, UDP_SEGMENT, &seg_sz, &seg_sz_len) == 0;
+}
+
+ssize_t udp_recv_gro(int sk, void *buf, size_t buf_sz,
+                     struct sockaddr *addr, socklen_t *addr_sz,
+                     size_t *seg_sz) {
+  char cbuf[CMSG_SPACE(sizeof(int))];
+  struct iovec iov = { .iov_base = buf, .iov_len = buf_sz };
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  ssize_t ret;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_name = addr;
+  msg.msg_namelen = addr_sz ? *addr_sz : 0;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cbuf;
+  msg.msg_controllen = sizeof(cbuf);
+
+  ret = recvmsg(sk, &msg, 0);
+  if ( ret < 0 ) return -1;
+
+  if ( addr_sz ) *addr_sz = msg.msg_namelen;
+  *seg_sz = ret;
+
+  for ( cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg) ) {
+    if ( cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO ) {
+      int gso_size;
+      memcpy(&gso_size, CMSG_DATA(cmsg), sizeof(gso_size));
+      if ( gso_size > 0 && gso_size < ret )
+        *seg_sz = gso_size;
+    }
+  }
+
+  return ret;
+}
+
+ssize_t udp_send_gso(int sk, const void *buf, size_t buf_sz, size_t seg_sz,
+                     const struct sockaddr *addr, socklen_t addr_sz) {
+  char cbuf[CMSG_SPACE(sizeof(uint16_t))];
+  struct iovec iov = { .iov_base = (void *) buf, .iov_len = buf_sz };
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  uint16_t gso_size = seg_sz;
+  ssize_t ret;
+
+  if ( buf_sz <= seg_sz )
+    return sendto(sk, buf, buf_sz, 0, addr, addr_sz);
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_name = (void *) addr;
+  msg.msg_namelen = addr_sz;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cbuf;
+  msg.msg_controllen = sizeof(cbuf);
+
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_UDP;
+  cmsg->cmsg_type = UDP_SEGMENT;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(gso_size));
+  memcpy(CMSG_DATA(cmsg), &gso_size, sizeof(gso_size));
+
+  ret = sendmsg(sk, &msg, 0);
+  if ( ret < 0 &&
+       (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT ||
+        errno == EOPNOTSUPP) )
+    errno = EOPNOTSUPP;
+
+  return ret;
+}
+
 int eventloop_subscribe_fd(struct eventloop *el, int fd, uint16_t evs, struct fdsub *sub) {
   int err;
   struct epoll_event ev;
@@ -1212,6 +1316,7 @@ void eventloop_queue_all(struct eventloop *el, evtqueue *q) {
     fprintf(stderr, "eventloop_queue_all: could not lock mutex\n");
   } else {
     struct qdevtsub *cur, *next;
+    int queued = *q != NULL;
     for ( cur = *q, next = cur ? cur->qe_next : NULL;
           cur;
           cur = next, next = cur ? cur->qe_next : NULL ) {
@@ -1219,6 +1324,9 @@ void eventloop_queue_all(struct eventloop *el, evtqueue *q) {
       eventloop_queue_unlocked(el, cur);
     }
     *q = NULL;
+    // Wake the loop, as eventloop_queue does
+    if ( queued )
+      kill(getpid(), SIGALRM);
     pthread_mutex_unlock(&el->el_tmr_mutex);
   }
 }
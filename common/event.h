@@ -83,7 +83,9 @@ struct fdsub {
 #define FD_SUB_READ_OOB   0x10
 #define FD_SUB_WRITE_OOB  0x20
 #define FD_SUB_ERROR      0x40
-#define FD_SUB_ALL        (FD_SUB_READ | FD_SUB_WRITE | FD_SUB_HUP | FD_SUB_RDHUP | FD_SUB_READ_OOB | FD_SUB_WRITE_OOB | FD_SUB_ERROR)
+// Priority data, or a pressure stall trigger (see PSI)
+#define FD_SUB_PRIORITY   0x80
+#define FD_SUB_ALL        (FD_SUB_READ | FD_SUB_WRITE | FD_SUB_HUP | FD_SUB_RDHUP | FD_SUB_READ_OOB | FD_SUB_WRITE_OOB | FD_SUB_ERROR | FD_SUB_PRIORITY)
 
 #define STATE_FROM_FDSUB(type, field, sub) STRUCT_FROM_BASE(type, field, sub)
 // #define FDSUB_SUBSCRIBE(fds, s) __sync_or_and_fetch(&(fds)->fds_subscriptions, (s) & 0xFFFF)
@@ -96,6 +98,37 @@ void fdsub_clear(struct fdsub *sub);
 // Returns 0 on success, -1 on error
 int set_socket_nonblocking(int fd);
 
+// UDP segmentation offload (GSO/GRO).
+//
+// A coalesced datagram is never larger than UDP_GRO_BUF_SIZE, and the
+// kernel will not split a send into more than UDP_GSO_MAX_SEGMENTS
+// datagrams.
+#define UDP_GRO_BUF_SIZE     65536
+#define UDP_GSO_MAX_SEGMENTS 64
+
+// Ask the kernel to coalesce incoming datagrams from the same peer.
+//
+// Returns 1 if GRO was enabled, 0 if the kernel does not support it
+int udp_enable_gro(int sk);
+// Returns 1 if the kernel accepts UDP_SEGMENT sends on this socket, 0 otherwise
+int udp_gso_supported(int sk);
+
+// Like recvfrom(), except if GRO is enabled, buf may contain several
+// datagrams from the same peer back to back. *seg_sz is set to the
+// size of each datagram (the last one may be shorter).
+ssize_t udp_recv_gro(int sk, void *buf, size_t buf_sz,
+                     struct sockaddr *addr, socklen_t *addr_sz,
+                     size_t *seg_sz);
+
+// Send buf as a train of seg_sz-byte datagrams (the last may be
+// shorter) with a single system call.
+//
+// Returns the number of bytes sent, or -1 on error. If the kernel or
+// device refuses to segment the buffer, errno is set to EOPNOTSUPP
+// and the caller should fall back to sending datagrams one by one.
+ssize_t udp_send_gso(int sk, const void *buf, size_t buf_sz, size_t seg_sz,
+                     const struct sockaddr *addr, socklen_t addr_sz);
+
 // Adds the given events to the fd
 //
 // Returns the bit mask of which subscriptions were installed
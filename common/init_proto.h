@@ -2,6 +2,7 @@
 #define __stork_init_proto_H__
 
 #include <stdint.h>
+#include <netinet/in.h>
 
 #define STK_MAX_PKT_SZ (2 * 1024 * 1024)
 #define STK_ARG_MAX (64 * 1024)
@@ -22,15 +23,45 @@ struct stkinitmsg {
       int dir;
       uint16_t dom_len, tgt_len;
     } modhost;
+    struct {
+      int dir;
+      struct in_addr addr;
+      uint16_t port;
+    } modaddr;
   } un;
   char after[];
 };
 
+// Response to STK_REQ_HEALTH
+struct stkhealth {
+  int32_t sh_status;
+  // Consecutive failed checks
+  uint32_t sh_failures;
+  uint32_t sh_checks;
+};
+
+#define STK_HEALTH_NOT_STARTED 0
+#define STK_HEALTH_STARTING    1
+#define STK_HEALTH_HEALTHY     2
+#define STK_HEALTH_ERRORING    3
+
+// Range of the manifest's health-check-interval, in seconds. Checked
+// by applianced when parsing, and again by app-instance-init
+#define STK_HEALTH_MIN_INTERVAL 1
+#define STK_HEALTH_MAX_INTERVAL (24 * 60 * 60)
+
 #define STK_ARGS(msg) ((msg)->after)
 
 #define STK_REQ_RUN  0x0001
 #define STK_REQ_KILL 0x0002
 #define STK_REQ_MOD_HOST_ENTRY 0x0003
+// Adds (dir > 0) or removes (dir < 0) an address on the container's
+// interface. Processes serving several peers (webrtc-proxy in shared
+// mode) listen on addr:port on behalf of the peer
+#define STK_REQ_MOD_ADDR 0x0004
+// Report the result of the health checks. The response is a struct
+// stkhealth
+#define STK_REQ_HEALTH 0x0006
 
 // The process follows the kite initialization protocol. Set this flag
 // to wait for the process to really start
@@ -34,6 +34,7 @@ struct kitelocalattr {
 #define KLM_REQ_ENTITY_FLOCK   0x0300
 #define KLM_REQ_ENTITY_CONTAINER 0x0400
 #define KLM_REQ_ENTITY_SYSTEM  0x0500
+#define KLM_REQ_ENTITY_UPDATE  0x0600 // Queued and running app updates
 
 #define KLM_RESPONSE           0x8000
 
@@ -75,6 +76,12 @@ struct kitelocalattr {
 #define KLA_APP_SIGNATURE_URL  0x001F
 #define KLA_CRED               0x0020
 #define KLA_GUEST              0x0021
+#define KLA_HEALTH             0x0022 /* Three uint32_ts: STK_HEALTH_* status, consecutive failures, and checks run */
+#define KLA_UPDATE_STATUS      0x0023 /* int16_t AU_STATUS_* */
+#define KLA_UPDATE_PRIORITY    0x0024 /* uint16_t AU_PRIORITY_* */
+#define KLA_UPDATE_QUEUE       0x0025 /* uint16_t AU_QUEUE_* */
+#define KLA_APP_PERMISSION_REVOKED 0x0026
+#define KLA_UPDATE_REASON      0x0027 /* uint16_t AU_UPDATE_REASON_* */
 
 #define KLE_SUCCESS            0x0000
 #define KLE_NOT_IMPLEMENTED    0x0001
@@ -2,13 +2,23 @@
 #include <assert.h>
 #include <errno.h>
 #include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
 
 #include "process.h"
 
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
 #define OP_PS_STDIN EVT_CTL_CUSTOM
 #define OP_PS_STDOUT (EVT_CTL_CUSTOM + 1)
 #define OP_PS_STDERR (EVT_CTL_CUSTOM + 2)
 #define OP_PS_COMPLETE (EVT_CTL_CUSTOM + 3)
+#define OP_PS_PIDFD (EVT_CTL_CUSTOM + 4)
+
+// Cleared the first time pidfd_open() returns ENOSYS
+static int g_pidfd_supported = 1;
 
 static void psevtfn(struct eventloop *el, int op, void *arg);
 
@@ -224,6 +234,7 @@ void pssub_init(struct pssub *ps, int op, evtctlfn fn) {
 //  fdsub_init(&ps->ps_stdout_sub, el, OP_PS_STDOUT, fn);
 //  fdsub_init(&ps->ps_stderr_sub, el, OP_PS_STDERR, fn);
   ps->ps_which = -1;
+  ps->ps_pidfd = -1;
   DLIST_ENTRY_CLEAR(&ps->ps_list);
 }
 
@@ -234,8 +245,101 @@ void pssub_release(struct pssub *ps) {
     close(ps->ps_stdout);
   if ( ps->ps_stderr >= 0 )
     close(ps->ps_stderr);
+  if ( ps->ps_pidfd >= 0 )
+    close(ps->ps_pidfd);
 
   ps->ps_which = -1;
+  ps->ps_pidfd = -1;
+}
+
+static int pssub_open_pidfd(pid_t p) {
+  int fd;
+
+  if ( !__sync_fetch_and_or(&g_pidfd_supported, 0) ) return -1;
+
+  fd = syscall(SYS_pidfd_open, p, 0);
+  if ( fd < 0 ) {
+    if ( errno == ENOSYS ) {
+      if ( __sync_fetch_and_and(&g_pidfd_supported, 0) )
+        fprintf(stderr, "pssub: pidfd_open not supported. Falling back to SIGCHLD\n");
+    } else
+      perror("pssub_open_pidfd: pidfd_open");
+    return -1;
+  }
+
+  return fd;
+}
+
+void pssub_disable_pidfd() {
+  __sync_fetch_and_and(&g_pidfd_supported, 0);
+}
+
+// el_ps_mutex must be held
+static int pssub_is_tracked(struct eventloop *el, struct pssub *ps) {
+  return ps->ps_pidfd >= 0 || DLIST_ENTRY_IN_LIST(&el->el_processes, ps_list, ps);
+}
+
+// el_ps_mutex must be held
+static void pssub_track(struct eventloop *el, struct pssub *ps, pid_t p) {
+  ps->ps_which = p;
+  ps->ps_status = -1;
+
+  // p is our child, and it cannot be reaped before we wait for it,
+  // so the pid cannot have been reused
+  ps->ps_pidfd = pssub_open_pidfd(p);
+  if ( ps->ps_pidfd >= 0 ) {
+    fdsub_init(&ps->ps_pidfd_sub, el, ps->ps_pidfd, OP_PS_PIDFD, psevtfn);
+    eventloop_subscribe_fd(el, ps->ps_pidfd, FD_SUB_READ, &ps->ps_pidfd_sub);
+  } else
+    DLIST_INSERT(&el->el_processes, ps_list, ps);
+}
+
+// el_ps_mutex must be held. Returns -1 if the process was not being
+// tracked, which means its completion was already delivered
+static int pssub_untrack(struct eventloop *el, struct pssub *ps) {
+  if ( ps->ps_pidfd >= 0 ) {
+    eventloop_unsubscribe_fd(el, ps->ps_pidfd, FD_SUB_ALL, &ps->ps_pidfd_sub);
+    close(ps->ps_pidfd);
+    ps->ps_pidfd = -1;
+  } else if ( DLIST_ENTRY_IN_LIST(&el->el_processes, ps_list, ps) ) {
+    DLIST_REMOVE(&el->el_processes, ps_list, ps);
+  } else
+    return -1;
+
+  return 0;
+}
+
+// Called when the pidfd becomes readable, which happens once the
+// process has exited
+static void pssub_reap(struct eventloop *el, struct pssub *ps) {
+  int sts, done = 0;
+  pid_t exited;
+
+  SAFE_MUTEX_LOCK(&el->el_ps_mutex);
+  if ( ps->ps_pidfd < 0 ) {
+    // Detached while the event was being delivered
+    pthread_mutex_unlock(&el->el_ps_mutex);
+    return;
+  }
+
+  exited = waitpid(ps->ps_which, &sts, WNOHANG);
+  if ( exited == ps->ps_which ) {
+    ps->ps_status = sts;
+    done = 1;
+  } else if ( exited == 0 ) {
+    eventloop_subscribe_fd(el, ps->ps_pidfd, FD_SUB_READ, &ps->ps_pidfd_sub);
+  } else {
+    perror("pssub_reap: waitpid");
+    ps->ps_status = -1;
+    done = 1;
+  }
+
+  if ( done )
+    pssub_untrack(el, ps);
+  pthread_mutex_unlock(&el->el_ps_mutex);
+
+  if ( done )
+    eventloop_queue(el, &ps->ps_on_complete);
 }
 
 int pssub_attach(struct eventloop *el, struct pssub *ps, pid_t p) {
@@ -250,19 +354,15 @@ int pssub_detach_attach(struct eventloop *el, struct pssub *det, struct pssub *a
   if ( pthread_mutex_lock(&el->el_ps_mutex) == 0 ) {
     int ret = 0;
 
-    if ( det && det->ps_which > 0 ) {
-      DLIST_REMOVE(&el->el_processes, ps_list, det);
+    if ( det && det->ps_which > 0 && pssub_untrack(el, det) == 0 ) {
       det->ps_which = -1;
       det->ps_status = -1;
     } else if ( det )
       ret = -1;
 
-    if ( att && att->ps_which < 0 && ret == 0 ) {
-      att->ps_which = p;
-      att->ps_status = -1;
-
-      DLIST_INSERT(&el->el_processes, ps_list, att);
-    } else
+    if ( att && att->ps_which < 0 && ret == 0 )
+      pssub_track(el, att, p);
+    else if ( att )
       ret = -1;
 
     pthread_mutex_unlock(&el->el_ps_mutex);
@@ -276,7 +376,7 @@ int pssub_run_from_opts(struct eventloop *el, struct pssub *ps, struct pssubopts
     int ret = 0;
     pid_t new_child;
 
-    if ( DLIST_ENTRY_IN_LIST(&el->el_processes, ps_list, ps) ) {
+    if ( pssub_is_tracked(el, ps) ) {
       ret = -1;
     } else {
       new_child = fork();
@@ -345,9 +445,7 @@ int pssub_run_from_opts(struct eventloop *el, struct pssub *ps, struct pssubopts
           opts->pso_stderr_read = -1;
         }
 
-        ps->ps_which = new_child;
-
-        DLIST_INSERT(&el->el_processes, ps_list, ps);
+        pssub_track(el, ps, new_child);
       }
     }
     pthread_mutex_unlock(&el->el_ps_mutex);
@@ -358,6 +456,7 @@ int pssub_run_from_opts(struct eventloop *el, struct pssub *ps, struct pssubopts
 
 static void psevtfn(struct eventloop *el, int op, void *arg) {
   struct qdevent *qde;
+  struct fdevent *fde;
   struct pssub *sub;
   struct psevent pse;
 
@@ -376,6 +475,12 @@ static void psevtfn(struct eventloop *el, int op, void *arg) {
     sub->ps_ctl(el, sub->ps_op, &pse);
     break;
 
+  case OP_PS_PIDFD:
+    fde = arg;
+    sub = STRUCT_FROM_BASE(struct pssub, ps_pidfd_sub, fde->fde_sub);
+    pssub_reap(el, sub);
+    break;
+
   default:
     fprintf(stderr, "psevtfn: unknown op %d\n", op);
   }
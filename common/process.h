@@ -41,6 +41,12 @@ void pssubopts_set_command(struct pssubopts *pso, const char *cmd, argfreefn fn)
 int pssubopts_push_arg(struct pssubopts *pso, const char *arg, argfreefn fn);
 int pssubopts_push_env(struct pssubopts *pso, const char *var, const char *val);
 
+// A process whose exit is delivered through the event loop.
+//
+// Where the kernel supports it (Linux 5.3 and later), each process is
+// watched through a pidfd registered with epoll, and its exit costs a
+// single waitpid(). Otherwise, the process is kept on the event loop's
+// el_processes list, which is scanned on every SIGCHLD.
 struct pssub {
   int ps_op;
   evtctlfn ps_ctl;
@@ -51,6 +57,10 @@ struct pssub {
   pid_t ps_which;
   int ps_status;
 
+  // -1 if the process is not watched through a pidfd
+  int ps_pidfd;
+  struct fdsub ps_pidfd_sub;
+
   struct qdevtsub ps_on_complete;
 
   DLIST(struct pssub) ps_list;
@@ -76,4 +86,8 @@ int pssub_detach_attach(struct eventloop *el, struct pssub *det, struct pssub *a
 int pssub_detach(struct eventloop *el, struct pssub *ps);
 int pssub_attach(struct eventloop *el, struct pssub *ps, pid_t p);
 
+// Watch processes through SIGCHLD only, as on kernels without
+// pidfd_open(). Lets tests cover the fallback
+void pssub_disable_pidfd();
+
 #endif
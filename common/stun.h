@@ -124,6 +124,9 @@ struct stunattr {
 #define STUN_ATTR_KITE_PERSONAS_DATA 0x0048
 #define STUN_ATTR_KITE_ANSWER        0x0049
 #define STUN_ATTR_KITE_ANSWER_OFFSET 0x004A
+// Comprehension-optional, so peers that don't know it ignore it. Used
+// to pad path MTU probes to the size being probed.
+#define STUN_ATTR_KITE_PADDING       0xC04B
 
 #define STUN_ATTR_REQUIRED(attr)     (((attr) & 0x8000) == 0)
 #define STUN_ATTR_OPTIONAL(attr)     (((attr) & 0x8000) != 0)
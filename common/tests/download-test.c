@@ -0,0 +1,416 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <openssl/evp.h>
+
+#include "../event.h"
+#include "../download.h"
+
+// Downloads over HTTP from a small server on the loopback interface.
+//
+// The server serves:
+//
+//   /blob     BLOB_SIZE bytes, honoring 'Range: bytes=N-'
+//   /drop     Like /blob, but a request without a Range header gets
+//             the headers and half of the body, and then the connection
+//             is closed
+//   anything else is a 404
+//
+// Connections are kept alive, so that we can check that the
+// downloader reuses them.
+//
+// The same blob is also downloaded from a file: URI and a base64
+// data: URI, and the inline SHA256 digest is checked against it.
+
+#define BLOB_SIZE (256 * 1024)
+#define LOOP_THREADS 2
+#define MAX_CONNECTIONS 2
+#define PARALLEL_DOWNLOADS 6
+#define TEST_TIMEOUT 30
+
+static char g_blob[BLOB_SIZE];
+static int g_server_port;
+
+static int g_connections = 0, g_requests = 0, g_range_requests = 0;
+static int g_active = 0, g_max_active = 0;
+
+static pthread_mutex_t g_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_cond = PTHREAD_COND_INITIALIZER;
+static int g_pending = 0;
+
+struct testdl {
+  struct download td_dl;
+
+  size_t td_offset;
+  char *td_data;
+  size_t td_sz;
+
+  int td_sts;
+};
+
+// Server
+
+static int write_all(int sk, const void *buf, size_t sz) {
+  const char *data = buf;
+  ssize_t err;
+
+  while ( sz > 0 ) {
+    err = send(sk, data, sz, MSG_NOSIGNAL);
+    if ( err <= 0 ) return -1;
+    data += err;
+    sz -= err;
+  }
+
+  return 0;
+}
+
+static int serve_request(int sk, const char *req) {
+  char path[64], hdrs[256];
+  const char *range;
+  unsigned long start = 0;
+  int has_range = 0, hdrs_sz;
+
+  if ( sscanf(req, "GET %63s HTTP/1.1", path) != 1 ) return -1;
+
+  __sync_fetch_and_add(&g_requests, 1);
+
+  for ( range = req; (range = strchr(range, '\n')); ) {
+    range++;
+    if ( strncasecmp(range, "Range: bytes=", 13) == 0 ) {
+      if ( sscanf(range + 13, "%lu-", &start) != 1 ) return -1;
+      has_range = 1;
+      __sync_fetch_and_add(&g_range_requests, 1);
+      break;
+    }
+  }
+
+  if ( strcmp(path, "/blob") != 0 && strcmp(path, "/drop") != 0 ) {
+    hdrs_sz = snprintf(hdrs, sizeof(hdrs),
+                       "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n");
+    return write_all(sk, hdrs, hdrs_sz);
+  }
+
+  if ( start > BLOB_SIZE ) return -1;
+
+  if ( has_range )
+    hdrs_sz = snprintf(hdrs, sizeof(hdrs),
+                       "HTTP/1.1 206 Partial Content\r\nContent-Length: %lu\r\n"
+                       "Content-Range: bytes %lu-%d/%d\r\n\r\n",
+                       BLOB_SIZE - start, start, BLOB_SIZE - 1, BLOB_SIZE);
+  else
+    hdrs_sz = snprintf(hdrs, sizeof(hdrs),
+                       "HTTP/1.1 200 OK\r\nContent-Length: %d\r\n\r\n", BLOB_SIZE);
+
+  if ( write_all(sk, hdrs, hdrs_sz) < 0 ) return -1;
+
+  if ( strcmp(path, "/drop") == 0 && !has_range ) {
+    write_all(sk, g_blob, BLOB_SIZE / 2);
+    return -1;
+  }
+
+  return write_all(sk, g_blob + start, BLOB_SIZE - start);
+}
+
+static void *serve_connection(void *arg) {
+  int sk = (intptr_t) arg, active;
+  char req[4096];
+  size_t req_sz = 0;
+  ssize_t err;
+
+  active = __sync_add_and_fetch(&g_active, 1);
+  SAFE_MUTEX_LOCK(&g_mutex);
+  if ( active > g_max_active )
+    g_max_active = active;
+  pthread_mutex_unlock(&g_mutex);
+
+  while ( 1 ) {
+    char *end;
+
+    req[req_sz] = '\0';
+    end = strstr(req, "\r\n\r\n");
+    if ( end ) {
+      end += 4;
+      if ( serve_request(sk, req) < 0 ) break;
+
+      memmove(req, end, req_sz - (end - req));
+      req_sz -= end - req;
+      continue;
+    }
+
+    if ( req_sz >= sizeof(req) - 1 ) break;
+
+    err = recv(sk, req + req_sz, sizeof(req) - req_sz - 1, 0);
+    if ( err <= 0 ) break;
+    req_sz += err;
+  }
+
+  __sync_fetch_and_sub(&g_active, 1);
+  close(sk);
+  return NULL;
+}
+
+static void *serve(void *arg) {
+  int srv = (intptr_t) arg, sk;
+  pthread_t t;
+
+  while ( (sk = accept(srv, NULL, NULL)) >= 0 ) {
+    __sync_fetch_and_add(&g_connections, 1);
+    if ( pthread_create(&t, NULL, serve_connection, (void *) (intptr_t) sk) != 0 ) {
+      close(sk);
+      continue;
+    }
+    pthread_detach(t);
+  }
+
+  perror("serve: accept");
+  return NULL;
+}
+
+static void start_server() {
+  struct sockaddr_in addr;
+  socklen_t addr_sz = sizeof(addr);
+  pthread_t t;
+  int srv;
+
+  srv = socket(AF_INET, SOCK_STREAM, 0);
+  assert(srv >= 0);
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = 0;
+
+  assert(bind(srv, (struct sockaddr *) &addr, sizeof(addr)) == 0);
+  assert(listen(srv, 16) == 0);
+  assert(getsockname(srv, (struct sockaddr *) &addr, &addr_sz) == 0);
+  g_server_port = ntohs(addr.sin_port);
+
+  assert(pthread_create(&t, NULL, serve, (void *) (intptr_t) srv) == 0);
+  pthread_detach(t);
+}
+
+// Client
+
+static void testdlfn(struct eventloop *el, int op, void *arg) {
+  struct dlevent *dle = arg;
+  struct download *dl = dle->dle_dl;
+  struct testdl *td = STRUCT_FROM_BASE(struct testdl, td_dl, dl);
+
+  if ( download_complete(dl) ) {
+    SAFE_MUTEX_LOCK(&g_mutex);
+    td->td_sts = dl->dl_sts;
+    g_pending--;
+    pthread_cond_broadcast(&g_cond);
+    pthread_mutex_unlock(&g_mutex);
+  } else {
+    assert(td->td_sz + dl->dl_bufsz <= BLOB_SIZE);
+    memcpy(td->td_data + td->td_sz, dl->dl_buf, dl->dl_bufsz);
+    td->td_sz += dl->dl_bufsz;
+    download_continue(dl);
+  }
+}
+
+static void start_download_url(struct testdl *td, struct downloader *dr,
+                               const char *url, size_t offset, int hash) {
+  UriParserStateA urip;
+  UriUriA uri;
+
+  td->td_offset = offset;
+  td->td_sz = 0;
+  td->td_sts = DL_STATUS_NOT_STARTED;
+  td->td_data = malloc(BLOB_SIZE);
+  assert(td->td_data);
+
+  urip.uri = &uri;
+  assert(uriParseUriExA(&urip, url, url + strlen(url)) == URI_SUCCESS);
+  assert(download_init(&td->td_dl, dr, &uri, EVT_CTL_CUSTOM, testdlfn) == 0);
+  uriFreeUriMembersA(&uri);
+
+  if ( offset )
+    assert(download_set_offset(&td->td_dl, offset) == 0);
+
+  if ( hash )
+    assert(download_set_digest(&td->td_dl, EVP_sha256()) == 0);
+
+  SAFE_MUTEX_LOCK(&g_mutex);
+  g_pending++;
+  pthread_mutex_unlock(&g_mutex);
+
+  download_start(&td->td_dl);
+}
+
+static void start_download(struct testdl *td, struct downloader *dr,
+                           const char *path, size_t offset) {
+  char url[128];
+
+  snprintf(url, sizeof(url), "http://127.0.0.1:%d%s", g_server_port, path);
+  start_download_url(td, dr, url, offset, 0);
+}
+
+static void wait_for_downloads() {
+  struct timespec deadline;
+
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += TEST_TIMEOUT;
+
+  SAFE_MUTEX_LOCK(&g_mutex);
+  while ( g_pending > 0 ) {
+    if ( pthread_cond_timedwait(&g_cond, &g_mutex, &deadline) != 0 ) {
+      fprintf(stderr, "Timed out waiting for %d downloads\n", g_pending);
+      abort();
+    }
+  }
+  pthread_mutex_unlock(&g_mutex);
+}
+
+static void check_blob(struct testdl *td) {
+  assert(td->td_sts == DL_STATUS_COMPLETE);
+  assert(td->td_sz == BLOB_SIZE - td->td_offset);
+  assert(memcmp(td->td_data, g_blob + td->td_offset, td->td_sz) == 0);
+  assert(td->td_dl.dl_complete == BLOB_SIZE);
+  assert(td->td_dl.dl_total == BLOB_SIZE);
+}
+
+static void check_digest(struct testdl *td) {
+  unsigned char expected[EVP_MAX_MD_SIZE], actual[EVP_MAX_MD_SIZE];
+  unsigned int expected_sz, actual_sz;
+
+  assert(EVP_Digest(g_blob, BLOB_SIZE, expected, &expected_sz, EVP_sha256(), NULL));
+  assert(download_digest(&td->td_dl, actual, &actual_sz) == 0);
+  assert(actual_sz == expected_sz);
+  assert(memcmp(actual, expected, actual_sz) == 0);
+}
+
+static void finish_download(struct testdl *td) {
+  download_release(&td->td_dl);
+  free(td->td_data);
+}
+
+static void *eventloop_thread(void *arg) {
+  eventloop_run((struct eventloop *) arg);
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  struct eventloop el;
+  struct downloader dr;
+  struct testdl tds[PARALLEL_DOWNLOADS];
+  sigset_t all_signals;
+  pthread_t t;
+  int i, requests, fd;
+  char file_path[] = "/tmp/download-test-XXXXXX", file_url[64];
+  char *data_url;
+
+  for ( i = 0; i < BLOB_SIZE; ++i )
+    g_blob[i] = (i * 7 + i / 251) & 0xFF;
+
+  // Timer signals must go to the event loop threads
+  sigfillset(&all_signals);
+  sigdelset(&all_signals, SIGINT);
+  pthread_sigmask(SIG_SETMASK, &all_signals, NULL);
+
+  start_server();
+
+  assert(eventloop_init(&el) == 0);
+  eventloop_prepare(&el);
+  assert(downloader_init(&dr, &el, MAX_CONNECTIONS, MAX_CONNECTIONS) == 0);
+
+  for ( i = 0; i < LOOP_THREADS; ++i ) {
+    assert(pthread_create(&t, NULL, eventloop_thread, &el) == 0);
+    pthread_detach(t);
+  }
+
+  fprintf(stderr, "Whole download\n");
+  start_download(&tds[0], &dr, "/blob", 0);
+  wait_for_downloads();
+  check_blob(&tds[0]);
+  finish_download(&tds[0]);
+
+  fprintf(stderr, "Whole download, hashed\n");
+  snprintf(file_url, sizeof(file_url), "http://127.0.0.1:%d/blob", g_server_port);
+  start_download_url(&tds[0], &dr, file_url, 0, 1);
+  wait_for_downloads();
+  check_blob(&tds[0]);
+  check_digest(&tds[0]);
+  finish_download(&tds[0]);
+
+  fprintf(stderr, "File download, hashed\n");
+  fd = mkstemp(file_path);
+  assert(fd >= 0);
+  assert(write(fd, g_blob, BLOB_SIZE) == BLOB_SIZE);
+  close(fd);
+
+  snprintf(file_url, sizeof(file_url), "file://%s", file_path);
+  start_download_url(&tds[0], &dr, file_url, 0, 1);
+  wait_for_downloads();
+  unlink(file_path);
+  check_blob(&tds[0]);
+  check_digest(&tds[0]);
+  finish_download(&tds[0]);
+
+  fprintf(stderr, "Base64 data download, hashed\n");
+  data_url = malloc(64 + (BLOB_SIZE + 2) / 3 * 4);
+  assert(data_url);
+  i = sprintf(data_url, "data:application/octet-stream;base64,");
+  EVP_EncodeBlock((unsigned char *) data_url + i, (unsigned char *) g_blob, BLOB_SIZE);
+  start_download_url(&tds[0], &dr, data_url, 0, 1);
+  wait_for_downloads();
+  free(data_url);
+  check_blob(&tds[0]);
+  check_digest(&tds[0]);
+  finish_download(&tds[0]);
+
+  fprintf(stderr, "Missing file\n");
+  start_download(&tds[0], &dr, "/missing", 0);
+  wait_for_downloads();
+  assert(tds[0].td_sts == DL_STATUS_NOT_FOUND);
+  assert(tds[0].td_sz == 0);
+  finish_download(&tds[0]);
+
+  fprintf(stderr, "Download from an offset\n");
+  start_download(&tds[0], &dr, "/blob", BLOB_SIZE / 3);
+  wait_for_downloads();
+  check_blob(&tds[0]);
+  assert(g_range_requests == 1);
+  finish_download(&tds[0]);
+
+  fprintf(stderr, "Resume after the connection is dropped\n");
+  start_download(&tds[0], &dr, "/drop", 0);
+  wait_for_downloads();
+  check_blob(&tds[0]);
+  assert(tds[0].td_dl.dl_retries == 1);
+  assert(g_range_requests == 2);
+  finish_download(&tds[0]);
+
+  fprintf(stderr, "Parallel downloads\n");
+  SAFE_MUTEX_LOCK(&g_mutex);
+  g_max_active = g_active;
+  pthread_mutex_unlock(&g_mutex);
+
+  for ( i = 0; i < PARALLEL_DOWNLOADS; ++i )
+    start_download(&tds[i], &dr, "/blob", 0);
+  wait_for_downloads();
+
+  for ( i = 0; i < PARALLEL_DOWNLOADS; ++i ) {
+    check_blob(&tds[i]);
+    finish_download(&tds[i]);
+  }
+
+  requests = __sync_fetch_and_or(&g_requests, 0);
+  fprintf(stderr, "%d requests over %d connections (at most %d at once)\n",
+          requests, g_connections, g_max_active);
+  assert(g_max_active <= MAX_CONNECTIONS);
+  assert(g_connections < requests);
+
+  fprintf(stderr, "All download tests passed\n");
+  return 0;
+}
@@ -0,0 +1,157 @@
+#include <assert.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "../event.h"
+#include "../process.h"
+
+// Checks the pssub_detach() results that container_start_from_pool
+// relies on: detaching a live process succeeds exactly once. Then
+// runs children through the event loop, once watched with pidfds and
+// once through SIGCHLD, and checks each exit is delivered once, with
+// its status.
+
+#define CHILD_COUNT 16
+
+struct testchild {
+  struct pssub tc_ps;
+  int tc_done;
+  int tc_sts;
+};
+
+pthread_mutex_t g_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t g_cond = PTHREAD_COND_INITIALIZER;
+int g_done = 0;
+
+void psfn(struct eventloop *el, int op, void *arg) {
+  fprintf(stderr, "Detached process completed\n");
+  assert(0);
+}
+
+void childfn(struct eventloop *el, int op, void *arg) {
+  struct psevent *pse = arg;
+  struct testchild *tc = STRUCT_FROM_BASE(struct testchild, tc_ps, pse->pse_sub);
+
+  assert(pse->pse_what == PSE_DONE);
+
+  pthread_mutex_lock(&g_mutex);
+  tc->tc_done++;
+  tc->tc_sts = pse->pse_sts;
+  g_done++;
+  pthread_cond_broadcast(&g_cond);
+  pthread_mutex_unlock(&g_mutex);
+}
+
+void *loopfn(void *arg) {
+  eventloop_run((struct eventloop *) arg);
+  return NULL;
+}
+
+void run_children(struct eventloop *el, int use_pidfd) {
+  struct testchild children[CHILD_COUNT];
+  int i, go[2];
+  pid_t child;
+
+  // Children only exit once they are all attached, since SIGCHLD
+  // for a process not yet on el_processes would be missed
+  assert(pipe(go) == 0);
+
+  g_done = 0;
+  for ( i = 0; i < CHILD_COUNT; ++i ) {
+    char c;
+
+    pssub_init(&children[i].tc_ps, EVT_CTL_CUSTOM, childfn);
+    children[i].tc_done = 0;
+    children[i].tc_sts = -1;
+
+    child = fork();
+    assert(child >= 0);
+    if ( child == 0 ) {
+      close(go[1]);
+      if ( read(go[0], &c, 1) < 0 ) _exit(100);
+      _exit(i);
+    }
+
+    assert(pssub_attach(el, &children[i].tc_ps, child) == 0);
+    if ( !use_pidfd )
+      assert(children[i].tc_ps.ps_pidfd < 0);
+  }
+
+  close(go[0]);
+  close(go[1]);
+
+  pthread_mutex_lock(&g_mutex);
+  while ( g_done < CHILD_COUNT )
+    pthread_cond_wait(&g_cond, &g_mutex);
+  pthread_mutex_unlock(&g_mutex);
+
+  for ( i = 0; i < CHILD_COUNT; ++i ) {
+    assert(children[i].tc_done == 1);
+    assert(WIFEXITED(children[i].tc_sts));
+    assert(WEXITSTATUS(children[i].tc_sts) == i);
+
+    // Already delivered
+    assert(pssub_detach(el, &children[i].tc_ps) == -1);
+    pssub_release(&children[i].tc_ps);
+  }
+}
+
+int main(int argc, char **argv) {
+  // The loop thread outlives main
+  static struct eventloop el;
+  struct pssub ps, other;
+  sigset_t all_signals;
+  pthread_t loop;
+  pid_t child;
+  int sts;
+
+  eventloop_init(&el);
+  eventloop_prepare(&el);
+
+  child = fork();
+  assert(child >= 0);
+  if ( child == 0 ) {
+    pause();
+    _exit(0);
+  }
+
+  pssub_init(&ps, EVT_CTL_CUSTOM, psfn);
+  pssub_init(&other, EVT_CTL_CUSTOM + 1, psfn);
+
+  assert(pssub_detach(&el, &ps) == -1);
+
+  assert(pssub_attach(&el, &ps, child) == 0);
+  assert(pssub_attach(&el, &ps, child) == -1);
+  assert(pssub_detach(&el, &ps) == 0);
+  assert(pssub_detach(&el, &ps) == -1);
+
+  assert(pssub_attach(&el, &ps, child) == 0);
+  assert(pssub_detach_attach(&el, &ps, &other, child) == 0);
+  assert(pssub_detach_attach(&el, &ps, &other, child) == -1);
+  assert(pssub_detach(&el, &other) == 0);
+
+  kill(child, SIGKILL);
+  assert(waitpid(child, &sts, 0) == child);
+
+  pssub_release(&ps);
+  pssub_release(&other);
+
+  // SIGCHLD must go to the event loop thread
+  sigfillset(&all_signals);
+  sigdelset(&all_signals, SIGINT);
+  pthread_sigmask(SIG_SETMASK, &all_signals, NULL);
+
+  assert(pthread_create(&loop, NULL, loopfn, &el) == 0);
+  pthread_detach(loop);
+
+  run_children(&el, 1);
+
+  pssub_disable_pidfd();
+  run_children(&el, 0);
+
+  fprintf(stderr, "All process tests passed\n");
+  return 0;
+}
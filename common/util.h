@@ -270,6 +270,17 @@ int parse_decimal(int *out, const char *buf, int buf_sz);
       (head)->dh_first = (head)->dh_last = entry;                    \
     }                                                                \
   } while (0)
+#define DLIST_INSERT_HEAD(head, dl, entry) do {                      \
+    (entry)->dl.dl_prev = NULL;                                      \
+    (entry)->dl.dl_next = (head)->dh_first;                          \
+    if ( (head)->dh_first ) {                                        \
+      assert((head)->dh_last);                                       \
+      (head)->dh_first->dl.dl_prev = (entry);                        \
+    } else {                                                         \
+      (head)->dh_last = (entry);                                     \
+    }                                                                \
+    (head)->dh_first = (entry);                                      \
+  } while (0)
 #define DLIST_REMOVE(head, dl, entry)                                \
   do {                                                               \
     if ( (head)->dh_first == (entry) ) {                             \
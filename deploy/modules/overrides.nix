@@ -7,7 +7,7 @@
       my-curl = super.curl.override {
         c-aresSupport = true; sslSupport = true; idnSupport = true;
         scpSupport = false; gssSupport = true;
-        brotliSupport = true; openssl = super.openssl_1_1_0;
+        brotliSupport = true; openssl = super.openssl_1_1;
       };
     };
   };
@@ -1,4 +1,4 @@
-{ pkgs, stdenv, cmake, uriparser, lksctp-tools-1-0-18, curl, pkgconfig, zlib, openssl_1_1_0, uthash, check }:
+{ pkgs, stdenv, cmake, uriparser, lksctp-tools-1-0-18, curl, pkgconfig, zlib, xz, openssl_1_1, uthash, check }:
 
 stdenv.mkDerivation rec {
    name = "kite-${version}";
@@ -6,7 +6,7 @@ stdenv.mkDerivation rec {
 
    src = ./.. + "/kite-${version}.tar.bz2";
 
-   buildInputs = [ cmake uriparser lksctp-tools-1-0-18 curl pkgconfig openssl_1_1_0 uthash check ];
+   buildInputs = [ cmake uriparser lksctp-tools-1-0-18 curl pkgconfig zlib xz openssl_1_1 uthash check ];
 
    outputs = [ "out" "flockd" "applianced" "appliancectl" ];
 
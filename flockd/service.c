@@ -16,7 +16,10 @@
 
 #define FLOCK_DTLS_COOKIE_LENGTH 32
 
+#define FLOCKSERVICE_MAX_PENDING_ACCEPTS 64 // Handshakes waiting for SSL_accept on the async pool
+
 #define OP_FLOCKSERVICE_SOCKET EVT_CTL_CUSTOM
+#define OP_FLOCKSERVICE_ACCEPT (EVT_CTL_CUSTOM + 1)
 #define OP_FSCS_EXPIRE         EVT_CTL_CUSTOM
 
 // Data structures
@@ -597,6 +600,9 @@ static int flockservice_open_sk(struct flockservice *svc, struct eventloop *el,
     goto error;
   }
 
+  svc->fs_use_gro = udp_enable_gro(svc->fs_service_sk);
+  svc->fs_gro_size = svc->fs_gro_offs = svc->fs_gro_seg_sz = 0;
+
   return 0;
 
  error:
@@ -769,6 +775,7 @@ void flockservice_clear(struct flockservice *svc) {
   svc->fs_mutexes_initialized = 0;
   svc->fs_first_outgoing = NULL;
   svc->fs_last_outgoing = NULL;
+  svc->fs_pending_accepts = 0;
   svc->fs_service_sk = 0;
   fdsub_clear(&svc->fs_service_sub);
 
@@ -850,13 +857,47 @@ void flockservice_start(struct flockservice *svc, struct eventloop *el) {
 
 // Service
 
+// Move the next datagram out of a GRO-coalesced receive into
+// fs_incoming_packet. Returns 1 if there was one, 0 otherwise
+static int receive_next_coalesced_packet(struct flockservice *st) {
+  size_t seg_sz;
+
+  while ( st->fs_gro_offs < st->fs_gro_size ) {
+    seg_sz = MIN(st->fs_gro_seg_sz, st->fs_gro_size - st->fs_gro_offs);
+    st->fs_gro_offs += seg_sz;
+
+    if ( seg_sz > sizeof(st->fs_incoming_packet) ) {
+      fprintf(stderr, "receive_next_coalesced_packet: dropping oversized datagram of %zu bytes\n", seg_sz);
+      continue;
+    }
+
+    memcpy(st->fs_incoming_packet, st->fs_gro_packet + st->fs_gro_offs - seg_sz, seg_sz);
+    BIO_STATIC_SET_READ_SZ(&st->fs_sk_incoming, seg_sz);
+    return 1;
+  }
+
+  return 0;
+}
+
 static int receive_next_packet(struct flockservice *st, kite_sock_addr *datagram_addr) {
   int err;
   socklen_t addr_sz = sizeof(*datagram_addr);
   //  char addr_buf[INET6_ADDRSTRLEN];
 
-  err = recvfrom(st->fs_service_sk, st->fs_incoming_packet, sizeof(st->fs_incoming_packet),
-                 0, &datagram_addr->ksa, &addr_sz);
+  if ( st->fs_use_gro ) {
+    err = udp_recv_gro(st->fs_service_sk, st->fs_gro_packet, sizeof(st->fs_gro_packet),
+                       &datagram_addr->ksa, &addr_sz, &st->fs_gro_seg_sz);
+    if ( err > 0 ) {
+      st->fs_gro_size = err;
+      st->fs_gro_offs = 0;
+      if ( !receive_next_coalesced_packet(st) ) {
+        fprintf(stderr, "next_packet_address: no usable datagram in coalesced packet\n");
+        return -1;
+      }
+    }
+  } else
+    err = recvfrom(st->fs_service_sk, st->fs_incoming_packet, sizeof(st->fs_incoming_packet),
+                   0, &datagram_addr->ksa, &addr_sz);
   if ( err < 0 ) {
     perror("next_packet_address: recvmsg");
     return -1;
@@ -865,7 +906,8 @@ static int receive_next_packet(struct flockservice *st, kite_sock_addr *datagram
     return -1;
   }
 
-  BIO_STATIC_SET_READ_SZ(&st->fs_sk_incoming, err);
+  if ( !st->fs_use_gro )
+    BIO_STATIC_SET_READ_SZ(&st->fs_sk_incoming, err);
 
 //  fprintf(stderr, "Got packet from address %s:%d\n",
 //          inet_ntop(datagram_addr->sa_family, SOCKADDR_DATA(datagram_addr),
@@ -875,12 +917,112 @@ static int receive_next_packet(struct flockservice *st, kite_sock_addr *datagram
   return 0;
 }
 
+// A new client whose ClientHello passed the cookie check. The rest
+// of the handshake (SSL_accept) is run on the async pool, since it
+// involves a signature with our private key.
+struct flocksvcaccept {
+  struct qdevtsub fsa_async;
+
+  struct flockservice *fsa_svc;
+  struct eventloop *fsa_eventloop;
+  SSL *fsa_ssl;
+  kite_sock_addr fsa_peer;
+
+  struct BIO_static fsa_incoming, fsa_outgoing;
+  char fsa_pkt_out[PKT_BUF_SZ];
+};
+
+static void flock_service_finish_accept(struct flocksvcaccept *fsa) {
+  struct flockservice *st = fsa->fsa_svc;
+  struct flocksvcclientstate *client_st = NULL, *existing = NULL;
+  SSL *ssl = fsa->fsa_ssl;
+  int err;
+
+  err = SSL_accept(ssl);
+  fprintf(stderr, "SSL_accept returns\n");
+  if ( err <= 0 ) {
+    err = SSL_get_error(ssl, err);
+    switch (err) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_ZERO_RETURN:
+    case SSL_ERROR_SSL:
+      fprintf(stderr, "flock_service_accept: Invalid packet sent to DTLS socket while accepting\n");
+      goto flush;
+    case SSL_ERROR_WANT_CONNECT:
+    case SSL_ERROR_WANT_ACCEPT:
+      fprintf(stderr, "flock_service_accept: Internal DTLS error\n");
+      goto flush;
+    case SSL_ERROR_SYSCALL:
+      // The special retry is marked if we flushed
+      if ( !BIO_should_io_special(SSL_get_wbio(ssl)) )
+        goto flush;
+      else
+        perror("flock_service_accept: SSL_accept");
+      break;
+    case SSL_ERROR_WANT_WRITE:
+    case SSL_ERROR_NONE:
+    default:
+      fprintf(stderr, "flock_service_accept: SSL_accept fails\n");
+      goto flush;
+    }
+  }
+
+  // Otherwise, we have a new connection
+  fprintf(stderr, "Accepted new connection\n");
+
+  client_st = fscs_alloc(st, ssl, &fsa->fsa_peer);
+  if ( !client_st )
+    goto done;
+
+  // Established clients read from the service socket directly. Writes
+  // go through the client's own queue.
+  BIO_static_set(SSL_get_rbio(ssl), &st->fs_sk_incoming);
+  BIO_static_set(SSL_get_wbio(ssl), &client_st->fscs_outgoing);
+
+  pthread_rwlock_wrlock(&st->fs_clients_mutex);
+  HASH_FIND(fscs_hash_ent, st->fs_clients_hash, &fsa->fsa_peer, sizeof(fsa->fsa_peer), existing);
+  if ( !existing )
+    HASH_ADD(fscs_hash_ent, st->fs_clients_hash, fscs_addr, sizeof(kite_sock_addr), client_st);
+  pthread_rwlock_unlock(&st->fs_clients_mutex);
+
+  if ( existing ) {
+    // A retransmitted ClientHello was accepted first
+    fprintf(stderr, "flock_service_accept: client already connected\n");
+    FSCS_UNREF(client_st);
+    goto done;
+  }
+
+  fscs_subscribe(client_st, fsa->fsa_eventloop);
+
+  // Now attempt to send the packet. This may fail if there's no space
+  // in the socket buffer, but this is okay.
+ flush:
+  if ( BIO_STATIC_WPENDING(&fsa->fsa_outgoing) ) {
+    fprintf(stderr, "Responding to DTLS handshake\n");
+    err = sendto(st->fs_service_sk, fsa->fsa_pkt_out, BIO_STATIC_WPENDING(&fsa->fsa_outgoing), 0,
+                 &fsa->fsa_peer.ksa, sizeof(fsa->fsa_peer));
+    if ( err < 0 && errno != EAGAIN && errno != EWOULDBLOCK ) {
+      perror("sendto");
+    } else if ( err == 0 ) {
+      fprintf(stderr, "Ignoring handshake because we have no space in our send buffer\n");
+    }
+  }
+
+ done:
+  SSL_free(ssl);
+  __sync_fetch_and_sub(&st->fs_pending_accepts, 1);
+  free(fsa);
+}
+
+// Runs DTLSv1_listen on the incoming datagram. This is cheap, so it
+// is done on the event thread. If the ClientHello had a valid
+// cookie, the handshake continues in flock_service_finish_accept.
 static void flock_service_accept(struct flockservice *st, struct eventloop *eventloop,
                                  kite_sock_addr *peer) {
   int err;
   SSL *ssl = NULL;
   BIO *bio_in = NULL, *bio_out = NULL;
-  struct flocksvcclientstate *client_st = NULL;
+  struct flocksvcaccept *fsa = NULL;
   struct BIO_static outgoing_bio;
   char pkt_out[PKT_BUF_SZ];
 
@@ -943,52 +1085,44 @@ static void flock_service_accept(struct flockservice *st, struct eventloop *even
   }
   fprintf(stderr, "DTLSv1Listen suceeds\n");
 
-  err = SSL_accept(ssl);
-  fprintf(stderr, "SSL_accept returns\n");
-  if ( err <= 0 ) {
-    err = SSL_get_error(ssl, err);
-    switch (err) {
-    case SSL_ERROR_WANT_READ:
-    case SSL_ERROR_ZERO_RETURN:
-    case SSL_ERROR_SSL:
-      fprintf(stderr, "flock_service_accept: Invalid packet sent to DTLS socket while accepting\n");
-      goto flush;
-    case SSL_ERROR_WANT_CONNECT:
-    case SSL_ERROR_WANT_ACCEPT:
-      fprintf(stderr, "flock_service_accept: Internal DTLS error\n");
-      goto flush;
-    case SSL_ERROR_SYSCALL:
-      // The special retry is marked if we flushed
-      if ( !BIO_should_io_special(SSL_get_wbio(ssl)) )
-        goto flush;
-      else
-        perror("flock_service_accept: SSL_accept");
-      break;
-    case SSL_ERROR_WANT_WRITE:
-    case SSL_ERROR_NONE:
-    default:
-      fprintf(stderr, "flock_service_accept: SSL_accept fails\n");
-      goto flush;
-    }
+  if ( __sync_fetch_and_add(&st->fs_pending_accepts, 1) >= FLOCKSERVICE_MAX_PENDING_ACCEPTS ) {
+    // The client will retransmit its ClientHello
+    __sync_fetch_and_sub(&st->fs_pending_accepts, 1);
+    fprintf(stderr, "flock_service_accept: too many handshakes in progress\n");
+    goto error;
   }
 
-  // Otherwise, we have a new connection
-  fprintf(stderr, "Accepted new connection\n");
-
-  client_st = fscs_alloc(st, ssl, peer);
-  if ( !client_st )
+  fsa = malloc(sizeof(*fsa));
+  if ( !fsa ) {
+    __sync_fetch_and_sub(&st->fs_pending_accepts, 1);
+    fprintf(stderr, "flock_service_accept: out of memory\n");
     goto error;
+  }
 
-  SSL_free(ssl);
-
-  fscs_subscribe(client_st, eventloop);
-
-  // Reset SSL bio
-  BIO_static_set(SSL_get_wbio(ssl), &client_st->fscs_outgoing);
+  qdevtsub_init(&fsa->fsa_async, OP_FLOCKSERVICE_ACCEPT, flockservice_fn);
+  fsa->fsa_svc = st;
+  fsa->fsa_eventloop = eventloop;
+  fsa->fsa_ssl = ssl;
+  memcpy(&fsa->fsa_peer, peer, sizeof(fsa->fsa_peer));
+
+  // The ClientHello is now buffered inside the SSL object, and
+  // fs_sk_incoming will be reused for the next datagram
+  fsa->fsa_incoming.bs_buf = NULL;
+  BIO_STATIC_SET_READ_SZ(&fsa->fsa_incoming, 0);
+  fsa->fsa_outgoing.bs_buf = fsa->fsa_pkt_out;
+  fsa->fsa_outgoing.bs_sz = -((ssize_t) sizeof(fsa->fsa_pkt_out));
+  fsa->fsa_outgoing.bs_ptr = 0;
+
+  BIO_static_set(SSL_get_rbio(ssl), &fsa->fsa_incoming);
+  BIO_static_set(SSL_get_wbio(ssl), &fsa->fsa_outgoing);
+
+  if ( eventloop_invoke_async(eventloop, &fsa->fsa_async) < 0 ) {
+    perror("flock_service_accept: eventloop_invoke_async");
+    __sync_fetch_and_sub(&st->fs_pending_accepts, 1);
+    goto error;
+  }
 
-  pthread_rwlock_wrlock(&st->fs_clients_mutex);
-  HASH_ADD(fscs_hash_ent, st->fs_clients_hash, fscs_addr, sizeof(kite_sock_addr), client_st);
-  pthread_rwlock_unlock(&st->fs_clients_mutex);
+  return;
 
   // Now attempt to send the packet. This may fail if there's no space
   // in the socket buffer, but this is okay.
@@ -1005,20 +1139,23 @@ static void flock_service_accept(struct flockservice *st, struct eventloop *even
     }
   }
 
+ error:
+  if ( ssl ) SSL_free(ssl);
+  if ( fsa ) free(fsa);
   return;
 
  openssl_error:
   ERR_print_errors_fp(stderr);
- error:
   if ( ssl ) SSL_free(ssl);
   if ( bio_in ) BIO_free(bio_in);
   if ( bio_out ) BIO_free(bio_out);
-  if ( client_st ) free(client_st);
 }
 
+static void flock_service_handle_packet(struct flockservice *st, struct eventloop *eventloop,
+                                        kite_sock_addr *datagram_addr);
+
 static void flock_service_handle_read(struct flockservice *st, struct eventloop *eventloop) {
   kite_sock_addr datagram_addr;
-  struct flocksvcclientstate *client = NULL;
 
   memset(&datagram_addr, 0, sizeof(datagram_addr));
 
@@ -1027,13 +1164,23 @@ static void flock_service_handle_read(struct flockservice *st, struct eventloop
     return;
   }
 
+  // With GRO, one receive may contain several datagrams from this peer
+  do {
+    flock_service_handle_packet(st, eventloop, &datagram_addr);
+  } while ( st->fs_use_gro && receive_next_coalesced_packet(st) );
+}
+
+static void flock_service_handle_packet(struct flockservice *st, struct eventloop *eventloop,
+                                        kite_sock_addr *datagram_addr) {
+  struct flocksvcclientstate *client = NULL;
+
   // Lookup address in hash table
-  HASH_FIND(fscs_hash_ent, st->fs_clients_hash, &datagram_addr, sizeof(datagram_addr), client);
+  HASH_FIND(fscs_hash_ent, st->fs_clients_hash, datagram_addr, sizeof(*datagram_addr), client);
   if ( !client ) {
     fprintf(stderr, "This is a new client\n");
 
     // Attempt to run SSL_accept on this data gram
-    flock_service_accept(st, eventloop, &datagram_addr);
+    flock_service_accept(st, eventloop, datagram_addr);
   } else {
     fprintf(stderr, "This is an old client\n");
 
@@ -1180,6 +1327,10 @@ void flockservice_fn(struct eventloop *el, int op, void *arg) {
     else
       fprintf(stderr, "flockservice_fn: Got event with bad type: %d\n", ev->fde_ev.ev_type);
     break;
+  case OP_FLOCKSERVICE_ACCEPT:
+    flock_service_finish_accept(STRUCT_FROM_BASE(struct flocksvcaccept, fsa_async,
+                                                 ((struct qdevent *) arg)->qde_sub));
+    break;
   default:
     fprintf(stderr, "flockservice_fn: Unknown op %d\n", op);
   }
@@ -42,7 +42,17 @@ struct flockservice {
 
   SSL_CTX *fs_ssl_ctx;
 
+  // Number of handshakes queued on the async pool
+  int fs_pending_accepts;
+
   char fs_incoming_packet[PKT_BUF_SZ];
+
+  // If UDP_GRO is enabled on fs_service_sk, one receive can return
+  // several datagrams from the same peer. They are kept here and
+  // copied into fs_incoming_packet one at a time.
+  int fs_use_gro;
+  size_t fs_gro_size, fs_gro_offs, fs_gro_seg_sz;
+  char fs_gro_packet[UDP_GRO_BUF_SIZE];
 };
 
 #define FS_SERVICE_MUTEX      0x1
@@ -9,16 +9,20 @@
 #include <fcntl.h>
 #include <ftw.h>
 #include <signal.h>
+#include <time.h>
 #include <sys/wait.h>
 #include <sys/socket.h>
+#include <sys/signalfd.h>
 #include <linux/prctl.h>
+#include <poll.h>
 
 #include "init_proto.h"
 #include "init_common.h"
+#include "hosts.h"
+#include "health.h"
 #include "util.h"
 
 #define START_SCRIPT_PATH "/app/start"
-#define HC_SCRIPT_PATH    "/app/hc"
 
 extern char **environ;
 
@@ -27,29 +31,15 @@ char *g_app_url;
 char *g_nix_closure;
 
 pid_t g_start_pid = 0;
-pid_t g_hc_pid = 0;
-int g_hc_retries = 0; // The number of times the health check errored
-sig_atomic_t g_alarm_rung = 0; // Set to 1 on SIGALRM
-
-struct host {
-  const char *domain;
-  const char *target;
-  DLIST(struct host) ls;
-};
-
-DLIST_HEAD(struct host) g_hosts;
-
-enum {
-  NOT_STARTED,
-  STARTING,
-  HC_HEALTHY,
-  HC_ERRORING
-} g_status;
-
-// Run the health check script every 30 seconds
-#define HEALTH_CHECK_INTERVAL 30
-#define HC_ERR_AND_FIXED_STS  128
-#define HC_MAX_RETRIES        7
+
+// The DNS responder for the kite namespace, or -1 if hosts are
+// written to /run/hosts instead
+int g_dns_sk = -1;
+
+// SIGCHLD is blocked, and read from here
+int g_signal_fd = -1;
+
+struct healthcheck g_health;
 
 void dbg_printf(const char *format, ...)
   __attribute__ ((format (printf, 1, 2)));
@@ -63,97 +53,6 @@ void dbg_printf(const char *format, ...) {
   va_end(ap);
 }
 
-void update_hosts() {
-  struct host *h, *tmp;
-  FILE *f;
-
-  f = fopen("/run/hosts.tmp", "wt");
-  if ( !f ) {
-    dbg_printf("Error opening /run/hosts.tmp: %s\n", strerror(errno));
-    return;
-  }
-
-  fprintf(f, "127.0.0.1 localhost\n");
-  fprintf(f, "::1 localhost\n");
-  fprintf(f, "127.0.0.1 %s.kite.local\n", g_app_url);
-  fprintf(f, "::1 %s.kite.local\n", g_app_url);
-
-  DLIST_ITER(&g_hosts, ls, h, tmp) {
-    fprintf(f, "%s %s.kite.local\n", h->target, h->domain);
-  }
-
-  fclose(f);
-
-  if ( rename("/run/hosts.tmp", "/run/hosts") < 0 ) {
-    perror("update_hosts: rename(\"/run/hosts.tmp\", \"/run/hosts\")");
-  }
-}
-
-int modhost(int dir, const char *dom, size_t dom_sz, const char *tgt, size_t tgt_sz) {
-  struct host *h, *tmp;
-  int found = 0;
-
-  DLIST_ITER(&g_hosts, ls, h, tmp) {
-    if ( strncmp(h->domain, dom, dom_sz) == 0 ) {
-      found = 1;
-      if ( dir < 0 ) {
-        DLIST_REMOVE(&g_hosts, ls, h);
-        free(h);
-      } else {
-        char *new_tgt;
-
-        new_tgt = realloc((char *) h->target, tgt_sz + 1);
-        if ( !new_tgt ) {
-          dbg_printf("Could not reallocate target\n");
-          return -1;
-        }
-
-        memcpy(new_tgt, tgt, tgt_sz);
-        new_tgt[tgt_sz] = '\0';
-        h->target = new_tgt;
-      }
-      break;
-    }
-  }
-
-  if ( dir >= 0 && !found ) {
-    char *new_dom, *new_tgt;
-    // Add a new entry
-    h = malloc(sizeof(*h));
-    if ( !h ) {
-      dbg_printf("Could not allocate host entry\n");
-      return -1;
-    }
-
-    DLIST_ENTRY_CLEAR(&h->ls);
-
-    h->domain = new_dom = malloc(dom_sz + 1);
-    if ( !new_dom ) {
-      free(h);
-      dbg_printf("Could not allocate new domain\n");
-      return -1;
-    }
-
-    h->target = new_tgt = malloc(tgt_sz + 1);
-    if ( !new_tgt ) {
-      free(new_dom);
-      free(h);
-      dbg_printf("Could not allocate new target\n");
-      return -1;
-    }
-
-    memcpy(new_dom, dom, dom_sz);
-    new_dom[dom_sz] = '\0';
-
-    memcpy(new_tgt, tgt, tgt_sz);
-    new_tgt[tgt_sz] = '\0';
-
-    DLIST_INSERT(&g_hosts, ls, h);
-  }
-
-  return found;
-}
-
 // Perform the run stork init command
 pid_t do_run(struct stkinitmsg *pkt, int sz, int *fds, int nfds, int *waitfd) {
   char *args, *end;
@@ -375,98 +274,85 @@ pid_t do_run(struct stkinitmsg *pkt, int sz, int *fds, int nfds, int *waitfd) {
 void run_start_script() {
   pid_t child = vfork();
   if ( child == 0 ) {
+    sigset_t unblocked;
+
+    sigfillset(&unblocked);
+    sigprocmask(SIG_UNBLOCK, &unblocked, NULL);
+
     execl(START_SCRIPT_PATH, "start", g_persona_id, NULL);
-    exit(2);
+    _exit(2);
   } else {
     fprintf(stderr, "started script with pid %d\n", child);
-    g_status = STARTING;
+    g_health.hc_status = STK_HEALTH_STARTING;
     g_start_pid = child;
   }
 }
 
-void do_healthcheck() {
-  if ( g_status == HC_HEALTHY || g_status == HC_ERRORING ) {
-    pid_t child = vfork();
-    if ( child < 0 ) {
-      perror("vfork");
-      exit(4);
-    } else if ( child == 0 ) {
-      execl(HC_SCRIPT_PATH, "hc", g_persona_id, NULL);
-      exit(2);
-    } else {
-      g_hc_retries++;
-      g_hc_pid = child;
-    }
-  }
-}
-
-void set_alarm() {
-  alarm(HEALTH_CHECK_INTERVAL);
-}
-
-void app_instance_sigalrm_handler(int sig) {
-  g_alarm_rung = 1;
-}
-
-void app_instance_sigchld_handler(int sig) {
-  int saved_errno = errno;
+static void reap_children() {
+  struct signalfd_siginfo si;
   pid_t pid;
   int sts;
 
-  static const char sig_msg[] = "App instance SIGCHLD";
-  write(STDERR_FILENO, sig_msg, strlen(sig_msg));
+  // Signals are coalesced, so this only says to look
+  while ( read(g_signal_fd, &si, sizeof(si)) == sizeof(si) );
 
-  do {
-    pid = waitpid(-1, &sts, WNOHANG);
+  while ( (pid = waitpid(-1, &sts, WNOHANG)) > 0 ) {
     if ( g_start_pid != 0 && pid == g_start_pid ) {
-      if ( sts == 0 ) {
-        set_alarm();
-        g_status = HC_HEALTHY;
-      } else {
-        static const char exit_msg[] = "App instance init exiting because start script returned error\n";
-        write(STDERR_FILENO, exit_msg, strlen(exit_msg));
-        exit(sts);
-      }
-    } else if ( g_hc_pid != 0 && pid == g_hc_pid ) {
-      g_hc_pid = 0;
-      if ( sts == 0 ) {
-        g_status = HC_HEALTHY;
-        g_hc_retries = 0;
-      } else if ( sts == HC_ERR_AND_FIXED_STS ) {
-        if ( g_status == HC_ERRORING && g_hc_retries >= HC_MAX_RETRIES ) {
-          static const char exit_msg[] = "App instance exiting because health check had to fix container too many times\n";
-          write(STDERR_FILENO, exit_msg, strlen(exit_msg));
-          exit(sts);
-        }
-        g_status = HC_ERRORING;
+      g_start_pid = 0;
+      if ( WIFEXITED(sts) && WEXITSTATUS(sts) == 0 ) {
+        health_start(&g_health);
       } else {
-        static const char exit_msg[] = "App instance exiting because health check fails\n";
-        write(STDERR_FILENO, exit_msg, strlen(exit_msg));
-        exit(sts);
+        dbg_printf("App instance init exiting because start script returned error\n");
+        exit(WIFEXITED(sts) ? WEXITSTATUS(sts) : EXIT_FAILURE);
       }
-    }
-  } while ( pid > 0 );
-
-  errno = saved_errno;
+    } else
+      health_child_exited(&g_health, pid, sts);
+  }
 }
 
-void setup_custom_signals() {
-  struct sigaction sa;
-  sa.sa_handler = &app_instance_sigchld_handler;
-  sigemptyset(&sa.sa_mask);
-  sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
-  if ( sigaction(SIGCHLD, &sa, 0) == -1 ) {
-    perror("sigaction(SIGCHLD, ...)");
-    exit(1);
+static int setup_signal_fd() {
+  sigset_t signals;
+
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGCHLD);
+  if ( sigprocmask(SIG_BLOCK, &signals, NULL) < 0 ) {
+    perror("sigprocmask SIG_BLOCK SIGCHLD");
+    return -1;
   }
 
-  sa.sa_handler = &app_instance_sigalrm_handler;
-  sigemptyset(&sa.sa_mask);
-  sa.sa_flags = 0;
-  if ( sigaction(SIGALRM, &sa, 0) == -1 ) {
-    perror("sigaction(SIGALRM, ...)");
-    exit(1);
+  g_signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+  if ( g_signal_fd < 0 ) {
+    perror("signalfd");
+    return -1;
   }
+
+  return 0;
+}
+
+static unsigned int health_seed() {
+  unsigned int seed = getpid() ^ time(NULL);
+  const char *c;
+
+  // Instances started at the same time should not check together
+  for ( c = g_persona_id; *c; ++c ) seed = seed * 31 + *c;
+  for ( c = g_app_url; *c; ++c ) seed = seed * 31 + *c;
+
+  return seed;
+}
+
+static int send_health() {
+  struct stkhealth rsp;
+  int n;
+
+  rsp.sh_status = g_health.hc_status;
+  rsp.sh_failures = g_health.hc_failures;
+  rsp.sh_checks = g_health.hc_checks;
+
+  do {
+    n = send(COMM, &rsp, sizeof(rsp), 0);
+  } while ( n < 0 && errno == EINTR );
+
+  return n;
 }
 
 static int clean_tmp_ent(const char *path, struct stat *info,
@@ -502,7 +388,8 @@ static void clear_tmp() {
 
 void usage() {
   fprintf(stderr, "app-instance-init - stork init process for app instance containers\n");
-  fprintf(stderr, "usage: app-instance-init <persona-id> <app-name> <app-domain>\n");
+  fprintf(stderr, "usage: app-instance-init <persona-id> <app-name> <app-domain> [<health-check> [<interval>]]\n");
+  fprintf(stderr, "   <health-check> is one of script, tcp:<port>, or http:<port><path>\n");
 }
 
 int main(int argc, char **argv) {
@@ -516,13 +403,10 @@ int main(int argc, char **argv) {
     return 1;
   }
 
-  DLIST_INIT(&g_hosts);
-
   g_persona_id = argv[1];
   g_app_url = argv[2];
   g_nix_closure = argv[3];
 
-  g_status = NOT_STARTED;
   fcntl(COMM, F_SETFD, FD_CLOEXEC);
 
   dbg_printf("starting\n");
@@ -531,6 +415,12 @@ int main(int argc, char **argv) {
 
   dbg_printf("closed all open files\n");
 
+  if ( health_init(&g_health, argc > 4 ? argv[4] : NULL, argc > 5 ? argv[5] : NULL,
+                   g_persona_id, health_seed()) < 0 ) {
+    usage();
+    return 1;
+  }
+
   dbg_printf("chroot to %s\n", g_nix_closure);
 
   if ( chroot(g_nix_closure) < 0 ) {
@@ -540,7 +430,17 @@ int main(int argc, char **argv) {
 
   dbg_printf("clearing /tmp\n");
   clear_tmp();
-  update_hosts();
+
+  hosts_init(g_app_url);
+  g_dns_sk = hosts_dns_open();
+  if ( g_dns_sk >= 0 && hosts_dns_redirect_resolver() < 0 ) {
+    close(g_dns_sk);
+    g_dns_sk = -1;
+  }
+
+  if ( g_dns_sk < 0 )
+    dbg_printf("could not start DNS responder. Writing hosts to " HOSTS_PATH "\n");
+  hosts_write_file(g_dns_sk < 0);
 
   // Set cwd to /kite
   if ( chdir("/kite/") < 0 ) {
@@ -551,7 +451,8 @@ int main(int argc, char **argv) {
   dbg_printf("Changed directory to /kite\n");
 
   setup_signals();
-  setup_custom_signals();
+  if ( setup_signal_fd() < 0 )
+    return 1;
 
   // The app instance init file needs to run and poll the application
   // instance. We launch the application by running the 'start'
@@ -559,8 +460,9 @@ int main(int argc, char **argv) {
   //
   // We wait asynchronously for the start script to report
   // success. Once the start script does report success, we
-  // periodically (every 15-30 seconds) verify that our service is
-  // healthy by running the health check script.
+  // periodically verify that our service is healthy, with the probe
+  // given on the command line (see health.h). By default, this runs
+  // the health check script.
   //
   // The health check script is run asynchronously. It ought to check
   // that all services are running, and launch any that are acting
@@ -578,8 +480,8 @@ int main(int argc, char **argv) {
   // If the health check script returns 0, we put ourselves in the
   // healthy state and continue processing.
   //
-  // The health check timeout is achieved through the use of alarm(2)
-  // function.
+  // Everything is driven from the poll below: the health check timer
+  // is a timerfd, and children are reaped when the signalfd says so.
 
   run_start_script();
 
@@ -599,7 +501,8 @@ int main(int argc, char **argv) {
   while ( 1 ) {
     pid_t child_pid;
     char cbuf[128];
-    int fds[3], nfds = 0, i, waitfd = -1, err;
+    int fds[3], nfds = 0, i, waitfd = -1, err, npfds;
+    struct pollfd pfds[5];
     struct cmsghdr *cmsg;
     struct iovec iov = { .iov_base = buf,
                          .iov_len = STK_MAX_PKT_SZ };
@@ -615,15 +518,36 @@ int main(int argc, char **argv) {
       .msg_controllen = sizeof(cbuf)
     };
 
+    pfds[0].fd = COMM;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = g_signal_fd;
+    pfds[1].events = POLLIN;
+    // poll ignores negative descriptors
+    pfds[2].fd = g_dns_sk;
+    pfds[2].events = POLLIN;
+    npfds = 3 + health_pollfds(&g_health, pfds + 3);
+
+    err = poll(pfds, npfds, -1);
+    if ( err < 0 ) {
+      if ( errno == EINTR ) continue;
+      perror("poll");
+      return 1;
+    }
+
+    if ( pfds[1].revents & POLLIN )
+      reap_children();
+
+    if ( pfds[2].revents & POLLIN )
+      hosts_dns_process(g_dns_sk);
+
+    health_process(&g_health, pfds + 3, npfds - 3);
+
+    if ( !pfds[0].revents ) continue;
+
     n = recvmsg(COMM, &msg, 0);
     if ( n == 0 ) break;
     else if ( n == -1 ) {
       if ( errno == EAGAIN || errno == EINTR ) {
-        if ( g_alarm_rung ) {
-          g_alarm_rung = 0;
-          do_healthcheck();
-          set_alarm();
-        }
         continue;
       } else {
         perror("recv");
@@ -693,10 +617,10 @@ int main(int argc, char **argv) {
                    pkt->un.modhost.dom_len, pkt->un.modhost.tgt_len);
         err = -1;
       } else {
-        err = modhost(pkt->un.modhost.dir,
-                      pkt->after, pkt->un.modhost.dom_len,
-                      pkt->after + pkt->un.modhost.dom_len,
-                      pkt->un.modhost.tgt_len);
+        err = hosts_modify(pkt->un.modhost.dir,
+                           pkt->after, pkt->un.modhost.dom_len,
+                           pkt->after + pkt->un.modhost.dom_len,
+                           pkt->un.modhost.tgt_len);
       }
 
       do {
@@ -708,7 +632,16 @@ int main(int argc, char **argv) {
         return 1;
       }
 
-      update_hosts();
+      if ( g_dns_sk < 0 )
+        hosts_write_file(1);
+
+      break;
+
+    case STK_REQ_HEALTH:
+      if ( send_health() < 0 ) {
+        perror("send");
+        return 1;
+      }
 
       break;
 
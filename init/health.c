@@ -0,0 +1,339 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "init_proto.h"
+#include "health.h"
+
+static void health_arm(struct healthcheck *hc, unsigned int ms) {
+  struct itimerspec its;
+
+  memset(&its, 0, sizeof(its));
+  its.it_value.tv_sec = ms / 1000;
+  its.it_value.tv_nsec = (ms % 1000) * 1000000;
+  // A zero it_value disarms the timer
+  if ( ms == 0 ) its.it_value.tv_nsec = 1;
+
+  if ( timerfd_settime(hc->hc_timer, 0, &its, NULL) < 0 )
+    perror("health_arm: timerfd_settime");
+}
+
+static unsigned int health_jitter(struct healthcheck *hc, unsigned int range_ms) {
+  if ( range_ms == 0 ) return 0;
+  return rand_r(&hc->hc_seed) % range_ms;
+}
+
+static void health_schedule_next(struct healthcheck *hc) {
+  unsigned int interval_ms = hc->hc_interval * 1000;
+  unsigned int jitter_ms = interval_ms * HEALTH_JITTER_PERCENT / 100;
+
+  health_arm(hc, interval_ms - jitter_ms + health_jitter(hc, 2 * jitter_ms + 1));
+}
+
+int health_init(struct healthcheck *hc, const char *spec, const char *interval,
+                const char *persona_id, unsigned int seed) {
+  memset(hc, 0, sizeof(*hc));
+  hc->hc_probe = HEALTH_PROBE_SCRIPT;
+  hc->hc_interval = HEALTH_DEFAULT_INTERVAL;
+  hc->hc_persona_id = persona_id;
+  hc->hc_timer = -1;
+  hc->hc_seed = seed;
+  hc->hc_status = STK_HEALTH_NOT_STARTED;
+  hc->hc_pid = 0;
+  hc->hc_sk = -1;
+
+  if ( spec && strcmp(spec, "script") != 0 ) {
+    const char *port_start;
+    char *port_end;
+    unsigned long port;
+
+    if ( strncmp(spec, "tcp:", 4) == 0 ) {
+      hc->hc_probe = HEALTH_PROBE_TCP;
+      port_start = spec + 4;
+    } else if ( strncmp(spec, "http:", 5) == 0 ) {
+      hc->hc_probe = HEALTH_PROBE_HTTP;
+      port_start = spec + 5;
+    } else {
+      fprintf(stderr, "health_init: unknown health check %s\n", spec);
+      return -1;
+    }
+
+    errno = 0;
+    port = strtoul(port_start, &port_end, 10);
+    if ( errno != 0 || port_end == port_start || port == 0 || port > 0xFFFF ) {
+      fprintf(stderr, "health_init: invalid port in %s\n", spec);
+      return -1;
+    }
+    hc->hc_port = port;
+
+    if ( hc->hc_probe == HEALTH_PROBE_TCP && *port_end != '\0' ) {
+      fprintf(stderr, "health_init: trailing characters in %s\n", spec);
+      return -1;
+    }
+
+    if ( hc->hc_probe == HEALTH_PROBE_HTTP ) {
+      const char *path = *port_end ? port_end : "/";
+      int n;
+
+      if ( path[0] != '/' || strpbrk(path, " \r\n") ||
+           strlen(path) >= sizeof(hc->hc_path) ) {
+        fprintf(stderr, "health_init: invalid path in %s\n", spec);
+        return -1;
+      }
+      strcpy(hc->hc_path, path);
+
+      n = snprintf(hc->hc_req, sizeof(hc->hc_req),
+                   "GET %s HTTP/1.0\r\nHost: localhost\r\nConnection: close\r\n\r\n",
+                   hc->hc_path);
+      if ( n >= sizeof(hc->hc_req) ) return -1;
+      hc->hc_req_sz = n;
+    }
+  }
+
+  if ( interval ) {
+    char *end;
+    unsigned long secs;
+
+    errno = 0;
+    secs = strtoul(interval, &end, 10);
+    if ( errno != 0 || *end != '\0' || secs < HEALTH_MIN_INTERVAL || secs > HEALTH_MAX_INTERVAL ) {
+      fprintf(stderr, "health_init: invalid interval %s\n", interval);
+      return -1;
+    }
+    hc->hc_interval = secs;
+  }
+
+  hc->hc_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if ( hc->hc_timer < 0 ) {
+    perror("health_init: timerfd_create");
+    return -1;
+  }
+
+  return 0;
+}
+
+void health_start(struct healthcheck *hc) {
+  hc->hc_status = STK_HEALTH_HEALTHY;
+  health_arm(hc, health_jitter(hc, hc->hc_interval * 1000));
+}
+
+static void health_finish(struct healthcheck *hc, int healthy, int fixed) {
+  if ( hc->hc_sk >= 0 ) {
+    close(hc->hc_sk);
+    hc->hc_sk = -1;
+  }
+  hc->hc_pid = 0;
+  hc->hc_running = 0;
+  hc->hc_checks++;
+
+  if ( healthy ) {
+    hc->hc_status = STK_HEALTH_HEALTHY;
+    hc->hc_failures = 0;
+  } else if ( fixed ) {
+    hc->hc_failures++;
+    if ( hc->hc_status == STK_HEALTH_ERRORING && hc->hc_failures >= HEALTH_MAX_RETRIES ) {
+      fprintf(stderr, "App instance exiting because health check had to fix container too many times\n");
+      exit(HEALTH_ERR_AND_FIXED_STS);
+    }
+    hc->hc_status = STK_HEALTH_ERRORING;
+  } else {
+    fprintf(stderr, "App instance exiting because health check fails\n");
+    exit(EXIT_FAILURE);
+  }
+
+  health_schedule_next(hc);
+}
+
+static void health_start_script(struct healthcheck *hc) {
+  pid_t child = vfork();
+  if ( child < 0 ) {
+    perror("health_start_script: vfork");
+    health_finish(hc, 0, 1);
+  } else if ( child == 0 ) {
+    sigset_t unblocked;
+
+    // The init takes SIGCHLD from a signalfd. The script should not
+    sigfillset(&unblocked);
+    sigprocmask(SIG_UNBLOCK, &unblocked, NULL);
+
+    execl(HEALTH_SCRIPT_PATH, "hc", hc->hc_persona_id, NULL);
+    _exit(2);
+  } else
+    hc->hc_pid = child;
+}
+
+static void health_start_connect(struct healthcheck *hc) {
+  struct sockaddr_in addr;
+
+  hc->hc_sk = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if ( hc->hc_sk < 0 ) {
+    perror("health_start_connect: socket");
+    health_finish(hc, 0, 1);
+    return;
+  }
+
+  hc->hc_connected = 0;
+  hc->hc_sent = hc->hc_rsp_sz = 0;
+
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(hc->hc_port);
+  if ( connect(hc->hc_sk, (struct sockaddr *) &addr, sizeof(addr)) < 0 &&
+       errno != EINPROGRESS ) {
+    health_finish(hc, 0, 1);
+    return;
+  }
+}
+
+static void health_begin(struct healthcheck *hc) {
+  unsigned int timeout = HEALTH_PROBE_TIMEOUT;
+
+  if ( timeout > hc->hc_interval ) timeout = hc->hc_interval;
+
+  hc->hc_running = 1;
+  health_arm(hc, timeout * 1000);
+
+  if ( hc->hc_probe == HEALTH_PROBE_SCRIPT )
+    health_start_script(hc);
+  else
+    health_start_connect(hc);
+}
+
+static void health_timed_out(struct healthcheck *hc) {
+  fprintf(stderr, "Health check timed out\n");
+
+  // The script is reaped later, by which time we have forgotten it
+  if ( hc->hc_pid > 0 )
+    kill(hc->hc_pid, SIGKILL);
+
+  health_finish(hc, 0, 1);
+}
+
+// Returns 1 if the response is complete, 0 if more is needed
+static int health_http_response(struct healthcheck *hc, int *healthy) {
+  int major, minor, code;
+  char *eol;
+
+  eol = memchr(hc->hc_rsp, '\n', hc->hc_rsp_sz);
+  if ( !eol && hc->hc_rsp_sz < sizeof(hc->hc_rsp) - 1 ) return 0;
+
+  hc->hc_rsp[hc->hc_rsp_sz] = '\0';
+  *healthy = sscanf(hc->hc_rsp, "HTTP/%d.%d %d", &major, &minor, &code) == 3 &&
+    code >= 100 && code < 400;
+  return 1;
+}
+
+static void health_socket_event(struct healthcheck *hc, short revents) {
+  int err, healthy;
+  socklen_t err_sz = sizeof(err);
+  ssize_t n;
+
+  if ( !hc->hc_connected ) {
+    if ( !(revents & (POLLOUT | POLLERR | POLLHUP)) ) return;
+
+    if ( getsockopt(hc->hc_sk, SOL_SOCKET, SO_ERROR, &err, &err_sz) < 0 || err != 0 ) {
+      health_finish(hc, 0, 1);
+      return;
+    }
+
+    hc->hc_connected = 1;
+    if ( hc->hc_probe == HEALTH_PROBE_TCP ) {
+      health_finish(hc, 1, 0);
+      return;
+    }
+  }
+
+  if ( hc->hc_sent < hc->hc_req_sz ) {
+    n = send(hc->hc_sk, hc->hc_req + hc->hc_sent, hc->hc_req_sz - hc->hc_sent, MSG_NOSIGNAL);
+    if ( n < 0 ) {
+      if ( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ) return;
+      health_finish(hc, 0, 1);
+      return;
+    }
+    hc->hc_sent += n;
+    return;
+  }
+
+  if ( !(revents & (POLLIN | POLLERR | POLLHUP)) ) return;
+
+  n = recv(hc->hc_sk, hc->hc_rsp + hc->hc_rsp_sz, sizeof(hc->hc_rsp) - 1 - hc->hc_rsp_sz, 0);
+  if ( n < 0 ) {
+    if ( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ) return;
+    health_finish(hc, 0, 1);
+  } else if ( n == 0 ) {
+    // Closed before the status line was complete
+    if ( !health_http_response(hc, &healthy) ) healthy = 0;
+    health_finish(hc, healthy, !healthy);
+  } else {
+    hc->hc_rsp_sz += n;
+    if ( health_http_response(hc, &healthy) )
+      health_finish(hc, healthy, !healthy);
+  }
+}
+
+int health_pollfds(struct healthcheck *hc, struct pollfd *pfds) {
+  int n = 0;
+
+  if ( hc->hc_timer < 0 ) return 0;
+
+  pfds[n].fd = hc->hc_timer;
+  pfds[n].events = POLLIN;
+  pfds[n].revents = 0;
+  n++;
+
+  if ( hc->hc_sk >= 0 ) {
+    pfds[n].fd = hc->hc_sk;
+    pfds[n].events = hc->hc_connected && hc->hc_sent >= hc->hc_req_sz ? POLLIN : POLLOUT;
+    pfds[n].revents = 0;
+    n++;
+  }
+
+  return n;
+}
+
+void health_process(struct healthcheck *hc, struct pollfd *pfds, int npfds) {
+  int i;
+
+  for ( i = 0; i < npfds; ++i ) {
+    if ( !pfds[i].revents ) continue;
+
+    if ( pfds[i].fd == hc->hc_timer ) {
+      uint64_t expirations;
+
+      if ( read(hc->hc_timer, &expirations, sizeof(expirations)) < 0 &&
+           errno != EAGAIN )
+        perror("health_process: read(timerfd)");
+
+      if ( hc->hc_running )
+        health_timed_out(hc);
+      else if ( hc->hc_status == STK_HEALTH_HEALTHY ||
+                hc->hc_status == STK_HEALTH_ERRORING )
+        health_begin(hc);
+    } else if ( hc->hc_sk >= 0 && pfds[i].fd == hc->hc_sk )
+      health_socket_event(hc, pfds[i].revents);
+  }
+}
+
+int health_child_exited(struct healthcheck *hc, pid_t pid, int sts) {
+  if ( hc->hc_pid == 0 || pid != hc->hc_pid ) return 0;
+
+  if ( WIFEXITED(sts) && WEXITSTATUS(sts) == 0 )
+    health_finish(hc, 1, 0);
+  else if ( WIFEXITED(sts) && WEXITSTATUS(sts) == HEALTH_ERR_AND_FIXED_STS )
+    health_finish(hc, 0, 1);
+  else
+    health_finish(hc, 0, 0);
+
+  return 1;
+}
@@ -0,0 +1,92 @@
+#ifndef __stork_init_health_H__
+#define __stork_init_health_H__
+
+#include <stdint.h>
+#include <poll.h>
+#include <sys/types.h>
+
+#include "init_proto.h"
+
+// Health checks for app-instance-init
+//
+// Checks are driven from the init's poll loop, by a timerfd, instead
+// of SIGALRM. Each check is one probe:
+//
+//   script            Run /app/hc, as before. 0 is healthy, 128
+//                     means a fix was made, anything else is fatal
+//   tcp:<port>        Connect to 127.0.0.1:<port>, in-process
+//   http:<port><path> GET <path> from 127.0.0.1:<port>, in-process.
+//                     1xx-3xx responses are healthy
+//
+// A failed tcp or http probe is treated like a script that had to
+// fix something: the instance is erroring, and it is brought down
+// after HEALTH_MAX_RETRIES in a row.
+//
+// Checks are spaced HEALTH_DEFAULT_INTERVAL seconds apart, unless the
+// manifest says otherwise. The first one is at a random point in the
+// first interval, and each later one is moved by up to
+// HEALTH_JITTER_PERCENT of the interval, so that instances started
+// together do not check in lock step.
+
+#define HEALTH_DEFAULT_INTERVAL 30
+#define HEALTH_MIN_INTERVAL     STK_HEALTH_MIN_INTERVAL
+#define HEALTH_MAX_INTERVAL     STK_HEALTH_MAX_INTERVAL
+// Time a probe has to finish, capped at the interval
+#define HEALTH_PROBE_TIMEOUT    10
+#define HEALTH_JITTER_PERCENT   10
+#define HEALTH_ERR_AND_FIXED_STS 128
+#define HEALTH_MAX_RETRIES      7
+
+#define HEALTH_SCRIPT_PATH      "/app/hc"
+#define HEALTH_HTTP_MAX_PATH    256
+
+#define HEALTH_PROBE_SCRIPT 1
+#define HEALTH_PROBE_TCP    2
+#define HEALTH_PROBE_HTTP   3
+
+struct healthcheck {
+  int hc_probe;
+  uint16_t hc_port;
+  char hc_path[HEALTH_HTTP_MAX_PATH];
+  unsigned int hc_interval;
+
+  const char *hc_persona_id;
+
+  int hc_timer;
+  unsigned int hc_seed;
+
+  // One of the STK_HEALTH_* codes
+  int hc_status;
+  uint32_t hc_failures;
+  uint32_t hc_checks;
+
+  // The probe in progress, if any
+  int hc_running;
+  pid_t hc_pid;
+  int hc_sk;
+  int hc_connected;
+  size_t hc_req_sz, hc_sent, hc_rsp_sz;
+  char hc_req[HEALTH_HTTP_MAX_PATH + 128];
+  char hc_rsp[32];
+};
+
+// Parse the probe description (spec) and interval, either of which
+// may be NULL. Returns 0 on success and -1 if either is invalid
+int health_init(struct healthcheck *hc, const char *spec, const char *interval,
+                const char *persona_id, unsigned int seed);
+
+// The start script succeeded. Begin checking
+void health_start(struct healthcheck *hc);
+
+// Fill in the descriptors to poll for. Returns the number filled in,
+// which is at most 2
+int health_pollfds(struct healthcheck *hc, struct pollfd *pfds);
+
+// Handle the descriptors filled in by health_pollfds
+void health_process(struct healthcheck *hc, struct pollfd *pfds, int npfds);
+
+// Called for every child reaped by the init. Returns 1 if pid was the
+// health check script
+int health_child_exited(struct healthcheck *hc, pid_t pid, int sts);
+
+#endif
@@ -0,0 +1,397 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <errno.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <uthash.h>
+
+#include "hosts.h"
+
+#define DNS_HEADER_SZ  12
+#define DNS_ANSWER_SZ  16
+#define DNS_MAX_NAME   255
+
+#define DNS_FLAG_QR    0x8000
+#define DNS_FLAG_AA    0x0400
+#define DNS_FLAG_RD    0x0100
+#define DNS_OPCODE(f)  (((f) >> 11) & 0xF)
+
+#define DNS_RCODE_FORMERR  1
+#define DNS_RCODE_NXDOMAIN 3
+#define DNS_RCODE_NOTIMP   4
+#define DNS_RCODE_REFUSED  5
+
+#define DNS_TYPE_A     1
+#define DNS_TYPE_ANY   255
+#define DNS_CLASS_IN   1
+
+struct host {
+  UT_hash_handle hh;
+
+  char *target;
+  // Set if target is an IPv4 address, which the responder can serve
+  int has_addr;
+  struct in_addr addr;
+
+  char domain[];
+};
+
+static struct host *g_hosts_table = NULL;
+static const char *g_hosts_self = NULL;
+
+void hosts_init(const char *self) {
+  g_hosts_self = self;
+}
+
+static void hosts_lower(char *s, size_t sz) {
+  size_t i;
+  for ( i = 0; i < sz; ++i )
+    s[i] = tolower((unsigned char) s[i]);
+}
+
+static int hosts_set_target(struct host *h, const char *tgt, size_t tgt_sz) {
+  char *new_tgt;
+
+  new_tgt = realloc(h->target, tgt_sz + 1);
+  if ( !new_tgt ) {
+    fprintf(stderr, "hosts_set_target: could not allocate target\n");
+    return -1;
+  }
+
+  memcpy(new_tgt, tgt, tgt_sz);
+  new_tgt[tgt_sz] = '\0';
+  h->target = new_tgt;
+  h->has_addr = inet_pton(AF_INET, new_tgt, &h->addr) == 1;
+
+  return 0;
+}
+
+int hosts_modify(int dir, const char *dom, size_t dom_sz, const char *tgt, size_t tgt_sz) {
+  char key[DNS_MAX_NAME + 1];
+  struct host *h;
+
+  if ( dom_sz == 0 || dom_sz > DNS_MAX_NAME ) {
+    fprintf(stderr, "hosts_modify: invalid domain length %zu\n", dom_sz);
+    return -1;
+  }
+
+  memcpy(key, dom, dom_sz);
+  hosts_lower(key, dom_sz);
+
+  HASH_FIND(hh, g_hosts_table, key, dom_sz, h);
+  if ( h ) {
+    if ( dir < 0 ) {
+      HASH_DELETE(hh, g_hosts_table, h);
+      free(h->target);
+      free(h);
+    } else if ( hosts_set_target(h, tgt, tgt_sz) < 0 )
+      return -1;
+
+    return 1;
+  }
+
+  if ( dir < 0 ) return 0;
+
+  h = malloc(sizeof(*h) + dom_sz + 1);
+  if ( !h ) {
+    fprintf(stderr, "hosts_modify: could not allocate host entry\n");
+    return -1;
+  }
+
+  h->target = NULL;
+  memcpy(h->domain, key, dom_sz);
+  h->domain[dom_sz] = '\0';
+
+  if ( hosts_set_target(h, tgt, tgt_sz) < 0 ) {
+    free(h);
+    return -1;
+  }
+
+  HASH_ADD(hh, g_hosts_table, domain, dom_sz, h);
+
+  return 0;
+}
+
+void hosts_write_file(int with_table) {
+  struct host *h, *tmp;
+  FILE *f;
+
+  f = fopen(HOSTS_PATH ".tmp", "wt");
+  if ( !f ) {
+    fprintf(stderr, "Error opening " HOSTS_PATH ".tmp: %s\n", strerror(errno));
+    return;
+  }
+
+  fprintf(f, "127.0.0.1 localhost\n");
+  fprintf(f, "::1 localhost\n");
+  if ( g_hosts_self ) {
+    fprintf(f, "127.0.0.1 %s." HOSTS_DOMAIN "\n", g_hosts_self);
+    fprintf(f, "::1 %s." HOSTS_DOMAIN "\n", g_hosts_self);
+  }
+
+  if ( with_table ) {
+    HASH_ITER(hh, g_hosts_table, h, tmp) {
+      fprintf(f, "%s %s." HOSTS_DOMAIN "\n", h->target, h->domain);
+    }
+  }
+
+  fclose(f);
+
+  if ( rename(HOSTS_PATH ".tmp", HOSTS_PATH) < 0 ) {
+    perror("hosts_write_file: rename(\"" HOSTS_PATH ".tmp\", \"" HOSTS_PATH "\")");
+  }
+}
+
+static int hosts_loopback_up(int sk) {
+  struct ifreq ifr;
+
+  memset(&ifr, 0, sizeof(ifr));
+  strcpy(ifr.ifr_name, "lo");
+
+  if ( ioctl(sk, SIOCGIFFLAGS, &ifr) < 0 ) {
+    perror("hosts_loopback_up: SIOCGIFFLAGS");
+    return -1;
+  }
+
+  if ( ifr.ifr_flags & IFF_UP ) return 0;
+
+  ifr.ifr_flags |= IFF_UP;
+  if ( ioctl(sk, SIOCSIFFLAGS, &ifr) < 0 ) {
+    perror("hosts_loopback_up: SIOCSIFFLAGS");
+    return -1;
+  }
+
+  return 0;
+}
+
+int hosts_dns_open() {
+  struct sockaddr_in addr;
+  int sk;
+
+  sk = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if ( sk < 0 ) {
+    perror("hosts_dns_open: socket");
+    return -1;
+  }
+
+  if ( hosts_loopback_up(sk) < 0 ) {
+    close(sk);
+    return -1;
+  }
+
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(HOSTS_DNS_PORT);
+  if ( bind(sk, (struct sockaddr *) &addr, sizeof(addr)) < 0 ) {
+    perror("hosts_dns_open: bind");
+    close(sk);
+    return -1;
+  }
+
+  return sk;
+}
+
+int hosts_dns_redirect_resolver() {
+  char line[512];
+  FILE *in, *out;
+
+  out = fopen(HOSTS_RUN_RESOLV, "wt");
+  if ( !out ) {
+    perror("hosts_dns_redirect_resolver: fopen(" HOSTS_RUN_RESOLV ")");
+    return -1;
+  }
+
+  fprintf(out, "nameserver 127.0.0.1\n");
+
+  // The original name servers follow ours. The responder refuses
+  // names outside kite.local, so the resolver asks them next
+  in = fopen(HOSTS_RESOLV_CONF, "rt");
+  if ( in ) {
+    while ( fgets(line, sizeof(line), in) )
+      fputs(line, out);
+    fclose(in);
+  }
+
+  if ( fchmod(fileno(out), 0644) < 0 )
+    perror("hosts_dns_redirect_resolver: fchmod");
+
+  if ( fclose(out) != 0 ) {
+    perror("hosts_dns_redirect_resolver: fclose");
+    return -1;
+  }
+
+  if ( mount(HOSTS_RUN_RESOLV, HOSTS_RESOLV_CONF, NULL, MS_BIND, NULL) < 0 ) {
+    perror("hosts_dns_redirect_resolver: mount");
+    return -1;
+  }
+
+  return 0;
+}
+
+// Parse the question name at ofs into name, lower-cased and dotted,
+// and return the offset following it, or -1 if it is malformed
+static int hosts_dns_name(const unsigned char *msg, int msg_sz, int ofs, char *name) {
+  int name_sz = 0;
+
+  while ( ofs < msg_sz ) {
+    int label_sz = msg[ofs++];
+    if ( label_sz == 0 ) {
+      name[name_sz] = '\0';
+      return ofs;
+    }
+
+    // Compression is never used in the question of a query
+    if ( label_sz > 63 || (ofs + label_sz) > msg_sz ||
+         (name_sz + label_sz + 1) > DNS_MAX_NAME )
+      return -1;
+
+    if ( name_sz > 0 ) name[name_sz++] = '.';
+    memcpy(name + name_sz, msg + ofs, label_sz);
+    hosts_lower(name + name_sz, label_sz);
+    name_sz += label_sz;
+    ofs += label_sz;
+  }
+
+  return -1;
+}
+
+static void hosts_dns_put16(unsigned char *p, uint16_t v) {
+  v = htons(v);
+  memcpy(p, &v, sizeof(v));
+}
+
+static uint16_t hosts_dns_get16(const unsigned char *p) {
+  uint16_t v;
+  memcpy(&v, p, sizeof(v));
+  return ntohs(v);
+}
+
+// Turn the query in msg into a response. Returns the size of the
+// response, or 0 if the query should be dropped
+static int hosts_dns_answer(unsigned char *msg, int msg_sz, int buf_sz) {
+  char name[DNS_MAX_NAME + 1];
+  size_t name_sz, suffix_sz = strlen(HOSTS_DOMAIN);
+  uint16_t flags, qtype, qclass;
+  struct in_addr addr;
+  struct host *h;
+  int ofs, rcode = 0, found = 0;
+
+  if ( msg_sz < DNS_HEADER_SZ ) return 0;
+
+  flags = hosts_dns_get16(msg + 2);
+  if ( flags & DNS_FLAG_QR ) return 0;
+
+  // Answers never carry authority or additional records
+  hosts_dns_put16(msg + 6, 0);
+  hosts_dns_put16(msg + 8, 0);
+  hosts_dns_put16(msg + 10, 0);
+
+  if ( DNS_OPCODE(flags) != 0 ) {
+    rcode = DNS_RCODE_NOTIMP;
+    goto header_only;
+  }
+
+  if ( hosts_dns_get16(msg + 4) != 1 ) {
+    rcode = DNS_RCODE_FORMERR;
+    goto header_only;
+  }
+
+  ofs = hosts_dns_name(msg, msg_sz, DNS_HEADER_SZ, name);
+  if ( ofs < 0 || (ofs + 4) > msg_sz ) {
+    rcode = DNS_RCODE_FORMERR;
+    goto header_only;
+  }
+
+  qtype = hosts_dns_get16(msg + ofs);
+  qclass = hosts_dns_get16(msg + ofs + 2);
+  ofs += 4;
+
+  name_sz = strlen(name);
+  if ( name_sz <= suffix_sz + 1 ||
+       name[name_sz - suffix_sz - 1] != '.' ||
+       strcmp(name + name_sz - suffix_sz, HOSTS_DOMAIN) != 0 ) {
+    rcode = DNS_RCODE_REFUSED;
+    goto respond;
+  }
+
+  name_sz -= suffix_sz + 1;
+  name[name_sz] = '\0';
+
+  if ( g_hosts_self && strcasecmp(name, g_hosts_self) == 0 ) {
+    addr.s_addr = htonl(INADDR_LOOPBACK);
+    found = 1;
+  } else {
+    HASH_FIND(hh, g_hosts_table, name, name_sz, h);
+    if ( h ) {
+      found = h->has_addr ? 1 : -1;
+      addr = h->addr;
+    }
+  }
+
+  if ( !found ) {
+    rcode = DNS_RCODE_NXDOMAIN;
+    goto respond;
+  }
+
+  // Other record types exist for no name, so those are answered with
+  // no records
+  if ( found > 0 && qclass == DNS_CLASS_IN &&
+       (qtype == DNS_TYPE_A || qtype == DNS_TYPE_ANY) &&
+       (ofs + DNS_ANSWER_SZ) <= buf_sz ) {
+    // Name is a pointer to the question
+    msg[ofs] = 0xC0;
+    msg[ofs + 1] = DNS_HEADER_SZ;
+    hosts_dns_put16(msg + ofs + 2, DNS_TYPE_A);
+    hosts_dns_put16(msg + ofs + 4, DNS_CLASS_IN);
+    // Addresses change whenever instances move, so nothing is cached
+    memset(msg + ofs + 6, 0, 4);
+    hosts_dns_put16(msg + ofs + 10, sizeof(addr));
+    memcpy(msg + ofs + 12, &addr, sizeof(addr));
+    ofs += DNS_ANSWER_SZ;
+
+    hosts_dns_put16(msg + 6, 1);
+  }
+
+ respond:
+  // We are the authority for kite.local only
+  hosts_dns_put16(msg + 2, DNS_FLAG_QR | (flags & DNS_FLAG_RD) | rcode |
+                  (rcode == DNS_RCODE_REFUSED ? 0 : DNS_FLAG_AA));
+  return ofs;
+
+ header_only:
+  hosts_dns_put16(msg + 2, DNS_FLAG_QR | (flags & DNS_FLAG_RD) | rcode);
+  hosts_dns_put16(msg + 4, 0);
+  return DNS_HEADER_SZ;
+}
+
+void hosts_dns_process(int sk) {
+  unsigned char msg[HOSTS_DNS_MAX_MSG + DNS_ANSWER_SZ];
+  struct sockaddr_in from;
+  socklen_t from_sz;
+  int n;
+
+  while ( 1 ) {
+    from_sz = sizeof(from);
+    n = recvfrom(sk, msg, HOSTS_DNS_MAX_MSG, 0, (struct sockaddr *) &from, &from_sz);
+    if ( n < 0 ) {
+      if ( errno == EINTR ) continue;
+      if ( errno != EAGAIN && errno != EWOULDBLOCK )
+        perror("hosts_dns_process: recvfrom");
+      return;
+    }
+
+    n = hosts_dns_answer(msg, n, sizeof(msg));
+    if ( n > 0 &&
+         sendto(sk, msg, n, 0, (struct sockaddr *) &from, from_sz) < 0 )
+      perror("hosts_dns_process: sendto");
+  }
+}
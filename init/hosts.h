@@ -0,0 +1,48 @@
+#ifndef __stork_init_hosts_H__
+#define __stork_init_hosts_H__
+
+#include <stddef.h>
+
+// Hosts in the kite namespace (<domain>.kite.local)
+//
+// Entries are kept in a hash table, updated by STK_REQ_MOD_HOST_ENTRY
+// messages, and served by a small DNS responder on 127.0.0.1:53. The
+// responder answers A queries for names in kite.local, and refuses
+// anything else, so that the resolver moves on to the next name
+// server.
+//
+// If the responder cannot be started, the table is written to
+// /run/hosts instead, as it was before.
+
+#define HOSTS_DOMAIN        "kite.local"
+#define HOSTS_PATH          "/run/hosts"
+#define HOSTS_RESOLV_CONF   "/etc/resolv.conf"
+#define HOSTS_RUN_RESOLV    "/run/resolv.conf"
+#define HOSTS_DNS_PORT      53
+#define HOSTS_DNS_MAX_MSG   512
+
+// self, if not NULL, is the domain of the container's own app, which
+// resolves to the loopback address
+void hosts_init(const char *self);
+
+// Add or update (dir >= 0) or remove (dir < 0) a host. Returns 1 if
+// the host existed, 0 if not, and -1 on error
+int hosts_modify(int dir, const char *dom, size_t dom_sz, const char *tgt, size_t tgt_sz);
+
+// Open the responder socket, bringing up the loopback interface if
+// needed. Returns the socket, or -1 on error
+int hosts_dns_open();
+
+// Point the resolver at the responder, by mounting a copy of
+// /etc/resolv.conf with 127.0.0.1 as the first name server. Only
+// for containers with their own mount namespace
+int hosts_dns_redirect_resolver();
+
+// Answer every query waiting on the responder socket
+void hosts_dns_process(int sk);
+
+// Write the hosts file. If with_table is 0, only the loopback entries
+// are written, and the rest is left to the responder
+void hosts_write_file(int with_table);
+
+#endif
@@ -28,10 +28,16 @@ in ((import <nixpkgs> {}).writeText "${config.kite.meta.slug}-manifest"
         nix-closure = closures;
         run-as-admin = config.kite.runAsAdmin;
         singleton = config.kite.singleton;
+        warm-containers = config.kite.warmContainers;
+        health-check = config.kite.healthCheck;
+        health-check-interval = config.kite.healthCheckInterval;
 
         version = "${builtins.toString config.kite.version.major}.${builtins.toString config.kite.version.minor}.${builtins.toString config.kite.version.revision}";
 
         bind-mounts = config.kite.bindMounts;
+
+        binary-caches = map (c: { inherit (c) url; keys = c.signatures; })
+                            (builtins.sort (a: b: a.priority < b.priority) config.kite.binaryCaches);
       })) // { toplevels = closures; }
 
 
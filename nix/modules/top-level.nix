@@ -31,7 +31,7 @@
     };
 
     kite.binaryCaches = mkOption {
-      type = types.attrsOf (types.submodule {
+      type = types.listOf (types.submodule {
         options = {
           url = mkOption {
             type = types.str;
@@ -39,8 +39,8 @@
           };
 
           signatures = mkOption {
-            type = types.str;
-            description = "Signatures for this cache";
+            type = types.listOf types.str;
+            description = "Public keys that sign this cache's paths (name:base64)";
           };
 
           type = mkOption {
@@ -50,7 +50,7 @@
 
           priority = mkOption {
             type = types.int;
-            description = "Priority of this cache";
+            description = "Priority of this cache. Caches with lower priorities are tried first";
           };
         };
       });
@@ -105,6 +105,37 @@
       '';
     };
 
+    kite.warmContainers = mkOption {
+      type = types.int;
+      default = 0;
+      description = ''
+        Number of idle containers the appliance keeps ready for new
+        instances of this app, so that launching one does not wait for
+        its container to be created.
+      '';
+    };
+
+    kite.healthCheck = mkOption {
+      type = types.string;
+      default = "script";
+      description = ''
+        How the appliance checks that instances of this app are healthy.
+
+        "script" runs the health check hook. "tcp:<port>" connects to
+        the port, and "http:<port><path>" expects a 1xx-3xx response
+        to a GET of the path.
+      '';
+    };
+
+    kite.healthCheckInterval = mkOption {
+      type = types.int;
+      default = 30;
+      description = ''
+        Seconds between health checks. Each instance moves its checks
+        by a little, so that instances do not check at the same time.
+      '';
+    };
+
     kite.systemPackages = mkOption {
       type = types.listOf types.package;
       default = [];
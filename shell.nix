@@ -60,7 +60,7 @@ let stdenv = pkgs.stdenv;
    curl-kite = pkgs.curl.override {
      c-aresSupport = true; sslSupport = true; idnSupport = true;
      scpSupport = false; gssSupport = true;
-     brotliSupport = true; openssl = pkgs.openssl_1_1_0;
+     brotliSupport = true; openssl = pkgs.openssl_1_1;
    };
 
    lksctp-tools-1-0-18 = pkgs.callPackage ./deploy/pkgs/lksctp-tools.nix { };
@@ -69,9 +69,9 @@ in pkgs.stdenv.mkDerivation {
   name = "stork-cpp";
 
   buildInputs = with pkgs; [
-    pkgconfig cmake gdb openssl_1_1_0.dev
+    pkgconfig cmake gdb openssl_1_1.dev
     uriparser nodejs-8_x
-    uthash zlib check
+    uthash zlib xz check
 
     ncat
 
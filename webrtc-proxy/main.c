@@ -8,14 +8,21 @@
 #include <assert.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <pthread.h>
+#include <getopt.h>
 #include <linux/sockios.h>
+#include <net/if.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <sys/socket.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
 #include <storkd_proto.h>
+#include <init_proto.h>
 
 #define SCTP_DEBUG 1
 //#include <usrsctp.h>
@@ -28,6 +35,20 @@
 #define SCTP_INTERLEAVING_SUPPORTED 125
 #endif
 
+#ifndef SCTP_PR_SUPPORTED
+#define SCTP_PR_SUPPORTED 113
+#define SCTP_PR_SCTP_TTL  0x0010
+#define SCTP_PR_SCTP_RTX  0x0020
+#endif
+
+// Stream schedulers (enum sctp_sched_type). Older headers don't have
+// the weighted fair queueing scheduler, so these are spelled out
+#define WRTC_SS_PRIO 1
+#define WRTC_SS_WFQ  4
+
+// WebRTC priority of a channel that did not give one (RFC 8831)
+#define WEBRTC_PRIO_NORMAL 256
+
 #ifndef WEBRTC_PROXY_DEBUG
 #define WEBRTC_PROXY_DEBUG 0
 #endif
@@ -90,8 +111,27 @@ struct stack_ent {
 //#define CONTROL_PROTO_LEN  7
 #define PROXY_BUF_SIZE  1024
 
+// Every epoll registration points at one of these, so that the event
+// loop can tell channel sockets, SCTP sockets and wakeups apart
+struct wrtcepollsrc {
+  uint8_t wes_type;
+};
+
+#define WRTC_EPOLL_CHAN   1
+#define WRTC_EPOLL_ASSOC  2
+#define WRTC_EPOLL_WAKEUP 3
+#define WRTC_EPOLL_TIMER  4
+#define WRTC_EPOLL_COMM   5
+#define WRTC_EPOLL_POOL_TIMER 6
+#define WRTC_EPOLL_POOLED 7
+
+struct wrtcassoc;
+
 typedef uint16_t wrcchanid;
 struct wrtcchan {
+  struct wrtcepollsrc wrc_epsrc;
+  struct wrtcassoc   *wrc_assoc;
+
   uint8_t  wrc_sts;
   wrcchanid wrc_chan_id;
 
@@ -105,6 +145,12 @@ struct wrtcchan {
   int      wrc_family;
   int      wrc_type;
 
+  // sinfo_flags and sinfo_timetolive used for data messages on
+  // SOCK_DGRAM channels. Set from the channel type when the socket is
+  // connected.
+  uint16_t wrc_pr_flags;
+  uint32_t wrc_pr_value;
+
   int      wrc_sk;
 
   // Messages we have received externally that have yet to be written locally
@@ -120,15 +166,31 @@ struct wrtcchan {
 
   struct timespec wrc_last_msg_sent, wrc_created_at;
 
+  // Index in the worker's retry heap (or -1), and the time of the
+  // next retry
+  int      wrc_retry_idx;
+  struct timespec wrc_retry_at;
+
   uint32_t wrc_flags;
 
-  // Stuff we've received locally but haven't written out over SCTP
+  // Control responses we've received locally but haven't written out
+  // over SCTP
   int wrc_proxy_buf_sz;
   char wrc_proxy_buf[PROXY_BUF_SIZE];
 
+  // Stream data we've received locally but haven't written out over
+  // SCTP. This is a ring buffer of wrc_ring_sz bytes, allocated when
+  // the channel first proxies data, and grown as needed up to the
+  // association's send buffer size.
+  char    *wrc_ring;
+  size_t   wrc_ring_sz, wrc_ring_head, wrc_ring_len;
+
   struct stack_ent wrc_closed_stack;
   struct stack_ent wrc_pending_reads;
   struct stack_ent wrc_reset_stack;
+
+  // Next channel in the association's free list
+  struct wrtcchan *wrc_next_free;
 };
 
 #define WRC_HAS_MESSAGE_PENDING(chan)                                   \
@@ -154,6 +216,7 @@ struct wrtcchan {
 #define WRC_NEEDS_CONN_OPENS_RSP 0x200
 #define WRC_SCM_IN_PROG      0x400
 #define WRC_NEEDS_CONNECT    0x800
+#define WRC_DROP_DGRAM       0x1000 // Discard the rest of the datagram in progress
 
 #define WEBRTC_CHANID(sid) (sid)
 #define WEBRTC_CLIENT_SID(chan_id) (chan_id)
@@ -211,41 +274,205 @@ struct stkcmsg {
 
 #define OUTGOING_BUF_SIZE    65536
 #define PACKET_BUF_SIZE      65536
+#define PROXY_RING_MIN_SIZE  16384
+#define PROXY_RING_MAX_SIZE  (4 * 1024 * 1024)
+#define PROXY_MAX_MSG_SIZE   16384 // Largest SCTP message we send on a stream channel
+#define PROXY_DGRAM_BATCH    32    // Datagrams proxied per wakeup on a datagram channel
 #define OPEN_APP_MAX_RETRIES 7
 #define MAX_EPOLL_EVENTS     16
 #define ADDR_DESC_TBL_SZ     1024
 #define DFL_EPOLL_EVENTS     (EPOLLIN | EPOLLRDHUP | EPOLLPRI | EPOLLONESHOT)
-
-// Global state
+#define MAX_WORKER_THREADS   64
+#define POOL_TICK_MILLIS     1000
+#define POOL_MAX_PER_DEST    16  // Default for -p
+#define POOL_MAX_SOCKETS     256 // Pooled sockets per worker, over all destinations
+#define POOL_MAX_IDLE_SECS   20  // Apps may time out idle connections, so recycle them before then
 
 #define SCTP_FUTURE_ASSOC    0
 
+struct wrtcworker;
+
+// An SCTP association and all the channels opened on it.
+//
+// In single-threaded mode, there is only one of these, and wa_sk is
+// the listening one-to-many socket. In multi-threaded mode, the
+// listening socket gets its own wrtcassoc (with WA_FLAG_LISTENER
+// set), and every new association is peeled off onto its own socket
+// and handed to a worker. Only the owning worker touches an
+// association after that.
+struct wrtcassoc {
+  struct wrtcepollsrc wa_epsrc;
+
+  int          wa_sk;
+  sctp_assoc_t wa_assoc_id;
+  uint32_t     wa_flags;
+
+  struct wrtcworker *wa_worker;
+  struct wrtcassoc  *wa_next;
+
+  // wa_channels holds wa_num_strms preallocated channels. Unused
+  // ones are kept on wa_free_chans. Open channels are found by
+  // stream id in wa_chans_by_sid.
+  int wa_num_strms;
+  struct wrtcchan *wa_channels;
+  struct wrtcchan *wa_free_chans;
+  struct wrtcchan **wa_chans_by_sid;
+
+  wrcchanid *wa_closing_chans;
+  int wa_closing_chans_pending;
+
+  // Stream reset request with room for every stream, filled in by
+  // perform_delayed_closes
+  struct sctp_reset_streams *wa_reset_req;
+
+  struct stack_ent wa_pending_free_channels;
+  struct stack_ent wa_pending_reads;
+  struct stack_ent wa_reset_in_progress;
+  int wa_reset_retries;
+
+  // Largest number of bytes we are waiting to write on wa_sk during
+  // this event loop iteration
+  int wa_needs_write_space;
+
+  // SO_SNDBUF of wa_sk. Channel ring buffers never grow beyond this
+  int wa_sndbuf;
+
+  // Stream scheduler in use on this association (WRTC_SS_*), or 0 if
+  // the kernel's default first-come first-served scheduler is used
+  int wa_sched;
+
+  // In shared mode, the session address this association (or
+  // listener) belongs to. Channel sockets are bound to it
+  struct in_addr wa_local_addr;
+};
+
+struct wrtcpooldest;
+
+// A TCP socket connected (or connecting) to a pool destination ahead
+// of any channel asking for it
+struct wrtcpooledsk {
+  struct wrtcepollsrc wps_epsrc;
+
+  struct wrtcpooldest *wps_dest;
+  struct wrtcpooledsk *wps_next;
+
+  int wps_sk;
+  int wps_connected;
+  struct timespec wps_since;
+};
+
+// A destination (app address and port, plus the session address in
+// shared mode) that channels have recently connected to.
+//
+// wpd_rate is a moving average of the opens per pool tick, in 1/256
+// units, and wpd_target is the number of sockets we try to keep
+// around, derived from it
+struct wrtcpooldest {
+  struct wrtcpooldest *wpd_next;
+
+  struct sockaddr_in wpd_sin;
+  struct in_addr     wpd_local_addr;
+
+  struct wrtcpooledsk *wpd_ready;
+  struct wrtcpooledsk *wpd_pending;
+  int wpd_ready_count, wpd_pending_count;
+
+  unsigned int wpd_rate;
+  int wpd_opens, wpd_target;
+
+  // Set when a pooled connect fails, so that we do not hammer an app
+  // that is down. Cleared on the next tick
+  int wpd_failed;
+};
+
+#define WA_FLAG_LISTENER 0x1
+#define WA_FLAG_CLOSED   0x2 // Freed by the worker at the end of the loop iteration
+
+// An epoll loop, with the associations it owns
+// A request from the main thread to close a removed session's
+// associations on a worker
+struct wrtcsessclose {
+  struct in_addr wsc_addr;
+  struct wrtcsessclose *wsc_next;
+};
+
+struct wrtcworker {
+  struct wrtcepollsrc ww_wakeup_src;
+  struct wrtcepollsrc ww_timer_src;
+
+  int       ww_epollfd;
+  int       ww_wakeup_fd;
+  pthread_t ww_thread;
+
+  // Channels waiting to retry a message, as a binary min-heap on
+  // wrc_retry_at. ww_timer_fd is armed for the earliest one
+  int       ww_timer_fd;
+  struct timespec ww_retry_armed;
+  struct wrtcchan **ww_retry_heap;
+  int       ww_retry_count, ww_retry_size;
+
+  // Associations handed over by the listener, but not yet armed, and
+  // session addresses whose associations should be closed
+  pthread_mutex_t   ww_mutex;
+  struct wrtcassoc *ww_incoming;
+  struct wrtcsessclose *ww_closing;
+
+  struct wrtcassoc *ww_assocs;
+  int ww_assoc_count;
+
+  // Pre-connected sockets for SCM_REQ_CONNECT. ww_pool_timer_fd
+  // ticks every POOL_TICK_MILLIS while there are any destinations
+  struct wrtcepollsrc  ww_pool_timer_src;
+  int                  ww_pool_timer_fd;
+  struct wrtcpooldest *ww_pool;
+  int                  ww_pool_sockets;
+};
+
+#define CHAN_EPOLLFD(chan) ((chan)->wrc_assoc->wa_worker->ww_epollfd)
+
+// Global state
+
 const char *g_capability = NULL;
 
-sctp_assoc_t g_webrtc_assoc = SCTP_FUTURE_ASSOC;
 int g_max_strms = 1024;
-int g_num_strms = 1024;
 
 int g_dbg_port = -1;
 
-struct wrtcchan *g_channels = NULL;
-struct wrtcchan **g_channel_htbl = NULL;
-struct stack_ent g_pending_free_channels = STACK_INIT;
-int g_channels_open = 0;
-
-wrcchanid *g_closing_chans = NULL;
-int g_closing_chans_pending = 0;
+// Number of worker threads. If 0, all associations are served from
+// the main thread
+int g_worker_count = 0;
+struct wrtcworker g_main_worker;
+struct wrtcworker *g_workers = NULL;
+
+// In shared mode, applianced asks us over COMM to listen on behalf of
+// each session, on the session's own address
+int g_shared = 0;
+struct wrtcepollsrc g_comm_src = { .wes_type = WRTC_EPOLL_COMM };
+
+// Largest number of pre-connected sockets kept per destination. If 0,
+// every SCM_REQ_CONNECT makes a fresh connection
+int g_pool_max = POOL_MAX_PER_DEST;
+
+// Each descriptor is only valid for the session address it was
+// handed out on. In shared mode, every session has its own address,
+// so one session cannot connect to an app that applianced only opened
+// for another.
+struct addrdesc {
+  uint32_t ad_local;
+  uint32_t ad_ip;
+};
 
-uint32_t g_address_table[ADDR_DESC_TBL_SZ];
+pthread_mutex_t g_address_mutex = PTHREAD_MUTEX_INITIALIZER;
+struct addrdesc g_address_table[ADDR_DESC_TBL_SZ];
 int g_address_next_desc = 0;
 
-int g_epollfd;
-
-struct stack_ent g_pending_reads = STACK_INIT;
-struct stack_ent g_reset_in_progress = STACK_INIT;
-int g_reset_retries = 0;
-
-static int receive_sctp(int srv);
+static int receive_sctp(struct wrtcassoc *wa);
+static void close_assoc(struct wrtcassoc *wa);
+void schedule_chan_retry(struct wrtcchan *chan);
+void unschedule_chan_retry(struct wrtcchan *chan);
+static void free_assoc(struct wrtcassoc *wa);
+struct wrtcassoc *alloc_assoc(int sk, struct wrtcworker *w, uint32_t flags);
+static void handle_comm();
 
 // Utilities
 
@@ -305,6 +532,25 @@ int connect_socket(struct wrtcchan *chan, struct sockaddr_in *sin) {
   if ( clock_gettime(CLOCK_REALTIME, &chan->wrc_last_msg_sent) < 0 ) {
     perror("connect_socket: clock_gettime");
   }
+  schedule_chan_retry(chan);
+
+  // Connect from the session's address, so that apps see the session
+  // rather than the shared proxy
+  if ( chan->wrc_assoc->wa_local_addr.s_addr != INADDR_ANY ) {
+    struct sockaddr_in local;
+
+    memset(&local, 0, sizeof(local));
+    local.sin_family = AF_INET;
+    local.sin_addr = chan->wrc_assoc->wa_local_addr;
+    if ( bind(chan->wrc_sk, (struct sockaddr *) &local, sizeof(local)) < 0 ) {
+      int saved_errno = errno;
+      perror("connect_socket: bind");
+      errno = saved_errno;
+      close(chan->wrc_sk);
+      chan->wrc_sk = 0;
+      return -1;
+    }
+  }
 
   log_printf("Will connect to %s:%d\n",
              inet_ntop(AF_INET, &sin->sin_addr, name, sizeof(name)),
@@ -329,34 +575,44 @@ int connect_socket(struct wrtcchan *chan, struct sockaddr_in *sin) {
 }
 
 // address utilities
-int get_address_descriptor(uint32_t ip) {
+//
+// The address table is shared by all workers, but entries are keyed on
+// the local address of the association that opened the app
+int get_address_descriptor(struct in_addr local, uint32_t ip) {
   int i = 0, ret = -1;
 
+  pthread_mutex_lock(&g_address_mutex);
   for ( i = 0; i < g_address_next_desc; ++i ) {
-    if ( g_address_table[i] == ip ) {
+    if ( g_address_table[i].ad_local == local.s_addr &&
+         g_address_table[i].ad_ip == ip ) {
       ret = i;
       goto done;
     }
   }
 
   if ( g_address_next_desc >= ADDR_DESC_TBL_SZ )
-    return -1;
+    goto done;
 
   ret = g_address_next_desc++;
-  g_address_table[i] = ip;
+  g_address_table[i].ad_local = local.s_addr;
+  g_address_table[i].ad_ip = ip;
 
  done:
+  pthread_mutex_unlock(&g_address_mutex);
   return ret;
 }
 
-int get_address_by_descriptor(int desc, uint32_t *ip) {
+int get_address_by_descriptor(struct in_addr local, int desc, uint32_t *ip) {
   int ret;
 
-  if ( desc < g_address_next_desc ) {
+  pthread_mutex_lock(&g_address_mutex);
+  if ( desc >= 0 && desc < g_address_next_desc &&
+       g_address_table[desc].ad_local == local.s_addr ) {
     ret = 1;
-    *ip = g_address_table[desc];
+    *ip = g_address_table[desc].ad_ip;
   } else
     ret = 0;
+  pthread_mutex_unlock(&g_address_mutex);
 
   return ret;
 }
@@ -379,92 +635,56 @@ int chan_has_more_proxying(struct wrtcchan *c) {
   return bytes_left || (c->wrc_flags & WRC_HAS_OUTGOING);
 }
 
-void insert_chan_in_htbl(struct wrtcchan *c) {
-  int hidx = c->wrc_chan_id % g_num_strms;
-  for ( ; g_channel_htbl[hidx]; hidx ++ );
-  g_channel_htbl[hidx] = c;
+struct wrtcchan *find_chan(struct wrtcassoc *wa, wrcchanid cid) {
+  if ( cid >= wa->wa_num_strms ) return NULL;
+  return wa->wa_chans_by_sid[cid];
 }
 
-struct wrtcchan *find_chan(wrcchanid cid) {
-  int hidx, first_idx, scan_count;
-  struct wrtcchan *ret;
+// Takes a channel off the free list and installs it at its stream
+// id. If a closing channel still holds the stream, it is replaced, and
+// will no longer be found by find_chan.
+struct wrtcchan *alloc_wrtc_chan(struct wrtcassoc *wa, wrcchanid chan_id) {
+  struct wrtcchan *ret = wa->wa_free_chans;
 
-  first_idx = cid % g_num_strms;
-  scan_count = 0;
-  for ( hidx = first_idx;
-        g_channel_htbl[hidx] && g_channel_htbl[hidx]->wrc_chan_id != cid;
-        ++ hidx ) {
-    if ( hidx == first_idx ) scan_count ++;
-    if ( scan_count > 1 ) break;
+  if ( chan_id >= wa->wa_num_strms ) {
+    fprintf(stderr, "alloc_wrtc_chan: stream %d out of range\n", chan_id);
+    return NULL;
   }
 
-  if ( scan_count > 1 ) ret = NULL;
-  else ret = g_channel_htbl[hidx];
-
-  return ret;
-}
-
-void remove_chan_from_tbl(struct wrtcchan *c) {
-  int hidx = c->wrc_chan_id % g_num_strms, jidx, kidx = 0;
-
-  // TODO test this
-  if ( g_channel_htbl[hidx] ) {
-    jidx = hidx;
-
-    while ( 1 ) {
-      g_channel_htbl[hidx] = NULL;
+  if ( !ret ) return NULL;
 
-      do {
-        jidx = (jidx + 1) % g_num_strms;
-        log_printf("remove_chan_from_tbl: hidx=%d jidx=%d kidx=%d; %p\n", hidx, jidx, kidx, g_channel_htbl[jidx]);
+  wa->wa_free_chans = ret->wrc_next_free;
+  ret->wrc_next_free = NULL;
 
-        if ( !g_channel_htbl[jidx] ) return;
+  ret->wrc_sts = WEBRTC_STS_VALID;
+  ret->wrc_chan_id = chan_id;
+  memset(&ret->wrc_label, 0, WEBRTC_NAME_MAX);
+  memset(&ret->wrc_proto, 0, WEBRTC_NAME_MAX);
+  ret->wrc_family = 0;
+  ret->wrc_type = 0;
+  ret->wrc_sk = 0;
+  ret->wrc_ctype = 0xFF;
 
-        kidx = g_channel_htbl[jidx]->wrc_chan_id % g_num_strms;
-      } while ( (hidx <= jidx) ?
-                ((hidx < kidx) && (kidx <= jidx)) :
-                ((hidx < jidx) || (kidx <= jidx)) );
-
-      g_channel_htbl[hidx] = g_channel_htbl[jidx];
-
-      hidx = jidx;
-    }
-  }
-}
+  CLEAR_STACK(&ret->wrc_closed_stack);
+  CLEAR_STACK(&ret->wrc_reset_stack);
+  CLEAR_STACK(&ret->wrc_pending_reads);
 
-// Allocates a new channel and returns it in a locked state
-struct wrtcchan *alloc_wrtc_chan(wrcchanid chan_id) {
-  int i = 0;
-  struct wrtcchan *ret = NULL;
-
-  for ( i = 0; i < g_num_strms; ++i ) {
-    if ( get_chan_sts(&g_channels[i]) == WEBRTC_STS_INVALID ) {
-      g_channels[i].wrc_sts = WEBRTC_STS_VALID;
-      g_channels[i].wrc_chan_id = chan_id;
-      memset(&g_channels[i].wrc_label, 0, WEBRTC_NAME_MAX);
-      memset(&g_channels[i].wrc_proto, 0, WEBRTC_NAME_MAX);
-      g_channels[i].wrc_family = 0;
-      g_channels[i].wrc_type = 0;
-      g_channels[i].wrc_sk = 0;
-      g_channels[i].wrc_ctype = 0xFF;
-
-      CLEAR_STACK(&(g_channels[i].wrc_closed_stack));
-      CLEAR_STACK(&(g_channels[i].wrc_reset_stack));
-      CLEAR_STACK(&(g_channels[i].wrc_pending_reads));
-
-      insert_chan_in_htbl(&g_channels[i]);
-
-      ret = &g_channels[i];
-      goto done;
-    }
-  }
+  wa->wa_chans_by_sid[chan_id] = ret;
 
- done:
   return ret;
 }
 
+// Returns the channel to the free list. The write buffer, and the
+// ring if it has not grown past PACKET_BUF_SIZE, are kept for the next
+// channel that uses this slot.
 void dealloc_wrtc_chan(struct wrtcchan *chan) {
-  remove_chan_from_tbl(chan);
+  struct wrtcassoc *wa = chan->wrc_assoc;
+
+  if ( chan->wrc_sts == WEBRTC_STS_INVALID ) return;
+
+  if ( wa->wa_chans_by_sid[chan->wrc_chan_id] == chan )
+    wa->wa_chans_by_sid[chan->wrc_chan_id] = NULL;
+  unschedule_chan_retry(chan);
 
   chan->wrc_sts = WEBRTC_STS_INVALID;
 
@@ -473,16 +693,25 @@ void dealloc_wrtc_chan(struct wrtcchan *chan) {
     //fprintf(stderr, "dealloc_wrtc_chan: closing sk %d\n", chan->wrc_sk);
   }
 
-  if ( chan->wrc_buffer ) {
-    free(chan->wrc_buffer);
-    chan->wrc_buffer = NULL;
+  chan->wrc_msg_sz = 0;
+
+  if ( chan->wrc_ring && chan->wrc_ring_sz > PACKET_BUF_SIZE ) {
+    free(chan->wrc_ring);
+    chan->wrc_ring = NULL;
+    chan->wrc_ring_sz = 0;
   }
+  chan->wrc_ring_head = chan->wrc_ring_len = 0;
+
+  chan->wrc_next_free = wa->wa_free_chans;
+  wa->wa_free_chans = chan;
 }
 
 void mark_channel_closed(struct wrtcchan *chan) {
+  struct wrtcassoc *wa = chan->wrc_assoc;
+
   chan->wrc_flags |= WRC_WRITE_CLOSED;
   //  fprintf(stderr, "mark_channel_closed: chnnel %d\n", chan->wrc_chan_id);
-  PUSH_STACK(&g_pending_free_channels, chan, wrc_closed_stack);
+  PUSH_STACK(&wa->wa_pending_free_channels, chan, wrc_closed_stack);
 }
 
 void force_close_channel(struct wrtcchan *chan) {
@@ -492,10 +721,10 @@ void force_close_channel(struct wrtcchan *chan) {
   }
 }
 
-void rsp_cmsg_error(int srv, struct wrtcchan *chan, uint8_t req, int rsperr) {
+void rsp_cmsg_error(struct wrtcchan *chan, uint8_t req, int rsperr) {
   struct stkcmsg msg;
   struct sctp_sndrcvinfo sri;
-  int err;
+  int srv = chan->wrc_assoc->wa_sk, err;
 
   log_printf("CMSG error: %d %d\n", chan->wrc_chan_id, rsperr);
 
@@ -506,7 +735,7 @@ void rsp_cmsg_error(int srv, struct wrtcchan *chan, uint8_t req, int rsperr) {
   sri.sinfo_stream = WEBRTC_SERVER_SID(chan->wrc_chan_id);
   sri.sinfo_ppid = htonl(WEBRTC_BINARY_PPID);
   sri.sinfo_context = chan->wrc_chan_id;
-  sri.sinfo_assoc_id = g_webrtc_assoc;
+  sri.sinfo_assoc_id = chan->wrc_assoc->wa_assoc_id;
 
   err = sctp_send(srv, (void *) &msg, sizeof(msg), &sri, 0);
   if ( err < 0 ) {
@@ -518,11 +747,11 @@ void rsp_cmsg_error(int srv, struct wrtcchan *chan, uint8_t req, int rsperr) {
 // void reset_wrc_chan(int srv, wrcchanid chan_id) {
 //   int i, open_ix = -1;
 //
-//   for ( i = 0; i < g_num_strms; ++i ) {
-//     if ( g_closing_chans[i] == 0xFFFF ) {
+//   for ( i = 0; i < wa->wa_num_strms; ++i ) {
+//     if ( wa->wa_closing_chans[i] == 0xFFFF ) {
 //       if ( open_ix == -1 )
 //         open_ix = i;
-//     } else if ( g_closing_chans[i] == chan_id ) {
+//     } else if ( wa->wa_closing_chans[i] == chan_id ) {
 //       open_ix = -2;
 //       break;
 //     }
@@ -530,45 +759,47 @@ void rsp_cmsg_error(int srv, struct wrtcchan *chan, uint8_t req, int rsperr) {
 //   if ( open_ix == -1 ) {
 //     fprintf(stderr, "WARNING: ran out of space in closing chans?\n");
 //   } else if ( open_ix >= 0 ) {
-//     g_closing_chans_pending++;
-//     g_closing_chans[open_ix] = chan_id;
+//     wa->wa_closing_chans_pending++;
+//     wa->wa_closing_chans[open_ix] = chan_id;
 //   }
 //   fprintf(stderr, "Marked %d for delayed close\n", chan_id);
 // }
 
-void do_not_close_channel(wrcchanid chan) {
+void do_not_close_channel(struct wrtcassoc *wa, wrcchanid chan) {
   int i = 0;
 
-  for ( i = 0; i < g_num_strms; ++i ) {
-    if ( g_closing_chans[i] == chan ) {
-      g_closing_chans[i] = 0xFFFF;
-      g_closing_chans_pending --;
+  if ( wa->wa_closing_chans_pending == 0 ) return;
+
+  for ( i = 0; i < wa->wa_num_strms; ++i ) {
+    if ( wa->wa_closing_chans[i] == chan ) {
+      wa->wa_closing_chans[i] = 0xFFFF;
+      wa->wa_closing_chans_pending --;
     }
   }
 }
 
 //void perform_delayed_resets(int srv) {
 //
-//  if ( g_closing_chans_pending ) {
+//  if ( wa->wa_closing_chans_pending ) {
 //    struct sctp_reset_streams *srs;
 //    int i, chan_ix;
-//    size_t buf_sz = sizeof(struct sctp_reset_streams) + sizeof(uint16_t) * g_closing_chans_pending;
+//    size_t buf_sz = sizeof(struct sctp_reset_streams) + sizeof(uint16_t) * wa->wa_closing_chans_pending;
 //    srs = malloc(buf_sz);
 //    assert(srs);
 //
 //    srs->srs_assoc_id = g_webrtc_assoc;
 //    srs->srs_flags = SCTP_STREAM_RESET_OUTGOING;
-//    srs->srs_number_streams = g_closing_chans_pending;
+//    srs->srs_number_streams = wa->wa_closing_chans_pending;
 //
-//    for ( i = 0, chan_ix = 0; i < g_num_strms; ++i ) {
-//      if ( g_closing_chans[i] != 0xFFFF ) {
-//        //        fprintf(stderr, "reset %d\n", g_closing_chans[i]);
-//        srs->srs_stream_list[chan_ix] = g_closing_chans[i];
+//    for ( i = 0, chan_ix = 0; i < wa->wa_num_strms; ++i ) {
+//      if ( wa->wa_closing_chans[i] != 0xFFFF ) {
+//        //        fprintf(stderr, "reset %d\n", wa->wa_closing_chans[i]);
+//        srs->srs_stream_list[chan_ix] = wa->wa_closing_chans[i];
 //        chan_ix ++;
 //      }
 //    }
 //
-//    assert(chan_ix == g_closing_chans_pending);
+//    assert(chan_ix == wa->wa_closing_chans_pending);
 //
 //    if ( setsockopt(srv, IPPROTO_SCTP, SCTP_RESET_STREAMS, srs, buf_sz) < 0 &&
 //         errno != EINPROGRESS ) {
@@ -579,39 +810,39 @@ void do_not_close_channel(wrcchanid chan) {
 //    } else {
 //      fprintf(stderr, "perform_delayed_resets: success\n");
 //
-//      g_closing_chans_pending = 0;
-//      memset(g_closing_chans, 0xFF, g_num_strms * sizeof(*g_closing_chans));
+//      wa->wa_closing_chans_pending = 0;
+//      memset(wa->wa_closing_chans, 0xFF, wa->wa_num_strms * sizeof(*wa->wa_closing_chans));
 //    }
 //    free(srs);
 //  }
 //}
 
 // Returns 0 if the close was performed. 1 if we need write ability on the socket
-void perform_delayed_closes(int srv) {
+void perform_delayed_closes(struct wrtcassoc *wa) {
   struct wrtcchan *chan;
+  int srv = wa->wa_sk;
 
-  if ( STACK_IS_EMPTY(&g_reset_in_progress) && !STACK_IS_EMPTY(&g_pending_free_channels) ) {
+  if ( STACK_IS_EMPTY(&wa->wa_reset_in_progress) && !STACK_IS_EMPTY(&wa->wa_pending_free_channels) ) {
     int total_cnt = 0, i = 0;
 
-    CONSUME_STACK(&g_pending_free_channels, chan, struct wrtcchan, wrc_closed_stack) {
+    CONSUME_STACK(&wa->wa_pending_free_channels, chan, struct wrtcchan, wrc_closed_stack) {
       // log_printf("Closing channel %d (delayed)\n", chan->wrc_chan_id);
-      PUSH_STACK(&g_reset_in_progress, chan, wrc_reset_stack);
+      PUSH_STACK(&wa->wa_reset_in_progress, chan, wrc_reset_stack);
       total_cnt++;
     }
 
     if ( total_cnt > 0 ) {
+      // Every channel is on the reset stack at most once, so this
+      // always fits
       int buf_sz = sizeof(struct sctp_reset_streams) + sizeof(uint16_t) * total_cnt;
-      struct sctp_reset_streams *srs = malloc(buf_sz);
-      if ( !srs ) {
-        fprintf(stderr, "webrtc-proxy: out of memory\n");
-        abort();
-      }
+      struct sctp_reset_streams *srs = wa->wa_reset_req;
+      assert(total_cnt <= wa->wa_num_strms);
 
-      srs->srs_assoc_id = g_webrtc_assoc;
+      srs->srs_assoc_id = wa->wa_assoc_id;
       srs->srs_flags = SCTP_STREAM_RESET_OUTGOING;
       srs->srs_number_streams = total_cnt;
 
-      READ_STACK(&g_reset_in_progress, chan, struct wrtcchan, wrc_reset_stack) {
+      READ_STACK(&wa->wa_reset_in_progress, chan, struct wrtcchan, wrc_reset_stack) {
         log_printf("Marking %d (sk %d) for deletion (i = %d, srs->stream_list=%p, sz=%d)\n", chan->wrc_chan_id, chan->wrc_sk, i, srs->srs_stream_list, buf_sz);
         srs->srs_stream_list[i] = chan->wrc_chan_id;
         i++;
@@ -624,23 +855,21 @@ void perform_delayed_closes(int srv) {
           //fprintf(stderr, "perform_delayed_closes: trying again later\n");
 
           // Put everything back
-          CONSUME_STACK(&g_reset_in_progress, chan, struct wrtcchan, wrc_reset_stack) {
-            PUSH_STACK(&g_pending_free_channels, chan, wrc_closed_stack);
+          CONSUME_STACK(&wa->wa_reset_in_progress, chan, struct wrtcchan, wrc_reset_stack) {
+            PUSH_STACK(&wa->wa_pending_free_channels, chan, wrc_closed_stack);
           }
         } else
           perror("sctp_setsockopt SCTP_RESET_STREAMS");
       } else {
         log_printf( "Successfully requested stream reset\n");
       }
-
-      free(srs);
     };
   }
 
   //  log_printf("We have now closed all delayed channels\n");
 }
 
-void process_strreset_ack(struct sctp_stream_reset_event *rse, int sz) {
+void process_strreset_ack(struct wrtcassoc *wa, struct sctp_stream_reset_event *rse, int sz) {
   int stream_list_sz = sz - sizeof(*rse);
   int stream_cnt = stream_list_sz / sizeof(rse->strreset_stream_list[0]);
   int i;
@@ -650,7 +879,7 @@ void process_strreset_ack(struct sctp_stream_reset_event *rse, int sz) {
   if ( sz != rse->strreset_length )
     fprintf(stderr, "process_strreset_ack: warning: length mismatch between header and recv()\n");
 
-  if ( rse->strreset_assoc_id != g_webrtc_assoc ) {
+  if ( rse->strreset_assoc_id != wa->wa_assoc_id ) {
     fprintf(stderr, "process_strreset_ack: received reset event for an unknown association\n");
     return;
   }
@@ -667,15 +896,15 @@ void process_strreset_ack(struct sctp_stream_reset_event *rse, int sz) {
 
   if ( rse->strreset_flags & SCTP_STREAM_RESET_FAILED ) {
     fprintf(stderr, "process_strreset_ack: stream reset failed. Retrying\n");
-    if ( g_reset_retries > 7 ) {
+    if ( wa->wa_reset_retries > 7 ) {
       fprintf(stderr, "process_strreset_ack: no more retries left. Aborting\n");
       abort();
     } else {
-      g_reset_retries++;
+      wa->wa_reset_retries++;
 
       // Move everything back to pending_free
-      CONSUME_STACK(&g_reset_in_progress, chan, struct wrtcchan, wrc_reset_stack) {
-        PUSH_STACK(&g_pending_free_channels, chan, wrc_closed_stack);
+      CONSUME_STACK(&wa->wa_reset_in_progress, chan, struct wrtcchan, wrc_reset_stack) {
+        PUSH_STACK(&wa->wa_pending_free_channels, chan, wrc_closed_stack);
       }
     }
 
@@ -683,9 +912,9 @@ void process_strreset_ack(struct sctp_stream_reset_event *rse, int sz) {
   }
 
   // Successful resets
-  g_reset_retries = 0;
+  wa->wa_reset_retries = 0;
 
-  CONSUME_STACK(&g_reset_in_progress, chan, struct wrtcchan, wrc_reset_stack) {
+  CONSUME_STACK(&wa->wa_reset_in_progress, chan, struct wrtcchan, wrc_reset_stack) {
     int channel_was_reset = 0;
 
     for ( i = 0; i < stream_cnt; ++i ) {
@@ -706,12 +935,12 @@ void process_strreset_ack(struct sctp_stream_reset_event *rse, int sz) {
   }
 
   CONSUME_STACK(&still_resetting, chan, struct wrtcchan, wrc_closed_stack) {
-    PUSH_STACK(&g_reset_in_progress, chan, wrc_reset_stack);
+    PUSH_STACK(&wa->wa_reset_in_progress, chan, wrc_reset_stack);
   }
 
   for ( i = 0; i < stream_cnt; ++i ) {
     if ( rse->strreset_stream_list[i] != 0xFFFF ) {
-      chan = find_chan(WEBRTC_CHANID(rse->strreset_stream_list[i]));
+      chan = find_chan(wa, WEBRTC_CHANID(rse->strreset_stream_list[i]));
       if ( !chan ) {
         log_printf("process_strreset_ack: received new stream reset for unopened channel %d\n",
                    rse->strreset_stream_list[i]);
@@ -733,12 +962,12 @@ void wait_for_write_on_chan(struct wrtcchan *chan) {
   int err;
 
   ev.events = DFL_EPOLL_EVENTS | EPOLLOUT;
-  ev.data.ptr = (void *) chan;
+  ev.data.ptr = (void *) &chan->wrc_epsrc;
 
   if ( chan->wrc_flags & WRC_WAIT_FOR_SCTP_OUT ) // Ignore HAS_OUTGOING because this is called to initiate a connect
     ev.events &= ~EPOLLIN;
 
-  err = epoll_ctl(g_epollfd, EPOLL_CTL_MOD, chan->wrc_sk, &ev);
+  err = epoll_ctl(CHAN_EPOLLFD(chan), EPOLL_CTL_MOD, chan->wrc_sk, &ev);
   if ( err == -1 ) {
     perror("epoll_ctl EPOLL_CTL_MOD write");
   }
@@ -751,6 +980,7 @@ void mark_channel_writable(struct wrtcchan *chan, int retries_left, int retry_mi
     chan->wrc_flags |= WRC_RETRY_MSG;
     chan->wrc_retries_left = retries_left;
     chan->wrc_retry_interval_millis = (retry_millis > 2) ? (retry_millis / 2) : 1;
+    schedule_chan_retry(chan);
   }
 }
 
@@ -771,7 +1001,7 @@ void signal_new_timeout() {
 
 void disarm_channel(struct wrtcchan *chan) {
   struct epoll_event ev; // Must be supplied in some kernels
-  int err = epoll_ctl(g_epollfd, EPOLL_CTL_DEL, chan->wrc_sk, &ev);
+  int err = epoll_ctl(CHAN_EPOLLFD(chan), EPOLL_CTL_DEL, chan->wrc_sk, &ev);
   if ( err < 0 ) {
     perror("epoll_ctl EPOLL_CTL_DEL");
   }
@@ -782,27 +1012,27 @@ void arm_channel(struct wrtcchan *chan) {
   int err;
 
   ev.events = DFL_EPOLL_EVENTS;
-  ev.data.ptr = (void *) chan;
+  ev.data.ptr = (void *) &chan->wrc_epsrc;
 
   if ( chan->wrc_flags & WRC_HAS_OUTGOING )
     ev.events |= EPOLLOUT;
 
   log_printf("Arming channel %d (fd %d) with %d\n", chan->wrc_chan_id, chan->wrc_sk, ev.events);
 
-  err = epoll_ctl(g_epollfd, EPOLL_CTL_ADD, chan->wrc_sk, &ev);
+  err = epoll_ctl(CHAN_EPOLLFD(chan), EPOLL_CTL_ADD, chan->wrc_sk, &ev);
   if ( err < 0 ) {
     perror("arm_channel: epoll_ctl EPOLL_CTL_ADD");
   }
 }
 
-void arm_sctp(int srv) {
+void arm_sctp(struct wrtcassoc *wa) {
   struct epoll_event ev;
   int err;
 
   ev.events = DFL_EPOLL_EVENTS;
-  ev.data.ptr = NULL;
+  ev.data.ptr = (void *) &wa->wa_epsrc;
 
-  err = epoll_ctl(g_epollfd, EPOLL_CTL_ADD, srv, &ev);
+  err = epoll_ctl(wa->wa_worker->ww_epollfd, EPOLL_CTL_ADD, wa->wa_sk, &ev);
   if ( err < 0 ) {
     perror("arm_sctp: epoll_ctl EPOLL_CTL_ADD");
   }
@@ -821,6 +1051,7 @@ void mark_channel_connecting(struct wrtcchan *chan,
   chan->wrc_msg_sz = sizeof(*pconn);
   chan->wrc_retries_left = retries;
   chan->wrc_retry_interval_millis = 200;
+  schedule_chan_retry(chan);
 
   memcpy(&pconn->wpc_sin, in, sizeof(pconn->wpc_sin));
 
@@ -832,6 +1063,7 @@ void mark_channel_connected(struct wrtcchan *chan) {
   chan->wrc_sts = WEBRTC_STS_CONNECTED;
   chan->wrc_flags &= ~(WRC_CONTROL | WRC_HAS_PENDING_CONN | WRC_RETRY_MSG | WRC_SCM_IN_PROG);
   chan->wrc_msg_sz = 0;
+  unschedule_chan_retry(chan);
 }
 
 void cancel_pending_writes(struct wrtcchan *chan) {
@@ -842,14 +1074,15 @@ void cancel_pending_writes(struct wrtcchan *chan) {
   chan->wrc_msg_sz = 0;
   chan->wrc_retries_left = 0;
   chan->wrc_retry_rsp = 0;
+  unschedule_chan_retry(chan);
 
   ev.events = DFL_EPOLL_EVENTS;
-  ev.data.ptr = (void *) chan;
+  ev.data.ptr = (void *) &chan->wrc_epsrc;
 
   if ( chan->wrc_flags & (WRC_WAIT_FOR_SCTP_OUT | WRC_HAS_PENDING_CONN) )
     ev.events &= ~EPOLLIN;
 
-  err = epoll_ctl(g_epollfd, EPOLL_CTL_MOD, chan->wrc_sk, &ev);
+  err = epoll_ctl(CHAN_EPOLLFD(chan), EPOLL_CTL_MOD, chan->wrc_sk, &ev);
   if ( err == -1 ) {
     perror("cancel_pending_writes: epoll_ctl");
   }
@@ -861,7 +1094,7 @@ void chan_sctp_sndrcvinfo(struct wrtcchan *chan, struct sctp_sndrcvinfo *si) {
   si->sinfo_flags = 0;
   si->sinfo_ppid = htonl(WEBRTC_BINARY_PPID);
   si->sinfo_context = chan->wrc_chan_id;
-  si->sinfo_assoc_id = g_webrtc_assoc;
+  si->sinfo_assoc_id = chan->wrc_assoc->wa_assoc_id;
 }
 
 int chan_supports_sk_type(struct wrtcchan *chan, int sk_type) {
@@ -878,6 +1111,64 @@ int chan_supports_sk_type(struct wrtcchan *chan, int sk_type) {
   }
 }
 
+// Datagrams on unordered channel types are sent unordered, and those
+// on partially reliable ones are abandoned after wrc_rel
+// retransmissions or milliseconds.
+void chan_set_pr_policy(struct wrtcchan *chan) {
+  chan->wrc_pr_flags = 0;
+  chan->wrc_pr_value = 0;
+
+  switch ( chan->wrc_ctype ) {
+  case DATA_CHANNEL_RELIABLE_UNORDERED:
+    chan->wrc_pr_flags = SCTP_UNORDERED;
+    break;
+  case DATA_CHANNEL_PARTIAL_RELIABLE_REXMIT_UNORDERED:
+    chan->wrc_pr_flags = SCTP_UNORDERED;
+    // fall through
+  case DATA_CHANNEL_PARTIAL_RELIABLE_REXMIT:
+    chan->wrc_pr_flags |= SCTP_PR_SCTP_RTX;
+    chan->wrc_pr_value = chan->wrc_rel;
+    break;
+  case DATA_CHANNEL_PARTIAL_RELIABLE_TIMED_UNORDERED:
+    chan->wrc_pr_flags = SCTP_UNORDERED;
+    // fall through
+  case DATA_CHANNEL_PARTIAL_RELIABLE_TIMED:
+    chan->wrc_pr_flags |= SCTP_PR_SCTP_TTL;
+    chan->wrc_pr_value = chan->wrc_rel;
+    break;
+  default:
+    break;
+  }
+}
+
+// Under weighted fair queueing, the WebRTC priority of a channel is
+// the weight of its stream. Under the priority scheduler, lower values
+// are sent first, so the priority is inverted. Streams of equal
+// priority are served round-robin.
+uint16_t chan_sched_value(int sched, uint16_t prio) {
+  if ( prio == 0 ) prio = WEBRTC_PRIO_NORMAL;
+
+  if ( sched == WRTC_SS_WFQ )
+    return prio;
+  else
+    return 0xFFFF - prio;
+}
+
+void set_chan_sched_value(struct wrtcchan *chan) {
+  struct wrtcassoc *wa = chan->wrc_assoc;
+  struct sctp_stream_value ss_prio;
+
+  if ( !wa->wa_sched ) return;
+
+  ss_prio.assoc_id = wa->wa_assoc_id;
+  ss_prio.stream_id = WEBRTC_SERVER_SID(chan->wrc_chan_id);
+  ss_prio.stream_value = chan_sched_value(wa->wa_sched, chan->wrc_prio);
+  if ( setsockopt(wa->wa_sk, IPPROTO_SCTP, SCTP_STREAM_SCHEDULER_VALUE,
+                  &ss_prio, sizeof(ss_prio)) < 0 ) {
+    perror("setsockopt SCTP_STREAM_SCHEDULER_VALUE");
+  }
+}
+
 const char *chan_status_str(uint8_t s) {
   switch (s) {
   case WEBRTC_STS_INVALID:   return "WEBRTC_STS_INVALID";
@@ -1023,11 +1314,11 @@ int stkcmsg_has_enough(struct stkcmsg *msg, int sz) {
   }
 }
 
-int receive_ctl_rsp(int srv, struct wrtcchan *chan) {
+int receive_ctl_rsp(struct wrtcchan *chan) {
 #if WEBRTC_PROXY_DEBUG
   char addr_buf[INET6_ADDRSTRLEN]; // For forwards compatibility
 #endif
-  int err, rsp_sz;
+  int srv = chan->wrc_assoc->wa_sk, err, rsp_sz;
   struct sctp_sndrcvinfo sri;
 
   struct stkdmsg *msg = (struct stkdmsg *) chan->wrc_proxy_buf;
@@ -1066,7 +1357,8 @@ int receive_ctl_rsp(int srv, struct wrtcchan *chan) {
 
           rsp.scm_type = SCM_RESPONSE | SCM_REQ_OPEN_APP;
           rsp_sz = SCM_OPENED_APP_RSP_SZ;
-          err = get_address_descriptor(msg->sm_data.sm_opened_app.sm_addr);
+          err = get_address_descriptor(chan->wrc_assoc->wa_local_addr,
+                                       msg->sm_data.sm_opened_app.sm_addr);
           if ( err < 0 ) {
             rsp.scm_type |= SCM_ERROR;
             rsp.data.scm_error = htonl(STKD_ERROR_NO_SPACE);
@@ -1121,78 +1413,210 @@ int receive_ctl_rsp(int srv, struct wrtcchan *chan) {
   return 0;
 }
 
-int proxy_stream_socket(int srv, struct wrtcchan *chan, int *events) {
-  int bytes_read, bytes_written, buffer_available;
+// Make sure the channel has a ring buffer. If the ring is empty and
+// the last read filled it, double its size, up to the SCTP send
+// buffer size, so that busy channels move more data per wakeup.
+static int chan_ring_reserve(struct wrtcchan *chan, int filled) {
+  size_t new_sz, max_sz = PROXY_RING_MAX_SIZE;
+  char *ring;
+
+  if ( chan->wrc_assoc->wa_sndbuf > 0 &&
+       chan->wrc_assoc->wa_sndbuf < max_sz )
+    max_sz = chan->wrc_assoc->wa_sndbuf;
+  if ( max_sz < PROXY_RING_MIN_SIZE )
+    max_sz = PROXY_RING_MIN_SIZE;
+
+  if ( !chan->wrc_ring )
+    new_sz = PROXY_RING_MIN_SIZE;
+  else if ( filled && chan->wrc_ring_len == 0 && (chan->wrc_ring_sz * 2) <= max_sz )
+    new_sz = chan->wrc_ring_sz * 2;
+  else
+    return 0;
 
-  buffer_available = PROXY_BUF_SIZE - chan->wrc_proxy_buf_sz;
-  log_printf("proxy_data stream %d\n", buffer_available);
-  assert(buffer_available >= 0);
+  ring = malloc(new_sz);
+  if ( !ring ) {
+    // Keep using the smaller ring, if we have one
+    if ( chan->wrc_ring ) return 0;
 
-  bytes_read = recv(chan->wrc_sk, chan->wrc_proxy_buf + chan->wrc_proxy_buf_sz,
-                    buffer_available, MSG_DONTWAIT);
-  if ( bytes_read < 0 ) {
-    if ( errno != EAGAIN && errno != EWOULDBLOCK ) {
-      perror("proxy_stream_socket: recv");
-      return -1;
-    }
-  } else if ( bytes_read == 0 ) {
-    log_printf("Did not read anything\n");
-    if ( chan->wrc_flags & WRC_READ_CLOSED ) {
-      if ( !chan_has_more_proxying(chan) ) {
-        mark_channel_closed(chan);
-        *events = 0;
-        return 0;
+    fprintf(stderr, "chan_ring_reserve: could not allocate %zu bytes\n", new_sz);
+    return -1;
+  }
+
+  if ( chan->wrc_ring ) free(chan->wrc_ring);
+  chan->wrc_ring = ring;
+
+  log_printf("Channel %d ring buffer is now %zu bytes\n", chan->wrc_chan_id, new_sz);
+  chan->wrc_ring_sz = new_sz;
+  chan->wrc_ring_head = 0;
+  return 0;
+}
+
+int proxy_stream_socket(struct wrtcchan *chan, int *events) {
+  int srv = chan->wrc_assoc->wa_sk, filled = 0;
+  ssize_t bytes_read = 0, bytes_written;
+  size_t space, tail, first;
+  struct iovec iov[2];
+
+  if ( chan_ring_reserve(chan, 0) < 0 )
+    return -1;
+
+  space = chan->wrc_ring_sz - chan->wrc_ring_len;
+  log_printf("proxy_data stream %zu\n", space);
+
+  if ( space > 0 ) {
+    // Read directly into the free part of the ring, which may wrap
+    tail = (chan->wrc_ring_head + chan->wrc_ring_len) % chan->wrc_ring_sz;
+    first = MIN(space, chan->wrc_ring_sz - tail);
+
+    iov[0].iov_base = chan->wrc_ring + tail;
+    iov[0].iov_len = first;
+    iov[1].iov_base = chan->wrc_ring;
+    iov[1].iov_len = space - first;
+
+    bytes_read = readv(chan->wrc_sk, iov, iov[1].iov_len ? 2 : 1);
+    if ( bytes_read < 0 ) {
+      if ( errno != EAGAIN && errno != EWOULDBLOCK ) {
+        perror("proxy_stream_socket: readv");
+        return -1;
+      }
+    } else if ( bytes_read == 0 ) {
+      log_printf("Did not read anything\n");
+      if ( chan->wrc_flags & WRC_READ_CLOSED ) {
+        if ( !chan_has_more_proxying(chan) ) {
+          mark_channel_closed(chan);
+          *events = 0;
+          return 0;
+        }
       }
+    } else {
+      chan->wrc_ring_len += bytes_read;
+      filled = (bytes_read == space);
+      log_printf("Received %zd bytes. Buffer is now %zu\n", bytes_read, chan->wrc_ring_len);
     }
-  } else {
-    chan->wrc_proxy_buf_sz += bytes_read;
-    log_printf("Received %d bytes. Buffer is now %d\n", bytes_read, chan->wrc_proxy_buf_sz);
   }
 
-  if ( chan->wrc_proxy_buf_sz > 0 ) {
+  if ( chan->wrc_ring_len > 0 ) {
     struct sctp_sndrcvinfo sri;
     chan_sctp_sndrcvinfo(chan, &sri);
 
-    bytes_written = sctp_send(srv, (void *)chan->wrc_proxy_buf, chan->wrc_proxy_buf_sz, &sri, MSG_DONTWAIT);
-    if ( bytes_written < 0 ) {
-      if ( errno == EAGAIN || errno == EWOULDBLOCK ) {
-	log_printf("Writing this packet would block, so we're requesting time\n");
+    // Send contiguous runs of the ring as individual messages until
+    // the ring is empty or SCTP has no more room
+    while ( chan->wrc_ring_len > 0 ) {
+      size_t msg_sz = MIN(chan->wrc_ring_len, chan->wrc_ring_sz - chan->wrc_ring_head);
+      if ( msg_sz > PROXY_MAX_MSG_SIZE ) msg_sz = PROXY_MAX_MSG_SIZE;
+
+      bytes_written = sctp_send(srv, chan->wrc_ring + chan->wrc_ring_head, msg_sz, &sri, MSG_DONTWAIT);
+      if ( bytes_written < 0 ) {
+        if ( errno == EAGAIN || errno == EWOULDBLOCK ) {
+          log_printf("Writing this packet would block, so we're requesting time\n");
+          chan->wrc_flags |= WRC_HAS_OUTGOING;
+          return MIN(chan->wrc_ring_len, PROXY_MAX_MSG_SIZE);
+        } else {
+          perror("proxy_stream_socket: sctp_send");
+          return -1;
+        }
+      } else if ( bytes_written == 0 ) {
         chan->wrc_flags |= WRC_HAS_OUTGOING;
-        assert(chan->wrc_proxy_buf_sz >= 0);
-        return chan->wrc_proxy_buf_sz;
-      } else {
-        perror("proxy_stream_socket: sctp_send");
-        return -1;
+        return MIN(chan->wrc_ring_len, PROXY_MAX_MSG_SIZE);
       }
-    } else if ( bytes_written < chan->wrc_proxy_buf_sz ) {
-      log_printf("Only able to write %d of %d bytes. Waiting\n", bytes_written, chan->wrc_proxy_buf_sz);
-      chan->wrc_flags |= WRC_HAS_OUTGOING;
-      chan->wrc_proxy_buf_sz -= bytes_written;
-      memmove(chan->wrc_proxy_buf, chan->wrc_proxy_buf + bytes_written, chan->wrc_proxy_buf_sz - bytes_written);
-      return chan->wrc_proxy_buf_sz;
-    } else {
-      chan->wrc_proxy_buf_sz = 0;
-      chan->wrc_flags &= ~WRC_HAS_OUTGOING;
-      return 0;
+
+      chan->wrc_ring_head = (chan->wrc_ring_head + bytes_written) % chan->wrc_ring_sz;
+      chan->wrc_ring_len -= bytes_written;
     }
+
+    chan->wrc_ring_head = 0;
+    chan->wrc_flags &= ~WRC_HAS_OUTGOING;
+
+    if ( chan_ring_reserve(chan, filled) < 0 )
+      return -1;
+
+    return 0;
   } else {
     log_printf("Nothing in buffer\n");
     return 0;
   }
 }
 
+// Each datagram read from the local socket goes out as exactly one
+// SCTP message, using the channel's partial reliability policy. If
+// SCTP has no room, the datagram is held in the ring and sent first
+// on the next wakeup. Nothing more is read until it goes out.
+int proxy_dgram_socket(struct wrtcchan *chan) {
+  int srv = chan->wrc_assoc->wa_sk, i;
+  ssize_t n;
+  struct sctp_sndrcvinfo sri;
+
+  if ( !chan->wrc_ring || chan->wrc_ring_sz < PACKET_BUF_SIZE ) {
+    if ( chan->wrc_ring ) free(chan->wrc_ring);
+
+    chan->wrc_ring = malloc(PACKET_BUF_SIZE);
+    if ( !chan->wrc_ring ) {
+      fprintf(stderr, "proxy_dgram_socket: could not allocate datagram buffer\n");
+      return -1;
+    }
+
+    chan->wrc_ring_sz = PACKET_BUF_SIZE;
+    chan->wrc_ring_head = chan->wrc_ring_len = 0;
+  }
+
+  chan_sctp_sndrcvinfo(chan, &sri);
+  sri.sinfo_flags = chan->wrc_pr_flags;
+  sri.sinfo_timetolive = chan->wrc_pr_value;
+
+  for ( i = 0; i < PROXY_DGRAM_BATCH; ++i ) {
+    if ( chan->wrc_ring_len == 0 ) {
+      n = recv(chan->wrc_sk, chan->wrc_ring, chan->wrc_ring_sz, MSG_DONTWAIT | MSG_TRUNC);
+      if ( n < 0 ) {
+        if ( errno == EAGAIN || errno == EWOULDBLOCK )
+          break;
+        else if ( errno == ECONNREFUSED )
+          // The application is not listening (yet). Not fatal for UDP
+          continue;
+
+        perror("proxy_dgram_socket: recv");
+        return -1;
+      } else if ( n == 0 ) {
+        log_printf("Dropping empty datagram on channel %d\n", chan->wrc_chan_id);
+        continue;
+      } else if ( n > chan->wrc_ring_sz ) {
+        log_printf("Dropping truncated datagram of %zd bytes on channel %d\n",
+                   n, chan->wrc_chan_id);
+        continue;
+      }
+
+      chan->wrc_ring_len = n;
+    }
+
+    n = sctp_send(srv, chan->wrc_ring, chan->wrc_ring_len, &sri, MSG_DONTWAIT);
+    if ( n < 0 ) {
+      if ( errno == EAGAIN || errno == EWOULDBLOCK ) {
+        log_printf("Datagram on channel %d would block, so we're requesting time\n",
+                   chan->wrc_chan_id);
+        return chan->wrc_ring_len;
+      } else {
+        perror("proxy_dgram_socket: sctp_send");
+        return -1;
+      }
+    } else if ( n == 0 )
+      return chan->wrc_ring_len;
+
+    chan->wrc_ring_len = 0;
+  }
+
+  return 0;
+}
+
 // proxy_buf is of size PROXY_BUF_SIZE
-int proxy_data(int srv, struct wrtcchan *chan, int *events) {
+int proxy_data(struct wrtcchan *chan, int *events) {
   if ( chan->wrc_flags & WRC_CONTROL ) {
-    return receive_ctl_rsp(srv, chan);
+    return receive_ctl_rsp(chan);
   } else {
     switch ( chan->wrc_type ) {
     case SOCK_DGRAM:
-      fprintf(stderr, "proxy_data: TODO dgram\n");
-      return -1; //return proxy_dgram_socket(srv, chan);
+      return proxy_dgram_socket(chan);
 
     case SOCK_STREAM:
-      return proxy_stream_socket(srv, chan, events);
+      return proxy_stream_socket(chan, events);
 
     default:
       fprintf(stderr, "Can't proxy data on unknown connection type %d\n", chan->wrc_type);
@@ -1202,10 +1626,10 @@ int proxy_data(int srv, struct wrtcchan *chan, int *events) {
   }
 }
 
-int send_connection_opens_rsp(int srv, struct wrtcchan *chan) {
+int send_connection_opens_rsp(struct wrtcchan *chan) {
   struct stkcmsg rsp;
   struct sctp_sndrcvinfo sri;
-  int err;
+  int srv = chan->wrc_assoc->wa_sk, err;
 
   rsp.scm_type = SCM_RESPONSE | SCM_REQ_CONNECT;
 
@@ -1224,7 +1648,7 @@ int send_connection_opens_rsp(int srv, struct wrtcchan *chan) {
     return 0;
 }
 
-void flush_chan(int srv, struct wrtcchan *chan, int *new_events, int *needs_write_space) {
+void flush_chan(struct wrtcchan *chan, int *new_events, int *needs_write_space) {
   int err, old_sk;
 
   if ( chan->wrc_flags & WRC_HAS_PENDING_CONN ) {
@@ -1255,7 +1679,7 @@ void flush_chan(int srv, struct wrtcchan *chan, int *new_events, int *needs_writ
 
       scm_error = translate_stk_connection_error(scm_error);
 
-      rsp_cmsg_error(srv, chan, SCM_REQ_CONNECT, scm_error);
+      rsp_cmsg_error(chan, SCM_REQ_CONNECT, scm_error);
       chan->wrc_flags &= ~(WRC_RETRY_MSG | WRC_HAS_PENDING_CONN);
 
       // TODO mark channel closed
@@ -1264,7 +1688,7 @@ void flush_chan(int srv, struct wrtcchan *chan, int *new_events, int *needs_writ
     } else if ( err == 0 ) {
       log_printf("Successfully opened channel %d\n", chan->wrc_chan_id);
       mark_channel_connected(chan);
-      err = send_connection_opens_rsp(srv, chan);
+      err = send_connection_opens_rsp(chan);
       if ( err < 0 ) {
         fprintf(stderr, "flush_chan: could not send connection opens response\n");
       } else if ( err > 0 ) {
@@ -1284,7 +1708,7 @@ void flush_chan(int srv, struct wrtcchan *chan, int *new_events, int *needs_writ
     log_printf("Flushing channel %d of type %s\n", chan->wrc_chan_id, sk_type_str(chan->wrc_type));
 
     if ( chan->wrc_flags & WRC_NEEDS_CONN_OPENS_RSP ) {
-      err = send_connection_opens_rsp(srv, chan);
+      err = send_connection_opens_rsp(chan);
       if ( err < 0 ) {
         fprintf(stderr, "flush_chan: could not send connection opens response\n");
         return;
@@ -1328,13 +1752,15 @@ void flush_chan(int srv, struct wrtcchan *chan, int *new_events, int *needs_writ
           log_printf("No more retries left for datagram\n");
           if ( chan->wrc_flags & WRC_ERROR_ON_RETRY ) {
             log_printf("An error was requested to be delivered on retry failure\n");
-            rsp_cmsg_error(srv, chan, chan->wrc_retry_rsp, STKD_ERROR_TEMP_UNAVAILABLE);
+            rsp_cmsg_error(chan, chan->wrc_retry_rsp, STKD_ERROR_TEMP_UNAVAILABLE);
           }
           chan->wrc_flags &= ~(WRC_RETRY_MSG | WRC_ERROR_ON_RETRY);
         } else {
           chan->wrc_retries_left--;
           chan->wrc_retry_interval_millis *= 2;
         }
+
+        schedule_chan_retry(chan);
       } else
         chan->wrc_msg_sz = 0;
       break;
@@ -1376,7 +1802,7 @@ void flush_chan(int srv, struct wrtcchan *chan, int *new_events, int *needs_writ
   }
 }
 
-void state_transition(int srv, struct wrtcchan *chan, int epev) {
+void state_transition(struct wrtcchan *chan, int epev) {
   // Perform necessary transitions
   if ( chan->wrc_sts == WEBRTC_STS_OPEN && (epev & EPOLLOUT) &&
        !(epev & EPOLLRDHUP) && !(epev & EPOLLHUP)) {
@@ -1384,12 +1810,12 @@ void state_transition(int srv, struct wrtcchan *chan, int epev) {
 
     mark_channel_connected(chan);
     // Typically, we want to send some kind of success msg here as well
-    send_connection_opens_rsp(srv, chan);
+    send_connection_opens_rsp(chan);
   }
 }
 
 // Run when we get a EPOLLRDHUP or EPOLLHUP on the socket
-int chan_disconnects(int srv, struct wrtcchan *chan, int triggers, int *evts) {
+int chan_disconnects(struct wrtcchan *chan, int triggers, int *evts) {
   int sockerr, cerr, err;
   socklen_t sockerrlen = sizeof(sockerr);
 
@@ -1418,13 +1844,14 @@ int chan_disconnects(int srv, struct wrtcchan *chan, int triggers, int *evts) {
         chan->wrc_retries_left--;
         chan->wrc_retry_interval_millis *= 2;
         chan->wrc_flags |= WRC_RETRY_MSG;
+        schedule_chan_retry(chan);
         log_printf("Marked channel %d for connection retry\n", chan->wrc_chan_id);
         *evts = 0; // This prevents a tight loop
         return 0;
       } else {
         chan->wrc_sts = WEBRTC_STS_VALID;
         chan->wrc_flags &= ~(WRC_RETRY_MSG | WRC_HAS_PENDING_CONN);
-        rsp_cmsg_error(srv, chan, SCM_REQ_CONNECT, cerr);
+        rsp_cmsg_error(chan, SCM_REQ_CONNECT, cerr);
         return -1;
       }
     }
@@ -1482,271 +1909,1165 @@ int chan_needs_retry(struct wrtcchan *chan, struct timespec *now,
     return 0;
 }
 
-int do_pending_proxies(int srv) {
-  struct wrtcchan *cur;
-  int err, ret = -1;
+// Retry scheduling
+//
+// Rather than scanning every channel on each loop iteration, each
+// worker keeps the channels with WRC_RETRY_MSG set in a min-heap
+// keyed on their next retry time, and sleeps on a timerfd until the
+// earliest one. Heap entries may go stale (for example, if the retry
+// flag is cleared); they are checked again when they expire.
 
-  //fprintf(stderr, "do pending proxies\n");
+static int chan_retry_deadline(struct wrtcchan *chan, struct timespec *when) {
+  struct timespec ri;
 
-  CONSUME_STACK(&g_pending_reads, cur, struct wrtcchan, wrc_pending_reads) {
-    int new_events = DFL_EPOLL_EVENTS;
+  if ( !(chan->wrc_flags & WRC_RETRY_MSG) || chan->wrc_retries_left == 0 )
+    return 0;
 
-    err = proxy_data(srv, cur, &new_events);
-    if ( err < 0 ) {
-      fprintf(stderr, "do_pending_reads: error while proxying data\n");
-    } else if ( err > 0 ) {
-      fprintf(stderr, "do_pending_reads: could not complete proxy for %d\n", cur->wrc_chan_id);
-      return err;
-    } else {
-      if ( new_events ) {
-        struct epoll_event ev;
-        ev.events = new_events;
-        ev.data.ptr = cur;
+  millis_to_timespec(&ri, chan->wrc_retry_interval_millis);
+  timespec_add(when, &chan->wrc_last_msg_sent, &ri);
 
-        if ( cur->wrc_flags & WRC_HAS_OUTGOING )
-          ev.events |= EPOLLOUT;
+  return 1;
+}
 
-        err = epoll_ctl(g_epollfd, EPOLL_CTL_MOD, cur->wrc_sk, &ev);
-        if ( err < 0 ) {
-          perror("do_pending_proxies: epoll_ctl");
-        } else {
-          ret = 0;
-        }
+static void retry_heap_set(struct wrtcworker *w, int i, struct wrtcchan *chan) {
+  w->ww_retry_heap[i] = chan;
+  chan->wrc_retry_idx = i;
+}
 
-        cur->wrc_flags &= ~WRC_WAIT_FOR_SCTP_OUT;
-      } else
-        ret = 0;
-    }
+static void retry_heap_up(struct wrtcworker *w, int i) {
+  struct wrtcchan *chan = w->ww_retry_heap[i];
+
+  while ( i > 0 ) {
+    int parent = (i - 1) / 2;
+    if ( !timespec_lt(&chan->wrc_retry_at, &w->ww_retry_heap[parent]->wrc_retry_at) )
+      break;
+
+    retry_heap_set(w, i, w->ww_retry_heap[parent]);
+    i = parent;
   }
 
-  return ret;
+  retry_heap_set(w, i, chan);
 }
 
-int main_loop(int srv) {
-  struct epoll_event evs[MAX_EPOLL_EVENTS];
-  int i, ev_cnt = 0, timeout = -1, err;
-  struct timespec now;
-  sigset_t block, old;
+static void retry_heap_down(struct wrtcworker *w, int i) {
+  struct wrtcchan *chan = w->ww_retry_heap[i];
 
-  fprintf(stderr, "WebRTC epoll thread starts on port %d\n", g_dbg_port);
+  while ( 1 ) {
+    int child = 2 * i + 1;
+    if ( child >= w->ww_retry_count ) break;
 
-  sigfillset(&block);
-  err = sigprocmask(SIG_SETMASK, &block, &old);
-  if ( err != 0 ) {
-    errno = err;
-    perror("sigmask SIG_SETMASK");
-    return 20;
-  }
+    if ( (child + 1) < w->ww_retry_count &&
+         timespec_lt(&w->ww_retry_heap[child + 1]->wrc_retry_at,
+                     &w->ww_retry_heap[child]->wrc_retry_at) )
+      child ++;
 
-  sigdelset(&old, SIGTERM);
-  sigdelset(&old, SIGINT);
-  sigdelset(&old, SIGQUIT);
-  sigdelset(&old, SIGHUP);
+    if ( !timespec_lt(&w->ww_retry_heap[child]->wrc_retry_at, &chan->wrc_retry_at) )
+      break;
 
-  g_epollfd = epoll_create1(EPOLL_CLOEXEC);
-  if ( g_epollfd < 0 ) {
-    perror("epoll_create1");
-    return 4;
+    retry_heap_set(w, i, w->ww_retry_heap[child]);
+    i = child;
   }
 
-  // We'll want subscriptions on the main SCTP socket
-  arm_sctp(srv);
+  retry_heap_set(w, i, chan);
+}
 
-  while (1) {
-    int ofs, needs_write_space = 0;
+void unschedule_chan_retry(struct wrtcchan *chan) {
+  struct wrtcworker *w = chan->wrc_assoc->wa_worker;
+  int i = chan->wrc_retry_idx;
 
-    log_printf("Epoll with timeout: %d\n", timeout);
-    ev_cnt = epoll_pwait(g_epollfd, evs, MAX_EPOLL_EVENTS, timeout, &old);
-    if ( ev_cnt == -1 ) {
-      if ( errno == EINTR ) {
-        log_printf("Received EPOLL interrupt\n");
-        continue;
-      } else {
-        perror("epoll_wait");
-        return 6;
-      }
-    }
-    log_printf("Finished epoll wait: %d\n", ev_cnt);
+  if ( i < 0 ) return;
 
-    timeout = -1;
+  chan->wrc_retry_idx = -1;
+  w->ww_retry_count--;
 
-    ofs = rand();
+  if ( i < w->ww_retry_count ) {
+    struct wrtcchan *moved = w->ww_retry_heap[w->ww_retry_count];
 
-    // Go over each event in the epoll and continue
-    for ( i = 0; i < ev_cnt; ++i ) {
-      struct epoll_event *ev = evs + ((i + ofs) % ev_cnt) ;
-      struct wrtcchan *chan = (struct wrtcchan *) ev->data.ptr;
-      int new_events = DFL_EPOLL_EVENTS;
+    retry_heap_set(w, i, moved);
+    retry_heap_up(w, i);
+    retry_heap_down(w, moved->wrc_retry_idx);
+  }
+}
 
-      if ( !chan ) {
-        log_printf("Got epoll for sctp: %08x %d %d %d\n",
-                   ev->events,
-                   ev->events & EPOLLIN,
-                   ev->events & EPOLLOUT,
-                   ev->events & EPOLLHUP);
-
-        if ( ev->events & EPOLLIN ) {
-          err = receive_sctp(srv);
-          if ( err < 0 ) {
-            fprintf(stderr, "Could not receive SCTP message\n");
-            return -1;
-          }
-        }
+// Call whenever the retry flag, interval, or last send time of a
+// channel changes
+void schedule_chan_retry(struct wrtcchan *chan) {
+  struct wrtcworker *w = chan->wrc_assoc->wa_worker;
+  struct timespec when;
 
-        if ( ev->events & EPOLLOUT ) {
-          perform_delayed_closes(srv);
+  if ( !chan_retry_deadline(chan, &when) ) {
+    unschedule_chan_retry(chan);
+    return;
+  }
 
-          err = do_pending_proxies(srv);
-          if ( err > needs_write_space )
-            needs_write_space = err;
-        }
+  chan->wrc_retry_at = when;
 
-        ev->events = DFL_EPOLL_EVENTS;
-        //fprintf(stderr, "Set SCTP trigger %d %d %d\n", !!needs_write_space,
-        //        !!g_pending_reads.next, !!g_pending_free_channels.next);
-        if ( needs_write_space ||
-             g_pending_reads.next ||
-             g_pending_free_channels.next )
-          ev->events |= EPOLLOUT;
-        err = epoll_ctl(g_epollfd, EPOLL_CTL_MOD, srv, ev);
-        if ( err < 0 ) {
-          perror("epoll_ctl EPOLL_CTL_MOD srv");
+  if ( chan->wrc_retry_idx < 0 ) {
+    if ( w->ww_retry_count >= w->ww_retry_size ) {
+      int new_size = w->ww_retry_size ? w->ww_retry_size * 2 : 64;
+      struct wrtcchan **new_heap = realloc(w->ww_retry_heap, sizeof(*new_heap) * new_size);
+      if ( !new_heap ) {
+        fprintf(stderr, "webrtc-proxy: out of memory\n");
+        abort();
+      }
+
+      w->ww_retry_heap = new_heap;
+      w->ww_retry_size = new_size;
+    }
+
+    retry_heap_set(w, w->ww_retry_count, chan);
+    w->ww_retry_count++;
+    retry_heap_up(w, chan->wrc_retry_idx);
+  } else {
+    retry_heap_up(w, chan->wrc_retry_idx);
+    retry_heap_down(w, chan->wrc_retry_idx);
+  }
+}
+
+// Arm the timer for the earliest retry, if it changed
+static void arm_retry_timer(struct wrtcworker *w) {
+  struct itimerspec its;
+
+  memset(&its, 0, sizeof(its));
+  if ( w->ww_retry_count > 0 )
+    its.it_value = w->ww_retry_heap[0]->wrc_retry_at;
+
+  if ( its.it_value.tv_sec == w->ww_retry_armed.tv_sec &&
+       its.it_value.tv_nsec == w->ww_retry_armed.tv_nsec )
+    return;
+
+  w->ww_retry_armed = its.it_value;
+
+  // A zero it_value disarms the timer
+  if ( timerfd_settime(w->ww_timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0 ) {
+    perror("timerfd_settime");
+  }
+}
+
+static void run_due_retries(struct wrtcworker *w) {
+  struct wrtcchan *chan;
+  struct timespec now;
+  uint64_t expirations;
+  int timeout = -1;
+
+  if ( read(w->ww_timer_fd, &expirations, sizeof(expirations)) < 0 &&
+       errno != EAGAIN )
+    perror("run_due_retries: read");
+
+  // The timer has expired, so it must be set again, even if the
+  // earliest deadline is unchanged
+  memset(&w->ww_retry_armed, 0, sizeof(w->ww_retry_armed));
+
+  if ( clock_gettime(CLOCK_REALTIME, &now) < 0 ) {
+    perror("clock_gettime now");
+    return;
+  }
+
+  while ( w->ww_retry_count > 0 &&
+          timespec_lt(&w->ww_retry_heap[0]->wrc_retry_at, &now) ) {
+    chan = w->ww_retry_heap[0];
+    unschedule_chan_retry(chan);
+
+    if ( chan_needs_retry(chan, &now, &timeout) ) {
+      log_printf("WebRTC channel is requesting retry %d\n", chan->wrc_chan_id);
+      if ( chan->wrc_flags & WRC_HAS_PENDING_CONN )
+        chan->wrc_flags |= WRC_NEEDS_CONNECT;
+      wait_for_write_on_chan(chan);
+    } else
+      schedule_chan_retry(chan);
+  }
+}
+
+// Connection pool
+//
+// Browsers open many channels to the same app at once, and every
+// SCM_REQ_CONNECT would otherwise wait for a fresh connect (and
+// possibly the retry timer). Each worker keeps a few connected
+// sockets per destination it has seen, and hands one straight to the
+// channel. How many is adapted every tick to the recent open rate.
+
+static void pool_arm_timer(struct wrtcworker *w, int on) {
+  struct itimerspec its;
+
+  memset(&its, 0, sizeof(its));
+  if ( on ) {
+    millis_to_timespec(&its.it_value, POOL_TICK_MILLIS);
+    its.it_interval = its.it_value;
+  }
+
+  if ( timerfd_settime(w->ww_pool_timer_fd, 0, &its, NULL) < 0 )
+    perror("pool_arm_timer: timerfd_settime");
+}
+
+static void pool_unlink_sk(struct wrtcpooledsk **list, struct wrtcpooledsk *ps) {
+  for ( ; *list; list = &(*list)->wps_next ) {
+    if ( *list == ps ) {
+      *list = ps->wps_next;
+      ps->wps_next = NULL;
+      return;
+    }
+  }
+}
+
+// Remove the socket from its destination. If close_sk is 0, the
+// socket is being handed to a channel, and is only removed from epoll
+static void pool_release_sk(struct wrtcworker *w, struct wrtcpooledsk *ps, int close_sk) {
+  struct wrtcpooldest *d = ps->wps_dest;
+  struct epoll_event ev; // Must be supplied in some kernels
+
+  if ( ps->wps_connected ) {
+    pool_unlink_sk(&d->wpd_ready, ps);
+    d->wpd_ready_count--;
+  } else {
+    pool_unlink_sk(&d->wpd_pending, ps);
+    d->wpd_pending_count--;
+  }
+  w->ww_pool_sockets--;
+
+  if ( close_sk )
+    close(ps->wps_sk);
+  else if ( epoll_ctl(w->ww_epollfd, EPOLL_CTL_DEL, ps->wps_sk, &ev) < 0 )
+    perror("pool_release_sk: epoll_ctl EPOLL_CTL_DEL");
+
+  free(ps);
+}
+
+// Start connections until the destination has wpd_target sockets
+static void pool_fill(struct wrtcworker *w, struct wrtcpooldest *d) {
+  struct wrtcpooledsk *ps;
+  struct epoll_event ev;
+  int sk, err;
+
+  while ( !d->wpd_failed &&
+          (d->wpd_ready_count + d->wpd_pending_count) < d->wpd_target &&
+          w->ww_pool_sockets < POOL_MAX_SOCKETS ) {
+    sk = mk_socket(SOCK_STREAM);
+    if ( sk < 0 ) {
+      d->wpd_failed = 1;
+      return;
+    }
+
+    if ( d->wpd_local_addr.s_addr != INADDR_ANY ) {
+      struct sockaddr_in local;
+
+      memset(&local, 0, sizeof(local));
+      local.sin_family = AF_INET;
+      local.sin_addr = d->wpd_local_addr;
+      if ( bind(sk, (struct sockaddr *) &local, sizeof(local)) < 0 ) {
+        perror("pool_fill: bind");
+        close(sk);
+        d->wpd_failed = 1;
+        return;
+      }
+    }
+
+    err = connect(sk, (struct sockaddr *) &d->wpd_sin, sizeof(d->wpd_sin));
+    if ( err < 0 && errno != EINPROGRESS ) {
+      perror("pool_fill: connect");
+      close(sk);
+      d->wpd_failed = 1;
+      return;
+    }
+
+    ps = calloc(1, sizeof(*ps));
+    if ( !ps ) {
+      close(sk);
+      return;
+    }
+
+    ps->wps_epsrc.wes_type = WRTC_EPOLL_POOLED;
+    ps->wps_dest = d;
+    ps->wps_sk = sk;
+    ps->wps_connected = err == 0;
+    if ( clock_gettime(CLOCK_MONOTONIC, &ps->wps_since) < 0 )
+      perror("pool_fill: clock_gettime");
+
+    if ( ps->wps_connected ) {
+      ps->wps_next = d->wpd_ready;
+      d->wpd_ready = ps;
+      d->wpd_ready_count++;
+    } else {
+      ps->wps_next = d->wpd_pending;
+      d->wpd_pending = ps;
+      d->wpd_pending_count++;
+    }
+    w->ww_pool_sockets++;
+
+    // We never read from a pooled socket. Anything the app sends
+    // first stays queued for the channel that takes it
+    ev.events = EPOLLRDHUP;
+    if ( !ps->wps_connected )
+      ev.events |= EPOLLOUT;
+    ev.data.ptr = (void *) &ps->wps_epsrc;
+    if ( epoll_ctl(w->ww_epollfd, EPOLL_CTL_ADD, sk, &ev) < 0 ) {
+      perror("pool_fill: epoll_ctl EPOLL_CTL_ADD");
+      pool_release_sk(w, ps, 1);
+      return;
+    }
+  }
+}
+
+static struct wrtcpooldest *pool_find_dest(struct wrtcworker *w, struct sockaddr_in *sin,
+                                           struct in_addr local) {
+  struct wrtcpooldest *d;
+
+  for ( d = w->ww_pool; d; d = d->wpd_next ) {
+    if ( d->wpd_sin.sin_addr.s_addr == sin->sin_addr.s_addr &&
+         d->wpd_sin.sin_port == sin->sin_port &&
+         d->wpd_local_addr.s_addr == local.s_addr )
+      return d;
+  }
+
+  d = calloc(1, sizeof(*d));
+  if ( !d ) return NULL;
+
+  memcpy(&d->wpd_sin, sin, sizeof(d->wpd_sin));
+  d->wpd_local_addr = local;
+
+  if ( !w->ww_pool )
+    pool_arm_timer(w, 1);
+
+  d->wpd_next = w->ww_pool;
+  w->ww_pool = d;
+
+  return d;
+}
+
+// Called for every stream connection a channel asks for. Returns a
+// connected socket from the pool, or -1 if there is none and the
+// caller should connect itself
+int pool_take(struct wrtcworker *w, struct sockaddr_in *sin, struct in_addr local) {
+  struct wrtcpooldest *d;
+  struct wrtcpooledsk *ps;
+  int sk = -1;
+
+  if ( g_pool_max <= 0 ) return -1;
+
+  d = pool_find_dest(w, sin, local);
+  if ( !d ) return -1;
+
+  d->wpd_opens++;
+
+  while ( sk < 0 && (ps = d->wpd_ready) ) {
+    char c;
+    int err;
+
+    // The app may have closed the connection since we last heard
+    err = recv(ps->wps_sk, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    if ( err == 0 || (err < 0 && errno != EAGAIN && errno != EWOULDBLOCK) ) {
+      pool_release_sk(w, ps, 1);
+      continue;
+    }
+
+    sk = ps->wps_sk;
+    pool_release_sk(w, ps, 0);
+  }
+
+  // Grow the pool mid-burst, rather than waiting for the next tick
+  if ( d->wpd_opens > d->wpd_target )
+    d->wpd_target = d->wpd_opens < g_pool_max ? d->wpd_opens : g_pool_max;
+
+  pool_fill(w, d);
+
+  return sk;
+}
+
+static void pooled_sk_event(struct wrtcworker *w, struct wrtcpooledsk *ps,
+                            struct epoll_event *ev) {
+  struct epoll_event new_ev;
+  int sk_err = 0;
+  socklen_t sk_err_sz = sizeof(sk_err);
+
+  if ( ps->wps_connected ||
+       (ev->events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) ) {
+    if ( !ps->wps_connected )
+      ps->wps_dest->wpd_failed = 1;
+    pool_release_sk(w, ps, 1);
+    return;
+  }
+
+  if ( getsockopt(ps->wps_sk, SOL_SOCKET, SO_ERROR, &sk_err, &sk_err_sz) < 0 ||
+       sk_err != 0 ) {
+    ps->wps_dest->wpd_failed = 1;
+    pool_release_sk(w, ps, 1);
+    return;
+  }
+
+  pool_unlink_sk(&ps->wps_dest->wpd_pending, ps);
+  ps->wps_dest->wpd_pending_count--;
+
+  ps->wps_connected = 1;
+  ps->wps_next = ps->wps_dest->wpd_ready;
+  ps->wps_dest->wpd_ready = ps;
+  ps->wps_dest->wpd_ready_count++;
+
+  new_ev.events = EPOLLRDHUP;
+  new_ev.data.ptr = (void *) &ps->wps_epsrc;
+  if ( epoll_ctl(w->ww_epollfd, EPOLL_CTL_MOD, ps->wps_sk, &new_ev) < 0 ) {
+    perror("pooled_sk_event: epoll_ctl EPOLL_CTL_MOD");
+    pool_release_sk(w, ps, 1);
+  }
+}
+
+// Update each destination's open rate and target, recycle sockets
+// that have been idle too long, and forget destinations nobody uses
+static void pool_tick(struct wrtcworker *w) {
+  struct wrtcpooldest *d, **dp;
+  struct wrtcpooledsk *ps, *next;
+  struct timespec now;
+  uint64_t expirations;
+
+  if ( read(w->ww_pool_timer_fd, &expirations, sizeof(expirations)) < 0 &&
+       errno != EAGAIN )
+    perror("pool_tick: read");
+
+  if ( clock_gettime(CLOCK_MONOTONIC, &now) < 0 ) {
+    perror("pool_tick: clock_gettime");
+    return;
+  }
+
+  for ( dp = &w->ww_pool; *dp; ) {
+    int ready_kept = 0;
+
+    d = *dp;
+
+    d->wpd_rate = d->wpd_rate - d->wpd_rate / 4 + (d->wpd_opens * 256) / 4;
+    d->wpd_opens = 0;
+    d->wpd_failed = 0;
+
+    d->wpd_target = (d->wpd_rate + 255) / 256;
+    if ( d->wpd_target > g_pool_max )
+      d->wpd_target = g_pool_max;
+
+    for ( ps = d->wpd_ready; ps; ps = next ) {
+      next = ps->wps_next;
+
+      if ( ready_kept >= d->wpd_target ||
+           (now.tv_sec - ps->wps_since.tv_sec) >= POOL_MAX_IDLE_SECS )
+        pool_release_sk(w, ps, 1);
+      else
+        ready_kept++;
+    }
+
+    if ( d->wpd_target == 0 &&
+         d->wpd_ready_count == 0 && d->wpd_pending_count == 0 ) {
+      *dp = d->wpd_next;
+      free(d);
+      continue;
+    }
+
+    pool_fill(w, d);
+
+    dp = &d->wpd_next;
+  }
+
+  if ( !w->ww_pool )
+    pool_arm_timer(w, 0);
+}
+
+int do_pending_proxies(struct wrtcassoc *wa) {
+  struct wrtcchan *cur;
+  int err, ret = -1;
+
+  //fprintf(stderr, "do pending proxies\n");
+
+  CONSUME_STACK(&wa->wa_pending_reads, cur, struct wrtcchan, wrc_pending_reads) {
+    int new_events = DFL_EPOLL_EVENTS;
+
+    err = proxy_data(cur, &new_events);
+    if ( err < 0 ) {
+      fprintf(stderr, "do_pending_reads: error while proxying data\n");
+    } else if ( err > 0 ) {
+      fprintf(stderr, "do_pending_reads: could not complete proxy for %d\n", cur->wrc_chan_id);
+      return err;
+    } else {
+      if ( new_events ) {
+        struct epoll_event ev;
+        ev.events = new_events;
+        ev.data.ptr = &cur->wrc_epsrc;
+
+        if ( cur->wrc_flags & WRC_HAS_OUTGOING )
+          ev.events |= EPOLLOUT;
+
+        err = epoll_ctl(CHAN_EPOLLFD(cur), EPOLL_CTL_MOD, cur->wrc_sk, &ev);
+        if ( err < 0 ) {
+          perror("do_pending_proxies: epoll_ctl");
+        } else {
+          ret = 0;
         }
+
+        cur->wrc_flags &= ~WRC_WAIT_FOR_SCTP_OUT;
+      } else
+        ret = 0;
+    }
+  }
+
+  return ret;
+}
+
+// Returns 0 on success, or -1 if the SCTP socket failed
+static int sctp_event(struct wrtcassoc *wa, struct epoll_event *ev) {
+  int err;
+
+  log_printf("Got epoll for sctp: %08x %d %d %d\n",
+             ev->events,
+             ev->events & EPOLLIN,
+             ev->events & EPOLLOUT,
+             ev->events & EPOLLHUP);
+
+  if ( ev->events & EPOLLIN ) {
+    err = receive_sctp(wa);
+    if ( err < 0 ) {
+      fprintf(stderr, "Could not receive SCTP message\n");
+      return -1;
+    }
+
+    if ( wa->wa_flags & WA_FLAG_CLOSED )
+      return 0;
+  }
+
+  if ( ev->events & EPOLLOUT ) {
+    perform_delayed_closes(wa);
+
+    err = do_pending_proxies(wa);
+    if ( err > wa->wa_needs_write_space )
+      wa->wa_needs_write_space = err;
+  }
+
+  ev->events = DFL_EPOLL_EVENTS;
+  //fprintf(stderr, "Set SCTP trigger %d %d %d\n", !!wa->wa_needs_write_space,
+  //        !!wa->wa_pending_reads.next, !!wa->wa_pending_free_channels.next);
+  if ( wa->wa_needs_write_space ||
+       wa->wa_pending_reads.next ||
+       wa->wa_pending_free_channels.next )
+    ev->events |= EPOLLOUT;
+  err = epoll_ctl(wa->wa_worker->ww_epollfd, EPOLL_CTL_MOD, wa->wa_sk, ev);
+  if ( err < 0 ) {
+    perror("epoll_ctl EPOLL_CTL_MOD srv");
+  }
+
+  return 0;
+}
+
+static void chan_event(struct wrtcchan *chan, struct epoll_event *ev) {
+  struct wrtcassoc *wa = chan->wrc_assoc;
+  int err, new_events = DFL_EPOLL_EVENTS;
+
+  log_printf("Got epoll for %d %d\n", chan->wrc_chan_id, ev->events);
+
+  state_transition(chan, ev->events);
+
+  if ( chan->wrc_flags & (WRC_WAIT_FOR_SCTP_OUT | WRC_HAS_PENDING_CONN) )
+    new_events &= ~EPOLLIN;
+
+  if ( ev->events & EPOLLIN ) {
+    log_printf("proxy_data %d\n", chan->wrc_chan_id);
+    // We have data ready for reading. Read the data and send it
+    // out on the channel.
+    err = proxy_data(chan, &new_events);
+    if ( err < 0 ) {
+      fprintf(stderr, "proxy_data: failed on channel %d\n", chan->wrc_chan_id);
+    } else if ( err ) {
+      if ( err > wa->wa_needs_write_space )
+        wa->wa_needs_write_space = err;
+
+      new_events &= ~EPOLLIN;
+      chan->wrc_flags |= WRC_WAIT_FOR_SCTP_OUT;
+
+      PUSH_STACK(&wa->wa_pending_reads, chan, wrc_pending_reads);
+    }
+  }
+
+  if ( ev->events & (EPOLLHUP | EPOLLRDHUP) ) {
+    if ( !((ev->events & EPOLLRDHUP) &&
+           (chan->wrc_flags & WRC_READ_CLOSED )) ) {
+      err = chan_disconnects(chan, ev->events, &new_events);
+      if ( err != 0 )
+        return;
+    }
+
+    if ( chan->wrc_flags & WRC_WRITE_CLOSED )
+      return;
+  }
+
+  if ( (ev->events & EPOLLOUT) ||
+       (chan->wrc_flags & WRC_NEEDS_CONNECT) ) {
+    // The socket can be written to. Flush any pending messages
+    flush_chan(chan, &new_events, &wa->wa_needs_write_space);
+
+    if ( (chan->wrc_flags & WRC_READ_CLOSED) &&
+         !chan_has_more_proxying(chan) ) {
+      mark_channel_closed(chan);
+      new_events = 0;
+    }
+
+    chan->wrc_flags &= ~WRC_NEEDS_CONNECT;
+  }
+
+  // Rearm the channel
+
+  if ( new_events != 0 ) {
+    int orig_ev = ev->events;
+    ev->events = new_events;
+    err = epoll_ctl(CHAN_EPOLLFD(chan), EPOLL_CTL_MOD, chan->wrc_sk, ev);
+    if ( err < 0 ) {
+      perror("epoll_ctl EPOLL_CTL_MOD");
+      fprintf(stderr, "While registering %x for %d (id %d)\n", new_events, chan->wrc_sk, chan->wrc_chan_id);
+      fprintf(stderr, "we were originally responding to %x (%x, %x, %x)\n", orig_ev, EPOLLIN, EPOLLOUT, EPOLLHUP);
+    }
+  }
+}
+
+// Arm any associations the listener has handed to this worker, then
+// close those of any sessions that were removed. Hand-offs are queued
+// before a session is removed, so none are missed.
+static void accept_assocs(struct wrtcworker *w) {
+  struct wrtcassoc *wa, *next;
+  struct wrtcsessclose *wsc, *next_wsc;
+  uint64_t cnt;
+
+  if ( read(w->ww_wakeup_fd, &cnt, sizeof(cnt)) < 0 &&
+       errno != EAGAIN )
+    perror("accept_assocs: read");
+
+  pthread_mutex_lock(&w->ww_mutex);
+  wa = w->ww_incoming;
+  w->ww_incoming = NULL;
+  wsc = w->ww_closing;
+  w->ww_closing = NULL;
+  pthread_mutex_unlock(&w->ww_mutex);
+
+  for ( ; wa; wa = next ) {
+    next = wa->wa_next;
+
+    wa->wa_next = w->ww_assocs;
+    w->ww_assocs = wa;
+
+    arm_sctp(wa);
+  }
+
+  for ( ; wsc; wsc = next_wsc ) {
+    next_wsc = wsc->wsc_next;
+
+    for ( wa = w->ww_assocs; wa; wa = wa->wa_next ) {
+      if ( wa->wa_local_addr.s_addr == wsc->wsc_addr.s_addr )
+        close_assoc(wa);
+    }
+
+    free(wsc);
+  }
+}
+
+int init_worker(struct wrtcworker *w) {
+  struct epoll_event ev;
+
+  memset(w, 0, sizeof(*w));
+  w->ww_wakeup_src.wes_type = WRTC_EPOLL_WAKEUP;
+  w->ww_timer_src.wes_type = WRTC_EPOLL_TIMER;
+  w->ww_pool_timer_src.wes_type = WRTC_EPOLL_POOL_TIMER;
+  w->ww_wakeup_fd = -1;
+  w->ww_timer_fd = -1;
+  w->ww_pool_timer_fd = -1;
+
+  if ( pthread_mutex_init(&w->ww_mutex, NULL) != 0 ) {
+    fprintf(stderr, "init_worker: could not create mutex\n");
+    return -1;
+  }
+
+  w->ww_epollfd = epoll_create1(EPOLL_CLOEXEC);
+  if ( w->ww_epollfd < 0 ) {
+    perror("epoll_create1");
+    return -1;
+  }
+
+  w->ww_wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if ( w->ww_wakeup_fd < 0 ) {
+    perror("eventfd");
+    return -1;
+  }
+
+  ev.events = EPOLLIN;
+  ev.data.ptr = (void *) &w->ww_wakeup_src;
+  if ( epoll_ctl(w->ww_epollfd, EPOLL_CTL_ADD, w->ww_wakeup_fd, &ev) < 0 ) {
+    perror("init_worker: epoll_ctl EPOLL_CTL_ADD");
+    return -1;
+  }
+
+  w->ww_timer_fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+  if ( w->ww_timer_fd < 0 ) {
+    perror("timerfd_create");
+    return -1;
+  }
+
+  ev.events = EPOLLIN;
+  ev.data.ptr = (void *) &w->ww_timer_src;
+  if ( epoll_ctl(w->ww_epollfd, EPOLL_CTL_ADD, w->ww_timer_fd, &ev) < 0 ) {
+    perror("init_worker: epoll_ctl EPOLL_CTL_ADD");
+    return -1;
+  }
+
+  w->ww_pool_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if ( w->ww_pool_timer_fd < 0 ) {
+    perror("timerfd_create");
+    return -1;
+  }
+
+  ev.events = EPOLLIN;
+  ev.data.ptr = (void *) &w->ww_pool_timer_src;
+  if ( epoll_ctl(w->ww_epollfd, EPOLL_CTL_ADD, w->ww_pool_timer_fd, &ev) < 0 ) {
+    perror("init_worker: epoll_ctl EPOLL_CTL_ADD");
+    return -1;
+  }
+
+  return 0;
+}
+
+// Runs the event loop for all associations owned by this worker.
+//
+// sigmask is passed to epoll_pwait, and may be NULL
+static int worker_loop(struct wrtcworker *w, const sigset_t *sigmask) {
+  struct epoll_event evs[MAX_EPOLL_EVENTS];
+  int i, ev_cnt = 0, err;
+  struct wrtcassoc *wa, **wap;
+
+  while (1) {
+    int ofs;
+
+    ev_cnt = epoll_pwait(w->ww_epollfd, evs, MAX_EPOLL_EVENTS, -1, sigmask);
+    if ( ev_cnt == -1 ) {
+      if ( errno == EINTR ) {
+        log_printf("Received EPOLL interrupt\n");
+        continue;
       } else {
-        log_printf("Got epoll for %d %d\n", chan->wrc_chan_id, ev->events);
+        perror("epoll_wait");
+        return 6;
+      }
+    }
+    log_printf("Finished epoll wait: %d\n", ev_cnt);
 
-        state_transition(srv, chan, ev->events);
+    ofs = rand();
 
-        if ( chan->wrc_flags & (WRC_WAIT_FOR_SCTP_OUT | WRC_HAS_PENDING_CONN) )
-          new_events &= ~EPOLLIN;
+    // Go over each event in the epoll and continue
+    for ( i = 0; i < ev_cnt; ++i ) {
+      struct epoll_event *ev = evs + ((i + ofs) % ev_cnt) ;
+      struct wrtcepollsrc *src = (struct wrtcepollsrc *) ev->data.ptr;
+      struct wrtcchan *chan;
 
-        if ( ev->events & EPOLLIN ) {
-          log_printf("proxy_data %d\n", chan->wrc_chan_id);
-          // We have data ready for reading. Read the data and send it
-          // out on the channel.
-          err = proxy_data(srv, chan, &new_events);
-          if ( err < 0 ) {
-            fprintf(stderr, "proxy_data: failed on channel %d\n", chan->wrc_chan_id);
-          } else if ( err ) {
-            if ( err > needs_write_space )
-              needs_write_space = err;
+      switch ( src->wes_type ) {
+      case WRTC_EPOLL_WAKEUP:
+        accept_assocs(w);
+        break;
 
-            new_events &= ~EPOLLIN;
-            chan->wrc_flags |= WRC_WAIT_FOR_SCTP_OUT;
+      case WRTC_EPOLL_TIMER:
+        run_due_retries(w);
+        break;
 
-            PUSH_STACK(&g_pending_reads, chan, wrc_pending_reads);
-          }
-        }
+      case WRTC_EPOLL_COMM:
+        handle_comm();
+        break;
 
-        if ( ev->events & (EPOLLHUP | EPOLLRDHUP) ) {
-          if ( !((ev->events & EPOLLRDHUP) &&
-                 (chan->wrc_flags & WRC_READ_CLOSED )) ) {
-            err = chan_disconnects(srv, chan, ev->events, &new_events);
-            if ( err != 0 ) {
-              continue;
-            }
-          }
+      case WRTC_EPOLL_POOL_TIMER:
+        pool_tick(w);
+        break;
 
-          if ( chan->wrc_flags & WRC_WRITE_CLOSED )
-            continue;
-        }
+      case WRTC_EPOLL_POOLED:
+        pooled_sk_event(w, STRUCT_FROM_BASE(struct wrtcpooledsk, wps_epsrc, src), ev);
+        break;
 
-        if ( (ev->events & EPOLLOUT) ||
-             (chan->wrc_flags & WRC_NEEDS_CONNECT) ) {
-          // The socket can be written to. Flush any pending messages
-          flush_chan(srv, chan, &new_events, &needs_write_space);
+      case WRTC_EPOLL_ASSOC:
+        wa = STRUCT_FROM_BASE(struct wrtcassoc, wa_epsrc, src);
+        if ( wa->wa_flags & WA_FLAG_CLOSED ) break;
 
-          if ( (chan->wrc_flags & WRC_READ_CLOSED) &&
-               !chan_has_more_proxying(chan) ) {
-            mark_channel_closed(chan);
-            new_events = 0;
-          }
+        if ( sctp_event(wa, ev) < 0 ) {
+          if ( (wa->wa_flags & WA_FLAG_LISTENER) && !g_shared )
+            return -1;
 
-          chan->wrc_flags &= ~WRC_NEEDS_CONNECT;
+          close_assoc(wa);
         }
+        break;
 
-        // Rearm the channel
+      case WRTC_EPOLL_CHAN:
+        chan = STRUCT_FROM_BASE(struct wrtcchan, wrc_epsrc, src);
+        // The channel's socket may have been closed along with its
+        // association earlier in this iteration
+        if ( chan->wrc_assoc->wa_flags & WA_FLAG_CLOSED ) break;
 
-        if ( new_events != 0 ) {
-          int orig_ev = ev->events;
-          ev->events = new_events;
-          err = epoll_ctl(g_epollfd, EPOLL_CTL_MOD, chan->wrc_sk, ev);
-          if ( err < 0 ) {
-            perror("epoll_ctl EPOLL_CTL_MOD");
-            fprintf(stderr, "While registering %x for %d (id %d)\n", new_events, chan->wrc_sk, chan->wrc_chan_id);
-            fprintf(stderr, "we were originally responding to %x (%x, %x, %x)\n", orig_ev, EPOLLIN, EPOLLOUT, EPOLLHUP);
-          }
+        chan_event(chan, ev);
+        break;
+
+      default:
+        fprintf(stderr, "worker_loop: unknown epoll source %d\n", src->wes_type);
+        abort();
+      }
+    }
+
+    for ( wap = &w->ww_assocs; *wap; ) {
+      wa = *wap;
+
+      if ( wa->wa_flags & WA_FLAG_CLOSED ) {
+        *wap = wa->wa_next;
+        __atomic_sub_fetch(&w->ww_assoc_count, 1, __ATOMIC_SEQ_CST);
+        free_assoc(wa);
+        continue;
+      }
+
+      // If we need more space in the write buffer or we have a reset to
+      // send, wait for the ability to write
+      if ( wa->wa_needs_write_space ||
+           wa->wa_pending_free_channels.next ) {
+        struct epoll_event srv_ev;
+        srv_ev.events = DFL_EPOLL_EVENTS | EPOLLOUT;
+        srv_ev.data.ptr = (void *) &wa->wa_epsrc;
+
+        //fprintf(stderr, "Needs write space in SCTP socket\n");
+
+        err = epoll_ctl(w->ww_epollfd, EPOLL_CTL_MOD, wa->wa_sk, &srv_ev);
+        if ( err < 0 ) {
+          perror("epoll_ctl EPOLL_CTL_MOD srv");
         }
       }
+      wa->wa_needs_write_space = 0;
+
+      wap = &wa->wa_next;
+    }
+
+    arm_retry_timer(w);
+  }
+}
+
+static void *worker_thread(void *arg) {
+  struct wrtcworker *w = (struct wrtcworker *) arg;
+
+  // Signals are blocked in all worker threads, and handled by the
+  // main thread's epoll_pwait
+  exit(worker_loop(w, NULL));
+}
+
+int main_loop(int srv) {
+  struct wrtcassoc *listener;
+  int i, err;
+  sigset_t block, old;
+
+  fprintf(stderr, "WebRTC epoll thread starts on port %d\n", g_dbg_port);
+
+  sigfillset(&block);
+  err = sigprocmask(SIG_SETMASK, &block, &old);
+  if ( err != 0 ) {
+    errno = err;
+    perror("sigmask SIG_SETMASK");
+    return 20;
+  }
+
+  sigdelset(&old, SIGTERM);
+  sigdelset(&old, SIGINT);
+  sigdelset(&old, SIGQUIT);
+  sigdelset(&old, SIGHUP);
+
+  if ( init_worker(&g_main_worker) < 0 )
+    return 4;
+
+  if ( srv >= 0 ) {
+    listener = alloc_assoc(srv, &g_main_worker, WA_FLAG_LISTENER);
+    if ( !listener )
+      return 4;
+
+    g_main_worker.ww_assocs = listener;
+    g_main_worker.ww_assoc_count = 1;
+
+    // We'll want subscriptions on the main SCTP socket
+    arm_sctp(listener);
+  }
+
+  if ( g_shared ) {
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = (void *) &g_comm_src;
+    if ( epoll_ctl(g_main_worker.ww_epollfd, EPOLL_CTL_ADD, COMM, &ev) < 0 ) {
+      perror("main_loop: epoll_ctl COMM");
+      return 4;
+    }
+  }
+
+  if ( g_worker_count > 0 ) {
+    fprintf(stderr, "webrtc-proxy: starting %d worker threads\n", g_worker_count);
+
+    g_workers = calloc(g_worker_count, sizeof(*g_workers));
+    if ( !g_workers ) {
+      perror("calloc g_workers");
+      return 4;
+    }
+
+    // The worker threads inherit the fully blocked signal mask
+    for ( i = 0; i < g_worker_count; ++i ) {
+      if ( init_worker(&g_workers[i]) < 0 )
+        return 4;
+
+      err = pthread_create(&g_workers[i].ww_thread, NULL, worker_thread, &g_workers[i]);
+      if ( err != 0 ) {
+        errno = err;
+        perror("pthread_create");
+        return 4;
+      }
     }
+  }
+
+  return worker_loop(&g_main_worker, &old);
+}
+
+// SCTP Server
+
+void warn_if_ext_not_supported(struct wrtcassoc *wa, const char *nm, int opt) {
+  struct sctp_assoc_value val;
+  socklen_t val_sz = sizeof(val);
+
+  val.assoc_id = wa->wa_assoc_id;
+  val.assoc_value = 0;
+
+  if ( getsockopt(wa->wa_sk, IPPROTO_SCTP, opt,
+                  &val, &val_sz) < 0 ) {
+    perror("warn_if_ext_not_supported: getsockopt");
+  }
+
+  if ( !val.assoc_value )
+    fprintf(stderr, "Association does not support %s\n", nm);
+  else
+    fprintf(stderr, "Association supports %s\n", nm);
+}
+
+struct wrtcassoc *alloc_assoc(int sk, struct wrtcworker *w, uint32_t flags) {
+  struct wrtcassoc *wa = calloc(1, sizeof(*wa));
+  if ( !wa ) {
+    perror("alloc_assoc: calloc");
+    return NULL;
+  }
+
+  wa->wa_epsrc.wes_type = WRTC_EPOLL_ASSOC;
+  wa->wa_sk = sk;
+  wa->wa_assoc_id = SCTP_FUTURE_ASSOC;
+  wa->wa_flags = flags;
+  wa->wa_worker = w;
+
+  return wa;
+}
+
+static void free_assoc(struct wrtcassoc *wa) {
+  int i;
+
+  for ( i = 0; i < wa->wa_num_strms; ++i ) {
+    if ( wa->wa_channels[i].wrc_buffer )
+      free(wa->wa_channels[i].wrc_buffer);
+    if ( wa->wa_channels[i].wrc_ring )
+      free(wa->wa_channels[i].wrc_ring);
+  }
+
+  if ( wa->wa_channels ) free(wa->wa_channels);
+  if ( wa->wa_chans_by_sid ) free(wa->wa_chans_by_sid);
+  if ( wa->wa_closing_chans ) free(wa->wa_closing_chans);
+  if ( wa->wa_reset_req ) free(wa->wa_reset_req);
+
+  close(wa->wa_sk);
+  free(wa);
+}
+
+// Stops serving the association and closes all its channel
+// sockets. The owning worker frees it at the end of the current loop
+// iteration, since other events in this iteration may still point to
+// its channels.
+static void close_assoc(struct wrtcassoc *wa) {
+  struct epoll_event ev; // Must be supplied in some kernels
+  int i;
+
+  if ( wa->wa_flags & WA_FLAG_CLOSED ) return;
+  wa->wa_flags |= WA_FLAG_CLOSED;
+
+  if ( epoll_ctl(wa->wa_worker->ww_epollfd, EPOLL_CTL_DEL, wa->wa_sk, &ev) < 0 )
+    perror("close_assoc: epoll_ctl EPOLL_CTL_DEL");
+
+  for ( i = 0; i < wa->wa_num_strms; ++i ) {
+    unschedule_chan_retry(&wa->wa_channels[i]);
+
+    if ( get_chan_sts(&wa->wa_channels[i]) != WEBRTC_STS_INVALID )
+      force_close_channel(&wa->wa_channels[i]);
+  }
+}
+
+// In single-threaded mode, the proxy exits along with its association
+static void assoc_ends(struct wrtcassoc *wa, int status) {
+  if ( g_worker_count == 0 )
+    exit(status);
+  else if ( !(wa->wa_flags & WA_FLAG_LISTENER) )
+    close_assoc(wa);
+}
+
+// Sets the socket options for a newly established association and
+// allocates its channel tables. Returns 0 on success, -1 on error
+int configure_assoc(struct wrtcassoc *wa, struct sctp_assoc_change *sac) {
+  struct sctp_assoc_value sched;
+  struct sctp_paddrparams spp;
+  struct sockaddr_in any_ip;
+  socklen_t optlen;
+  int i, srv = wa->wa_sk;
+
+  optlen = sizeof(wa->wa_sndbuf);
+  if ( getsockopt(srv, SOL_SOCKET, SO_SNDBUF, &wa->wa_sndbuf, &optlen) < 0 ) {
+    perror("getsockopt SO_SNDBUF");
+    wa->wa_sndbuf = 0;
+  }
+
+  warn_if_ext_not_supported(wa, "SCTP reconfig", SCTP_RECONFIG_SUPPORTED);
+  warn_if_ext_not_supported(wa, "SCTP partial reliability", SCTP_PR_SUPPORTED);
+
+  warn_if_ext_not_supported(wa, "SCTP message interleaving", SCTP_INTERLEAVING_SUPPORTED);
+
+  // Prefer weighted fair queueing, so that every channel makes
+  // progress in proportion to its priority. Fall back to strict
+  // priority on kernels without it
+  wa->wa_sched = 0;
+  sched.assoc_id = wa->wa_assoc_id;
+  sched.assoc_value = WRTC_SS_WFQ;
+  if ( setsockopt(srv, IPPROTO_SCTP, SCTP_STREAM_SCHEDULER, &sched, sizeof(sched)) == 0 )
+    wa->wa_sched = WRTC_SS_WFQ;
+  else {
+    sched.assoc_value = WRTC_SS_PRIO;
+    if ( setsockopt(srv, IPPROTO_SCTP, SCTP_STREAM_SCHEDULER, &sched, sizeof(sched)) < 0 ) {
+      perror("setsockopt SCTP_STREAM_SCHEDULER");
+    } else
+      wa->wa_sched = WRTC_SS_PRIO;
+  }
+
+  sched.assoc_id = wa->wa_assoc_id;
+  sched.assoc_value = SCTP_ENABLE_RESET_STREAM_REQ | SCTP_ENABLE_RESET_ASSOC_REQ |
+    SCTP_ENABLE_CHANGE_ASSOC_REQ;
+  if ( setsockopt(srv, IPPROTO_SCTP, SCTP_ENABLE_STREAM_RESET, &sched, sizeof(sched)) < 0) {
+    perror("setsockopt SCTP_ENABLE_STREAM_RESET");
+  }
+
+  sched.assoc_id = wa->wa_assoc_id;
+  sched.assoc_value = 0;
+  optlen = sizeof(sched);
+  if ( getsockopt(srv, IPPROTO_SCTP, SCTP_ENABLE_STREAM_RESET, &sched, &optlen) < 0 ) {
+    perror("getsockopt SCTP_ENABLE_STREAM_RESET");
+  } else
+    fprintf(stderr, "SCTP_ENABLE_STREAM_RESET value: %x\n", sched.assoc_value);
+
+  any_ip.sin_family = AF_INET;
+  any_ip.sin_port = 0;
+  any_ip.sin_addr.s_addr = INADDR_ANY;
+
+  memset(&spp, 0, sizeof(spp));
+  spp.spp_assoc_id = wa->wa_assoc_id;
+  memcpy(&spp.spp_address, &any_ip, sizeof(any_ip));
+  spp.spp_hbinterval = 30000; // Send a heartbeat every ten seconds
+  spp.spp_pathmaxrxt = 5;
+  if ( setsockopt(srv, IPPROTO_SCTP, SCTP_PEER_ADDR_PARAMS, &spp, sizeof(spp)) < 0 ) {
+    perror("setsockopt SCTP_PEER_ADDR_PARAMS");
+  }
+
+  wa->wa_num_strms = (sac->sac_outbound_streams < sac->sac_inbound_streams ?
+                      sac->sac_inbound_streams : sac->sac_outbound_streams);
+  wa->wa_channels = calloc(sizeof(*wa->wa_channels), wa->wa_num_strms);
+  if ( !wa->wa_channels ) {
+    perror("calloc wa_channels");
+    return -1;
+  }
+
+  // Build the free list so that the lowest slots are used first
+  wa->wa_free_chans = NULL;
+  for ( i = wa->wa_num_strms - 1; i >= 0; --i ) {
+    wa->wa_channels[i].wrc_epsrc.wes_type = WRTC_EPOLL_CHAN;
+    wa->wa_channels[i].wrc_assoc = wa;
+    wa->wa_channels[i].wrc_retry_idx = -1;
+    wa->wa_channels[i].wrc_next_free = wa->wa_free_chans;
+    wa->wa_free_chans = &wa->wa_channels[i];
+  }
+
+  wa->wa_chans_by_sid = calloc(sizeof(*wa->wa_chans_by_sid), wa->wa_num_strms);
+  if ( !wa->wa_chans_by_sid ) {
+    perror("calloc wa_chans_by_sid");
+    return -1;
+  }
+
+  wa->wa_reset_req = malloc(sizeof(*wa->wa_reset_req) +
+                            sizeof(wa->wa_reset_req->srs_stream_list[0]) * wa->wa_num_strms);
+  if ( !wa->wa_reset_req ) {
+    perror("malloc wa_reset_req");
+    return -1;
+  }
+
+  wa->wa_closing_chans = calloc(sizeof(*wa->wa_closing_chans), wa->wa_num_strms);
+  if ( !wa->wa_closing_chans ) {
+    perror("calloc wa_closing_chans");
+    return -1;
+  }
+  memset(wa->wa_closing_chans, 0xFF, sizeof(*wa->wa_closing_chans) * wa->wa_num_strms);
 
-    // If we need more space in the write buffer or we have a reset to
-    // send, wait for the ability to write
-    if ( needs_write_space ||
-         g_pending_free_channels.next ) {
-      struct epoll_event srv_ev;
-      srv_ev.events = DFL_EPOLL_EVENTS | EPOLLOUT;
-      srv_ev.data.ptr = NULL;
+  return 0;
+}
 
-      //fprintf(stderr, "Needs write space in SCTP socket\n");
+// Peels a new association off the listening socket and hands it to
+// the worker currently serving the fewest associations
+static void hand_off_assoc(struct wrtcassoc *listener, struct sctp_assoc_change *sac) {
+  struct wrtcworker *w = NULL;
+  struct wrtcassoc *wa;
+  uint64_t one = 1;
+  int i, sk, cnt, min_cnt = 0;
+
+  sk = sctp_peeloff(listener->wa_sk, sac->sac_assoc_id);
+  if ( sk < 0 ) {
+    perror("sctp_peeloff");
+    return;
+  }
 
-      err = epoll_ctl(g_epollfd, EPOLL_CTL_MOD, srv, &srv_ev);
-      if ( err < 0 ) {
-        perror("epoll_ctl EPOLL_CTL_MOD srv");
-      }
-    }
+  set_sk_nonblocking(sk);
 
-    // Now, go over all open channels and if a timeout has expired,
-    // mark the socket as waiting for output as well
-    if ( clock_gettime(CLOCK_REALTIME, &now) < 0 ) {
-      perror("clock_gettime now");
-      return 10;
+  for ( i = 0; i < g_worker_count; ++i ) {
+    cnt = __atomic_load_n(&g_workers[i].ww_assoc_count, __ATOMIC_SEQ_CST);
+    if ( !w || cnt < min_cnt ) {
+      w = &g_workers[i];
+      min_cnt = cnt;
     }
+  }
 
-    for ( i = 0, timeout = -1; i < g_num_strms; ++i )
-      if ( g_channel_htbl[i] ) {
-        if ( chan_needs_retry(g_channel_htbl[i], &now, &timeout) ) {
-          log_printf("WebRTC channel is requesting retry %d %d\n",
-                     g_channel_htbl[i]->wrc_chan_id, timeout);
-          if ( g_channel_htbl[i]->wrc_flags & WRC_HAS_PENDING_CONN )
-            g_channel_htbl[i]->wrc_flags |= WRC_NEEDS_CONNECT;
-          wait_for_write_on_chan(g_channel_htbl[i]);
-        }
-      }
+  wa = alloc_assoc(sk, w, 0);
+  if ( !wa ) {
+    close(sk);
+    return;
   }
-}
 
-// SCTP Server
+  wa->wa_assoc_id = sac->sac_assoc_id;
+  wa->wa_local_addr = listener->wa_local_addr;
+  if ( configure_assoc(wa, sac) < 0 ) {
+    free_assoc(wa);
+    return;
+  }
 
-void warn_if_ext_not_supported(int srv, const char *nm, int opt) {
-  struct sctp_assoc_value val;
-  socklen_t val_sz = sizeof(val);
+  log_printf("Handing association %d to worker %ld\n", wa->wa_assoc_id, (long) (w - g_workers));
 
-  val.assoc_id = g_webrtc_assoc;
-  val.assoc_value = 0;
+  __atomic_add_fetch(&w->ww_assoc_count, 1, __ATOMIC_SEQ_CST);
 
-  if ( getsockopt(srv, IPPROTO_SCTP, opt,
-                  &val, &val_sz) < 0 ) {
-    perror("warn_if_ext_not_supported: getsockopt");
-  }
+  pthread_mutex_lock(&w->ww_mutex);
+  wa->wa_next = w->ww_incoming;
+  w->ww_incoming = wa;
+  pthread_mutex_unlock(&w->ww_mutex);
 
-  if ( !val.assoc_value )
-    fprintf(stderr, "Association does not support %s\n", nm);
-  else
-    fprintf(stderr, "Association supports %s\n", nm);
+  if ( write(w->ww_wakeup_fd, &one, sizeof(one)) < 0 )
+    perror("hand_off_assoc: write");
 }
 
-void handle_assoc_change(int srv, struct sctp_assoc_change *sac, int sz) {
+void handle_assoc_change(struct wrtcassoc *wa, struct sctp_assoc_change *sac, int sz) {
   if ( sz < sizeof(*sac) ) return;
 
   switch ( sac->sac_state ) {
   case SCTP_COMM_UP:
     dbg_assoc_change(sac, sz);
-    if ( g_webrtc_assoc != SCTP_FUTURE_ASSOC ) {
+    if ( g_worker_count > 0 && (wa->wa_flags & WA_FLAG_LISTENER) ) {
+      hand_off_assoc(wa, sac);
+    } else if ( wa->wa_assoc_id != SCTP_FUTURE_ASSOC ) {
       int assoc;
       // Close this association
       fprintf(stderr, "Received another association: %d\n", sac->sac_assoc_id);
-      assoc = sctp_peeloff(srv, sac->sac_assoc_id);
+      assoc = sctp_peeloff(wa->wa_sk, sac->sac_assoc_id);
       if ( assoc < 0 ) {
         perror("sctp_peeloff");
         return;
@@ -1757,86 +3078,25 @@ void handle_assoc_change(int srv, struct sctp_assoc_change *sac, int sz) {
         return;
       }
     } else {
-      struct sctp_assoc_value sched;
-      struct sctp_paddrparams spp;
-      struct sockaddr_in any_ip;
-      socklen_t optlen;
-
-      g_webrtc_assoc = sac->sac_assoc_id;
-      warn_if_ext_not_supported(srv, "SCTP reconfig", SCTP_RECONFIG_SUPPORTED);
-      warn_if_ext_not_supported(srv, "SCTP partial reliability", SCTP_PR_SUPPORTED);
-
-      sched.assoc_id = g_webrtc_assoc;
-      sched.assoc_value = SCTP_SS_PRIO;
-      if ( setsockopt(srv, IPPROTO_SCTP, SCTP_STREAM_SCHEDULER, &sched, sizeof(sched)) < 0 ) {
-        perror("setsockopt SCTP_PLUGGABLE_SS");
-      }
-
-      sched.assoc_id = g_webrtc_assoc;
-      sched.assoc_value = SCTP_ENABLE_RESET_STREAM_REQ | SCTP_ENABLE_RESET_ASSOC_REQ |
-        SCTP_ENABLE_CHANGE_ASSOC_REQ;
-      if ( setsockopt(srv, IPPROTO_SCTP, SCTP_ENABLE_STREAM_RESET, &sched, sizeof(sched)) < 0) {
-        perror("setsockopt SCTP_ENABLE_STREAM_RESET");
-      }
-
-      sched.assoc_id = g_webrtc_assoc;
-      sched.assoc_value = 0;
-      optlen = sizeof(sched);
-      if ( getsockopt(srv, IPPROTO_SCTP, SCTP_ENABLE_STREAM_RESET, &sched, &optlen) < 0 ) {
-        perror("getsockopt SCTP_ENABLE_STREAM_RESET");
-      } else
-        fprintf(stderr, "SCTP_ENABLE_STREAM_RESET value: %x\n", sched.assoc_value);
-
-      any_ip.sin_family = AF_INET;
-      any_ip.sin_port = 0;
-      any_ip.sin_addr.s_addr = INADDR_ANY;
-
-      memset(&spp, 0, sizeof(spp));
-      spp.spp_assoc_id = g_webrtc_assoc;
-      memcpy(&spp.spp_address, &any_ip, sizeof(any_ip));
-      spp.spp_hbinterval = 30000; // Send a heartbeat every ten seconds
-      spp.spp_pathmaxrxt = 5;
-      if ( setsockopt(srv, IPPROTO_SCTP, SCTP_PEER_ADDR_PARAMS, &spp, sizeof(spp)) < 0 ) {
-        perror("setsockopt SCTP_PEER_ADDR_PARAMS");
-      }
-
-
-      g_num_strms = (sac->sac_outbound_streams < sac->sac_inbound_streams ?
-                     sac->sac_inbound_streams : sac->sac_outbound_streams);
-      g_channels = calloc(sizeof(*g_channels), g_num_strms);
-      if ( !g_channels ) {
-        perror("calloc g_channels");
+      wa->wa_assoc_id = sac->sac_assoc_id;
+      if ( configure_assoc(wa, sac) < 0 )
         exit(200);
-      }
-
-      g_channel_htbl = calloc(sizeof(*g_channel_htbl), g_num_strms);
-      if ( !g_channel_htbl ) {
-        perror("calloc g_channel_htbl");
-        exit(201);
-      }
-
-      g_closing_chans = calloc(sizeof(*g_closing_chans), g_num_strms);
-      if ( !g_closing_chans ) {
-        perror("calloc g_closing_chans");
-        exit(202);
-      }
-      memset(g_closing_chans, 0xFF, sizeof(*g_closing_chans) * g_num_strms);
     }
     break;
   case SCTP_COMM_LOST:
     fprintf(stderr, "SCTP comm lost: error %d\n", sac->sac_error);
-    exit(20);
+    assoc_ends(wa, 20);
     break;
   case SCTP_RESTART:
     fprintf(stderr, "WARNING: SCTP restart detected (TODO)\n");
     break;
   case SCTP_SHUTDOWN_COMP:
     fprintf(stderr, "SCTP shutdown complete\n");
-    exit(0);
+    assoc_ends(wa, 0);
     break;
   case SCTP_CANT_STR_ASSOC:
     fprintf(stderr, "Error: could not start association\n");
-    exit(1);
+    assoc_ends(wa, 1);
     break;
   default:
     fprintf(stderr, "Unknown sac_state value: %d", sac->sac_state);
@@ -1844,16 +3104,16 @@ void handle_assoc_change(int srv, struct sctp_assoc_change *sac, int sz) {
   }
 }
 
-void handle_notification(int srv, union sctp_notification *nf, int sz) {
+void handle_notification(struct wrtcassoc *wa, union sctp_notification *nf, int sz) {
   switch ( nf->sn_header.sn_type ) {
   case SCTP_ASSOC_CHANGE:
-    handle_assoc_change(srv, &nf->sn_assoc_change, sz);
+    handle_assoc_change(wa, &nf->sn_assoc_change, sz);
     break;
   case SCTP_STREAM_RESET_EVENT:
     // TODO this should reset the stream and close any connections
     log_printf( "SCTP stream reset\n");
     if ( sz >= sizeof(nf->sn_strreset_event) )
-      process_strreset_ack(&nf->sn_strreset_event, sz);
+      process_strreset_ack(wa, &nf->sn_strreset_event, sz);
     else
       fprintf(stderr, "handle_notification: not enough space for stream reset event\n");
     break;
@@ -1893,9 +3153,9 @@ int write_open_app_req(struct wrtcchan *chan, char *app_name, int app_name_len)
   return 0;
 }
 
-void handle_chan_msg(int srv, struct wrtcchan *chan,
+void handle_chan_msg(struct wrtcchan *chan,
                      void *buf, int sz, int flags) {
-  int app_name_len, err, rsp_sz, req;
+  int srv = chan->wrc_assoc->wa_sk, app_name_len, err, rsp_sz, req;
   struct stkcmsg rsp, *msg = (struct stkcmsg *)buf;
   struct sctp_sndrcvinfo sri;
   struct sockaddr_in endpoint;
@@ -1923,7 +3183,7 @@ void handle_chan_msg(int srv, struct wrtcchan *chan,
 
       if ( WRC_HAS_MESSAGE_PENDING(chan) ) {
         fprintf(stderr, "Request already in progress on channel %d\n", chan->wrc_chan_id);
-        rsp_cmsg_error(srv, chan, STK_CMSG_REQ(msg), STKD_ERROR_SYSTEM_BUSY);
+        rsp_cmsg_error(chan, STK_CMSG_REQ(msg), STKD_ERROR_SYSTEM_BUSY);
         break;
       }
 
@@ -1932,7 +3192,7 @@ void handle_chan_msg(int srv, struct wrtcchan *chan,
         int saved_errno = errno;
         perror("write_open_app_req");
         errno = saved_errno;
-        rsp_cmsg_error(srv, chan, STK_CMSG_REQ(msg), STKD_ERROR_SYSTEM_ERROR);
+        rsp_cmsg_error(chan, STK_CMSG_REQ(msg), STKD_ERROR_SYSTEM_ERROR);
         break;
       }
 
@@ -1956,14 +3216,24 @@ void handle_chan_msg(int srv, struct wrtcchan *chan,
         endpoint.sin_family = AF_INET;
         endpoint.sin_port = msg->data.scm_connect.scm_port;
 
-        if ( !get_address_by_descriptor(ntohl(msg->data.scm_connect.scm_app),
+        if ( !get_address_by_descriptor(chan->wrc_assoc->wa_local_addr,
+                                        ntohl(msg->data.scm_connect.scm_app),
                                         &endpoint.sin_addr.s_addr) ) {
           log_printf("Could not find app %d\n", ntohl(msg->data.scm_connect.scm_app));
           rsp_sz = SCM_ERROR_RSP_SZ;
           rsp.scm_type = SCM_RESPONSE | SCM_ERROR | SCM_REQ_CONNECT;
           rsp.data.scm_error = htonl(STKD_ERROR_APP_DOES_NOT_EXIST);
         } else {
-          err = mk_socket(msg->data.scm_connect.scm_sk_type);
+          int pooled = -1;
+
+          if ( msg->data.scm_connect.scm_sk_type == SOCK_STREAM )
+            pooled = pool_take(chan->wrc_assoc->wa_worker, &endpoint,
+                               chan->wrc_assoc->wa_local_addr);
+
+          if ( pooled >= 0 )
+            err = pooled;
+          else
+            err = mk_socket(msg->data.scm_connect.scm_sk_type);
           if ( err < 0 ) {
             int saved_errno = errno;
             perror("mk_socket");
@@ -1980,8 +3250,17 @@ void handle_chan_msg(int srv, struct wrtcchan *chan,
             chan->wrc_sk = err;
             close(old_sk);
 
-            // Attempt to connect on this channel
-            err = connect_socket(chan, &endpoint);
+            chan->wrc_family = AF_INET;
+            chan->wrc_type = msg->data.scm_connect.scm_sk_type;
+            chan_set_pr_policy(chan);
+
+            // Attempt to connect on this channel, unless the pool
+            // gave us a socket that is already connected
+            if ( pooled >= 0 ) {
+              log_printf("Using pooled connection for channel %d\n", chan->wrc_chan_id);
+              err = 0;
+            } else
+              err = connect_socket(chan, &endpoint);
             if ( err < 0 ) {
               // TODO we should probably close this socket
               rsp_sz = SCM_ERROR_RSP_SZ;
@@ -1996,9 +3275,6 @@ void handle_chan_msg(int srv, struct wrtcchan *chan,
                 rsp.scm_type = SCM_RESPONSE | SCM_REQ_CONNECT;
               } else {
                 // The connection is in progress
-                chan->wrc_family = AF_INET;
-                chan->wrc_type = msg->data.scm_connect.scm_sk_type;
-
                 mark_channel_connecting(chan, &endpoint, msg->data.scm_connect.scm_retries);
               }
             }
@@ -2042,10 +3318,16 @@ void handle_chan_msg(int srv, struct wrtcchan *chan,
         partial_ok = 1;
         break;
       case SOCK_DGRAM:
+        if ( chan->wrc_flags & WRC_HAS_PENDING_CONN ) {
+          log_printf("Dropping datagram on channel %d because it is not connected yet\n",
+                     chan->wrc_chan_id);
+          goto done;
+        }
+
         if ( chan->wrc_flags & WRC_DATA_IN_PROG )
           data_sz = sz;
         else
-          data_sz = sz - SCM_DATA_REQ_SZ + 4;
+          data_sz = sz - SCM_DATA_REQ_SZ;
         reliable = 0;
         partial_ok = 0;
         break;
@@ -2055,16 +3337,40 @@ void handle_chan_msg(int srv, struct wrtcchan *chan,
         goto done;
       };
 
-      if ( (chan->wrc_msg_sz + data_sz) <= chan->wrc_buf_sz ) {
-        uint8_t *outgoing_buf = (unsigned char *) (chan->wrc_buffer + chan->wrc_msg_sz);
-
-        if ( chan->wrc_type == SOCK_DGRAM && (chan->wrc_flags & WRC_DATA_IN_PROG) == 0) {
-          // Include frame
-          *((uint32_t *) outgoing_buf) = data_sz;
-          outgoing_buf += 4;
+      if ( chan->wrc_type == SOCK_DGRAM ) {
+        // Each SCTP message is exactly one datagram. Fragments are
+        // collected in the buffer, and the datagram is sent when the
+        // message is complete. If the local socket can't take it, the
+        // datagram is dropped, as it would be on the network.
+        if ( (chan->wrc_flags & WRC_DROP_DGRAM) == 0 ) {
+          if ( (chan->wrc_msg_sz + data_sz) <= chan->wrc_buf_sz ) {
+            memcpy(chan->wrc_buffer + chan->wrc_msg_sz, data_buf, data_sz);
+            chan->wrc_msg_sz += data_sz;
+          } else {
+            log_printf("Dropping datagram on channel %d because it is too large\n",
+                       chan->wrc_chan_id);
+            chan->wrc_flags |= WRC_DROP_DGRAM;
+          }
         }
 
-        memcpy(outgoing_buf, data_buf, data_sz);
+        if ( flags & MSG_EOR ) {
+          if ( (chan->wrc_flags & WRC_DROP_DGRAM) == 0 ) {
+            err = send(chan->wrc_sk, chan->wrc_buffer, chan->wrc_msg_sz, MSG_DONTWAIT);
+            if ( err < 0 && errno != ECONNREFUSED ) {
+              if ( errno == EAGAIN || errno == EWOULDBLOCK ) {
+                log_printf("Dropping datagram on channel %d because the socket is full\n",
+                           chan->wrc_chan_id);
+              } else
+                perror("handle_chan_msg: send SOCK_DGRAM");
+            }
+          }
+
+          chan->wrc_msg_sz = 0;
+          chan->wrc_flags &= ~(WRC_DATA_IN_PROG | WRC_DROP_DGRAM);
+        } else
+          chan->wrc_flags |= WRC_DATA_IN_PROG;
+      } else if ( (chan->wrc_msg_sz + data_sz) <= chan->wrc_buf_sz ) {
+        memcpy(chan->wrc_buffer + chan->wrc_msg_sz, data_buf, data_sz);
 
         chan->wrc_msg_sz += data_sz;
 
@@ -2115,22 +3421,21 @@ void handle_chan_msg(int srv, struct wrtcchan *chan,
   return;
 }
 
-void handle_msg(int srv,
+void handle_msg(struct wrtcassoc *wa,
                 struct sctp_sndrcvinfo *rcv,
                 void *buf, int sz, int flags) {
   struct wrtcmsg *control;
   struct wrtcchan *chan;
-  struct sctp_stream_value ss_prio;
   struct sctp_sndrcvinfo sri;
   wrcchanid chan_id;
   uint8_t ack;
   ssize_t err;
-  int sk;
+  int srv = wa->wa_sk, sk;
   struct sockaddr_in remote;
 
   switch ( ntohl(rcv->sinfo_ppid) ) {
   case WEBRTC_BINARY_PPID:
-    chan = find_chan(WEBRTC_CHANID(rcv->sinfo_stream));
+    chan = find_chan(wa, WEBRTC_CHANID(rcv->sinfo_stream));
     if ( !chan ) {
       // Channel does not exist, we should reset the streams
       fprintf(stderr, "Could not find channel: %d\n", WEBRTC_CHANID(rcv->sinfo_stream));
@@ -2138,7 +3443,7 @@ void handle_msg(int srv,
       break;
     }
 
-    handle_chan_msg(srv, chan, buf, sz, flags);
+    handle_chan_msg(chan, buf, sz, flags);
     break;
   case WEBRTC_CONTROL_PPID:
     control = (struct wrtcmsg *)buf;
@@ -2151,9 +3456,9 @@ void handle_msg(int srv,
       chan_id = WEBRTC_CHANID(rcv->sinfo_stream);
       fprintf(stderr, "Request to open WebRTC data channel %d\n", chan_id);
 
-      do_not_close_channel(chan_id);
+      do_not_close_channel(wa, chan_id);
 
-      chan = alloc_wrtc_chan(chan_id);
+      chan = alloc_wrtc_chan(wa, chan_id);
       if ( !chan ) {
         fprintf(stderr, "Could not allocate webrtc channel: resetting stream\n");
         //reset_wrc_chan(srv, chan_id);
@@ -2175,7 +3480,8 @@ void handle_msg(int srv,
       chan->wrc_type = 0;
       chan->wrc_sk = 0;
       chan->wrc_flags = WRC_CONTROL;
-      chan->wrc_buffer = malloc(OUTGOING_BUF_SIZE);
+      if ( !chan->wrc_buffer )
+        chan->wrc_buffer = malloc(OUTGOING_BUF_SIZE);
       if ( !chan->wrc_buffer ) {
         fprintf(stderr, "Could not allocate socket buffer\n");
         mark_channel_closed(chan);
@@ -2235,24 +3541,14 @@ void handle_msg(int srv,
       chan->wrc_sk = sk;
       arm_channel(chan);
 
-      ss_prio.assoc_id = g_webrtc_assoc;
-      ss_prio.stream_id = WEBRTC_CLIENT_SID(chan_id);
-      ss_prio.stream_value = 0xFFFF - control->wm_prio;
-      if ( setsockopt(srv, IPPROTO_SCTP, SCTP_STREAM_SCHEDULER_VALUE, &ss_prio, sizeof(ss_prio)) < 0 ) {
-        perror("setsockopt SCTP_STREAM_SCHEDULER_VALUE (client)");
-      }
-
-      ss_prio.stream_id = WEBRTC_SERVER_SID(chan_id);
-      if ( setsockopt(srv, IPPROTO_SCTP, SCTP_STREAM_SCHEDULER_VALUE, &ss_prio, sizeof(ss_prio)) < 0 ) {
-        perror("setsockopt SCTP_STREAM_SCHEDULER_VALUE (server)");
-      }
+      set_chan_sched_value(chan);
 
       // Send ACK message now
       memset(&sri, 0, sizeof(sri));
       sri.sinfo_stream = WEBRTC_SERVER_SID(chan_id);
       sri.sinfo_ppid = htonl(WEBRTC_CONTROL_PPID);
       sri.sinfo_context = chan_id;
-      sri.sinfo_assoc_id = g_webrtc_assoc;
+      sri.sinfo_assoc_id = wa->wa_assoc_id;
 
       ack = WEBRTC_MSG_OPEN_ACK;
       err = sctp_send(srv, (void *)&ack, sizeof(ack), &sri, 0);
@@ -2273,7 +3569,7 @@ void handle_msg(int srv,
   }
 }
 
-static int receive_sctp(int srv) {
+static int receive_sctp(struct wrtcassoc *wa) {
 #if WEBRTC_PROXY_DEBUG
   char name[INET_ADDRSTRLEN];
 #endif
@@ -2283,11 +3579,11 @@ static int receive_sctp(int srv) {
   struct sctp_sndrcvinfo rcv_info;
   int flags, n;
 
-  while (1) {
+  while ( !(wa->wa_flags & WA_FLAG_CLOSED) ) {
     from_len = sizeof(addr);
     flags = MSG_DONTWAIT;
     log_printf( "webrtc-proxy: going to read from socket\n");
-    n = sctp_recvmsg(srv, (void *) &buffer, sizeof(buffer),
+    n = sctp_recvmsg(wa->wa_sk, (void *) &buffer, sizeof(buffer),
                      (struct sockaddr *)&addr, &from_len,
                      (void *) &rcv_info, &flags);
 
@@ -2301,7 +3597,7 @@ static int receive_sctp(int srv) {
       if ( flags & MSG_NOTIFICATION ) {
         union sctp_notification *nf = (union sctp_notification *) buffer;
         log_printf( "Received SCTP notification\n");
-        handle_notification(srv, nf, n);
+        handle_notification(wa, nf, n);
       } else {
         log_printf( "Message of length %llu received from %s:%u on stream %u with SSN %u and TSN %u, PPID %u, complete %d\n",
                    (unsigned long long) n,
@@ -2309,22 +3605,22 @@ static int receive_sctp(int srv) {
                    rcv_info.sinfo_stream, rcv_info.sinfo_ssn, rcv_info.sinfo_tsn,
                    ntohl(rcv_info.sinfo_ppid), (flags & MSG_EOR) ? 1 : 0);
 
-        handle_msg(srv, &rcv_info, buffer, n, flags);
+        handle_msg(wa, &rcv_info, buffer, n, flags);
       }
+    } else if ( !(wa->wa_flags & WA_FLAG_LISTENER) ) {
+      // A peeled off association reads EOF once the peer shuts down
+      log_printf("webrtc-proxy: association %d shut down\n", wa->wa_assoc_id);
+      close_assoc(wa);
     }
   }
-}
 
-void usage() {
-  fprintf(stderr, "webrtc-proxy - WebRTC -> sockets proxy\n");
-  fprintf(stderr, "Usage: webrtc-proxy <SCTP UDP port> <capability>\n");
+  return 0;
 }
 
-int main(int argc, char **argv) {
-  uint16_t port;
-  //  int on = 1, i = 0;
-  int sock;
-
+// Creates a non-blocking SCTP listening socket bound to addr. Returns
+// the socket, or -1 on error
+static int mk_listener(struct sockaddr_in *addr) {
+  int sock, frag_il = 2;
   struct sctp_event_subscribe subs;
 //  struct sctp_event event;
 //  uint16_t event_types[] = {
@@ -2335,47 +3631,15 @@ int main(int argc, char **argv) {
 //    SCTP_ADAPTATION_INDICATION,
 //    SCTP_PARTIAL_DELIVERY_EVENT
 //  };
-
-  struct sockaddr_in addr;
-
-  int flags;
-
-  uint8_t kite_sts = 1;
-  int comm_up = 0, frag_il = 2;
   //  int autoclose_interval = 60; // Close the association in 60 seconds
   //  struct linger sctp_linger;
-
   struct sctp_initmsg init;
   struct sctp_assoc_value reseto;
 
-  srand(time(NULL));
-
-  //  sigset_t block;
-  if ( fcntl(COMM, F_GETFD) >= 0 ) {
-    fprintf(stderr, "webrtc-proxy: running in kite\n");
-    comm_up = 1;
-  } else {
-    fprintf(stderr, "webrtc-proxy: running in debug mode\n");
-    comm_up = 0;
-  }
-
-  if ( argc < 3 ) {
-    usage();
-    return 1;
-  }
-
-  g_dbg_port = port = atoi(argv[1]);
-  g_capability = argv[2];
-
-  memset(g_address_table, 0xFF, sizeof(g_address_table));
-
-  //usrsctp_init(port, NULL, debug_printf);
-  //  usrsctp_sysctl_set_sctp_debug_on(SCTP_DEBUG_ALL);
-
   sock = socket(AF_INET, SOCK_SEQPACKET, IPPROTO_SCTP);
-  if ( !sock ) {
+  if ( sock < 0 ) {
     perror("socket");
-    return 1;
+    return -1;
   }
 
 //  if ( setsockopt(sock, SOL_SOCKET, SO_DEBUG, &yes, sizeof(yes)) < 0 ) {
@@ -2384,18 +3648,16 @@ int main(int argc, char **argv) {
 
 //  if ( setsockopt(sock, IPPROTO_SCTP, SCTP_RECVRCVINFO, &on, sizeof(on)) < 0 ) {
 //    perror("setsockopt SCTP_RECVRCVINFO");
-//    return 1;
+//    goto error;
 //  }
 
-  g_max_strms = sysconf(_SC_OPEN_MAX);
-
   init.sinit_num_ostreams   = g_max_strms * 2;
   init.sinit_max_instreams  = g_max_strms * 2;
   init.sinit_max_attempts   = 0;
   init.sinit_max_init_timeo = 0;
   if ( setsockopt(sock, IPPROTO_SCTP, SCTP_INITMSG, &init, sizeof(init)) < 0 ) {
     perror("setsockopt SCTP_INITMSG");
-    return 1;
+    goto error;
   }
 
   // Register events
@@ -2416,19 +3678,19 @@ int main(int argc, char **argv) {
 
   if ( setsockopt(sock, IPPROTO_SCTP, SCTP_EVENTS, &subs, sizeof(subs)) < 0 ) {
     perror("setsockopt SCTP_EVENTS");
-    return 1;
+    goto error;
   }
 
 //  if ( setsockopt(sock, IPPROTO_SCTP, SCTP_AUTOCLOSE, &autoclose_interval, sizeof(autoclose_interval)) < 0 ) {
 //    perror("setsockopt SCTP_AUTOCLOSE");
-//    return 1;
+//    goto error;
 //  }
 //
 //  sctp_linger.l_onoff = 1;
 //  sctp_linger.l_linger = 0; // Cause the association to shutdown via ABORT
 //  if ( setsockopt(sock, SOL_SOCKET, SO_LINGER, &sctp_linger, sizeof(sctp_linger)) < 0 ) {
 //    perror("setsockopt SO_LINGER");
-//    return 1;
+//    goto error;
 //  }
 //
 //  memset(&event, 0, sizeof(event));
@@ -2445,7 +3707,7 @@ int main(int argc, char **argv) {
   reseto.assoc_value = 1;
   if ( setsockopt(sock, IPPROTO_SCTP, SCTP_RECONFIG_SUPPORTED, &reseto, sizeof(reseto)) < 0 ) {
     perror("setsockopt SCTP_RECONFIG_SUPPORTED");
-    return 1;
+    goto error;
   }
 
   reseto.assoc_id = 0;
@@ -2453,12 +3715,12 @@ int main(int argc, char **argv) {
     SCTP_ENABLE_CHANGE_ASSOC_REQ;
   if ( setsockopt(sock, IPPROTO_SCTP, SCTP_ENABLE_STREAM_RESET, &reseto, sizeof(reseto)) < 0) {
     perror("setsockopt SCTP_ENABLE_STREAM_RESET");
-    return 1;
+    goto error;
   }
 
   if ( setsockopt(sock, IPPROTO_SCTP, SCTP_FRAGMENT_INTERLEAVE, &frag_il, sizeof(frag_il)) < 0 ) {
     perror("setsockopt SCTP_FRAGMENT_INTERLEAVE");
-    return 1;
+    goto error;
   }
 
   reseto.assoc_id = 0;
@@ -2467,41 +3729,347 @@ int main(int argc, char **argv) {
     perror("setsockopt SCTP_INTERLEAVING_SUPPORTED");
     
     if ( errno != ENOPROTOOPT )
-      return 1;
+      goto error;
     else
       fprintf(stderr, "webrtc-proxy: running without SCTP interleaving\n");
   }
 
-  memset(&addr, 0, sizeof(addr));
-  addr.sin_family = AF_INET;
-  addr.sin_port = htons(port); // TODO accept this port on command line
-  addr.sin_addr.s_addr = INADDR_ANY;
-  if ( sctp_bindx(sock, (struct sockaddr *) &addr, 1, SCTP_BINDX_ADD_ADDR) < 0 ) {
+  // Partial reliability, for datagram channels
+  reseto.assoc_id = 0;
+  reseto.assoc_value = 1;
+  if ( setsockopt(sock, IPPROTO_SCTP, SCTP_PR_SUPPORTED, &reseto, sizeof(reseto)) < 0 ) {
+    perror("setsockopt SCTP_PR_SUPPORTED");
+
+    if ( errno != ENOPROTOOPT )
+      goto error;
+    else
+      fprintf(stderr, "webrtc-proxy: running without SCTP partial reliability\n");
+  }
+
+  if ( sctp_bindx(sock, (struct sockaddr *) addr, 1, SCTP_BINDX_ADD_ADDR) < 0 ) {
     perror("sctp_bind");
-    return 1;
+    goto error;
   }
 
   if ( listen(sock, 5) < 0 ) {
     perror("listen");
-    return 1;
+    goto error;
   }
 
-  if ( comm_up ) {
-    if ( write(COMM, &kite_sts, 1) != 1 )
-      perror("webrtc-proxy: write(COMM)");
-    close(COMM);
+  set_sk_nonblocking(sock);
+
+  return sock;
+
+ error:
+  close(sock);
+  return -1;
+}
+
+// Shared mode
+//
+// Each session's association is accepted on the session's own address,
+// which applianced assigns and asks us to add to our interface. Session
+// addresses get alias labels derived from the address, so they can be
+// found again when the session ends.
+
+#define SESSION_IF "eth0"
+
+static int mod_session_addr(int dir, struct in_addr *addr) {
+  struct ifreq ifr;
+  struct sockaddr_in *sin = (struct sockaddr_in *) &ifr.ifr_addr;
+  int sk, ret = -1;
+
+  memset(&ifr, 0, sizeof(ifr));
+  snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), SESSION_IF ":%u",
+           ntohl(addr->s_addr) & 0xFFFFFF);
+
+  sk = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if ( sk < 0 ) {
+    perror("mod_session_addr: socket");
+    return -1;
   }
 
-  flags = fcntl(sock, F_GETFL, 0);
-  if ( flags < 0 ) {
-    perror("webrtc-proxy: fcntl F_GETFL");
-    flags = 0;
+  if ( dir > 0 ) {
+    sin->sin_family = AF_INET;
+    sin->sin_addr = *addr;
+    if ( ioctl(sk, SIOCSIFADDR, &ifr) < 0 ) {
+      perror("mod_session_addr: SIOCSIFADDR");
+      goto done;
+    }
+
+    // Same subnet as the container's own address
+    sin->sin_addr.s_addr = htonl(0xFF000000);
+    if ( ioctl(sk, SIOCSIFNETMASK, &ifr) < 0 ) {
+      perror("mod_session_addr: SIOCSIFNETMASK");
+      goto done;
+    }
+  } else {
+    // Taking the alias down removes the address
+    if ( ioctl(sk, SIOCGIFFLAGS, &ifr) < 0 ) {
+      perror("mod_session_addr: SIOCGIFFLAGS");
+      goto done;
+    }
+
+    ifr.ifr_flags &= ~IFF_UP;
+    if ( ioctl(sk, SIOCSIFFLAGS, &ifr) < 0 ) {
+      perror("mod_session_addr: SIOCSIFFLAGS");
+      goto done;
+    }
   }
 
-  flags = fcntl(sock, F_SETFL, flags | O_NONBLOCK);
-  if ( flags < 0 ) {
-    perror("webrtc-proxy: fcntl F_SETFL");
-    return 1;
+  ret = 0;
+
+ done:
+  close(sk);
+  return ret;
+}
+
+static struct wrtcassoc *find_session_listener(struct in_addr *addr) {
+  struct wrtcassoc *wa;
+
+  for ( wa = g_main_worker.ww_assocs; wa; wa = wa->wa_next ) {
+    if ( (wa->wa_flags & WA_FLAG_LISTENER) &&
+         !(wa->wa_flags & WA_FLAG_CLOSED) &&
+         wa->wa_local_addr.s_addr == addr->s_addr )
+      return wa;
+  }
+
+  return NULL;
+}
+
+static int add_session(struct in_addr *addr, uint16_t port) {
+  struct wrtcassoc *listener;
+  struct sockaddr_in sin;
+  int sk;
+
+  if ( find_session_listener(addr) ) {
+    fprintf(stderr, "add_session: already listening for this session\n");
+    return -1;
+  }
+
+  if ( mod_session_addr(1, addr) < 0 )
+    return -1;
+
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons(port);
+  sin.sin_addr = *addr;
+
+  sk = mk_listener(&sin);
+  if ( sk < 0 )
+    goto error;
+
+  listener = alloc_assoc(sk, &g_main_worker, WA_FLAG_LISTENER);
+  if ( !listener ) {
+    close(sk);
+    goto error;
+  }
+  listener->wa_local_addr = *addr;
+
+  listener->wa_next = g_main_worker.ww_assocs;
+  g_main_worker.ww_assocs = listener;
+  __atomic_add_fetch(&g_main_worker.ww_assoc_count, 1, __ATOMIC_SEQ_CST);
+
+  arm_sctp(listener);
+  return 0;
+
+ error:
+  mod_session_addr(-1, addr);
+  return -1;
+}
+
+// Asks every worker to close the associations it serves for the
+// session at addr
+static int close_session_assocs(struct in_addr *addr) {
+  struct wrtcsessclose *wsc;
+  uint64_t one = 1;
+  int i, ret = 0;
+
+  for ( i = 0; i < g_worker_count; ++i ) {
+    wsc = malloc(sizeof(*wsc));
+    if ( !wsc ) {
+      perror("close_session_assocs: malloc");
+      ret = -1;
+      continue;
+    }
+
+    wsc->wsc_addr = *addr;
+
+    pthread_mutex_lock(&g_workers[i].ww_mutex);
+    wsc->wsc_next = g_workers[i].ww_closing;
+    g_workers[i].ww_closing = wsc;
+    pthread_mutex_unlock(&g_workers[i].ww_mutex);
+
+    if ( write(g_workers[i].ww_wakeup_fd, &one, sizeof(one)) < 0 )
+      perror("close_session_assocs: write");
+  }
+
+  return ret;
+}
+
+// Closing the listener aborts any association not yet handed off, and
+// the workers close those they already serve.
+static int remove_session(struct in_addr *addr) {
+  struct wrtcassoc *listener = find_session_listener(addr);
+  int ret = 0;
+
+  if ( listener )
+    close_assoc(listener);
+  else {
+    fprintf(stderr, "remove_session: no listener for this session\n");
+    ret = -1;
+  }
+
+  if ( close_session_assocs(addr) < 0 )
+    ret = -1;
+
+  if ( mod_session_addr(-1, addr) < 0 )
+    ret = -1;
+
+  return ret;
+}
+
+// Requests from applianced, on the main thread
+static void handle_comm() {
+  struct stkinitmsg msg;
+  int n, sts = -2;
+
+  n = recv(COMM, &msg, sizeof(msg), 0);
+  if ( n == 0 ) {
+    fprintf(stderr, "webrtc-proxy: kite closed the init socket\n");
+    exit(0);
+  } else if ( n < 0 ) {
+    if ( errno == EAGAIN || errno == EINTR ) return;
+    perror("handle_comm: recv");
+    exit(1);
+  }
+
+  if ( n < sizeof(msg) ) {
+    fprintf(stderr, "handle_comm: request too short\n");
+  } else if ( msg.sim_req == STK_REQ_MOD_ADDR ) {
+    if ( msg.un.modaddr.dir > 0 )
+      sts = add_session(&msg.un.modaddr.addr, msg.un.modaddr.port);
+    else if ( msg.un.modaddr.dir < 0 )
+      sts = remove_session(&msg.un.modaddr.addr);
+  } else
+    fprintf(stderr, "handle_comm: unknown request %d\n", msg.sim_req);
+
+  if ( send(COMM, &sts, sizeof(sts), MSG_NOSIGNAL) < 0 )
+    perror("handle_comm: send");
+}
+
+void usage() {
+  fprintf(stderr, "webrtc-proxy - WebRTC -> sockets proxy\n");
+  fprintf(stderr, "Usage: webrtc-proxy [-w <workers>] [-p <pool>] <SCTP UDP port> <capability>\n");
+  fprintf(stderr, "       webrtc-proxy -s [-w <workers>] [-p <pool>] [<capability>]\n\n");
+  fprintf(stderr, "   -w <workers>   Accept any number of associations, and serve\n");
+  fprintf(stderr, "                  them from this many threads (default: serve one\n");
+  fprintf(stderr, "                  association from the main thread)\n");
+  fprintf(stderr, "   -s             Shared mode. Serve many sessions, listening on the\n");
+  fprintf(stderr, "                  addresses kite adds over the init socket. Implies -w 1\n");
+  fprintf(stderr, "                  unless more workers are given\n");
+  fprintf(stderr, "   -p <pool>      Keep up to this many connections open ahead of time\n");
+  fprintf(stderr, "                  to each app channels connect to (default: %d, 0 disables)\n",
+          POOL_MAX_PER_DEST);
+}
+
+int main(int argc, char **argv) {
+  uint16_t port;
+  //  int on = 1, i = 0;
+  int sock = -1;
+
+  struct sockaddr_in addr;
+
+  int opt;
+
+  uint8_t kite_sts = 1;
+  int comm_up = 0;
+
+  srand(time(NULL));
+
+  //  sigset_t block;
+  if ( fcntl(COMM, F_GETFD) >= 0 ) {
+    fprintf(stderr, "webrtc-proxy: running in kite\n");
+    comm_up = 1;
+  } else {
+    fprintf(stderr, "webrtc-proxy: running in debug mode\n");
+    comm_up = 0;
+  }
+
+  while ( (opt = getopt(argc, argv, "sw:p:")) != -1 ) {
+    switch ( opt ) {
+    case 's':
+      g_shared = 1;
+      break;
+    case 'w':
+      g_worker_count = atoi(optarg);
+      if ( g_worker_count < 0 || g_worker_count > MAX_WORKER_THREADS ) {
+        fprintf(stderr, "webrtc-proxy: worker count must be between 0 and %d\n", MAX_WORKER_THREADS);
+        return 1;
+      }
+      break;
+    case 'p':
+      g_pool_max = atoi(optarg);
+      if ( g_pool_max < 0 ) {
+        fprintf(stderr, "webrtc-proxy: pool size must not be negative\n");
+        return 1;
+      }
+      break;
+    default:
+      usage();
+      return 1;
+    }
+  }
+
+  if ( g_shared ) {
+    if ( !comm_up ) {
+      fprintf(stderr, "webrtc-proxy: shared mode must be run in kite\n");
+      return 1;
+    }
+
+    // The shared proxy acts for many peers, so there may be no single
+    // capability to present to apps
+    g_capability = (argc - optind) >= 1 ? argv[optind] : "";
+
+    // The proxy outlives every session, so associations are always
+    // served from worker threads
+    if ( g_worker_count == 0 )
+      g_worker_count = 1;
+  } else {
+    if ( (argc - optind) < 2 ) {
+      usage();
+      return 1;
+    }
+
+    g_dbg_port = port = atoi(argv[optind]);
+    g_capability = argv[optind + 1];
+  }
+
+  memset(g_address_table, 0xFF, sizeof(g_address_table));
+
+  //usrsctp_init(port, NULL, debug_printf);
+  //  usrsctp_sysctl_set_sctp_debug_on(SCTP_DEBUG_ALL);
+
+  g_max_strms = sysconf(_SC_OPEN_MAX);
+
+  if ( !g_shared ) {
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = INADDR_ANY;
+
+    sock = mk_listener(&addr);
+    if ( sock < 0 )
+      return 1;
+  }
+
+  if ( comm_up ) {
+    if ( write(COMM, &kite_sts, 1) != 1 )
+      perror("webrtc-proxy: write(COMM)");
+
+    // In shared mode, sessions are added and removed over COMM
+    if ( !g_shared )
+      close(COMM);
   }
 
   return main_loop(sock);
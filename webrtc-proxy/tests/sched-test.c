@@ -0,0 +1,401 @@
+// Measures the latency of small SCTP messages sent while a bulk
+// transfer runs on another stream of the same association, first with
+// the kernel's default scheduler and then with the settings
+// webrtc-proxy uses (I-DATA interleaving and a stream scheduler).
+//
+// Both endpoints run over the loopback interface. The test fails if
+// the scheduled configuration gives pings a worse p99 than the default
+// one, or if it starves the bulk stream.
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <netinet/sctp.h>
+
+#ifndef SCTP_INTERLEAVING_SUPPORTED
+#define SCTP_INTERLEAVING_SUPPORTED 125
+#endif
+
+// Same as webrtc-proxy
+#define WRTC_SS_PRIO 1
+#define WRTC_SS_WFQ  4
+
+#define PING_STREAM   0
+#define BULK_STREAM   1
+#define PING_PRIO     512 // High
+#define BULK_PRIO     256 // Normal
+
+#define PING_SIZE     16
+#define PING_COUNT    200
+#define BULK_MSG_SIZE 65536
+#define RECV_BUF_SIZE (BULK_MSG_SIZE + 1024)
+
+// Loopback timings are noisy, so the scheduled p99 may exceed the
+// default one by this much before the test fails
+#define P99_SLACK_US      500
+// The bulk stream must keep at least 1/BULK_MIN_SHARE of its default
+// throughput while pings are prioritized
+#define BULK_MIN_SHARE    4
+
+struct schedcfg {
+  const char *sc_name;
+  int         sc_interleave;
+  int         sc_sched;
+};
+
+struct schedresult {
+  long sr_median_us, sr_p99_us, sr_max_us;
+  // Bulk bytes sent per second
+  double sr_bulk_rate;
+};
+
+struct schedrun {
+  int sr_client, sr_server;
+
+  volatile int sr_done;
+  unsigned long sr_bulk_bytes;
+
+  long sr_rtts[PING_COUNT];
+};
+
+static uint16_t sched_value(int sched, uint16_t prio) {
+  if ( sched == WRTC_SS_WFQ )
+    return prio;
+  else
+    return 0xFFFF - prio;
+}
+
+static int configure_socket(int sk, struct schedcfg *cfg) {
+  struct sctp_initmsg init;
+  struct sctp_event_subscribe evs;
+  struct sctp_assoc_value val;
+  int frag_il = 2;
+
+  memset(&init, 0, sizeof(init));
+  init.sinit_num_ostreams = 2;
+  init.sinit_max_instreams = 2;
+  if ( setsockopt(sk, IPPROTO_SCTP, SCTP_INITMSG, &init, sizeof(init)) < 0 ) {
+    perror("setsockopt SCTP_INITMSG");
+    return -1;
+  }
+
+  memset(&evs, 0, sizeof(evs));
+  evs.sctp_data_io_event = 1;
+  if ( setsockopt(sk, IPPROTO_SCTP, SCTP_EVENTS, &evs, sizeof(evs)) < 0 ) {
+    perror("setsockopt SCTP_EVENTS");
+    return -1;
+  }
+
+  if ( cfg->sc_interleave ) {
+    if ( setsockopt(sk, IPPROTO_SCTP, SCTP_FRAGMENT_INTERLEAVE, &frag_il, sizeof(frag_il)) < 0 ) {
+      perror("setsockopt SCTP_FRAGMENT_INTERLEAVE");
+      return -1;
+    }
+
+    val.assoc_id = 0;
+    val.assoc_value = 1;
+    if ( setsockopt(sk, IPPROTO_SCTP, SCTP_INTERLEAVING_SUPPORTED, &val, sizeof(val)) < 0 ) {
+      perror("setsockopt SCTP_INTERLEAVING_SUPPORTED");
+      fprintf(stderr, "%s: running without interleaving\n", cfg->sc_name);
+    }
+  }
+
+  return 0;
+}
+
+static int configure_sched(int sk, struct schedcfg *cfg) {
+  struct sctp_assoc_value sched;
+  struct sctp_stream_value val;
+
+  if ( !cfg->sc_sched ) return 0;
+
+  sched.assoc_id = 0;
+  sched.assoc_value = cfg->sc_sched;
+  if ( setsockopt(sk, IPPROTO_SCTP, SCTP_STREAM_SCHEDULER, &sched, sizeof(sched)) < 0 ) {
+    if ( cfg->sc_sched != WRTC_SS_WFQ ) {
+      perror("setsockopt SCTP_STREAM_SCHEDULER");
+      return -1;
+    }
+
+    fprintf(stderr, "%s: no weighted fair queueing, using priority scheduler\n", cfg->sc_name);
+    cfg->sc_sched = sched.assoc_value = WRTC_SS_PRIO;
+    if ( setsockopt(sk, IPPROTO_SCTP, SCTP_STREAM_SCHEDULER, &sched, sizeof(sched)) < 0 ) {
+      perror("setsockopt SCTP_STREAM_SCHEDULER");
+      return -1;
+    }
+  }
+
+  val.assoc_id = 0;
+  val.stream_id = PING_STREAM;
+  val.stream_value = sched_value(cfg->sc_sched, PING_PRIO);
+  if ( setsockopt(sk, IPPROTO_SCTP, SCTP_STREAM_SCHEDULER_VALUE, &val, sizeof(val)) < 0 ) {
+    perror("setsockopt SCTP_STREAM_SCHEDULER_VALUE");
+    return -1;
+  }
+
+  val.stream_id = BULK_STREAM;
+  val.stream_value = sched_value(cfg->sc_sched, BULK_PRIO);
+  if ( setsockopt(sk, IPPROTO_SCTP, SCTP_STREAM_SCHEDULER_VALUE, &val, sizeof(val)) < 0 ) {
+    perror("setsockopt SCTP_STREAM_SCHEDULER_VALUE");
+    return -1;
+  }
+
+  return 0;
+}
+
+// Returns 0 and fills in sr_client and sr_server on success, 1 if
+// SCTP is not available, and -1 on error
+static int connect_endpoints(struct schedrun *run, struct schedcfg *cfg) {
+  struct sockaddr_in addr;
+  socklen_t addr_sz = sizeof(addr);
+  struct timeval timeout = { 5, 0 };
+  int listener;
+
+  listener = socket(AF_INET, SOCK_STREAM, IPPROTO_SCTP);
+  if ( listener < 0 ) {
+    if ( errno == EPROTONOSUPPORT ) return 1;
+    perror("socket");
+    return -1;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = 0;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  if ( configure_socket(listener, cfg) < 0 ) goto error;
+
+  if ( bind(listener, (struct sockaddr *) &addr, sizeof(addr)) < 0 ) {
+    perror("bind");
+    goto error;
+  }
+
+  if ( getsockname(listener, (struct sockaddr *) &addr, &addr_sz) < 0 ) {
+    perror("getsockname");
+    goto error;
+  }
+
+  if ( listen(listener, 1) < 0 ) {
+    perror("listen");
+    goto error;
+  }
+
+  run->sr_client = socket(AF_INET, SOCK_STREAM, IPPROTO_SCTP);
+  if ( run->sr_client < 0 ) {
+    perror("socket");
+    goto error;
+  }
+
+  if ( configure_socket(run->sr_client, cfg) < 0 ) goto error;
+
+  if ( connect(run->sr_client, (struct sockaddr *) &addr, sizeof(addr)) < 0 ) {
+    perror("connect");
+    goto error;
+  }
+
+  run->sr_server = accept(listener, NULL, NULL);
+  if ( run->sr_server < 0 ) {
+    perror("accept");
+    goto error;
+  }
+  close(listener);
+
+  if ( configure_sched(run->sr_client, cfg) < 0 ||
+       configure_sched(run->sr_server, cfg) < 0 )
+    return -1;
+
+  // Never wait forever for an echo
+  if ( setsockopt(run->sr_client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0 ) {
+    perror("setsockopt SO_RCVTIMEO");
+    return -1;
+  }
+
+  return 0;
+
+ error:
+  close(listener);
+  return -1;
+}
+
+static void *bulk_thread(void *arg) {
+  struct schedrun *run = arg;
+  char *buf = calloc(1, BULK_MSG_SIZE);
+  int err;
+
+  assert(buf);
+
+  while ( !run->sr_done ) {
+    err = sctp_sendmsg(run->sr_client, buf, BULK_MSG_SIZE, NULL, 0,
+                       0, 0, BULK_STREAM, 0, 0);
+    if ( err < 0 ) {
+      perror("bulk_thread: sctp_sendmsg");
+      break;
+    }
+
+    run->sr_bulk_bytes += err;
+  }
+
+  free(buf);
+  return NULL;
+}
+
+// Drains the bulk stream and echoes every ping back
+static void *echo_thread(void *arg) {
+  struct schedrun *run = arg;
+  struct sctp_sndrcvinfo sri;
+  char *buf = malloc(RECV_BUF_SIZE);
+  int err, flags;
+
+  assert(buf);
+
+  for (;;) {
+    flags = 0;
+    memset(&sri, 0, sizeof(sri));
+    err = sctp_recvmsg(run->sr_server, buf, RECV_BUF_SIZE, NULL, NULL, &sri, &flags);
+    if ( err < 0 ) {
+      perror("echo_thread: sctp_recvmsg");
+      break;
+    } else if ( err == 0 )
+      break;
+
+    if ( sri.sinfo_stream == PING_STREAM ) {
+      err = sctp_sendmsg(run->sr_server, buf, err, NULL, 0,
+                         0, 0, PING_STREAM, 0, 0);
+      if ( err < 0 ) {
+        perror("echo_thread: sctp_sendmsg");
+        break;
+      }
+    }
+  }
+
+  free(buf);
+  return NULL;
+}
+
+static long elapsed_us(struct timespec *start, struct timespec *end) {
+  return (end->tv_sec - start->tv_sec) * 1000000 +
+    (end->tv_nsec - start->tv_nsec) / 1000;
+}
+
+static int cmp_long(const void *a, const void *b) {
+  long x = *(const long *) a, y = *(const long *) b;
+  return (x > y) - (x < y);
+}
+
+// Returns 0 on success, 1 if SCTP is not available, -1 on error
+static int run_test(struct schedcfg *cfg, struct schedresult *res) {
+  struct schedrun run;
+  struct sctp_sndrcvinfo sri;
+  struct timespec start, end, bulk_start, bulk_end;
+  pthread_t bulk, echo;
+  char ping[PING_SIZE], pong[RECV_BUF_SIZE];
+  int i, err, flags, ret = 0;
+
+  memset(&run, 0, sizeof(run));
+
+  err = connect_endpoints(&run, cfg);
+  if ( err != 0 ) return err;
+
+  clock_gettime(CLOCK_MONOTONIC, &bulk_start);
+  if ( pthread_create(&echo, NULL, echo_thread, &run) != 0 ||
+       pthread_create(&bulk, NULL, bulk_thread, &run) != 0 ) {
+    fprintf(stderr, "Could not start threads\n");
+    exit(1);
+  }
+
+  // Let the bulk transfer fill the send buffer
+  usleep(200000);
+
+  memset(ping, 'p', sizeof(ping));
+  for ( i = 0; i < PING_COUNT; ++i ) {
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    err = sctp_sendmsg(run.sr_client, ping, sizeof(ping), NULL, 0,
+                       0, 0, PING_STREAM, 0, 0);
+    if ( err < 0 ) {
+      perror("sctp_sendmsg ping");
+      ret = -1;
+      break;
+    }
+
+    flags = 0;
+    err = sctp_recvmsg(run.sr_client, pong, sizeof(pong), NULL, NULL, &sri, &flags);
+    if ( err < 0 ) {
+      perror("sctp_recvmsg pong");
+      ret = -1;
+      break;
+    } else if ( err != sizeof(ping) || memcmp(ping, pong, sizeof(ping)) != 0 ) {
+      fprintf(stderr, "%s: bad echo for ping %d (%d bytes)\n", cfg->sc_name, i, err);
+      ret = -1;
+      break;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    run.sr_rtts[i] = elapsed_us(&start, &end);
+  }
+
+  run.sr_done = 1;
+  pthread_join(bulk, NULL);
+  clock_gettime(CLOCK_MONOTONIC, &bulk_end);
+
+  close(run.sr_client);
+  pthread_join(echo, NULL);
+  close(run.sr_server);
+
+  if ( ret == 0 ) {
+    qsort(run.sr_rtts, PING_COUNT, sizeof(run.sr_rtts[0]), cmp_long);
+    res->sr_median_us = run.sr_rtts[PING_COUNT / 2];
+    res->sr_p99_us = run.sr_rtts[(PING_COUNT * 99) / 100];
+    res->sr_max_us = run.sr_rtts[PING_COUNT - 1];
+    res->sr_bulk_rate = run.sr_bulk_bytes * 1000000.0 / elapsed_us(&bulk_start, &bulk_end);
+
+    fprintf(stderr, "%s: ping rtt median %ldus, p99 %ldus, max %ldus (bulk %.0f bytes/s)\n",
+            cfg->sc_name, res->sr_median_us, res->sr_p99_us, res->sr_max_us,
+            res->sr_bulk_rate);
+  }
+
+  return ret;
+}
+
+int main(int argc, char **argv) {
+  struct schedcfg cfgs[] = {
+    { "fcfs", 0, 0 },
+    { "interleaved", 1, WRTC_SS_WFQ }
+  };
+  struct schedresult res[sizeof(cfgs) / sizeof(cfgs[0])];
+  int i, err, ret = 0;
+
+  for ( i = 0; i < sizeof(cfgs) / sizeof(cfgs[0]); ++i ) {
+    err = run_test(&cfgs[i], &res[i]);
+    if ( err == 1 ) {
+      fprintf(stderr, "SCTP is not available: skipping\n");
+      return 0;
+    } else if ( err < 0 ) {
+      fprintf(stderr, "%s: failed\n", cfgs[i].sc_name);
+      return 1;
+    }
+  }
+
+  if ( res[1].sr_p99_us > res[0].sr_p99_us + P99_SLACK_US ) {
+    fprintf(stderr, "%s: ping p99 %ldus is worse than %s (%ldus)\n",
+            cfgs[1].sc_name, res[1].sr_p99_us, cfgs[0].sc_name, res[0].sr_p99_us);
+    ret = 1;
+  }
+
+  if ( res[1].sr_bulk_rate * BULK_MIN_SHARE < res[0].sr_bulk_rate ) {
+    fprintf(stderr, "%s: bulk stream starved (%.0f bytes/s, %s sent %.0f bytes/s)\n",
+            cfgs[1].sc_name, res[1].sr_bulk_rate, cfgs[0].sc_name, res[0].sr_bulk_rate);
+    ret = 1;
+  }
+
+  return ret;
+}